@@ -0,0 +1,221 @@
+/*
+ * cgit-bench: throughput of the core, as JSON.
+ *
+ * Micro benchmarks call core functions in a loop over a sweep of input
+ * sizes (micro.c). Macro benchmarks run the cgit executable against a
+ * generated repository (macro.c). Each result is one object in the
+ * "results" array, keyed by name and size or file count, so two runs on
+ * different commits can be joined and compared. Progress goes to stderr.
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/common.h"
+#include "../include/core.h"
+#include "bench.h"
+
+static const char usage[] =
+    "usage: cgit-bench [--micro | --macro] [--quick] [--files <n>] "
+    "[--repeat <n>]\n"
+    "                  [--cgit <path>] [--scratch <dir>] [--label <text>] "
+    "[-o <file>]\n";
+
+uint64_t bench_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* s as a JSON string, for text that came from the command line */
+static void json_string(FILE *out, const char *s) {
+  fputc('"', out);
+  for (; *s; s++) {
+    unsigned char c = (unsigned char)*s;
+    if (c == '"' || c == '\\')
+      fprintf(out, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(out, "\\u%04x", c);
+    else
+      fputc(c, out);
+  }
+  fputc('"', out);
+}
+
+static void report_separator(bench_report_t *report) {
+  fprintf(report->out, "%s\n    ", report->count++ ? "," : "");
+}
+
+/* unit is "bytes" or "entries"; throughput is given for bytes only */
+void bench_report_micro(bench_report_t *report, const char *name,
+                        size_t size, const char *unit, uint64_t iterations,
+                        uint64_t ns) {
+  double per_op = (double)ns / (double)iterations;
+  report_separator(report);
+  fprintf(report->out,
+          "{\"name\": \"%s\", \"kind\": \"micro\", \"size\": %zu, "
+          "\"unit\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.1f",
+          name, size, unit, (unsigned long long)iterations, per_op);
+  if (strcmp(unit, "bytes") == 0)
+    fprintf(report->out, ", \"mb_per_s\": %.2f", (double)size * 1e3 / per_op);
+  fputc('}', report->out);
+  fprintf(stderr, "  %-28s %10zu %-7s %12.1f ns/op\n", name, size, unit,
+          per_op);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/* runs_ns is sorted in place */
+void bench_report_macro(bench_report_t *report, const char *name,
+                        size_t files, uint64_t *runs_ns, int runs) {
+  uint64_t total = 0;
+  qsort(runs_ns, (size_t)runs, sizeof(*runs_ns), cmp_u64);
+  for (int i = 0; i < runs; i++) total += runs_ns[i];
+  double median = runs % 2 ? (double)runs_ns[runs / 2]
+                           : ((double)runs_ns[runs / 2 - 1] +
+                              (double)runs_ns[runs / 2]) / 2;
+
+  report_separator(report);
+  fprintf(report->out,
+          "{\"name\": \"%s\", \"kind\": \"macro\", \"files\": %zu, "
+          "\"runs\": %d, \"min_ms\": %.3f, \"median_ms\": %.3f, "
+          "\"mean_ms\": %.3f, \"max_ms\": %.3f}",
+          name, files, runs, runs_ns[0] / 1e6, median / 1e6,
+          (double)total / runs / 1e6, runs_ns[runs - 1] / 1e6);
+  fprintf(stderr, "  %-28s %10zu %-7s %12.3f ms (median)\n", name, files,
+          "files", median / 1e6);
+}
+
+static int parse_count(const char *arg, long max, long *out) {
+  char *end;
+  long val = strtol(arg, &end, 10);
+
+  if (*arg == '\0' || *end != '\0' || val < 1 || val > max) {
+    fprintf(stderr, "error: invalid count '%s'\n", arg);
+    return 1;
+  }
+  *out = val;
+  return 0;
+}
+
+/* The cgit next to this executable, as the build puts them */
+static char *default_cgit(const char *argv0) {
+  char self[PATH_MAX];
+  ssize_t n = readlink("/proc/self/exe", self, sizeof(self) - 1);
+  if (n > 0) {
+    self[n] = '\0';
+  } else if (!realpath(argv0, self)) {
+    return NULL;
+  }
+
+  char *slash = strrchr(self, '/');
+  if (!slash || (size_t)(slash - self) + sizeof("/cgit") > sizeof(self))
+    return NULL;
+  strcpy(slash, "/cgit");
+  return strdup(self);
+}
+
+int main(int argc, char *argv[]) {
+  int result = 1;
+  int micro = 1, macro = 1;
+  const char *label = "";
+  const char *out_path = NULL;
+  char *cgit = NULL;
+  FILE *out = stdout;
+  bench_options_t opts = {
+      .min_seconds = 0.2,
+      .repeat = 5,
+      .files = 10000,
+      .scratch = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp",
+  };
+
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+    long n;
+
+    if (strcmp(arg, "--micro") == 0) {
+      macro = 0;
+    } else if (strcmp(arg, "--macro") == 0) {
+      micro = 0;
+    } else if (strcmp(arg, "--quick") == 0) {
+      opts.min_seconds = 0.02;
+      opts.repeat = 3;
+      opts.files = 1000;
+    } else if (strcmp(arg, "--files") == 0 && value) {
+      if (parse_count(value, 100000000, &n)) goto cleanup;
+      opts.files = (size_t)n;
+      i++;
+    } else if (strcmp(arg, "--repeat") == 0 && value) {
+      if (parse_count(value, 1000, &n)) goto cleanup;
+      opts.repeat = (int)n;
+      i++;
+    } else if (strcmp(arg, "--cgit") == 0 && value) {
+      free(cgit);
+      cgit = realpath(value, NULL);
+      if (!cgit) {
+        fprintf(stderr, "error: no cgit at '%s'\n", value);
+        goto cleanup;
+      }
+      i++;
+    } else if (strcmp(arg, "--scratch") == 0 && value) {
+      opts.scratch = value;
+      i++;
+    } else if (strcmp(arg, "--label") == 0 && value) {
+      label = value;
+      i++;
+    } else if (strcmp(arg, "-o") == 0 && value) {
+      out_path = value;
+      i++;
+    } else {
+      fputs(usage, stderr);
+      goto cleanup;
+    }
+  }
+
+  if (macro && !cgit) cgit = default_cgit(argv[0]);
+  if (macro && (!cgit || access(cgit, X_OK) != 0)) {
+    fprintf(stderr, "error: cannot find cgit; pass --cgit <path>\n");
+    goto cleanup;
+  }
+  opts.cgit = cgit;
+
+  if (out_path) {
+    out = fopen(out_path, "w");
+    if (!out) {
+      perror(out_path);
+      goto cleanup;
+    }
+  }
+
+  bench_report_t report = {.out = out};
+  fprintf(out, "{\n  \"label\": ");
+  json_string(out, label);
+  fprintf(out,
+          ",\n  \"timestamp\": %lld,\n  \"hash_backend\": \"%s\",\n"
+          "  \"results\": [",
+          (long long)time(NULL), hash_backend_name());
+
+  int failed = 0;
+  if (micro) failed |= bench_run_micro(&opts, &report);
+  if (macro) failed |= bench_run_macro(&opts, &report);
+
+  fprintf(out, "\n  ]\n}\n");
+  if (fflush(out) != 0 || ferror(out)) {
+    fprintf(stderr, "error: cannot write results\n");
+    goto cleanup;
+  }
+  result = failed;
+
+cleanup:
+  if (out && out != stdout) fclose(out);
+  free(cgit);
+  return result;
+}
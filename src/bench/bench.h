@@ -0,0 +1,33 @@
+#ifndef CGIT_BENCH_H
+#define CGIT_BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct {
+  double min_seconds;  /* how long each micro case runs at least */
+  int repeat;          /* runs of each macro case */
+  size_t files;        /* files in the generated working tree */
+  const char *cgit;    /* absolute path of the cgit executable */
+  const char *scratch; /* where macro repositories are generated */
+} bench_options_t;
+
+/* Results, written out as they come as one JSON array */
+typedef struct {
+  FILE *out;
+  int count;
+} bench_report_t;
+
+uint64_t bench_now_ns(void);
+
+void bench_report_micro(bench_report_t *report, const char *name,
+                        size_t size, const char *unit, uint64_t iterations,
+                        uint64_t ns);
+void bench_report_macro(bench_report_t *report, const char *name,
+                        size_t files, uint64_t *runs_ns, int runs);
+
+int bench_run_micro(const bench_options_t *opts, bench_report_t *report);
+int bench_run_macro(const bench_options_t *opts, bench_report_t *report);
+
+#endif
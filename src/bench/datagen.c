@@ -0,0 +1,54 @@
+/*
+ * Seeded file contents for cgit-bench and cgit-synth: source-like text or
+ * incompressible noise, the same bytes for the same seed on any machine.
+ */
+
+#include "datagen.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* xorshift64*: fast, and the same sequence for the same seed everywhere */
+uint64_t datagen_random(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545F4914F6CDD1Dull;
+}
+
+/* Keywords and numbers compress about 3:1, like source code */
+void datagen_fill(unsigned char *buf, size_t len, uint64_t *state,
+                  int compressible) {
+  static const char *const words[] = {
+      "static", "int", "return", "if", "else", "for", "while", "const",
+      "char", "size_t", "result", "buffer", "cleanup", "error", "=", "{",
+      "}", "(", ")", ";", "\n", "  ", "NULL", "data"};
+  size_t nwords = sizeof(words) / sizeof(words[0]);
+  size_t pos = 0;
+
+  while (pos < len) {
+    uint64_t r = datagen_random(state);
+    if (!compressible) {
+      /* Least significant byte first, whatever the host's byte order */
+      size_t n = len - pos < sizeof(r) ? len - pos : sizeof(r);
+      for (size_t k = 0; k < n; k++)
+        buf[pos + k] = (unsigned char)(r >> (8 * k));
+      pos += n;
+      continue;
+    }
+    /* A number now and then, so matches stay short as in real code */
+    char number[24];
+    const char *w = words[r % nwords];
+    if ((r >> 16) % 4 == 0) {
+      snprintf(number, sizeof(number), "%u", (unsigned)(r >> 40) % 100000);
+      w = number;
+    }
+    size_t n = strlen(w);
+    if (n > len - pos) n = len - pos;
+    memcpy(buf + pos, w, n);
+    pos += n;
+    if (pos < len && (r >> 32) % 3) buf[pos++] = ' ';
+  }
+}
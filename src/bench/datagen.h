@@ -0,0 +1,15 @@
+#ifndef CGIT_DATAGEN_H
+#define CGIT_DATAGEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Seeded file contents, shared by cgit-bench and cgit-synth so both
+ * generate the same data for the same seed. The state must not be 0.
+ */
+uint64_t datagen_random(uint64_t *state);
+void datagen_fill(unsigned char *buf, size_t len, uint64_t *state,
+                  int compressible);
+
+#endif
@@ -0,0 +1,286 @@
+/*
+ * Macro benchmarks: the cgit executable against a generated repository.
+ *
+ * The working tree has opts->files files of source-like text, 64 bytes to
+ * a few KiB each, 100 to a directory and 32 directories to a parent. Its
+ * contents depend only on the file count, so results from different
+ * commits describe the same input. Each case runs opts->repeat times and
+ * times only the command being measured, setup excluded.
+ */
+
+#define _GNU_SOURCE /* nftw's FTW_PHYS */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../include/common.h"
+#include "../include/core.h"
+#include "bench.h"
+#include "datagen.h"
+
+#define FILES_PER_DIR 100
+#define DIRS_PER_PARENT 32
+
+extern char **environ;
+
+typedef struct {
+  FILE *all;   /* every object id, for cat-file --batch */
+  FILE *trees; /* tree ids, for ls-tree */
+} id_lists_t;
+
+/*
+ * Run cgit with args, stdin from in_path (or /dev/null) and stdout thrown
+ * away. 0 when it exited with 0.
+ */
+static int run_cgit(const bench_options_t *opts, const char *const *args,
+                    const char *in_path) {
+  char *argv[8];
+  size_t n = 0;
+  posix_spawn_file_actions_t actions;
+  pid_t pid;
+  int status;
+
+  argv[n++] = (char *)opts->cgit;
+  for (; *args && n + 1 < sizeof(argv) / sizeof(argv[0]); args++)
+    argv[n++] = (char *)*args;
+  argv[n] = NULL;
+
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDIN_FILENO,
+                                   in_path ? in_path : "/dev/null", O_RDONLY,
+                                   0);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+                                   O_WRONLY, 0);
+  int err = posix_spawn(&pid, opts->cgit, &actions, NULL, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (err != 0) {
+    fprintf(stderr, "error: cannot run '%s': %s\n", opts->cgit, strerror(err));
+    return 1;
+  }
+
+  while (waitpid(pid, &status, 0) < 0)
+    if (errno != EINTR) return 1;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "error: cgit %s failed\n", argv[1]);
+    return 1;
+  }
+  return 0;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag,
+                        struct FTW *ftw) {
+  (void)st;
+  (void)flag;
+  (void)ftw;
+  return remove(path);
+}
+
+static int remove_tree(const char *path) {
+  if (access(path, F_OK) != 0) return 0;
+  return nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static int write_file(const char *path, const unsigned char *data,
+                      size_t len) {
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    perror(path);
+    return 1;
+  }
+  int failed = fwrite(data, 1, len, f) != len;
+  failed |= fclose(f) != 0;
+  if (failed) perror(path);
+  return failed;
+}
+
+/* Fill the current directory with the working tree */
+static int generate_tree(size_t files) {
+  unsigned char buf[8192];
+  char path[64];
+  uint64_t seed = 0x5eed;
+
+  for (size_t i = 0; i < files; i++) {
+    size_t dir = i / FILES_PER_DIR;
+    snprintf(path, sizeof(path), "d%03zu", dir / DIRS_PER_PARENT);
+    if (i % (FILES_PER_DIR * DIRS_PER_PARENT) == 0 && mkdir(path, 0755) != 0)
+      goto failed;
+    snprintf(path, sizeof(path), "d%03zu/s%02zu", dir / DIRS_PER_PARENT,
+             dir % DIRS_PER_PARENT);
+    if (i % FILES_PER_DIR == 0 && mkdir(path, 0755) != 0) goto failed;
+
+    /* Mostly small files, some up to about 4 KiB, as in a source tree */
+    uint64_t r = datagen_random(&seed);
+    size_t len = ((size_t)64 << (r % 7)) + (size_t)(r >> 32) % 64;
+    datagen_fill(buf, len, &seed, 1);
+    snprintf(path, sizeof(path), "d%03zu/s%02zu/f%06zu.c",
+             dir / DIRS_PER_PARENT, dir % DIRS_PER_PARENT, i);
+    if (write_file(path, buf, len)) return 1;
+  }
+  return 0;
+
+failed:
+  perror(path);
+  return 1;
+}
+
+static cgit_error_t list_object(const char *hash, void *data) {
+  id_lists_t *lists = data;
+  char type[CGIT_MAX_TYPE_LEN];
+  size_t size;
+
+  fprintf(lists->all, "%s\n", hash);
+  cgit_error_t result = read_object_header(hash, type, sizeof(type), &size);
+  if (result != CGIT_OK) return result;
+  if (strcmp(type, "tree") == 0) fprintf(lists->trees, "%s\n", hash);
+  return CGIT_OK;
+}
+
+static int fresh_repo(const bench_options_t *opts) {
+  static const char *const init[] = {"init", NULL};
+  if (remove_tree(CGIT_DIR) != 0) {
+    perror(CGIT_DIR);
+    return 1;
+  }
+  return run_cgit(opts, init, NULL);
+}
+
+static int bench_write_tree(const bench_options_t *opts,
+                            bench_report_t *report, uint64_t *runs) {
+  static const char *const serial[] = {"write-tree", "-j", "1", NULL};
+  static const char *const parallel[] = {"write-tree", NULL};
+  static const struct {
+    const char *name;
+    const char *const *args;
+  } cases[] = {{"write-tree/fresh/j1", serial},
+               {"write-tree/fresh", parallel}};
+
+  for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+    for (int i = 0; i < opts->repeat; i++) {
+      if (fresh_repo(opts)) return 1;
+      uint64_t start = bench_now_ns();
+      if (run_cgit(opts, cases[c].args, NULL)) return 1;
+      runs[i] = bench_now_ns() - start;
+    }
+    bench_report_macro(report, cases[c].name, opts->files, runs,
+                       opts->repeat);
+  }
+
+  /* The last fresh run left an index behind */
+  for (int i = 0; i < opts->repeat; i++) {
+    uint64_t start = bench_now_ns();
+    if (run_cgit(opts, parallel, NULL)) return 1;
+    runs[i] = bench_now_ns() - start;
+  }
+  bench_report_macro(report, "write-tree/warm", opts->files, runs,
+                     opts->repeat);
+  return 0;
+}
+
+static int bench_readers(const bench_options_t *opts, bench_report_t *report,
+                         uint64_t *runs, const char *all_path,
+                         const char *trees_path) {
+  static const char *const batch[] = {"cat-file", "--batch", NULL};
+  static const char *const check[] = {"cat-file", "--batch-check", NULL};
+  char hash[CGIT_HASH_HEX_LEN + 2];
+
+  for (int i = 0; i < opts->repeat; i++) {
+    uint64_t start = bench_now_ns();
+    if (run_cgit(opts, batch, all_path)) return 1;
+    runs[i] = bench_now_ns() - start;
+  }
+  bench_report_macro(report, "cat-file/batch", opts->files, runs,
+                     opts->repeat);
+
+  for (int i = 0; i < opts->repeat; i++) {
+    uint64_t start = bench_now_ns();
+    if (run_cgit(opts, check, all_path)) return 1;
+    runs[i] = bench_now_ns() - start;
+  }
+  bench_report_macro(report, "cat-file/batch-check", opts->files, runs,
+                     opts->repeat);
+
+  /* One ls-tree per tree: the cost of a command on a small tree */
+  FILE *trees = fopen(trees_path, "r");
+  if (!trees) {
+    perror(trees_path);
+    return 1;
+  }
+  int failed = 0;
+  for (int i = 0; i < opts->repeat && !failed; i++) {
+    uint64_t start = bench_now_ns();
+    rewind(trees);
+    while (!failed && fgets(hash, sizeof(hash), trees)) {
+      hash[strcspn(hash, "\n")] = '\0';
+      const char *const args[] = {"ls-tree", hash, NULL};
+      failed = run_cgit(opts, args, NULL);
+    }
+    runs[i] = bench_now_ns() - start;
+  }
+  fclose(trees);
+  if (!failed)
+    bench_report_macro(report, "ls-tree/every-tree", opts->files, runs,
+                       opts->repeat);
+  return failed;
+}
+
+int bench_run_macro(const bench_options_t *opts, bench_report_t *report) {
+  char root[PATH_MAX];
+  char repo[PATH_MAX + 8];
+  char all_path[PATH_MAX + 8];
+  char trees_path[PATH_MAX + 8];
+  char cwd[PATH_MAX];
+  id_lists_t lists = {0};
+  int failed = 1;
+
+  uint64_t *runs = calloc((size_t)opts->repeat, sizeof(*runs));
+  if (!runs || !getcwd(cwd, sizeof(cwd))) return 1;
+
+  snprintf(root, sizeof(root), "%s/cgit-bench-XXXXXX", opts->scratch);
+  if (!mkdtemp(root)) {
+    perror(root);
+    free(runs);
+    return 1;
+  }
+  snprintf(repo, sizeof(repo), "%s/repo", root);
+  snprintf(all_path, sizeof(all_path), "%s/ids", root);
+  snprintf(trees_path, sizeof(trees_path), "%s/trees", root);
+
+  fprintf(stderr, "macro benchmarks: %zu files in %s\n", opts->files, repo);
+  if (mkdir(repo, 0755) != 0 || chdir(repo) != 0) {
+    perror(repo);
+    goto cleanup;
+  }
+  if (generate_tree(opts->files)) goto cleanup;
+
+  if (bench_write_tree(opts, report, runs)) goto cleanup;
+
+  lists.all = fopen(all_path, "w");
+  lists.trees = fopen(trees_path, "w");
+  if (!lists.all || !lists.trees ||
+      for_each_loose_object(list_object, &lists) != CGIT_OK)
+    goto cleanup;
+  if (fclose(lists.all) != 0 || fclose(lists.trees) != 0) {
+    lists.all = lists.trees = NULL;
+    goto cleanup;
+  }
+  lists.all = lists.trees = NULL;
+
+  failed = bench_readers(opts, report, runs, all_path, trees_path);
+
+cleanup:
+  if (lists.all) fclose(lists.all);
+  if (lists.trees) fclose(lists.trees);
+  if (chdir(cwd) != 0 || remove_tree(root) != 0)
+    fprintf(stderr, "warning: cannot remove '%s'\n", root);
+  free(runs);
+  return failed;
+}
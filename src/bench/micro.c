@@ -0,0 +1,219 @@
+/*
+ * Micro benchmarks: one core function in a loop, per input size.
+ *
+ * Each case runs once to warm caches and per-thread contexts, then in
+ * batches that double until they take opts->min_seconds. The reported time
+ * is that of the last batch, divided by its iterations.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/common.h"
+#include "../include/core.h"
+#include "bench.h"
+#include "datagen.h"
+
+static const size_t byte_sizes[] = {64, 1024, 16 * 1024, 256 * 1024,
+                                    4 * 1024 * 1024};
+static const size_t entry_counts[] = {8, 64, 512, 4096};
+
+#define COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+typedef cgit_error_t (*case_fn)(void *arg);
+
+typedef struct {
+  const unsigned char *data;
+  size_t len;
+  buffer_t scratch; /* compressed input for decompress_data */
+  tree_entry_t *entries;
+  size_t count;
+  arena_t arena;
+} case_arg_t;
+
+static cgit_error_t run_compress(void *arg) {
+  case_arg_t *c = arg;
+  buffer_t out = {0};
+  cgit_error_t result = compress_data(c->data, c->len, &out);
+  buffer_free(&out);
+  return result;
+}
+
+static cgit_error_t run_decompress(void *arg) {
+  case_arg_t *c = arg;
+  buffer_t out = {0};
+  cgit_error_t result =
+      decompress_data(c->scratch.data, c->scratch.size, &out);
+  buffer_free(&out);
+  return result;
+}
+
+static cgit_error_t run_sha1(void *arg) {
+  case_arg_t *c = arg;
+  char hex[CGIT_HASH_HEX_LEN + 1];
+  return compute_sha1(c->data, c->len, hex);
+}
+
+static cgit_error_t run_object_header(void *arg) {
+  case_arg_t *c = arg;
+  buffer_t out = {0};
+  cgit_error_t result = build_object_header(c->data, c->len, "blob", &out);
+  buffer_free(&out);
+  return result;
+}
+
+static cgit_error_t run_serialize_tree(void *arg) {
+  case_arg_t *c = arg;
+  buffer_t out = {0};
+  cgit_error_t result = serialize_tree(c->entries, c->count, &out);
+  buffer_free(&out);
+  return result;
+}
+
+static cgit_error_t run_parse_tree(void *arg) {
+  case_arg_t *c = arg;
+  tree_entry_t *entries;
+  size_t count;
+  arena_mark_t mark = arena_mark(&c->arena);
+  cgit_error_t result =
+      parse_tree(&c->arena, c->data, c->len, &entries, &count);
+  arena_rewind(&c->arena, mark);
+  return result;
+}
+
+/* 0 and the time of the final batch in *ns_out, or 1 if fn failed */
+static int time_case(const bench_options_t *opts, case_fn fn, void *arg,
+                     uint64_t *iterations_out, uint64_t *ns_out) {
+  uint64_t min_ns = (uint64_t)(opts->min_seconds * 1e9);
+
+  if (fn(arg) != CGIT_OK) return 1;
+
+  for (uint64_t n = 1;; n *= 2) {
+    uint64_t start = bench_now_ns();
+    for (uint64_t i = 0; i < n; i++)
+      if (fn(arg) != CGIT_OK) return 1;
+    uint64_t elapsed = bench_now_ns() - start;
+
+    if (elapsed >= min_ns || n >= (1ull << 40)) {
+      *iterations_out = n;
+      *ns_out = elapsed;
+      return 0;
+    }
+  }
+}
+
+static int run_case(const bench_options_t *opts, bench_report_t *report,
+                    const char *name, size_t size, const char *unit,
+                    case_fn fn, void *arg) {
+  uint64_t iterations, ns;
+  if (time_case(opts, fn, arg, &iterations, &ns)) {
+    fprintf(stderr, "error: %s failed at %zu %s\n", name, size, unit);
+    return 1;
+  }
+  bench_report_micro(report, name, size, unit, iterations, ns);
+  return 0;
+}
+
+static int byte_sweep(const bench_options_t *opts, bench_report_t *report) {
+  size_t max = byte_sizes[COUNT(byte_sizes) - 1];
+  unsigned char *text = malloc(max);
+  unsigned char *noise = malloc(max);
+  uint64_t seed = 1;
+  int failed = 0;
+
+  if (!text || !noise) {
+    fprintf(stderr, "error: out of memory\n");
+    free(text);
+    free(noise);
+    return 1;
+  }
+  datagen_fill(text, max, &seed, 1);
+  datagen_fill(noise, max, &seed, 0);
+
+  for (size_t i = 0; i < COUNT(byte_sizes) && !failed; i++) {
+    size_t len = byte_sizes[i];
+    case_arg_t c = {.data = text, .len = len};
+    case_arg_t n = {.data = noise, .len = len};
+
+    failed |= run_case(opts, report, "compress_data", len, "bytes",
+                       run_compress, &c);
+    failed |= run_case(opts, report, "compress_data/incompressible", len,
+                       "bytes", run_compress, &n);
+
+    if (compress_data(text, len, &c.scratch) != CGIT_OK) {
+      failed = 1;
+      break;
+    }
+    failed |= run_case(opts, report, "decompress_data", len, "bytes",
+                       run_decompress, &c);
+    buffer_free(&c.scratch);
+
+    failed |= run_case(opts, report, "compute_sha1", len, "bytes", run_sha1,
+                       &c);
+    failed |= run_case(opts, report, "build_object_header", len, "bytes",
+                       run_object_header, &c);
+  }
+
+  free(text);
+  free(noise);
+  return failed;
+}
+
+/* Entries like a source directory's: sorted names, random ids */
+static tree_entry_t *make_entries(arena_t *arena, size_t count,
+                                  uint64_t *seed) {
+  tree_entry_t *entries = arena_alloc(arena, count * sizeof(*entries));
+  if (!entries) return NULL;
+
+  for (size_t i = 0; i < count; i++) {
+    unsigned char id[CGIT_HASH_RAW_LEN];
+    char name[48];
+
+    snprintf(name, sizeof(name), "source_file_%06zu.c", i);
+    entries[i].name = arena_strndup(arena, name, strlen(name));
+    if (!entries[i].name) return NULL;
+    entries[i].mode = i % 16 ? 0100644 : 040000;
+    entries[i].type = i % 16 ? "blob" : "tree";
+    datagen_fill(id, sizeof(id), seed, 0);
+    bytes_to_hex_hash(id, entries[i].hash);
+  }
+  return entries;
+}
+
+static int tree_sweep(const bench_options_t *opts, bench_report_t *report) {
+  uint64_t seed = 2;
+  int failed = 0;
+
+  for (size_t i = 0; i < COUNT(entry_counts) && !failed; i++) {
+    size_t count = entry_counts[i];
+    arena_t entries_arena = {0};
+    buffer_t tree = {0};
+    case_arg_t c = {.count = count};
+
+    c.entries = make_entries(&entries_arena, count, &seed);
+    if (!c.entries || serialize_tree(c.entries, count, &tree) != CGIT_OK) {
+      fprintf(stderr, "error: cannot build a %zu-entry tree\n", count);
+      failed = 1;
+    } else {
+      c.data = tree.data;
+      c.len = tree.size;
+      failed |= run_case(opts, report, "serialize_tree", count, "entries",
+                         run_serialize_tree, &c);
+      failed |= run_case(opts, report, "parse_tree", count, "entries",
+                         run_parse_tree, &c);
+    }
+
+    arena_release(&c.arena);
+    arena_release(&entries_arena);
+    buffer_free(&tree);
+  }
+  return failed;
+}
+
+int bench_run_micro(const bench_options_t *opts, bench_report_t *report) {
+  fprintf(stderr, "micro benchmarks\n");
+  int failed = byte_sweep(opts, report);
+  if (!failed) failed = tree_sweep(opts, report);
+  return failed;
+}
@@ -1,46 +1,171 @@
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "../include/common.h"
 #include "../include/core.h"
 
-static int cmd_cat_file(int opt, const char *exp_type, git_object_t *obj) {
-  switch (opt) {
-    case 't':
-      printf("%s\n", obj->type);
-      return 0;
-
-    case 's':
-      printf("%zu\n", obj->size);
-      return 0;
-
-    case 'p':
-      fwrite(obj->data, 1, obj->size, stdout);
-      return 0;
-
-    case 0:
-      if (strcmp(obj->type, exp_type) != 0) {
-        fprintf(stderr, "fatal: expected %s, got %s\n", exp_type, obj->type);
-        return 1;
-      }
-      fwrite(obj->data, 1, obj->size, stdout);
-      return 0;
+static int cmd_cat_file(int opt, const char *exp_type, const char *obj_hash) {
+  char type[CGIT_MAX_TYPE_LEN];
+  size_t size;
+
+  /* Type and size are in the header; the payload stays compressed */
+  if (opt != 'p') {
+    if (read_object_header(obj_hash, type, sizeof(type), &size) != CGIT_OK) {
+      fprintf(stderr, "Failed to read object %s\n", obj_hash);
+      return 1;
+    }
+
+    switch (opt) {
+      case 't':
+        printf("%s\n", type);
+        return 0;
+
+      case 's':
+        printf("%zu\n", size);
+        return 0;
+
+      case 0:
+        if (strcmp(type, exp_type) != 0) {
+          fprintf(stderr, "fatal: expected %s, got %s\n", exp_type, type);
+          return 1;
+        }
+        break;
+    }
+  }
+
+  /* Inflated straight to stdout: memory use does not grow with the object */
+  if (read_object_stream(obj_hash, type, sizeof(type), &size, sink_to_file,
+                         stdout) != CGIT_OK) {
+    fprintf(stderr, "Failed to read object %s\n", obj_hash);
+    return 1;
+  }
+  return 0;
+}
+
+typedef struct {
+  char buf[CGIT_READ_BUFFER_SIZE];
+  size_t start;
+  size_t end;
+  int eof;
+} line_reader_t;
+
+/*
+ * Returns the next stdin line (without its newline) or NULL at end of input.
+ * Output is flushed only right before a read that may block, so a bulk
+ * list of ids is answered in large writes while an interactive caller
+ * still sees each answer before it sends the next id.
+ */
+static char *next_line(line_reader_t *lr) {
+  for (;;) {
+    char *nl = memchr(lr->buf + lr->start, '\n', lr->end - lr->start);
+    if (nl) {
+      char *line = lr->buf + lr->start;
+      *nl = '\0';
+      lr->start = (size_t)(nl - lr->buf) + 1;
+      return line;
+    }
+
+    if (lr->eof) {
+      if (lr->start == lr->end) return NULL;
+      /* Last line without a trailing newline */
+      char *line = lr->buf + lr->start;
+      lr->buf[lr->end] = '\0';
+      lr->start = lr->end;
+      return line;
+    }
+
+    memmove(lr->buf, lr->buf + lr->start, lr->end - lr->start);
+    lr->end -= lr->start;
+    lr->start = 0;
+
+    /* One byte is kept free for the terminator of an unfinished line */
+    if (lr->end == sizeof(lr->buf) - 1) {
+      fprintf(stderr, "fatal: input line too long\n");
+      return NULL;
+    }
+
+    fflush(stdout);
+    ssize_t n = read(STDIN_FILENO, lr->buf + lr->end,
+                     sizeof(lr->buf) - 1 - lr->end);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      fprintf(stderr, "fatal: read error on stdin: %s\n", strerror(errno));
+      return NULL;
+    }
+    if (n == 0) lr->eof = 1;
+    lr->end += (size_t)n;
   }
-  return 1;
+}
+
+static int cmd_cat_file_batch(int with_contents) {
+  int result = 1;
+  object_reader_t reader;
+  line_reader_t *lr = calloc(1, sizeof(*lr));
+  char *line;
+
+  if (!lr) return 1;
+  if (object_reader_init(&reader) != CGIT_OK) {
+    free(lr);
+    return 1;
+  }
+
+  /* Records are small; let stdio gather many of them per write */
+  static char out_buf[CGIT_COMPRESSION_BUFFER_SIZE];
+  setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
+
+  while ((line = next_line(lr))) {
+    /* Anything after the id (e.g. a path from rev-list) is ignored */
+    line[strcspn(line, " \t\r")] = '\0';
+
+    object_view_t view;
+    cgit_error_t err = with_contents
+                           ? object_reader_read(&reader, line, &view)
+                           : object_reader_read_header(&reader, line, &view);
+    if (err == CGIT_ERROR_FILE_NOT_FOUND) {
+      printf("%s missing\n", line);
+      continue;
+    }
+    if (err != CGIT_OK) {
+      fprintf(stderr, "fatal: cannot read object %s\n", line);
+      goto cleanup;
+    }
+
+    printf("%s %s %zu\n", line, view.type, view.size);
+    if (with_contents) {
+      fwrite(view.data, 1, view.size, stdout);
+      putchar('\n');
+    }
+  }
+
+  if (!lr->eof) goto cleanup;
+  result = 0;
+
+cleanup:
+  if (fflush(stdout) != 0) result = 1;
+  object_reader_release(&reader);
+  free(lr);
+  return result;
 }
 
 int handle_cat_file(int argc, char *argv[]) {
   int opt = 0;
   int result = 1; /* default: failure */
-  git_object_t obj = {0};
   const char *obj_hash = NULL;
   const char *exp_type = NULL;
 
+  if (argc == 2 && strcmp(argv[1], "--batch") == 0)
+    return cmd_cat_file_batch(1);
+  if (argc == 2 && strcmp(argv[1], "--batch-check") == 0)
+    return cmd_cat_file_batch(0);
+
   if (argc != 3) {
     fprintf(stderr,
             "usage: cgit cat-file <type> <object>\n"
-            "   or: cgit cat-file (-e | -p | -t | -s) <object>\n");
+            "   or: cgit cat-file (-e | -p | -t | -s) <object>\n"
+            "   or: cgit cat-file (--batch | --batch-check) < <list>\n");
     goto cleanup;
   }
 
@@ -66,15 +191,8 @@ int handle_cat_file(int argc, char *argv[]) {
     goto cleanup;
   }
 
-  cgit_error_t err = read_object(obj_hash, &obj);
-  if (err != CGIT_OK) {
-    fprintf(stderr, "Failed to read object %s\n", obj_hash);
-    goto cleanup;
-  }
-
-  result = cmd_cat_file(opt, exp_type, &obj);
+  result = cmd_cat_file(opt, exp_type, obj_hash);
 
 cleanup:
-  free_object(&obj);
   return result;
 }
@@ -66,6 +66,7 @@ int handle_commit_tree(int argc, char *argv[]) {
 
   cgit_error_t err_writing =
       write_object(out_buf.data, out_buf.size, "commit", hash_out, persist);
+  if (err_writing == CGIT_OK) err_writing = object_files_flush();
   if (err_writing != CGIT_OK) goto cleanup;
 
   printf("%s\n", hash_out);
@@ -1,53 +1,86 @@
+#include <errno.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "../include/common.h"
 #include "../include/core.h"
 
+#define HASH_OBJECT_USAGE \
+  "usage: cgit hash-object [-w] (<file> | --stdin | --stdin-paths [-j <n>])\n"
+
+/* --stdin-paths ids, flushed so a caller waiting on each one sees it */
+static cgit_error_t print_ids(const unsigned char *ids, size_t len,
+                              void *file) {
+  if (fwrite(ids, 1, len, file) != len || fflush(file) != 0) {
+    fprintf(stderr, "error: cannot write output: %s\n", strerror(errno));
+    return CGIT_ERROR_IO;
+  }
+  return CGIT_OK;
+}
+
 int handle_hash_object(int argc, char *argv[]) {
-  int opt = 0;
   int result = 1;
   int persist = 0; /* Since -w is optional, the default is to avoid writing */
-  char *f;
+  int from_stdin = 0;
+  int stdin_paths = 0;
+  char *f = NULL;
   char hash_out[CGIT_HASH_HEX_LEN + 1];
   char *type = CGIT_DEFAULT_OBJ_TYPE;
-  buffer_t buf = {0};
+
+  size_t jobs = default_jobs();
 
   if (argc < 2) {
-    fprintf(stderr, "usage: cgit hash-object [-w] <file>\n");
+    fprintf(stderr, HASH_OBJECT_USAGE);
     goto cleanup;
   }
 
-  if (argv[1][0] == '-' && argv[1][1] != '\0' && argv[1][2] == '\0') {
-    opt = argv[1][1];
-
-    if (opt != 'w') {
-      fprintf(stderr, "Invalid option '-%c'\n", opt);
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-w") == 0) {
+      persist = 1;
+    } else if (strcmp(argv[i], "--stdin") == 0) {
+      from_stdin = 1;
+    } else if (strcmp(argv[i], "--stdin-paths") == 0) {
+      stdin_paths = 1;
+    } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      if (parse_jobs(argv[++i], &jobs) != CGIT_OK) goto cleanup;
+    } else if (strncmp(argv[i], "-j", 2) == 0 && argv[i][2] != '\0') {
+      if (parse_jobs(argv[i] + 2, &jobs) != CGIT_OK) goto cleanup;
+    } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+      fprintf(stderr, "Invalid option '%s'\n", argv[i]);
+      goto cleanup;
+    } else if (!f) {
+      f = argv[i];
+    } else {
+      fprintf(stderr, HASH_OBJECT_USAGE);
       goto cleanup;
     }
   }
 
-  if (opt && argc < 3) {
-    fprintf(stderr,
-            "Missing file name\n"
-            "usage: cgit hash-object [-w] <file>\n");
+  if ((f != NULL) + from_stdin + stdin_paths != 1) {
+    fprintf(stderr, f || from_stdin || stdin_paths ? HASH_OBJECT_USAGE
+                                                   : "Missing file name\n"
+                                                     HASH_OBJECT_USAGE);
     goto cleanup;
   }
 
-  if (!opt) {
-    f = argv[1];
-  } else {
-    f = argv[2];
-    persist = 1;
-  }
-
-  cgit_error_t err_read = read_file(f, &buf);
-  if (err_read != CGIT_OK) {
-    fprintf(stderr, "Failed to read file '%s'\n", f);
+  if (stdin_paths) {
+    if (ingest_paths(STDIN_FILENO, type, persist, jobs, print_ids, stdout) !=
+        CGIT_OK) {
+      fprintf(stderr, "Failed to create the object\n");
+      goto cleanup;
+    }
+    result = 0;
     goto cleanup;
   }
 
   cgit_error_t err_write =
-      write_object(buf.data, buf.size, type, hash_out, persist);
+      from_stdin
+          ? write_object_from_fd(STDIN_FILENO, "<stdin>", type, hash_out,
+                                 persist)
+          : write_object_from_file(f, type, hash_out, persist);
+
+  if (err_write == CGIT_OK) err_write = object_files_flush();
 
   if (err_write != CGIT_OK) {
     fprintf(stderr, "Failed to create the object\n");
@@ -58,6 +91,5 @@ int handle_hash_object(int argc, char *argv[]) {
   result = 0;
 
 cleanup:
-  buffer_free(&buf);
   return result;
 }
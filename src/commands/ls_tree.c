@@ -9,9 +9,10 @@ int handle_ls_tree(int argc, char *argv[]) {
   int result = 1;
   const char *obj_hash = NULL;
 
-  size_t count = 0;
-  tree_entry_t *entries = NULL;
   git_object_t obj = {0};
+  tree_iter_t it;
+  tree_iter_entry_t entry;
+  char hex[CGIT_HASH_HEX_LEN + 1];
 
   if (argc < 2) {
     fprintf(stderr, "usage: cgit ls-tree [--name-only] <object>\n");
@@ -42,27 +43,25 @@ int handle_ls_tree(int argc, char *argv[]) {
     goto cleanup;
   }
 
-  cgit_error_t err_parsing = parse_tree(obj.data, obj.size, &entries, &count);
-  if (err_parsing != CGIT_OK) {
-    fprintf(stderr, "Failed to read tree object %s\n", obj_hash);
-    goto cleanup;
+  /* Entries are views into obj.data; nothing is copied per entry */
+  tree_iter_init(&it, obj.data, obj.size);
+  while (tree_iter_next(&it, &entry)) {
+    if (!opt_name_only) {
+      bytes_to_hex_hash(entry.id, hex);
+      printf("%06o %s %s\t", entry.mode, object_type_name(entry.type), hex);
+    }
+    fwrite(entry.name, 1, entry.name_len, stdout);
+    putchar('\n');
   }
 
-  if (opt_name_only) {
-    for (size_t i = 0; i < count; i++) {
-      printf("%s\n", entries[i].name);
-    }
-  } else {
-    for (size_t i = 0; i < count; i++) {
-      printf("%06o %s %s\t%s\n", entries[i].mode, entries[i].type,
-             entries[i].hash, entries[i].name);
-    }
+  if (it.error != CGIT_OK) {
+    fprintf(stderr, "Failed to read tree object %s\n", obj_hash);
+    goto cleanup;
   }
 
   result = 0;
 
 cleanup:
   free_object(&obj);
-  free_tree_entries(entries, count);
   return result;
 }
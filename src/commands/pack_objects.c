@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../include/common.h"
+#include "../include/core.h"
+
+typedef struct {
+  char (*hashes)[CGIT_HASH_HEX_LEN + 1];
+  size_t count;
+  size_t capacity;
+} hash_list_t;
+
+static cgit_error_t hash_list_add(const char *hash, void *data) {
+  hash_list_t *list = data;
+
+  if (list->count == list->capacity) {
+    size_t new_cap = list->capacity ? list->capacity * 2 : 64;
+    char(*tmp)[CGIT_HASH_HEX_LEN + 1] =
+        realloc(list->hashes, new_cap * sizeof(*list->hashes));
+    if (!tmp) return CGIT_ERROR_MEMORY;
+    list->hashes = tmp;
+    list->capacity = new_cap;
+  }
+
+  memcpy(list->hashes[list->count], hash, CGIT_HASH_HEX_LEN);
+  list->hashes[list->count][CGIT_HASH_HEX_LEN] = '\0';
+  list->count++;
+  return CGIT_OK;
+}
+
+static int cmp_hash(const void *a, const void *b) {
+  return memcmp(a, b, CGIT_HASH_HEX_LEN);
+}
+
+/*
+ * Accepts "<hash>" lines as well as the "<hash> <path>" lines printed by
+ * `git rev-list --objects`, so existing object lists can be piped in.
+ */
+static int read_stdin_hashes(hash_list_t *list) {
+  char line[CGIT_READ_BUFFER_SIZE];
+
+  while (fgets(line, sizeof(line), stdin)) {
+    line[strcspn(line, " \t\r\n")] = '\0';
+    if (line[0] == '\0') continue;
+
+    if (is_valid_hash(line) != CGIT_OK) return 1;
+    if (hash_list_add(line, list) != CGIT_OK) {
+      fprintf(stderr, "error: out of memory\n");
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static int parse_count(const char *arg, const char *name, int *out) {
+  char *end;
+  long val = strtol(arg, &end, 10);
+
+  if (*arg == '\0' || *end != '\0' || val < 0 || val > 4096) {
+    fprintf(stderr, "error: invalid %s '%s'\n", name, arg);
+    return 1;
+  }
+  *out = (int)val;
+  return 0;
+}
+
+int handle_pack_objects(int argc, char *argv[]) {
+  int result = 1;
+  int opt_all = 0;
+  int opt_prune = 0;
+  hash_list_t list = {0};
+  char pack_hash[CGIT_HASH_HEX_LEN + 1];
+  pack_options_t opts = {.window = CGIT_PACK_DEFAULT_WINDOW,
+                         .depth = CGIT_PACK_DEFAULT_DEPTH};
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--all") == 0) {
+      opt_all = 1;
+    } else if (strcmp(argv[i], "--prune") == 0) {
+      opt_prune = 1;
+    } else if (strncmp(argv[i], "--window=", 9) == 0) {
+      if (parse_count(argv[i] + 9, "window", &opts.window)) goto cleanup;
+    } else if (strncmp(argv[i], "--depth=", 8) == 0) {
+      if (parse_count(argv[i] + 8, "depth", &opts.depth)) goto cleanup;
+    } else {
+      fprintf(stderr,
+              "usage: cgit pack-objects [--all] [--prune] [--window=<n>] "
+              "[--depth=<n>]\n");
+      goto cleanup;
+    }
+  }
+
+  if (opt_all) {
+    if (for_each_loose_object(hash_list_add, &list) != CGIT_OK) {
+      fprintf(stderr, "Failed to list loose objects\n");
+      goto cleanup;
+    }
+  } else if (read_stdin_hashes(&list) != 0) {
+    goto cleanup;
+  }
+
+  /* Sorted and unique, so the same set of objects always gives one pack */
+  qsort(list.hashes, list.count, sizeof(*list.hashes), cmp_hash);
+  size_t unique = 0;
+  for (size_t i = 0; i < list.count; i++) {
+    if (unique && cmp_hash(list.hashes[unique - 1], list.hashes[i]) == 0)
+      continue;
+    memmove(list.hashes[unique++], list.hashes[i], sizeof(*list.hashes));
+  }
+  list.count = unique;
+
+  /* --prune deletes the only other copy: the pack must be on disk first */
+  opts.durable = opt_prune;
+  if (write_pack((const char(*)[CGIT_HASH_HEX_LEN + 1])list.hashes,
+                 list.count, &opts, pack_hash) != CGIT_OK) {
+    fprintf(stderr, "Failed to write pack\n");
+    goto cleanup;
+  }
+
+  /* The pack is durably in place, so the loose copies are now redundant */
+  if (opt_prune) {
+    for (size_t i = 0; i < list.count; i++) {
+      char path[CGIT_MAX_PATH_LENGTH];
+      if (build_object_path(list.hashes[i], path, sizeof(path)) != CGIT_OK)
+        continue;
+      unlink(path);
+
+      /* Only succeeds once the fanout directory is empty */
+      if (build_object_dir(list.hashes[i], path, sizeof(path)) == CGIT_OK)
+        rmdir(path);
+    }
+  }
+
+  printf("%s\n", pack_hash);
+  result = 0;
+
+cleanup:
+  free(list.hashes);
+  return result;
+}
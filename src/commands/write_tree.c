@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 
 #include "../include/common.h"
 #include "../include/core.h"
@@ -7,34 +8,65 @@ int handle_write_tree(int argc, char *argv[]) {
   int result = 1;
   tree_entry_t *entries = NULL;
   size_t count = 0;
+  arena_t arena = {0};
   char *curr_dir_path = ".";
-  buffer_t out = {0};
-  int persist = 1;
+  tree_stats_t stats;
+  index_state_t *index = NULL;
   char hash_out[CGIT_HASH_HEX_LEN + 1];
 
-  cgit_error_t err = write_tree_recursive(curr_dir_path, &entries, &count);
-  if (err != CGIT_OK) {
-    fprintf(stderr, "Failed to create tree object\n");
+  size_t jobs = default_jobs();
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      if (parse_jobs(argv[++i], &jobs) != CGIT_OK) goto cleanup;
+    } else if (strncmp(argv[i], "-j", 2) == 0 && argv[i][2] != '\0') {
+      if (parse_jobs(argv[i] + 2, &jobs) != CGIT_OK) goto cleanup;
+    } else {
+      fprintf(stderr, "usage: cgit write-tree [-j <n>]\n");
+      goto cleanup;
+    }
+  }
+
+  if (index_load(&index) != CGIT_OK) {
+    fprintf(stderr, "Failed to read the index\n");
     goto cleanup;
   }
 
-  cgit_error_t err_serialize = serialize_tree(entries, count, &out);
-  if (err_serialize != CGIT_OK) {
-    fprintf(stderr, "Failed to serialize tree object\n");
+  /* -j 1 keeps the plain recursive walk, with no threads at all */
+  cgit_error_t err =
+      jobs > 1 ? write_tree_parallel(&arena, curr_dir_path, jobs, index,
+                                     &entries, &count, &stats)
+               : write_tree_recursive(&arena, curr_dir_path, index, &entries,
+                                      &count, &stats);
+  if (err != CGIT_OK) {
+    fprintf(stderr, "Failed to create tree object\n");
     goto cleanup;
   }
 
-  cgit_error_t err_writing =
-      write_object(out.data, out.size, "tree", hash_out, persist);
+  cgit_error_t err_writing = write_tree_object(curr_dir_path, index, entries,
+                                               count, &stats, hash_out, NULL);
   if (err_writing != CGIT_OK) {
     fprintf(stderr, "Failed to write tree object\n");
     goto cleanup;
   }
 
+  /* Batched objects need their final names before the index names them */
+  if (object_files_flush() != CGIT_OK) {
+    fprintf(stderr, "Failed to write objects\n");
+    goto cleanup;
+  }
+
+  /* Only a complete walk may replace the index */
+  if (index_commit(index) != CGIT_OK) {
+    fprintf(stderr, "Failed to write the index\n");
+    goto cleanup;
+  }
+
   printf("%s\n", hash_out);
   result = 0;
 cleanup:
-  buffer_free(&out);
-  free_tree_entries(entries, count);
+  object_files_flush(); /* after a failure, keep what was written */
+  arena_release(&arena);
+  index_free(index);
   return result;
 }
@@ -0,0 +1,128 @@
+/*
+ * Arena (bump) allocator.
+ *
+ * Tree parsing and tree building make several small allocations per entry
+ * (the entry array, the name) and used to free them one at a time. An arena
+ * hands out memory from large blocks by bumping a pointer, and gives it all
+ * back at once with arena_release, or back to an earlier point with
+ * arena_rewind.
+ *
+ * Blocks double in size up to CGIT_ARENA_MAX_BLOCK, so a 50k-entry tree
+ * costs a handful of mallocs. A zeroed arena_t is an empty arena, like a
+ * zeroed buffer_t.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/common.h"
+#include "../include/core.h"
+
+struct arena_block {
+  arena_block_t *prev;
+  size_t size; /* usable bytes in data */
+  size_t used;
+  max_align_t data[];
+};
+
+#define ARENA_ALIGN (sizeof(max_align_t))
+
+static size_t align_up(size_t n) {
+  return (n + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+static cgit_error_t add_block(arena_t *arena, size_t min_size) {
+  size_t size = arena->next_size ? arena->next_size : CGIT_ARENA_BLOCK_SIZE;
+  if (size < min_size) size = min_size;
+  if (size > SIZE_MAX - sizeof(arena_block_t)) return CGIT_ERROR_MEMORY;
+
+  arena_block_t *block = malloc(sizeof(*block) + size);
+  if (!block) {
+    cgit_report("error: out of memory\n");
+    return CGIT_ERROR_MEMORY;
+  }
+  block->prev = arena->head;
+  block->size = size;
+  block->used = 0;
+  arena->head = block;
+
+  if (arena->next_size < CGIT_ARENA_MAX_BLOCK)
+    arena->next_size = size * 2 < CGIT_ARENA_MAX_BLOCK ? size * 2
+                                                       : CGIT_ARENA_MAX_BLOCK;
+  return CGIT_OK;
+}
+
+/* Returns NULL when out of memory. The memory is not zeroed. */
+void *arena_alloc(arena_t *arena, size_t size) {
+  if (size > SIZE_MAX - ARENA_ALIGN) return NULL;
+  size = align_up(size ? size : 1);
+
+  arena_block_t *block = arena->head;
+  if (!block || block->size - block->used < size) {
+    if (add_block(arena, size) != CGIT_OK) return NULL;
+    block = arena->head;
+  }
+
+  void *ptr = (unsigned char *)block->data + block->used;
+  block->used += size;
+  arena->last = ptr;
+  return ptr;
+}
+
+/*
+ * Resize ptr (old_size bytes, from this arena) to new_size. The most recent
+ * allocation grows in place when its block has room; anything else is
+ * copied, and the old copy stays in the arena until it is released.
+ */
+void *arena_grow(arena_t *arena, void *ptr, size_t old_size,
+                 size_t new_size) {
+  if (!ptr) return arena_alloc(arena, new_size);
+  if (new_size <= old_size) return ptr;
+
+  arena_block_t *block = arena->head;
+  if (ptr == arena->last && new_size <= SIZE_MAX - ARENA_ALIGN) {
+    size_t offset = (size_t)((unsigned char *)ptr - (unsigned char *)block->data);
+    size_t needed = align_up(new_size);
+    if (needed <= block->size - offset) {
+      block->used = offset + needed;
+      return ptr;
+    }
+  }
+
+  void *fresh = arena_alloc(arena, new_size);
+  if (fresh) memcpy(fresh, ptr, old_size);
+  return fresh;
+}
+
+char *arena_strndup(arena_t *arena, const char *s, size_t len) {
+  char *copy = arena_alloc(arena, len + 1);
+  if (!copy) return NULL;
+
+  memcpy(copy, s, len);
+  copy[len] = '\0';
+  return copy;
+}
+
+arena_mark_t arena_mark(const arena_t *arena) {
+  arena_mark_t mark = {arena->head, arena->head ? arena->head->used : 0};
+  return mark;
+}
+
+/* Free everything allocated since mark was taken */
+void arena_rewind(arena_t *arena, arena_mark_t mark) {
+  while (arena->head != mark.block) {
+    arena_block_t *prev = arena->head->prev;
+    free(arena->head);
+    arena->head = prev;
+  }
+  if (arena->head) arena->head->used = mark.used;
+  arena->last = NULL;
+}
+
+void arena_release(arena_t *arena) {
+  arena_rewind(arena, (arena_mark_t){0});
+  memset(arena, 0, sizeof(*arena));
+}
@@ -1,4 +1,32 @@
-#include <errno.h>
+/*
+ * zlib compression behind a reusable context.
+ *
+ * Setting up a deflate stream allocates and clears about 256 KiB of state,
+ * which costs more than compressing a typical small object. A
+ * compress_ctx_t keeps its streams alive and resets them between objects
+ * instead. compress_data and decompress_data use one context per thread,
+ * created on first use and freed when the thread exits.
+ *
+ * The level comes from the repository config, as in git:
+ * core.looseCompression for loose objects and pack.compression for packs,
+ * each falling back to core.compression, then to zlib's default.
+ *
+ * Loose objects of CGIT_COMPRESS_SAMPLE_MIN bytes or more are probed
+ * first: a fast deflate of CGIT_COMPRESS_SAMPLE_SIZE bytes from their
+ * middle. JPEGs, archives and other already-compressed data barely shrink,
+ * and deflating them at the default level only burns time, so when the
+ * probe saves almost nothing the object is written as stored deflate
+ * blocks instead. The result is still ordinary zlib.
+ * core.adaptiveCompression = false turns this off.
+ *
+ * Building with CGIT_USE_LIBDEFLATE (the CGIT_COMPRESSION=libdeflate CMake
+ * option) swaps in libdeflate's whole-buffer compressor, which is faster
+ * for the in-memory objects these functions see. Streaming paths such as
+ * large blobs and pack reads still use zlib directly.
+ */
+
+#include <limits.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -6,150 +34,471 @@
 #include <string.h>
 #include <zlib.h>
 
+#ifdef CGIT_USE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
 #include "../include/common.h"
 #include "../include/core.h"
 
-cgit_error_t decompress_data(const unsigned char *input, size_t input_len,
-                             buffer_t *output) {
-  cgit_error_t result = CGIT_OK;
-  int strm_initialized = 0;
-  unsigned char tmp[CGIT_COMPRESSION_BUFFER_SIZE];
-  output->capacity = CGIT_READ_BUFFER_SIZE;
-  output->data = malloc(output->capacity);
-
-  if (!output->data) {
-    fprintf(stderr, "out of memory\n");
-    result = CGIT_ERROR_MEMORY;
-    goto cleanup;
+#ifndef CGIT_USE_LIBDEFLATE
+/*
+ * A deflate stream that keeps one level for life. Before zlib 1.2.12,
+ * deflateParams after deflateReset may flush into the previous object's
+ * output buffer, so a new level means a new stream instead.
+ */
+typedef struct {
+  z_stream strm;
+  int ready;
+  int level;
+} deflate_stream_t;
+#endif
+
+struct compress_ctx {
+  int level;
+  int adaptive; /* probe large inputs before compressing them */
+#ifdef CGIT_USE_LIBDEFLATE
+  struct libdeflate_compressor *compressor;
+  struct libdeflate_compressor *stored; /* level 0, for incompressible data */
+  struct libdeflate_compressor *probe;  /* level 1, for the adaptive probe */
+  struct libdeflate_decompressor *decompressor;
+#else
+  deflate_stream_t deflate; /* at level */
+  deflate_stream_t stored;  /* level 0, for incompressible data */
+  deflate_stream_t probe;   /* level 1, for the adaptive probe */
+  z_stream inflate;
+  int inflate_ready;
+#endif
+};
+
+static int valid_level(const char *key, int *level) {
+  if (!config_get_int(key, level)) return 0;
+  if (*level < Z_DEFAULT_COMPRESSION || *level > Z_BEST_COMPRESSION) {
+    cgit_report("warning: bad zlib compression level %d for '%s'\n",
+                *level, key);
+    return 0;
   }
+  return 1;
+}
 
-  z_stream strm;
-  memset(&strm, 0, sizeof(strm));
-  strm.next_in = (Bytef *)input;
-  strm.avail_in = (uInt)input_len;
-
-  int zret = inflateInit(&strm);
-  if (zret != Z_OK) {
-    fprintf(stderr, "error: inflateInit failed\n");
-    result = CGIT_ERROR_COMPRESSION;
-    goto cleanup;
+static int config_level(const char *key) {
+  int level;
+  if (valid_level(key, &level)) return level;
+  if (valid_level("core.compression", &level)) return level;
+  return Z_DEFAULT_COMPRESSION;
+}
+
+static void load_levels(void) {
+  cgit_repo_t *repo = repo_current();
+  repo->levels[CGIT_COMPRESS_LOOSE] = config_level("core.looseCompression");
+  repo->levels[CGIT_COMPRESS_PACK] = config_level("pack.compression");
+  repo->adaptive = config_get_bool("core.adaptiveCompression", 1);
+}
+
+/* The level for objects of one kind, from the config or zlib's default */
+int compression_level(compression_target_t target) {
+  cgit_repo_t *repo = repo_current();
+  pthread_once(&repo->levels_once, load_levels);
+  return repo->levels[target];
+}
+
+static int adaptive_enabled(void) {
+  cgit_repo_t *repo = repo_current();
+  pthread_once(&repo->levels_once, load_levels);
+  return repo->adaptive;
+}
+
+cgit_error_t compress_ctx_create(int level, compress_ctx_t **ctx_out) {
+  compress_ctx_t *ctx = calloc(1, sizeof(*ctx));
+  if (!ctx) {
+    cgit_report("error: out of memory\n");
+    return CGIT_ERROR_MEMORY;
   }
-  strm_initialized = 1;
 
-  for (;;) {
-    // Reset output window every iteration
-    strm.next_out = (Bytef *)tmp;
-    strm.avail_out = (uInt)sizeof(tmp);
+  ctx->level = level;
+  *ctx_out = ctx;
+  return CGIT_OK;
+}
+
+void compress_ctx_free(compress_ctx_t *ctx) {
+  if (!ctx) return;
+#ifdef CGIT_USE_LIBDEFLATE
+  libdeflate_free_compressor(ctx->compressor);
+  libdeflate_free_compressor(ctx->stored);
+  libdeflate_free_compressor(ctx->probe);
+  libdeflate_free_decompressor(ctx->decompressor);
+#else
+  if (ctx->deflate.ready) deflateEnd(&ctx->deflate.strm);
+  if (ctx->stored.ready) deflateEnd(&ctx->stored.strm);
+  if (ctx->probe.ready) deflateEnd(&ctx->probe.strm);
+  if (ctx->inflate_ready) inflateEnd(&ctx->inflate);
+#endif
+  free(ctx);
+}
 
-    zret = inflate(&strm, Z_NO_FLUSH);
+/* The probe window: the middle of the input, past any file header */
+#define SAMPLE_OF(data, len) \
+  ((data) + ((len) - CGIT_COMPRESS_SAMPLE_SIZE) / 2)
 
-    if (zret != Z_OK && zret != Z_STREAM_END) {
-      fprintf(stderr, "error: inflate failed (corrupt object?)\n");
-      result = CGIT_ERROR_COMPRESSION;
-      goto cleanup;
+/* A probe must save at least 1/32 (about 3%) to count as compressible */
+#define PROBE_LIMIT(len) ((len) - (len) / 32)
+
+#ifdef CGIT_USE_LIBDEFLATE
+
+/* libdeflate numbers its levels 0-12; zlib's default corresponds to 6 */
+static int libdeflate_level(int level) {
+  return level == Z_DEFAULT_COMPRESSION ? 6 : level;
+}
+
+static struct libdeflate_compressor *get_compressor(
+    struct libdeflate_compressor **slot, int level) {
+  if (!*slot) {
+    *slot = libdeflate_alloc_compressor(libdeflate_level(level));
+    if (!*slot) cgit_report("compression error\n");
+  }
+  return *slot;
+}
+
+static cgit_error_t probe(compress_ctx_t *ctx, const unsigned char *sample,
+                          size_t len, int *incompressible) {
+  unsigned char out[CGIT_COMPRESS_SAMPLE_SIZE];
+
+  struct libdeflate_compressor *compressor =
+      get_compressor(&ctx->probe, Z_BEST_SPEED);
+  if (!compressor) return CGIT_ERROR_COMPRESSION;
+  /* Zero means it did not fit in the limit */
+  *incompressible = libdeflate_zlib_compress(compressor, sample, len, out,
+                                             PROBE_LIMIT(len)) == 0;
+  return CGIT_OK;
+}
+
+/* The compressor is made for one level: drop it when the level changes */
+static void set_level(compress_ctx_t *ctx, int level) {
+  if (level == ctx->level) return;
+  libdeflate_free_compressor(ctx->compressor);
+  ctx->compressor = NULL;
+  ctx->level = level;
+}
+
+static cgit_error_t deflate_into(compress_ctx_t *ctx,
+                                 const unsigned char *input,
+                                 size_t input_len, buffer_t *output) {
+  cgit_error_t result = CGIT_OK;
+  int incompressible = 0;
+
+  if (ctx->adaptive && ctx->level != Z_NO_COMPRESSION &&
+      input_len >= CGIT_COMPRESS_SAMPLE_MIN) {
+    result = probe(ctx, SAMPLE_OF(input, input_len), CGIT_COMPRESS_SAMPLE_SIZE,
+                   &incompressible);
+    if (result != CGIT_OK) return result;
+  }
+
+  struct libdeflate_compressor *compressor =
+      incompressible ? get_compressor(&ctx->stored, Z_NO_COMPRESSION)
+                     : get_compressor(&ctx->compressor, ctx->level);
+  if (!compressor) return CGIT_ERROR_COMPRESSION;
+
+  output->size = 0;
+  size_t bound = libdeflate_zlib_compress_bound(compressor, input_len);
+  result = buffer_reserve(output, bound);
+  if (result != CGIT_OK) return result;
+
+  output->size = libdeflate_zlib_compress(compressor, input, input_len,
+                                          output->data, output->capacity);
+  if (output->size == 0) {
+    cgit_report("compression error\n");
+    return CGIT_ERROR_COMPRESSION;
+  }
+  return CGIT_OK;
+}
+
+static cgit_error_t inflate_into(compress_ctx_t *ctx,
+                                 const unsigned char *input,
+                                 size_t input_len, buffer_t *output) {
+  cgit_error_t result = CGIT_OK;
+
+  if (!ctx->decompressor) {
+    ctx->decompressor = libdeflate_alloc_decompressor();
+    if (!ctx->decompressor) {
+      cgit_report("error: out of memory\n");
+      return CGIT_ERROR_MEMORY;
     }
+  }
+
+  /* The inflated size is not stored, so grow until it fits */
+  size_t guess = input_len < SIZE_MAX / 4 ? input_len * 4 : input_len;
+  output->size = 0;
+  for (;;) {
+    result = buffer_reserve(output, guess);
+    if (result != CGIT_OK) return result;
 
-    size_t produced = sizeof(tmp) - (size_t)strm.avail_out;
-    if (produced > 0) {
-      if (output->size + produced > output->capacity) {
-        size_t new_cap = output->capacity;
-        while (new_cap < output->size + produced) new_cap *= 2;
-
-        unsigned char *p = (unsigned char *)realloc(output->data, new_cap);
-        if (!p) {
-          fprintf(stderr, "out of memory\n");
-          result = CGIT_ERROR_MEMORY;
-          goto cleanup;
-        }
-        output->data = p;
-        output->capacity = new_cap;
-      }
-
-      memcpy(output->data + output->size, tmp, produced);
-      output->size += produced;
+    size_t in_used, out_len;
+    enum libdeflate_result ret = libdeflate_zlib_decompress_ex(
+        ctx->decompressor, input, input_len, output->data, output->capacity,
+        &in_used, &out_len);
+    if (ret == LIBDEFLATE_SUCCESS) {
+      output->size = out_len;
+      return CGIT_OK;
     }
+    if (ret != LIBDEFLATE_INSUFFICIENT_SPACE) {
+      cgit_report("error: inflate failed (corrupt object?)\n");
+      return CGIT_ERROR_COMPRESSION;
+    }
+    guess = output->capacity + 1;
+  }
+}
+
+#else
 
-    if (zret == Z_STREAM_END) break;
+/* reset_deflate applies a new level when the next object starts */
+static void set_level(compress_ctx_t *ctx, int level) { ctx->level = level; }
+
+/*
+ * Reset a stream for the next object, initializing it on first use. A
+ * stream asked for another level is ended and initialized again.
+ */
+static z_stream *reset_deflate(deflate_stream_t *stream, int level) {
+  if (stream->ready && stream->level != level) {
+    deflateEnd(&stream->strm);
+    stream->ready = 0;
   }
 
-cleanup:
-  if (strm_initialized) inflateEnd(&strm);
-  return result;
+  if (!stream->ready) {
+    memset(&stream->strm, 0, sizeof(stream->strm));
+    if (deflateInit(&stream->strm, level) != Z_OK) {
+      cgit_report("compression error\n");
+      return NULL;
+    }
+    stream->ready = 1;
+    stream->level = level;
+  } else if (deflateReset(&stream->strm) != Z_OK) {
+    cgit_report("compression error\n");
+    return NULL;
+  }
+  return &stream->strm;
 }
 
-cgit_error_t compress_data(const unsigned char *input, size_t input_len,
-                           buffer_t *output) {
+static cgit_error_t probe(compress_ctx_t *ctx, const unsigned char *sample,
+                          size_t len, int *incompressible) {
+  unsigned char out[CGIT_COMPRESS_SAMPLE_SIZE];
+  z_stream *strm = reset_deflate(&ctx->probe, Z_BEST_SPEED);
+  if (!strm) return CGIT_ERROR_COMPRESSION;
+
+  strm->next_in = (Bytef *)sample;
+  strm->avail_in = (uInt)len;
+  strm->next_out = out;
+  strm->avail_out = (uInt)PROBE_LIMIT(len);
+
+  /* Running out of room before the end means it did not shrink enough */
+  *incompressible = deflate(strm, Z_FINISH) != Z_STREAM_END;
+  return CGIT_OK;
+}
+
+/*
+ * Deflate straight into output, sized with deflateBound up front, so the
+ * common case is one deflate call and no copying.
+ */
+static cgit_error_t deflate_into(compress_ctx_t *ctx,
+                                 const unsigned char *input,
+                                 size_t input_len, buffer_t *output) {
   cgit_error_t result = CGIT_OK;
-  int strm_initialized = 0;
-  unsigned char tmp[CGIT_COMPRESSION_BUFFER_SIZE];
-  output->capacity = CGIT_READ_BUFFER_SIZE;
-  output->data = malloc(output->capacity);
-
-  if (!output->data) {
-    fprintf(stderr, "out of memory\n");
-    result = CGIT_ERROR_MEMORY;
-    goto cleanup;
+  int incompressible = 0;
+  int ret;
+
+  if (ctx->adaptive && ctx->level != Z_NO_COMPRESSION &&
+      input_len >= CGIT_COMPRESS_SAMPLE_MIN) {
+    result = probe(ctx, SAMPLE_OF(input, input_len), CGIT_COMPRESS_SAMPLE_SIZE,
+                   &incompressible);
+    if (result != CGIT_OK) return result;
   }
 
-  z_stream strm;
-  memset(&strm, 0, sizeof(strm));
+  z_stream *strm = incompressible
+                       ? reset_deflate(&ctx->stored, Z_NO_COMPRESSION)
+                       : reset_deflate(&ctx->deflate, ctx->level);
+  if (!strm) return CGIT_ERROR_COMPRESSION;
 
-  strm.next_in = (Bytef *)input;
-  strm.avail_in = (uInt)input_len;
+  output->size = 0;
+  result = buffer_reserve(output, deflateBound(strm, input_len));
+  if (result != CGIT_OK) return result;
 
-  int ret = deflateInit(&strm, Z_DEFAULT_COMPRESSION);
-  if (ret != Z_OK) {
-    fprintf(stderr, "compression error\n");
-    result = CGIT_ERROR_COMPRESSION;
-    goto cleanup;
-  }
-  strm_initialized = 1;
+  strm->next_in = (Bytef *)input;
+  strm->avail_in = 0;
+  size_t in_left = input_len;
 
   do {
-    strm.next_out = tmp;
-    strm.avail_out = sizeof(tmp);
+    /* avail_in is a uInt: hand over inputs past 4 GiB a slice at a time */
+    if (strm->avail_in == 0 && in_left > 0) {
+      strm->avail_in = in_left > UINT_MAX ? UINT_MAX : (uInt)in_left;
+      in_left -= strm->avail_in;
+    }
 
-    ret = deflate(&strm, strm.avail_in == 0 ? Z_FINISH : Z_NO_FLUSH);
+    if (output->size == output->capacity) {
+      result = buffer_reserve(output, output->capacity + 1);
+      if (result != CGIT_OK) return result;
+    }
+    size_t room = output->capacity - output->size;
+    strm->next_out = output->data + output->size;
+    strm->avail_out = room > UINT_MAX ? UINT_MAX : (uInt)room;
+
+    ret = deflate(strm, strm->avail_in == 0 && in_left == 0 ? Z_FINISH
+                                                            : Z_NO_FLUSH);
     if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
-      fprintf(stderr, "compression error\n");
-      result = CGIT_ERROR_COMPRESSION;
-      goto cleanup;
+      cgit_report("compression error\n");
+      return CGIT_ERROR_COMPRESSION;
     }
+    output->size = (size_t)(strm->next_out - output->data);
+  } while (ret != Z_STREAM_END);
 
-    size_t produced = sizeof(tmp) - (size_t)strm.avail_out;
+  return CGIT_OK;
+}
 
-    if (produced > 0) {
-      if (produced > output->capacity - output->size) {
-        size_t new_cap = output->capacity;
+static cgit_error_t inflate_into(compress_ctx_t *ctx,
+                                 const unsigned char *input,
+                                 size_t input_len, buffer_t *output) {
+  cgit_error_t result = CGIT_OK;
+  z_stream *strm = &ctx->inflate;
+  int zret;
 
-        while (produced > new_cap - output->size) {
-          if (new_cap > SIZE_MAX / 2) {
-            fprintf(stderr, "new_cap is > max representable\n");
-            result = CGIT_ERROR_MEMORY;
-            goto cleanup;
-          }
-          new_cap *= 2;
-        }
+  if (!ctx->inflate_ready) {
+    if (inflateInit(strm) != Z_OK) {
+      cgit_report("error: inflateInit failed\n");
+      return CGIT_ERROR_COMPRESSION;
+    }
+    ctx->inflate_ready = 1;
+  } else if (inflateReset(strm) != Z_OK) {
+    cgit_report("error: inflateReset failed\n");
+    return CGIT_ERROR_COMPRESSION;
+  }
 
-        unsigned char *tmp_acc =
-            (unsigned char *)realloc(output->data, new_cap);
+  /* Objects usually inflate to a few times their stored size */
+  output->size = 0;
+  result = buffer_reserve(output, input_len < SIZE_MAX / 4 ? input_len * 4 : 0);
+  if (result != CGIT_OK) return result;
 
-        if (!tmp_acc) {
-          fprintf(stderr, "error: %s\n", strerror(errno));
-          result = CGIT_ERROR_MEMORY;
-          goto cleanup;
-        }
+  strm->next_in = (Bytef *)input;
+  strm->avail_in = 0;
+  size_t in_left = input_len;
 
-        output->data = tmp_acc;
-        output->capacity = new_cap;
-      }
+  do {
+    if (strm->avail_in == 0 && in_left > 0) {
+      strm->avail_in = in_left > UINT_MAX ? UINT_MAX : (uInt)in_left;
+      in_left -= strm->avail_in;
+    }
 
-      memcpy(output->data + output->size, tmp, produced);
-      output->size += produced;
+    if (output->size == output->capacity) {
+      result = buffer_reserve(output, output->capacity + 1);
+      if (result != CGIT_OK) return result;
     }
-  } while (ret != Z_STREAM_END);
+    size_t room = output->capacity - output->size;
+    strm->next_out = output->data + output->size;
+    strm->avail_out = room > UINT_MAX ? UINT_MAX : (uInt)room;
+
+    zret = inflate(strm, Z_NO_FLUSH);
+    output->size = (size_t)(strm->next_out - output->data);
+
+    /* Z_BUF_ERROR with input left means the output window was full */
+    if (zret == Z_BUF_ERROR && (strm->avail_in > 0 || in_left > 0)) continue;
+    if (zret != Z_OK && zret != Z_STREAM_END) {
+      cgit_report("error: inflate failed (corrupt object?)\n");
+      return CGIT_ERROR_COMPRESSION;
+    }
+  } while (zret != Z_STREAM_END);
+
+  return CGIT_OK;
+}
+
+#endif /* CGIT_USE_LIBDEFLATE */
+
+cgit_error_t compress_ctx_deflate(compress_ctx_t *ctx,
+                                  const unsigned char *input,
+                                  size_t input_len, buffer_t *output) {
+  uint64_t start = trace_begin();
+  cgit_error_t result = deflate_into(ctx, input, input_len, output);
+  trace_end(TRACE_DEFLATE, start, input_len);
+  return result;
+}
+
+cgit_error_t compress_ctx_inflate(compress_ctx_t *ctx,
+                                  const unsigned char *input,
+                                  size_t input_len, buffer_t *output) {
+  uint64_t start = trace_begin();
+  cgit_error_t result = inflate_into(ctx, input, input_len, output);
+  trace_end(TRACE_INFLATE, start, output->size);
+  return result;
+}
+
+static pthread_key_t thread_ctx_key;
+static pthread_once_t thread_ctx_once = PTHREAD_ONCE_INIT;
+
+static void free_thread_ctx(void *ctx) { compress_ctx_free(ctx); }
+
+static void make_thread_ctx_key(void) {
+  pthread_key_create(&thread_ctx_key, free_thread_ctx);
+}
+
+/*
+ * This thread's context for loose objects, set up for the current
+ * repository: a thread may serve several with different levels.
+ */
+static cgit_error_t thread_ctx(compress_ctx_t **ctx_out) {
+  int level = compression_level(CGIT_COMPRESS_LOOSE);
+
+  pthread_once(&thread_ctx_once, make_thread_ctx_key);
+
+  compress_ctx_t *ctx = pthread_getspecific(thread_ctx_key);
+  if (!ctx) {
+    cgit_error_t result = compress_ctx_create(level, &ctx);
+    if (result != CGIT_OK) return result;
+    pthread_setspecific(thread_ctx_key, ctx);
+  }
+
+  set_level(ctx, level);
+  ctx->adaptive = adaptive_enabled();
+  *ctx_out = ctx;
+  return CGIT_OK;
+}
+
+/*
+ * The level to stream a loose object at, given its first bytes: the
+ * configured level, or Z_NO_COMPRESSION when a probe says the data will
+ * not shrink. For streamed objects, where compress_ctx_deflate never sees
+ * the whole input.
+ */
+int compression_level_for(const unsigned char *head, size_t len) {
+  int level = compression_level(CGIT_COMPRESS_LOOSE);
+  compress_ctx_t *ctx;
+  int incompressible;
+
+  if (!adaptive_enabled() || level == Z_NO_COMPRESSION ||
+      len < CGIT_COMPRESS_SAMPLE_SIZE || thread_ctx(&ctx) != CGIT_OK)
+    return level;
+  if (probe(ctx, SAMPLE_OF(head, len), CGIT_COMPRESS_SAMPLE_SIZE,
+            &incompressible) != CGIT_OK)
+    return level;
+  return incompressible ? Z_NO_COMPRESSION : level;
+}
+
+/*
+ * On failure output is freed, as before; on success the caller owns it.
+ */
+cgit_error_t decompress_data(const unsigned char *input, size_t input_len,
+                             buffer_t *output) {
+  compress_ctx_t *ctx;
+  cgit_error_t result = thread_ctx(&ctx);
+  if (result != CGIT_OK) return result;
+
+  result = compress_ctx_inflate(ctx, input, input_len, output);
+  if (result != CGIT_OK) buffer_free(output);
+  return result;
+}
+
+cgit_error_t compress_data(const unsigned char *input, size_t input_len,
+                           buffer_t *output) {
+  compress_ctx_t *ctx;
+  cgit_error_t result = thread_ctx(&ctx);
+  if (result != CGIT_OK) return result;
 
-cleanup:
-  if (strm_initialized) deflateEnd(&strm);
+  result = compress_ctx_deflate(ctx, input, input_len, output);
+  if (result != CGIT_OK) buffer_free(output);
   return result;
 }
@@ -0,0 +1,278 @@
+/*
+ * Repository configuration (.cgit/config).
+ *
+ * The file uses git's config syntax:
+ *
+ *   # comment
+ *   [core]
+ *       compression = 1
+ *   [section "subsection"]
+ *       name = "quoted value" ; comment
+ *
+ * Keys are looked up as "section.name" or "section.subsection.name".
+ * Section and variable names are case-insensitive, subsections are not.
+ * When a key appears more than once, the last value wins, as in git.
+ *
+ * Each repository's file is read once, on first use, and never changes
+ * afterwards, so lookups need no locking. A missing file is an empty
+ * configuration.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "../include/common.h"
+#include "../include/core.h"
+
+typedef struct config_entry {
+  char *key; /* normalized: see normalize_key */
+  char *value;
+} config_entry_t;
+
+static char *trim(char *s) {
+  while (isspace((unsigned char)*s)) s++;
+  char *end = s + strlen(s);
+  while (end > s && isspace((unsigned char)end[-1])) end--;
+  *end = '\0';
+  return s;
+}
+
+static void lowercase(char *s, size_t len) {
+  for (size_t i = 0; i < len; i++) s[i] = (char)tolower((unsigned char)s[i]);
+}
+
+/* Lowercase the section and the variable name, but not a subsection */
+static void normalize_key(char *key) {
+  char *first_dot = strchr(key, '.');
+  char *last_dot = strrchr(key, '.');
+
+  if (!first_dot) {
+    lowercase(key, strlen(key));
+    return;
+  }
+  lowercase(key, (size_t)(first_dot - key));
+  lowercase(last_dot, strlen(last_dot));
+}
+
+/*
+ * Value after '=': unquote "..." parts, apply \\ \" \n \t escapes, and
+ * stop at a # or ; outside quotes. Returns 0 on a malformed value.
+ */
+static int parse_value(const char *in, char *out) {
+  int quoted = 0;
+  char *o = out;
+  char *last_kept = out; /* end of the value without trailing spaces */
+
+  while (isspace((unsigned char)*in)) in++;
+  for (const char *p = in; *p; p++) {
+    if (*p == '"') {
+      quoted = !quoted;
+      last_kept = o;
+      continue;
+    }
+    if (!quoted && (*p == '#' || *p == ';')) break;
+    if (*p == '\\') {
+      p++;
+      switch (*p) {
+        case '\\': *o++ = '\\'; break;
+        case '"': *o++ = '"'; break;
+        case 'n': *o++ = '\n'; break;
+        case 't': *o++ = '\t'; break;
+        default: return 0;
+      }
+      last_kept = o;
+      continue;
+    }
+    *o++ = *p;
+    if (quoted || !isspace((unsigned char)*p)) last_kept = o;
+  }
+  if (quoted) return 0;
+
+  *last_kept = '\0';
+  return 1;
+}
+
+/* "[core]" or "[remote \"origin\"]" into "core" or "remote.origin" */
+static int parse_section(char *line, char *out, size_t out_size) {
+  char *end = strchr(line, ']');
+  if (!end) return 0;
+  *end = '\0';
+
+  char *name = trim(line + 1);
+  char *quote = strchr(name, '"');
+  if (!quote) {
+    if (strlen(name) >= out_size) return 0;
+    strcpy(out, name);
+    return 1;
+  }
+
+  char *close = strrchr(name, '"');
+  if (close == quote) return 0;
+  *close = '\0';
+  *quote = '\0';
+  int n = snprintf(out, out_size, "%s.%s", trim(name), quote + 1);
+  return n > 0 && (size_t)n < out_size;
+}
+
+static int add_entry(cgit_repo_t *repo, const char *section,
+                     const char *name, const char *value, size_t *capacity) {
+  if (repo->config_count == *capacity) {
+    size_t new_cap = *capacity ? *capacity * 2 : 16;
+    config_entry_t *tmp = realloc(repo->config_entries, new_cap * sizeof(*tmp));
+    if (!tmp) return 0;
+    repo->config_entries = tmp;
+    *capacity = new_cap;
+  }
+
+  size_t key_len = strlen(section) + 1 + strlen(name) + 1;
+  char *key = malloc(key_len);
+  char *val = strdup(value);
+  if (!key || !val) {
+    free(key);
+    free(val);
+    return 0;
+  }
+  snprintf(key, key_len, "%s.%s", section, name);
+  normalize_key(key);
+
+  repo->config_entries[repo->config_count++] = (config_entry_t){key, val};
+  return 1;
+}
+
+static void config_load(void) {
+  cgit_repo_t *repo = repo_current();
+  char path[CGIT_MAX_PATH_LENGTH];
+  char line[CGIT_CONFIG_LINE_MAX];
+  char section[CGIT_CONFIG_LINE_MAX] = "";
+  size_t capacity = 0;
+  int line_no = 0;
+
+  if (repo_path(path, sizeof(path), CGIT_CONFIG_FILE) != CGIT_OK) return;
+
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    if (errno != ENOENT)
+      cgit_report("warning: cannot read %s: %s\n", path, strerror(errno));
+    return;
+  }
+
+  while (fgets(line, sizeof(line), file)) {
+    line_no++;
+    char *s = trim(line);
+    if (*s == '\0' || *s == '#' || *s == ';') continue;
+
+    if (*s == '[') {
+      if (!parse_section(s, section, sizeof(section))) goto bad_line;
+      continue;
+    }
+    if (!*section) goto bad_line;
+
+    /* "name = value", or a bare "name" meaning true */
+    char *eq = strchr(s, '=');
+    const char *value = "true";
+    char parsed[CGIT_CONFIG_LINE_MAX];
+    if (eq) {
+      *eq = '\0';
+      if (!parse_value(eq + 1, parsed)) goto bad_line;
+      value = parsed;
+    }
+
+    char *name = trim(s);
+    if (!*name || !isalpha((unsigned char)*name)) goto bad_line;
+    for (char *c = name; *c; c++)
+      if (!isalnum((unsigned char)*c) && *c != '-') goto bad_line;
+
+    if (!add_entry(repo, section, name, value, &capacity)) {
+      cgit_report("error: out of memory reading %s\n", path);
+      break;
+    }
+    continue;
+
+  bad_line:
+    cgit_report("warning: bad config line %d in %s\n", line_no, path);
+  }
+
+  fclose(file);
+}
+
+/* The value of key, or NULL when it is not set */
+const char *config_get(const char *key) {
+  cgit_repo_t *repo = repo_current();
+  char normalized[CGIT_CONFIG_LINE_MAX];
+
+  pthread_once(&repo->config_once, config_load);
+  if (strlen(key) >= sizeof(normalized)) return NULL;
+  strcpy(normalized, key);
+  normalize_key(normalized);
+
+  for (size_t i = repo->config_count; i > 0; i--)
+    if (strcmp(repo->config_entries[i - 1].key, normalized) == 0)
+      return repo->config_entries[i - 1].value;
+  return NULL;
+}
+
+/*
+ * Returns 1 and sets *value_out when key holds an integer, with git's
+ * k/m/g suffixes. Returns 0 when it is unset or not a number; the latter
+ * is reported.
+ */
+int config_get_int(const char *key, int *value_out) {
+  const char *value = config_get(key);
+  if (!value) return 0;
+
+  char *end;
+  errno = 0;
+  long n = strtol(value, &end, 10);
+  long scale = 1;
+  switch (tolower((unsigned char)*end)) {
+    case 'k': scale = 1024; end++; break;
+    case 'm': scale = 1024 * 1024; end++; break;
+    case 'g': scale = 1024 * 1024 * 1024; end++; break;
+  }
+
+  if (end == value || *end != '\0' || errno == ERANGE ||
+      n > INT_MAX / scale || n < INT_MIN / scale) {
+    cgit_report("warning: bad numeric config value '%s' for '%s'\n",
+                value, key);
+    return 0;
+  }
+
+  *value_out = (int)(n * scale);
+  return 1;
+}
+
+/*
+ * A boolean as git spells them: true/yes/on or a non-zero number, and
+ * false/no/off, 0 or an empty value. default_value when unset or invalid.
+ */
+int config_get_bool(const char *key, int default_value) {
+  static const char *const truthy[] = {"true", "yes", "on"};
+  static const char *const falsy[] = {"false", "no", "off", ""};
+  const char *value = config_get(key);
+  if (!value) return default_value;
+
+  for (size_t i = 0; i < sizeof(truthy) / sizeof(*truthy); i++)
+    if (strcasecmp(value, truthy[i]) == 0) return 1;
+  for (size_t i = 0; i < sizeof(falsy) / sizeof(*falsy); i++)
+    if (strcasecmp(value, falsy[i]) == 0) return 0;
+
+  int n;
+  if (config_get_int(key, &n)) return n != 0;
+  return default_value;
+}
+
+void config_release(cgit_repo_t *repo) {
+  for (size_t i = 0; i < repo->config_count; i++) {
+    free(repo->config_entries[i].key);
+    free(repo->config_entries[i].value);
+  }
+  free(repo->config_entries);
+  repo->config_entries = NULL;
+  repo->config_count = 0;
+}
@@ -0,0 +1,373 @@
+/*
+ * Binary deltas in git's pack format.
+ *
+ * A delta starts with the base and result sizes (little-endian base-128
+ * varints) followed by instructions: a byte with the top bit set copies a
+ * range of the base (the low 7 bits say which offset/size bytes follow), a
+ * byte 1..127 inserts that many literal bytes taken from the delta itself.
+ *
+ * The encoder indexes the base once per window slot: a rolling hash of every
+ * CGIT_DELTA_BLOCK-byte block is put in a chained hash table, then the
+ * target is scanned position by position looking for blocks the base also
+ * has and extending each hit as far as the bytes keep matching.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/common.h"
+#include "../include/core.h"
+
+#define CGIT_DELTA_BLOCK 16
+#define CGIT_DELTA_MAX_CHAIN 64   /* candidates checked per hash bucket */
+#define CGIT_DELTA_MAX_COPY 0x10000
+#define CGIT_DELTA_MAX_INSERT 127
+#define CGIT_DELTA_HASH_MULT 0x01000193u
+
+struct delta_index {
+  const unsigned char *src;
+  size_t src_len;
+  uint32_t mask;
+  uint32_t *heads; /* bucket -> first entry + 1, 0 when empty */
+  uint32_t *next;  /* entry -> next entry in the bucket + 1 */
+  uint32_t *offsets;
+  uint32_t *hashes;
+};
+
+/* Multiplier raised to the block length, to drop the outgoing byte */
+static uint32_t hash_out_factor(void) {
+  uint32_t f = 1;
+  for (int i = 0; i < CGIT_DELTA_BLOCK - 1; i++) f *= CGIT_DELTA_HASH_MULT;
+  return f;
+}
+
+static uint32_t hash_block(const unsigned char *p) {
+  uint32_t h = 0;
+  for (int i = 0; i < CGIT_DELTA_BLOCK; i++)
+    h = h * CGIT_DELTA_HASH_MULT + p[i];
+  return h;
+}
+
+static uint32_t mix(uint32_t h) { return (h ^ (h >> 15)) * 0x2c1b3c6du; }
+
+cgit_error_t create_delta_index(const unsigned char *src, size_t src_len,
+                                delta_index_t **index_out) {
+  cgit_error_t result = CGIT_OK;
+  delta_index_t *index = NULL;
+
+  if (src_len > UINT32_MAX) return CGIT_ERROR_INVALID_ARGS;
+
+  index = calloc(1, sizeof(*index));
+  if (!index) {
+    result = CGIT_ERROR_MEMORY;
+    goto cleanup;
+  }
+
+  size_t blocks = src_len / CGIT_DELTA_BLOCK;
+  size_t buckets = 16;
+  while (buckets < blocks) buckets *= 2;
+
+  index->src = src;
+  index->src_len = src_len;
+  index->mask = (uint32_t)(buckets - 1);
+  index->heads = calloc(buckets, sizeof(uint32_t));
+  index->next = malloc((blocks + 1) * sizeof(uint32_t));
+  index->offsets = malloc((blocks + 1) * sizeof(uint32_t));
+  index->hashes = malloc((blocks + 1) * sizeof(uint32_t));
+  if (!index->heads || !index->next || !index->offsets || !index->hashes) {
+    cgit_report("error: out of memory\n");
+    result = CGIT_ERROR_MEMORY;
+    goto cleanup;
+  }
+
+  /*
+   * Insert back to front so each bucket chain lists earlier offsets first;
+   * identical blocks then resolve to the lowest offset, which encodes in
+   * fewer bytes.
+   */
+  for (size_t b = blocks; b-- > 0;) {
+    uint32_t h = hash_block(src + b * CGIT_DELTA_BLOCK);
+    uint32_t bucket = mix(h) & index->mask;
+
+    index->offsets[b] = (uint32_t)(b * CGIT_DELTA_BLOCK);
+    index->hashes[b] = h;
+    index->next[b] = index->heads[bucket];
+    index->heads[bucket] = (uint32_t)b + 1;
+  }
+
+  *index_out = index;
+  index = NULL;
+
+cleanup:
+  free_delta_index(index);
+  return result;
+}
+
+void free_delta_index(delta_index_t *index) {
+  if (!index) return;
+  free(index->heads);
+  free(index->next);
+  free(index->offsets);
+  free(index->hashes);
+  free(index);
+}
+
+static size_t encode_delta_size(size_t size, unsigned char *out) {
+  size_t n = 0;
+  do {
+    unsigned char c = size & 0x7f;
+    size >>= 7;
+    out[n++] = c | (size ? 0x80 : 0);
+  } while (size);
+  return n;
+}
+
+static cgit_error_t emit(buffer_t *out, const unsigned char *data, size_t len,
+                         size_t max_size) {
+  if (len > max_size - out->size) return CGIT_ERROR_INVALID_ARGS;
+  memcpy(out->data + out->size, data, len);
+  out->size += len;
+  return CGIT_OK;
+}
+
+static cgit_error_t emit_insert(buffer_t *out, const unsigned char *lit,
+                                size_t len, size_t max_size) {
+  while (len) {
+    size_t n = len > CGIT_DELTA_MAX_INSERT ? CGIT_DELTA_MAX_INSERT : len;
+    unsigned char op = (unsigned char)n;
+
+    if (emit(out, &op, 1, max_size) != CGIT_OK) return CGIT_ERROR_INVALID_ARGS;
+    if (emit(out, lit, n, max_size) != CGIT_OK) return CGIT_ERROR_INVALID_ARGS;
+    lit += n;
+    len -= n;
+  }
+  return CGIT_OK;
+}
+
+static cgit_error_t emit_copy(buffer_t *out, size_t offset, size_t len,
+                              size_t max_size) {
+  while (len) {
+    size_t n = len > CGIT_DELTA_MAX_COPY ? CGIT_DELTA_MAX_COPY : len;
+    unsigned char op[8];
+    size_t i = 1;
+    op[0] = 0x80;
+
+    /* Only the non-zero offset/size bytes are stored */
+    for (int b = 0; b < 4; b++) {
+      unsigned char c = (unsigned char)(offset >> (8 * b));
+      if (c) {
+        op[i++] = c;
+        op[0] |= (unsigned char)(1 << b);
+      }
+    }
+    /* A size of 0x10000 is encoded as zero size bytes */
+    size_t enc = n == CGIT_DELTA_MAX_COPY ? 0 : n;
+    for (int b = 0; b < 3; b++) {
+      unsigned char c = (unsigned char)(enc >> (8 * b));
+      if (c) {
+        op[i++] = c;
+        op[0] |= (unsigned char)(0x10 << b);
+      }
+    }
+
+    if (emit(out, op, i, max_size) != CGIT_OK) return CGIT_ERROR_INVALID_ARGS;
+    offset += n;
+    len -= n;
+  }
+  return CGIT_OK;
+}
+
+/*
+ * The delta is abandoned as soon as it would grow past max_size; that is
+ * not an error, so the caller gets CGIT_OK and an empty *out.
+ */
+cgit_error_t create_delta(const delta_index_t *index,
+                          const unsigned char *trg, size_t trg_len,
+                          size_t max_size, buffer_t *out) {
+  const unsigned char *src = index->src;
+  size_t src_len = index->src_len;
+
+  out->data = malloc(max_size + 1);
+  if (!out->data) {
+    cgit_report("error: out of memory\n");
+    return CGIT_ERROR_MEMORY;
+  }
+  out->size = 0;
+  out->capacity = max_size + 1;
+
+  unsigned char sizes[2 * 10];
+  size_t n = encode_delta_size(src_len, sizes);
+  n += encode_delta_size(trg_len, sizes + n);
+  if (emit(out, sizes, n, max_size) != CGIT_OK) goto too_big;
+
+  uint32_t out_factor = hash_out_factor();
+  size_t lit_start = 0;
+  size_t i = 0;
+  uint32_t h = trg_len >= CGIT_DELTA_BLOCK ? hash_block(trg) : 0;
+
+  while (i + CGIT_DELTA_BLOCK <= trg_len) {
+    size_t best_len = 0;
+    size_t best_off = 0;
+    size_t best_back = 0;
+    int chain = 0;
+
+    for (uint32_t e = index->heads[mix(h) & index->mask];
+         e && chain < CGIT_DELTA_MAX_CHAIN; e = index->next[e - 1], chain++) {
+      if (index->hashes[e - 1] != h) continue;
+
+      size_t off = index->offsets[e - 1];
+      if (memcmp(src + off, trg + i, CGIT_DELTA_BLOCK) != 0) continue;
+
+      size_t len = CGIT_DELTA_BLOCK;
+      while (off + len < src_len && i + len < trg_len &&
+             src[off + len] == trg[i + len])
+        len++;
+
+      /* Grow backwards into bytes that would otherwise be literals */
+      size_t back = 0;
+      while (back < off && back < i - lit_start &&
+             src[off - back - 1] == trg[i - back - 1])
+        back++;
+
+      if (len + back > best_len + best_back) {
+        best_len = len;
+        best_off = off;
+        best_back = back;
+      }
+    }
+
+    if (!best_len) {
+      if (i + CGIT_DELTA_BLOCK < trg_len)
+        h = (h - trg[i] * out_factor) * CGIT_DELTA_HASH_MULT +
+            trg[i + CGIT_DELTA_BLOCK];
+      i++;
+      continue;
+    }
+
+    if (emit_insert(out, trg + lit_start, i - best_back - lit_start,
+                    max_size) != CGIT_OK ||
+        emit_copy(out, best_off - best_back, best_len + best_back,
+                  max_size) != CGIT_OK)
+      goto too_big;
+
+    i += best_len;
+    lit_start = i;
+    if (i + CGIT_DELTA_BLOCK <= trg_len) h = hash_block(trg + i);
+  }
+
+  if (emit_insert(out, trg + lit_start, trg_len - lit_start, max_size) !=
+      CGIT_OK)
+    goto too_big;
+
+  return CGIT_OK;
+
+too_big:
+  buffer_free(out);
+  return CGIT_OK;
+}
+
+static cgit_error_t parse_delta_size(const unsigned char **p,
+                                     const unsigned char *end, size_t *size) {
+  size_t val = 0;
+  unsigned int shift = 0;
+  unsigned char c;
+
+  do {
+    if (*p >= end || shift > sizeof(size_t) * 8 - 7) {
+      cgit_report("error: corrupt delta header\n");
+      return CGIT_ERROR_INVALID_OBJECT;
+    }
+    c = *(*p)++;
+    val |= (size_t)(c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+
+  *size = val;
+  return CGIT_OK;
+}
+
+cgit_error_t delta_result_size(const unsigned char *delta, size_t delta_len,
+                               size_t *size_out) {
+  const unsigned char *p = delta;
+  const unsigned char *end = delta + delta_len;
+  size_t base_size;
+
+  cgit_error_t result = parse_delta_size(&p, end, &base_size);
+  if (result != CGIT_OK) return result;
+  return parse_delta_size(&p, end, size_out);
+}
+
+cgit_error_t apply_delta(const unsigned char *base, size_t base_len,
+                         const unsigned char *delta, size_t delta_len,
+                         buffer_t *out) {
+  cgit_error_t result = CGIT_OK;
+  const unsigned char *p = delta;
+  const unsigned char *end = delta + delta_len;
+  size_t base_size, result_size;
+
+  result = parse_delta_size(&p, end, &base_size);
+  if (result != CGIT_OK) return result;
+  result = parse_delta_size(&p, end, &result_size);
+  if (result != CGIT_OK) return result;
+
+  if (base_size != base_len || result_size == SIZE_MAX) {
+    cgit_report("error: delta does not match its base\n");
+    return CGIT_ERROR_INVALID_OBJECT;
+  }
+
+  out->data = malloc(result_size + 1);
+  if (!out->data) {
+    cgit_report("error: out of memory\n");
+    return CGIT_ERROR_MEMORY;
+  }
+  out->capacity = result_size + 1;
+  out->size = 0;
+
+  while (p < end) {
+    unsigned char op = *p++;
+
+    if (op & 0x80) {
+      size_t offset = 0;
+      size_t len = 0;
+
+      for (int b = 0; b < 4; b++) {
+        if (!(op & (1 << b))) continue;
+        if (p >= end) goto corrupt;
+        offset |= (size_t)*p++ << (8 * b);
+      }
+      for (int b = 0; b < 3; b++) {
+        if (!(op & (0x10 << b))) continue;
+        if (p >= end) goto corrupt;
+        len |= (size_t)*p++ << (8 * b);
+      }
+      if (len == 0) len = CGIT_DELTA_MAX_COPY;
+
+      if (offset > base_len || len > base_len - offset ||
+          len > result_size - out->size)
+        goto corrupt;
+      memcpy(out->data + out->size, base + offset, len);
+      out->size += len;
+    } else if (op) {
+      if (op > (size_t)(end - p) || op > result_size - out->size)
+        goto corrupt;
+      memcpy(out->data + out->size, p, op);
+      out->size += op;
+      p += op;
+    } else {
+      /* Opcode 0 is reserved */
+      goto corrupt;
+    }
+  }
+
+  if (out->size != result_size) goto corrupt;
+  out->data[out->size] = '\0';
+  return CGIT_OK;
+
+corrupt:
+  cgit_report("error: corrupt delta\n");
+  result = CGIT_ERROR_INVALID_OBJECT;
+  buffer_free(out);
+  return result;
+}
@@ -0,0 +1,158 @@
+/*
+ * Directory iterator over an open directory fd.
+ *
+ * On Linux the entries come straight from getdents64, a buffer of
+ * CGIT_DIR_BUFFER_SIZE bytes per syscall, with no DIR stream and nothing
+ * allocated per entry. Elsewhere readdir on an fdopendir stream stands in.
+ * Either way each entry carries its d_type, so callers only need to
+ * fstatat the entries whose type alone does not tell them enough;
+ * DT_UNKNOWN means the filesystem does not say.
+ *
+ * Names are relative to the directory: callers open and stat them with
+ * the *at calls, so the kernel never resolves a full path per entry and
+ * no path length limit applies below the directory.
+ */
+
+#define _GNU_SOURCE /* O_DIRECTORY, O_NOFOLLOW, DT_* */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "../include/common.h"
+#include "../include/core.h"
+
+#ifdef __linux__
+/* One record of getdents64, as the kernel lays it out */
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+#endif
+
+/* Open name below dir_fd as a directory, never through a symlink */
+int dir_open_at(int dir_fd, const char *name) {
+  return openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+}
+
+/*
+ * Open the directory at path, however long. A path the kernel refuses as
+ * too long is opened one component at a time instead.
+ */
+int dir_open_path(const char *path) {
+  int fd = dir_open_at(AT_FDCWD, path);
+  if (fd >= 0 || errno != ENAMETOOLONG) return fd;
+
+  char *copy = strdup(path);
+  if (!copy) return -1;
+
+  fd = dir_open_at(AT_FDCWD, path[0] == '/' ? "/" : ".");
+  char *save = NULL;
+  for (char *name = strtok_r(copy, "/", &save); name && fd >= 0;
+       name = strtok_r(NULL, "/", &save)) {
+    int next = dir_open_at(fd, name);
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    fd = next;
+  }
+
+  free(copy);
+  return fd;
+}
+
+/* dir_fd stays the caller's; path only names it in messages */
+cgit_error_t dir_iter_init(dir_iter_t *it, int dir_fd, const char *path) {
+  it->fd = dir_fd;
+  it->path = path;
+  it->stream = NULL;
+  it->pos = 0;
+  it->len = 0;
+  it->error = CGIT_OK;
+
+#ifndef __linux__
+  /* The stream owns its fd, so give it a copy of ours */
+  int fd = dup(dir_fd);
+  it->stream = fd >= 0 ? fdopendir(fd) : NULL;
+  if (!it->stream) {
+    cgit_report("error: cannot read directory '%s': %s\n", path,
+                strerror(errno));
+    if (fd >= 0) close(fd);
+    return CGIT_ERROR_IO;
+  }
+#endif
+  return CGIT_OK;
+}
+
+void dir_iter_release(dir_iter_t *it) {
+  if (it->stream) closedir(it->stream);
+  it->stream = NULL;
+}
+
+static int is_dot_or_dot_dot(const char *name) {
+  return name[0] == '.' &&
+         (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+static int read_failed(dir_iter_t *it) {
+  cgit_report("error: cannot read directory '%s': %s\n", it->path,
+              strerror(errno));
+  it->error = CGIT_ERROR_IO;
+  return 0;
+}
+
+/*
+ * Returns 1 and fills entry with the next entry other than "." and "..",
+ * or 0 at the end of the directory. A failed read also ends the walk, with
+ * it->error set. The name stays valid until the next call.
+ */
+int dir_iter_next(dir_iter_t *it, dir_iter_entry_t *entry) {
+  if (it->error != CGIT_OK) return 0;
+
+#ifdef __linux__
+  for (;;) {
+    if (it->pos >= it->len) {
+      uint64_t start = trace_begin();
+      long n = syscall(SYS_getdents64, it->fd, it->buf, sizeof(it->buf));
+      trace_end(TRACE_WALK, start, n > 0 ? (size_t)n : 0);
+      trace_count(TRACE_SYSCALLS, 1);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) return read_failed(it);
+      if (n == 0) return 0;
+      it->pos = 0;
+      it->len = (size_t)n;
+    }
+
+    struct linux_dirent64 *d = (void *)(it->buf + it->pos);
+    it->pos += d->d_reclen;
+    if (is_dot_or_dot_dot(d->d_name)) continue;
+
+    entry->name = d->d_name;
+    entry->type = d->d_type;
+    return 1;
+  }
+#else
+  for (;;) {
+    errno = 0;
+    struct dirent *d = readdir(it->stream);
+    if (!d) return errno ? read_failed(it) : 0;
+    if (is_dot_or_dot_dot(d->d_name)) continue;
+
+    entry->name = d->d_name;
+    entry->type = d->d_type;
+    return 1;
+  }
+#endif
+}
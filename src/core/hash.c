@@ -1,41 +1,165 @@
 /*
- * SHA-1 hashing using openssl/sha.h.
+ * SHA-1 hashing.
  *
- * SHA1() is deprecated in OpenSSL 3.x in favor of the EVP API
- * (EVP_DigestInit_ex / EVP_DigestUpdate / EVP_DigestFinal_ex).
+ * Single streams go through OpenSSL's EVP interface. OpenSSL already picks
+ * the fastest code the CPU supports for one stream, including the SHA
+ * extensions (SHA-NI) where present. The digest is fetched once rather than
+ * looked up again on every EVP_DigestInit_ex, which matters for small
+ * objects.
  *
- * I use SHA1() here for simplicity — if OpenSSL ever removes it,
- * migrate to the EVP interface.
+ * Many small objects can also be hashed together with hash_batch. That call
+ * goes through a pluggable backend:
+ *
+ *   openssl      one EVP context, reused for each job in turn
+ *   multibuffer  eight jobs at a time in AVX2 lanes (sha1_mb.c)
+ *
+ * The default is multibuffer wherever AVX2 is available. Even next to
+ * SHA-NI it was ahead at every size measured (64 B to 64 KiB per job),
+ * since eight lanes hide the round latency that bounds a single stream.
+ * CGIT_HASH_BACKEND=<name> overrides the choice.
  */
 
-#include <openssl/sha.h>
+#include <openssl/evp.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "../include/common.h"
 #include "../include/core.h"
 
-cgit_error_t compute_sha1(const unsigned char *header, size_t len,
-                          char *hex_out) {
-  unsigned char hash[SHA_DIGEST_LENGTH];
+typedef struct {
+  const char *name;
+  int (*available)(void);
+  cgit_error_t (*batch)(hash_job_t *jobs, size_t count);
+} hash_backend_t;
 
-  if (!SHA1(header, len, hash)) {
-    return CGIT_ERROR_HASH;
+static const EVP_MD *sha1_md = NULL;
+static const hash_backend_t *backend = NULL;
+static pthread_once_t hash_once = PTHREAD_ONCE_INIT;
+
+static int always_available(void) { return 1; }
+
+static cgit_error_t batch_openssl(hash_job_t *jobs, size_t count) {
+  cgit_error_t result = CGIT_OK;
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  if (!ctx) return CGIT_ERROR_MEMORY;
+
+  for (size_t i = 0; i < count; i++) {
+    if (EVP_DigestInit_ex(ctx, sha1_md, NULL) != 1 ||
+        EVP_DigestUpdate(ctx, jobs[i].data, jobs[i].len) != 1 ||
+        EVP_DigestFinal_ex(ctx, jobs[i].digest, NULL) != 1) {
+      result = CGIT_ERROR_HASH;
+      break;
+    }
   }
 
-  for (size_t i = 0; i < SHA_DIGEST_LENGTH; i++) {
-    sprintf(hex_out + 2 * i, "%02x", hash[i]);
+  EVP_MD_CTX_free(ctx);
+  return result;
+}
+
+static cgit_error_t batch_multibuffer(hash_job_t *jobs, size_t count) {
+  sha1_mb_batch(jobs, count);
+  return CGIT_OK;
+}
+
+static const hash_backend_t backends[] = {
+    {"openssl", always_available, batch_openssl},
+    {"multibuffer", sha1_mb_available, batch_multibuffer},
+};
+
+static void hash_setup(void) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  sha1_md = EVP_MD_fetch(NULL, "SHA1", NULL);
+#else
+  sha1_md = EVP_sha1();
+#endif
+
+  const char *name = getenv("CGIT_HASH_BACKEND");
+  if (name && *name) {
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+      if (strcmp(backends[i].name, name) == 0 && backends[i].available()) {
+        backend = &backends[i];
+        return;
+      }
+    }
+    cgit_report("warning: hash backend '%s' is not available\n", name);
   }
 
-  hex_out[CGIT_HASH_HEX_LEN] = '\0';
+  backend = sha1_mb_available() ? &backends[1] : &backends[0];
+}
+
+static const EVP_MD *sha1(void) {
+  pthread_once(&hash_once, hash_setup);
+  return sha1_md;
+}
+
+const char *hash_backend_name(void) {
+  pthread_once(&hash_once, hash_setup);
+  return backend->name;
+}
+
+cgit_error_t compute_sha1(const unsigned char *header, size_t len,
+                          char *hex_out) {
+  unsigned char hash[CGIT_HASH_RAW_LEN];
+  const EVP_MD *md = sha1();
+
+  uint64_t start = trace_begin();
+  int ok = md && EVP_Digest(header, len, hash, NULL, md, NULL) == 1;
+  trace_end(TRACE_SHA1, start, len);
+  if (!ok) return CGIT_ERROR_HASH;
+
+  bytes_to_hex_hash(hash, hex_out);
 
   return CGIT_OK;
 }
 
-cgit_error_t hex_to_bytes_hash(const unsigned char *hex_hash, char *hash_out) {
-  for (size_t j = 0; j < CGIT_HASH_RAW_LEN; j++) {
-    unsigned int byte;
-    sscanf((const char *)&hex_hash[j * 2], "%02x", &byte);
-    hash_out[j] = (unsigned char)byte;
+/*
+ * Fills jobs[i].digest for every job. The jobs are independent, so a
+ * backend may hash them in any order or all at once.
+ */
+cgit_error_t hash_batch(hash_job_t *jobs, size_t count) {
+  if (!sha1()) return CGIT_ERROR_HASH;
+
+  size_t bytes = 0;
+  for (size_t i = 0; i < count; i++) bytes += jobs[i].len;
+  uint64_t start = trace_begin();
+  cgit_error_t result = backend->batch(jobs, count);
+  trace_end(TRACE_SHA1, start, bytes);
+  return result;
+}
+
+cgit_error_t hash_init(hash_ctx_t *ctx) {
+  ctx->md_ctx = EVP_MD_CTX_new();
+  if (!ctx->md_ctx) return CGIT_ERROR_MEMORY;
+
+  const EVP_MD *md = sha1();
+  if (!md || EVP_DigestInit_ex(ctx->md_ctx, md, NULL) != 1) {
+    hash_ctx_free(ctx);
+    return CGIT_ERROR_HASH;
   }
+
   return CGIT_OK;
 }
+
+cgit_error_t hash_update(hash_ctx_t *ctx, const void *data, size_t len) {
+  uint64_t start = trace_begin();
+  int ok = EVP_DigestUpdate(ctx->md_ctx, data, len) == 1;
+  trace_end(TRACE_SHA1, start, len);
+  return ok ? CGIT_OK : CGIT_ERROR_HASH;
+}
+
+cgit_error_t hash_final(hash_ctx_t *ctx, unsigned char *raw_out) {
+  cgit_error_t result = CGIT_OK;
+
+  if (EVP_DigestFinal_ex(ctx->md_ctx, raw_out, NULL) != 1)
+    result = CGIT_ERROR_HASH;
+
+  hash_ctx_free(ctx);
+  return result;
+}
+
+void hash_ctx_free(hash_ctx_t *ctx) {
+  EVP_MD_CTX_free(ctx->md_ctx);
+  ctx->md_ctx = NULL;
+}
@@ -0,0 +1,459 @@
+/*
+ * .cgitignore: gitignore patterns, compiled once per file.
+ *
+ * Any directory may hold a .cgitignore. Its patterns apply to everything
+ * below that directory, and the last pattern that matches decides, so "!"
+ * can re-include what an earlier line excluded. A deeper file's patterns
+ * take precedence over its parents'. The walkers never open an ignored
+ * directory, so nothing below one can be re-included, as in git.
+ *
+ * Most real patterns are plain names ("node_modules"), suffixes ("*.o")
+ * or prefixes ("tmp*"). Those go into buckets that cost a hash lookup or a
+ * memcmp. Only what is left goes through glob_match. Every bucket lists
+ * its patterns newest first, so a bucket's first match is its last
+ * matching line. The patterns a bucket has left to try can then be
+ * skipped as soon as they are older than the best match so far.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../include/common.h"
+#include "../include/core.h"
+
+typedef enum {
+  MATCH_LITERAL, /* the whole name or path, as is */
+  MATCH_SUFFIX,  /* "*" then a literal: the literal ends the name */
+  MATCH_PREFIX,  /* a literal then "*": the literal starts the name */
+  MATCH_GLOB,    /* anything else, through glob_match */
+} match_kind_t;
+
+typedef struct {
+  char *text; /* without "!", a leading "/" or a trailing "/" */
+  size_t len;
+  const char *literal; /* the literal part of a suffix or prefix */
+  size_t literal_len;
+  match_kind_t kind;
+  int negated;  /* "!pattern": re-include */
+  int dir_only; /* "pattern/": directories only */
+  int anchored; /* matched against the path below the file's directory */
+  long older;   /* the previous pattern with the same literal text, or -1 */
+} ignore_pattern_t;
+
+/* Pattern numbers, newest first */
+typedef struct {
+  size_t *items;
+  size_t count;
+} bucket_t;
+
+struct ignore_list {
+  char *storage; /* the file's bytes, which the patterns point into */
+  ignore_pattern_t *patterns;
+  size_t count;
+  long *literals; /* open addressing: newest literal basename, or -1 */
+  size_t literal_slots;
+  bucket_t suffixes;
+  bucket_t prefixes;
+  bucket_t others; /* globs and every anchored pattern but literals */
+  bucket_t anchored_literals;
+  int any_anchored;
+};
+
+static int is_glob_char(char c) {
+  return c == '*' || c == '?' || c == '[' || c == '\\';
+}
+
+static int has_glob(const char *s, size_t len) {
+  for (size_t i = 0; i < len; i++)
+    if (is_glob_char(s[i])) return 1;
+  return 0;
+}
+
+static uint32_t name_hash(const char *s, size_t len) {
+  uint32_t h = 2166136261u; /* FNV-1a */
+  for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 16777619u;
+  return h;
+}
+
+/* One character class at *p ("[a-z]", "[!0-9]"); -1 if it never closes */
+static int match_class(const char **p, const char *end, char c) {
+  const char *q = *p + 1;
+  int negate = q < end && (*q == '!' || *q == '^');
+  int found = 0;
+
+  if (negate) q++;
+  /* A "]" right after the opening bracket is a literal one */
+  for (int first = 1; q < end && (*q != ']' || first); first = 0) {
+    char lo = *q++;
+    if (lo == '\\' && q < end) lo = *q++;
+    char hi = lo;
+    if (q + 1 < end && *q == '-' && q[1] != ']') {
+      hi = q[1];
+      q += 2;
+      if (hi == '\\' && q < end) hi = *q++;
+    }
+    if ((unsigned char)c >= (unsigned char)lo &&
+        (unsigned char)c <= (unsigned char)hi)
+      found = 1;
+  }
+  if (q >= end) return -1;
+
+  *p = q + 1;
+  return found != negate && c != '/';
+}
+
+/*
+ * gitignore globbing: "*" and "?" stop at "/", "**" does not, and "**\/"
+ * also matches no directory at all.
+ */
+static int glob_match(const char *p, const char *pe, const char *s,
+                      const char *se) {
+  while (p < pe) {
+    char c = *p;
+
+    if (c == '*') {
+      if (p + 1 < pe && p[1] == '*') {
+        while (p < pe && *p == '*') p++;
+        if (p < pe && *p == '/') {
+          p++;
+          if (glob_match(p, pe, s, se)) return 1;
+          for (const char *t = s; t < se; t++)
+            if (*t == '/' && glob_match(p, pe, t + 1, se)) return 1;
+          return 0;
+        }
+        for (const char *t = s;; t++) {
+          if (glob_match(p, pe, t, se)) return 1;
+          if (t == se) return 0;
+        }
+      }
+
+      p++;
+      for (const char *t = s;; t++) {
+        if (glob_match(p, pe, t, se)) return 1;
+        if (t == se || *t == '/') return 0;
+      }
+    }
+
+    if (s == se) return 0;
+
+    if (c == '?') {
+      if (*s == '/') return 0;
+    } else if (c == '[') {
+      int r = match_class(&p, pe, *s);
+      if (r == 0) return 0;
+      if (r > 0) {
+        s++;
+        continue;
+      }
+      if (*s != '[') return 0; /* an unclosed "[" is literal */
+    } else {
+      if (c == '\\' && p + 1 < pe) c = *++p;
+      if (c != *s) return 0;
+    }
+    p++;
+    s++;
+  }
+  return s == se;
+}
+
+static int pattern_matches(const ignore_pattern_t *pat, const char *s,
+                           size_t len) {
+  switch (pat->kind) {
+    case MATCH_LITERAL:
+      return len == pat->len && memcmp(s, pat->text, len) == 0;
+    case MATCH_SUFFIX:
+      return len >= pat->literal_len &&
+             memcmp(s + len - pat->literal_len, pat->literal,
+                    pat->literal_len) == 0;
+    case MATCH_PREFIX:
+      return len >= pat->literal_len &&
+             memcmp(s, pat->literal, pat->literal_len) == 0;
+    default:
+      return glob_match(pat->text, pat->text + pat->len, s, s + len);
+  }
+}
+
+static cgit_error_t bucket_add(bucket_t *bucket, size_t n) {
+  size_t *tmp = realloc(bucket->items, (bucket->count + 1) * sizeof(*tmp));
+  if (!tmp) return CGIT_ERROR_MEMORY;
+  bucket->items = tmp;
+  bucket->items[bucket->count++] = n;
+  return CGIT_OK;
+}
+
+/* Buckets are filled oldest first; matching wants them newest first */
+static void bucket_reverse(bucket_t *bucket) {
+  for (size_t i = 0, j = bucket->count; i + 1 < j; i++, j--) {
+    size_t tmp = bucket->items[i];
+    bucket->items[i] = bucket->items[j - 1];
+    bucket->items[j - 1] = tmp;
+  }
+}
+
+/* Turn one line into a pattern; returns 0 for blanks and comments */
+static int parse_line(char *line, size_t len, ignore_pattern_t *pat) {
+  /* Trailing spaces go, unless escaped */
+  while (len && (line[len - 1] == ' ' || line[len - 1] == '\t') &&
+         !(len >= 2 && line[len - 2] == '\\'))
+    len--;
+  if (!len || line[0] == '#') return 0;
+
+  *pat = (ignore_pattern_t){.older = -1};
+  if (line[0] == '!') {
+    pat->negated = 1;
+    line++;
+    len--;
+  } else if (line[0] == '\\' && len > 1 &&
+             (line[1] == '!' || line[1] == '#')) {
+    line++;
+    len--;
+  }
+
+  if (len && line[len - 1] == '/') {
+    pat->dir_only = 1;
+    len--;
+  }
+  /* A "/" anywhere but at the end ties the pattern to this directory */
+  if (memchr(line, '/', len)) pat->anchored = 1;
+  if (len && line[0] == '/') {
+    line++;
+    len--;
+  }
+  if (!len) return 0;
+
+  pat->text = line;
+  pat->len = len;
+  line[len] = '\0';
+
+  if (!has_glob(line, len)) {
+    pat->kind = MATCH_LITERAL;
+  } else if (!pat->anchored && line[0] == '*' && len > 1 &&
+             !has_glob(line + 1, len - 1)) {
+    pat->kind = MATCH_SUFFIX;
+    pat->literal = line + 1;
+    pat->literal_len = len - 1;
+  } else if (!pat->anchored && line[len - 1] == '*' && len > 1 &&
+             !has_glob(line, len - 1)) {
+    pat->kind = MATCH_PREFIX;
+    pat->literal = line;
+    pat->literal_len = len - 1;
+  } else {
+    pat->kind = MATCH_GLOB;
+  }
+  return 1;
+}
+
+static cgit_error_t compile(ignore_list_t *list) {
+  cgit_error_t result = CGIT_OK;
+  size_t literal_count = 0;
+
+  for (size_t i = 0; i < list->count; i++)
+    if (list->patterns[i].kind == MATCH_LITERAL && !list->patterns[i].anchored)
+      literal_count++;
+
+  if (literal_count) {
+    list->literal_slots = 16;
+    while (list->literal_slots < literal_count * 2) list->literal_slots *= 2;
+    list->literals = malloc(list->literal_slots * sizeof(*list->literals));
+    if (!list->literals) return CGIT_ERROR_MEMORY;
+    for (size_t i = 0; i < list->literal_slots; i++) list->literals[i] = -1;
+  }
+
+  for (size_t i = 0; i < list->count && result == CGIT_OK; i++) {
+    ignore_pattern_t *pat = &list->patterns[i];
+    list->any_anchored |= pat->anchored;
+
+    if (pat->anchored) {
+      result = bucket_add(pat->kind == MATCH_LITERAL ? &list->anchored_literals
+                                                     : &list->others,
+                          i);
+      continue;
+    }
+
+    switch (pat->kind) {
+      case MATCH_LITERAL: {
+        size_t mask = list->literal_slots - 1;
+        size_t slot = name_hash(pat->text, pat->len) & mask;
+        while (list->literals[slot] >= 0) {
+          ignore_pattern_t *old = &list->patterns[list->literals[slot]];
+          if (old->len == pat->len && memcmp(old->text, pat->text, pat->len) == 0)
+            break;
+          slot = (slot + 1) & mask;
+        }
+        pat->older = list->literals[slot];
+        list->literals[slot] = (long)i;
+        break;
+      }
+      case MATCH_SUFFIX:
+        result = bucket_add(&list->suffixes, i);
+        break;
+      case MATCH_PREFIX:
+        result = bucket_add(&list->prefixes, i);
+        break;
+      default:
+        result = bucket_add(&list->others, i);
+        break;
+    }
+  }
+
+  bucket_reverse(&list->suffixes);
+  bucket_reverse(&list->prefixes);
+  bucket_reverse(&list->others);
+  bucket_reverse(&list->anchored_literals);
+  return result;
+}
+
+void ignore_free(ignore_list_t *list) {
+  if (!list) return;
+  free(list->storage);
+  free(list->patterns);
+  free(list->literals);
+  free(list->suffixes.items);
+  free(list->prefixes.items);
+  free(list->others.items);
+  free(list->anchored_literals.items);
+  free(list);
+}
+
+/*
+ * Compile dir_fd's .cgitignore into *list_out, which stays NULL when the
+ * directory has none. path names the directory in messages.
+ */
+cgit_error_t ignore_load_at(int dir_fd, const char *path,
+                            ignore_list_t **list_out) {
+  cgit_error_t result = CGIT_OK;
+  buffer_t buf = {0};
+  ignore_list_t *list = NULL;
+  size_t capacity = 0;
+
+  *list_out = NULL;
+  int fd = openat(dir_fd, CGIT_IGNORE_FILE, O_RDONLY | O_NOFOLLOW);
+  if (fd < 0) {
+    if (errno == ENOENT) return CGIT_OK;
+    cgit_report("error: cannot open '%s/%s': %s\n", path, CGIT_IGNORE_FILE,
+                strerror(errno));
+    return CGIT_ERROR_IO;
+  }
+
+  result = read_fd_fully(fd, &buf);
+  close(fd);
+  if (result != CGIT_OK) return result;
+
+  list = calloc(1, sizeof(*list));
+  if (!list) {
+    result = CGIT_ERROR_MEMORY;
+    goto cleanup;
+  }
+
+  /* Room for the NUL that ends a last line without a newline */
+  unsigned char *tmp = realloc(buf.data, buf.size + 1);
+  if (!tmp) {
+    result = CGIT_ERROR_MEMORY;
+    goto cleanup;
+  }
+  buf.data = tmp;
+  list->storage = (char *)buf.data;
+  buf.data = NULL;
+
+  /* Each line is cut where its newline was, in place */
+  for (size_t start = 0; start < buf.size;) {
+    char *line = list->storage + start;
+    char *nl = memchr(line, '\n', buf.size - start);
+    size_t len = nl ? (size_t)(nl - line) : buf.size - start;
+    start += len + 1;
+    if (len && line[len - 1] == '\r') len--;
+
+    if (list->count == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      ignore_pattern_t *tmp =
+          realloc(list->patterns, capacity * sizeof(*tmp));
+      if (!tmp) {
+        result = CGIT_ERROR_MEMORY;
+        goto cleanup;
+      }
+      list->patterns = tmp;
+    }
+    if (parse_line(line, len, &list->patterns[list->count])) list->count++;
+  }
+
+  if (!list->count) goto cleanup;
+
+  result = compile(list);
+  if (result != CGIT_OK) goto cleanup;
+
+  *list_out = list;
+  list = NULL;
+
+cleanup:
+  ignore_free(list);
+  buffer_free(&buf);
+  return result;
+}
+
+/* The newest pattern in list that matches; -1 for none */
+static long list_match(const ignore_list_t *list, const char *rel,
+                       size_t rel_len, const char *name, size_t name_len,
+                       int is_dir) {
+  long best = -1;
+
+  if (list->literals) {
+    size_t mask = list->literal_slots - 1;
+    size_t slot = name_hash(name, name_len) & mask;
+    for (long n; (n = list->literals[slot]) >= 0; slot = (slot + 1) & mask) {
+      const ignore_pattern_t *pat = &list->patterns[n];
+      if (pat->len != name_len || memcmp(pat->text, name, name_len) != 0)
+        continue;
+      while (n >= 0 && list->patterns[n].dir_only && !is_dir)
+        n = list->patterns[n].older;
+      best = n;
+      break;
+    }
+  }
+
+  const bucket_t *buckets[] = {&list->suffixes, &list->prefixes,
+                               &list->anchored_literals, &list->others};
+  for (size_t b = 0; b < sizeof(buckets) / sizeof(buckets[0]); b++) {
+    const bucket_t *bucket = buckets[b];
+    for (size_t i = 0; i < bucket->count; i++) {
+      long n = (long)bucket->items[i];
+      if (n <= best) break;
+
+      const ignore_pattern_t *pat = &list->patterns[n];
+      if (pat->dir_only && !is_dir) continue;
+      if (pat->anchored ? pattern_matches(pat, rel, rel_len)
+                        : pattern_matches(pat, name, name_len)) {
+        best = n;
+        break;
+      }
+    }
+  }
+  return best;
+}
+
+/*
+ * 1 when the entry at entry_path is ignored by the .cgitignore files in
+ * force. entry_path is its walk path, such as "./src/build", and its name
+ * starts at name_offset.
+ */
+int ignore_match(const ignore_stack_t *stack, const char *entry_path,
+                 size_t name_offset, int is_dir) {
+  const char *name = entry_path + name_offset;
+  size_t name_len = strlen(name);
+  size_t path_len = name_offset + name_len;
+
+  for (; stack; stack = stack->parent) {
+    const ignore_list_t *list = stack->list;
+    /* Anchored patterns see the path below the .cgitignore's directory */
+    size_t skip = stack->base_len + 1;
+    const char *rel = list->any_anchored ? entry_path + skip : NULL;
+
+    long n = list_match(list, rel, path_len - skip, name, name_len, is_dir);
+    if (n >= 0) return !list->patterns[n].negated;
+  }
+  return 0;
+}
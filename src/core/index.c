@@ -0,0 +1,714 @@
+/*
+ * The index (.cgit/index): a stat cache for write-tree.
+ *
+ * The file uses git's DIRC version 2 layout, so `git ls-files -s` can read
+ * it: a 12-byte header ("DIRC", version, entry count), one entry per file
+ * sorted by path, and a SHA-1 of everything before the trailer. An entry
+ * holds the ctime/mtime, dev, inode, mode, uid, gid and size a file had
+ * when it was hashed, plus its blob id. Integer fields are stored as 32-bit
+ * big-endian values, and each entry is padded with NULs to a multiple of 8.
+ *
+ * write-tree loads the index once. If a file's stat data still matches
+ * its entry, the walk reuses the recorded hash and never opens the file.
+ * Each file the walk sees is recorded into a fresh entry list. When the
+ * walk succeeds that list replaces the old one, so deleted files drop out.
+ * The index is only rewritten if something changed. It is written to
+ * index.lock and renamed over the old file, as git does.
+ *
+ * Racy entries: a file changed within the same timestamp tick as its last
+ * hash keeps an identical mtime. Any entry whose mtime is not older than
+ * the index file itself is therefore rehashed, never trusted.
+ *
+ * The index also carries git's cache-tree ("TREE" extension): for every
+ * directory, the tree id, the number of files below it and the number of
+ * subdirectories. Records are written in pre-order, each as
+ * "<name>\0<files> <subtrees>\n<20-byte id>", with an empty name for the
+ * root. A directory whose files all matched, whose subtrees were all reused,
+ * and whose counts are unchanged reuses its id, with no serializing or
+ * hashing. Any change therefore invalidates exactly the directories on its
+ * path up to the root.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../include/common.h"
+#include "../include/core.h"
+
+typedef struct {
+  uint32_t ctime_sec;
+  uint32_t ctime_nsec;
+  uint32_t mtime_sec;
+  uint32_t mtime_nsec;
+  uint32_t dev;
+  uint32_t ino;
+  uint32_t mode;
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t size;
+  unsigned char id[CGIT_HASH_RAW_LEN];
+  char *path;
+} index_entry_t;
+
+typedef struct {
+  char *path; /* "" for the root */
+  long files; /* -1 when git marked the directory invalid */
+  size_t subtrees;
+  unsigned char id[CGIT_HASH_RAW_LEN];
+} cache_tree_t;
+
+struct index_state {
+  index_entry_t *entries; /* as loaded, sorted by path; never modified */
+  size_t count;
+  cache_tree_t *trees; /* as loaded, sorted by path; never modified */
+  size_t tree_count;
+  int64_t mtime_sec; /* of the index file, for the racy check */
+  int64_t mtime_nsec;
+
+  pthread_mutex_t lock; /* guards everything below */
+  index_entry_t *fresh; /* entries recorded by this walk, unsorted */
+  size_t fresh_count;
+  size_t fresh_capacity;
+  cache_tree_t *fresh_trees;
+  size_t fresh_tree_count;
+  size_t fresh_tree_capacity;
+  int changed;
+};
+
+static uint32_t get_be32(const unsigned char *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static void put_be32(unsigned char *p, uint32_t v) {
+  p[0] = (unsigned char)(v >> 24);
+  p[1] = (unsigned char)(v >> 16);
+  p[2] = (unsigned char)(v >> 8);
+  p[3] = (unsigned char)v;
+}
+
+static cgit_error_t sha1_raw(const unsigned char *data, size_t len,
+                             unsigned char *raw_out) {
+  hash_ctx_t ctx;
+  cgit_error_t result = hash_init(&ctx);
+  if (result != CGIT_OK) return result;
+
+  result = hash_update(&ctx, data, len);
+  if (result != CGIT_OK) {
+    hash_ctx_free(&ctx);
+    return result;
+  }
+  return hash_final(&ctx, raw_out);
+}
+
+/* Walk paths look like "./dir/file"; index paths are "dir/file" */
+static const char *index_path(const char *walk_path) {
+  if (strcmp(walk_path, ".") == 0) return "";
+  return strncmp(walk_path, "./", 2) == 0 ? walk_path + 2 : walk_path;
+}
+
+/* Both are real octal modes; the index only records files */
+static uint32_t index_mode(unsigned int tree_mode) {
+  switch (tree_mode) {
+    case 0100755:
+    case 0120000:
+      return tree_mode;
+    default:
+      return 0100644;
+  }
+}
+
+static void fill_stat(index_entry_t *entry, const struct stat *st) {
+  entry->ctime_sec = (uint32_t)st->st_ctim.tv_sec;
+  entry->ctime_nsec = (uint32_t)st->st_ctim.tv_nsec;
+  entry->mtime_sec = (uint32_t)st->st_mtim.tv_sec;
+  entry->mtime_nsec = (uint32_t)st->st_mtim.tv_nsec;
+  entry->dev = (uint32_t)st->st_dev;
+  entry->ino = (uint32_t)st->st_ino;
+  entry->uid = (uint32_t)st->st_uid;
+  entry->gid = (uint32_t)st->st_gid;
+  entry->size = (uint32_t)st->st_size;
+}
+
+static int cmp_index_entry(const void *a, const void *b) {
+  return strcmp(((const index_entry_t *)a)->path,
+                ((const index_entry_t *)b)->path);
+}
+
+static void free_entries(index_entry_t *entries, size_t count) {
+  for (size_t i = 0; i < count; i++) free(entries[i].path);
+  free(entries);
+}
+
+static void free_trees(cache_tree_t *trees, size_t count) {
+  for (size_t i = 0; i < count; i++) free(trees[i].path);
+  free(trees);
+}
+
+static int cmp_cache_tree(const void *a, const void *b) {
+  return strcmp(((const cache_tree_t *)a)->path,
+                ((const cache_tree_t *)b)->path);
+}
+
+/*
+ * Pre-order for the TREE extension: '/' sorts before every other byte, so
+ * "a", "a/b", "a/b/c" come before "a-b" and each subtree stays contiguous.
+ */
+static int cmp_tree_preorder(const void *a, const void *b) {
+  const unsigned char *x = (const unsigned char *)((const cache_tree_t *)a)->path;
+  const unsigned char *y = (const unsigned char *)((const cache_tree_t *)b)->path;
+
+  while (*x && *x == *y) {
+    x++;
+    y++;
+  }
+  unsigned int cx = *x == '/' ? 1 : *x ? *x + 1u : 0;
+  unsigned int cy = *y == '/' ? 1 : *y ? *y + 1u : 0;
+  return (cx > cy) - (cx < cy);
+}
+
+static cgit_error_t append_tree(cache_tree_t **trees, size_t *count,
+                                size_t *capacity, cache_tree_t tree) {
+  if (*count == *capacity) {
+    size_t new_cap = *capacity ? *capacity * 2 : 16;
+    cache_tree_t *tmp = realloc(*trees, new_cap * sizeof(*tmp));
+    if (!tmp) return CGIT_ERROR_MEMORY;
+    *trees = tmp;
+    *capacity = new_cap;
+  }
+  (*trees)[(*count)++] = tree;
+  return CGIT_OK;
+}
+
+/* Decimal up to the terminator, sign included; callers check the range */
+static int parse_decimal(const unsigned char **p, const unsigned char *end,
+                         char terminator, long *out) {
+  int negative = 0;
+  long val = 0;
+
+  if (*p < end && **p == '-') {
+    negative = 1;
+    (*p)++;
+  }
+  if (*p >= end || **p == terminator) return 0;
+
+  while (*p < end && **p != terminator) {
+    if (**p < '0' || **p > '9' || val > (LONG_MAX - 9) / 10) return 0;
+    val = val * 10 + (**p - '0');
+    (*p)++;
+  }
+  if (*p >= end) return 0;
+
+  (*p)++;
+  *out = negative ? -val : val;
+  return 1;
+}
+
+static cgit_error_t parse_tree_node(index_state_t *index,
+                                    const unsigned char **p,
+                                    const unsigned char *end,
+                                    const char *prefix, size_t *capacity) {
+  const unsigned char *name = *p;
+  const unsigned char *nul = memchr(name, '\0', (size_t)(end - name));
+  if (!nul) return CGIT_ERROR_INVALID_OBJECT;
+  *p = nul + 1;
+
+  long files, subtrees;
+  if (!parse_decimal(p, end, ' ', &files) ||
+      !parse_decimal(p, end, '\n', &subtrees) || files < -1 || subtrees < 0)
+    return CGIT_ERROR_INVALID_OBJECT;
+
+  cache_tree_t tree = {.files = files, .subtrees = (size_t)subtrees};
+  if (files >= 0) {
+    if (end - *p < CGIT_HASH_RAW_LEN) return CGIT_ERROR_INVALID_OBJECT;
+    memcpy(tree.id, *p, CGIT_HASH_RAW_LEN);
+    *p += CGIT_HASH_RAW_LEN;
+  }
+
+  size_t name_len = (size_t)(nul - name);
+  size_t prefix_len = prefix ? strlen(prefix) : 0;
+  tree.path = malloc(prefix_len + 1 + name_len + 1);
+  if (!tree.path) return CGIT_ERROR_MEMORY;
+  if (prefix_len) {
+    memcpy(tree.path, prefix, prefix_len);
+    tree.path[prefix_len] = '/';
+    prefix_len++;
+  }
+  memcpy(tree.path + prefix_len, name, name_len);
+  tree.path[prefix_len + name_len] = '\0';
+
+  cgit_error_t result =
+      append_tree(&index->trees, &index->tree_count, capacity, tree);
+  if (result != CGIT_OK) {
+    free(tree.path);
+    return result;
+  }
+
+  /* index->trees may move while children are appended */
+  size_t self = index->tree_count - 1;
+  for (long i = 0; i < subtrees; i++) {
+    result = parse_tree_node(index, p, end, index->trees[self].path, capacity);
+    if (result != CGIT_OK) return result;
+  }
+  return CGIT_OK;
+}
+
+static cgit_error_t parse_index(index_state_t *index, const buffer_t *buf) {
+  unsigned char sum[CGIT_HASH_RAW_LEN];
+  const unsigned char *data = buf->data;
+  size_t len = buf->size;
+
+  if (len < CGIT_INDEX_HEADER_SIZE + CGIT_HASH_RAW_LEN ||
+      memcmp(data, CGIT_INDEX_SIGNATURE, 4) != 0 ||
+      get_be32(data + 4) != CGIT_INDEX_VERSION)
+    goto corrupt;
+
+  size_t body_len = len - CGIT_HASH_RAW_LEN;
+  cgit_error_t result = sha1_raw(data, body_len, sum);
+  if (result != CGIT_OK) return result;
+  if (memcmp(sum, data + body_len, CGIT_HASH_RAW_LEN) != 0) goto corrupt;
+
+  size_t count = get_be32(data + 8);
+  if (count > body_len / CGIT_INDEX_ENTRY_FIXED_SIZE) goto corrupt;
+
+  index->entries = calloc(count + 1, sizeof(*index->entries));
+  if (!index->entries) return CGIT_ERROR_MEMORY;
+
+  size_t pos = CGIT_INDEX_HEADER_SIZE;
+  for (size_t i = 0; i < count; i++) {
+    if (pos + CGIT_INDEX_ENTRY_FIXED_SIZE > body_len) goto corrupt;
+
+    const unsigned char *p = data + pos;
+    index_entry_t *entry = &index->entries[i];
+    entry->ctime_sec = get_be32(p);
+    entry->ctime_nsec = get_be32(p + 4);
+    entry->mtime_sec = get_be32(p + 8);
+    entry->mtime_nsec = get_be32(p + 12);
+    entry->dev = get_be32(p + 16);
+    entry->ino = get_be32(p + 20);
+    entry->mode = get_be32(p + 24);
+    entry->uid = get_be32(p + 28);
+    entry->gid = get_be32(p + 32);
+    entry->size = get_be32(p + 36);
+    memcpy(entry->id, p + 40, CGIT_HASH_RAW_LEN);
+
+    /* flags: stage bits and the extended flag are never set by cgit */
+    unsigned int flags = ((unsigned int)p[60] << 8) | p[61];
+    if (flags & 0x7000) goto corrupt;
+
+    const unsigned char *name = p + CGIT_INDEX_ENTRY_FIXED_SIZE;
+    const unsigned char *nul =
+        memchr(name, '\0', body_len - (size_t)(name - data));
+    if (!nul) goto corrupt;
+
+    size_t name_len = (size_t)(nul - name);
+    entry->path = strndup((const char *)name, name_len);
+    if (!entry->path) return CGIT_ERROR_MEMORY;
+    index->count++;
+
+    /* 1 to 8 NULs pad the entry to a multiple of 8 bytes */
+    pos += (CGIT_INDEX_ENTRY_FIXED_SIZE + name_len + 8) & ~(size_t)7;
+    if (i && strcmp(index->entries[i - 1].path, entry->path) >= 0)
+      goto corrupt;
+  }
+
+  /* Extensions: optional ones start with an uppercase letter */
+  while (pos + 8 <= body_len) {
+    size_t ext_len = get_be32(data + pos + 4);
+    if (data[pos] < 'A' || data[pos] > 'Z') goto corrupt;
+    if (ext_len > body_len - pos - 8) goto corrupt;
+
+    if (memcmp(data + pos, CGIT_INDEX_EXT_TREE, 4) == 0 && ext_len) {
+      const unsigned char *p = data + pos + 8;
+      const unsigned char *end = p + ext_len;
+      size_t capacity = 0;
+
+      result = parse_tree_node(index, &p, end, NULL, &capacity);
+      if (result == CGIT_ERROR_MEMORY) return result;
+      if (result != CGIT_OK || p != end) goto corrupt;
+    }
+    pos += 8 + ext_len;
+  }
+  if (pos != body_len) goto corrupt;
+
+  qsort(index->trees, index->tree_count, sizeof(*index->trees),
+        cmp_cache_tree);
+  return CGIT_OK;
+
+corrupt:
+  cgit_report("error: %s is corrupt\n", CGIT_INDEX_FILE);
+  return CGIT_ERROR_INVALID_OBJECT;
+}
+
+/* A missing index is an empty one */
+cgit_error_t index_load(index_state_t **index_out) {
+  cgit_error_t result = CGIT_OK;
+  buffer_t buf = {0};
+  char path[PATH_MAX];
+  struct stat st;
+
+  index_state_t *index = calloc(1, sizeof(*index));
+  if (!index) return CGIT_ERROR_MEMORY;
+  pthread_mutex_init(&index->lock, NULL);
+
+  result = repo_path(path, sizeof(path), CGIT_INDEX_FILE);
+  if (result != CGIT_OK) goto cleanup;
+
+  if (stat(path, &st) != 0) {
+    if (errno == ENOENT) goto done;
+    cgit_report("stat: %s: %s\n", path, strerror(errno));
+    result = CGIT_ERROR_IO;
+    goto cleanup;
+  }
+  index->mtime_sec = (int64_t)st.st_mtim.tv_sec;
+  index->mtime_nsec = (int64_t)st.st_mtim.tv_nsec;
+
+  result = read_file(path, &buf);
+  if (result != CGIT_OK) goto cleanup;
+
+  result = parse_index(index, &buf);
+  if (result != CGIT_OK) goto cleanup;
+
+  /*
+   * The index only names objects that were stored, which is what lets an
+   * unchanged entry skip hashing; vouch for them so rewrites of the same
+   * content skip the store too. Gitlinks name other repositories' commits.
+   */
+  for (size_t i = 0; i < index->count; i++)
+    if (index->entries[i].mode != 0160000)
+      object_mark_known(index->entries[i].id);
+  for (size_t i = 0; i < index->tree_count; i++)
+    if (index->trees[i].files >= 0) object_mark_known(index->trees[i].id);
+
+done:
+  *index_out = index;
+  index = NULL;
+
+cleanup:
+  buffer_free(&buf);
+  index_free(index);
+  return result;
+}
+
+void index_free(index_state_t *index) {
+  if (!index) return;
+  free_entries(index->entries, index->count);
+  free_entries(index->fresh, index->fresh_count);
+  free_trees(index->trees, index->tree_count);
+  free_trees(index->fresh_trees, index->fresh_tree_count);
+  pthread_mutex_destroy(&index->lock);
+  free(index);
+}
+
+static const index_entry_t *find_entry(const index_state_t *index,
+                                       const char *path) {
+  size_t lo = 0;
+  size_t hi = index->count;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    int cmp = strcmp(index->entries[mid].path, path);
+    if (cmp == 0) return &index->entries[mid];
+    if (cmp < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return NULL;
+}
+
+static int is_racy(const index_state_t *index, const index_entry_t *entry) {
+  if ((int64_t)entry->mtime_sec != index->mtime_sec)
+    return (int64_t)entry->mtime_sec > index->mtime_sec;
+  return (int64_t)entry->mtime_nsec >= index->mtime_nsec;
+}
+
+/*
+ * Returns 1 and fills hash_out when the file at walk_path still matches
+ * its entry and the entry is not racy. Safe to call from worker threads.
+ */
+int index_lookup(const index_state_t *index, const char *walk_path,
+                 const struct stat *st, unsigned int tree_mode,
+                 char *hash_out) {
+  const index_entry_t *entry = find_entry(index, index_path(walk_path));
+  if (!entry) return 0;
+
+  index_entry_t now = {0};
+  fill_stat(&now, st);
+
+  if (entry->mode != index_mode(tree_mode) ||
+      entry->mtime_sec != now.mtime_sec ||
+      entry->mtime_nsec != now.mtime_nsec ||
+      entry->ctime_sec != now.ctime_sec ||
+      entry->ctime_nsec != now.ctime_nsec || entry->size != now.size ||
+      entry->ino != now.ino || entry->dev != now.dev ||
+      entry->uid != now.uid || entry->gid != now.gid ||
+      is_racy(index, entry))
+    return 0;
+
+  bytes_to_hex_hash(entry->id, hash_out);
+  return 1;
+}
+
+/* Record a file seen by the walk. Safe to call from worker threads. */
+cgit_error_t index_record(index_state_t *index, const char *walk_path,
+                          const struct stat *st, unsigned int tree_mode,
+                          const char *hash) {
+  cgit_error_t result = CGIT_OK;
+  const char *path = index_path(walk_path);
+  index_entry_t entry = {0};
+
+  fill_stat(&entry, st);
+  entry.mode = index_mode(tree_mode);
+  hex_to_bytes_hash((const unsigned char *)hash, (char *)entry.id);
+  entry.path = strdup(path);
+  if (!entry.path) return CGIT_ERROR_MEMORY;
+
+  /* Anything but an exact copy of the loaded entry means a rewrite */
+  const index_entry_t *old = find_entry(index, path);
+  int same = old && memcmp(old, &entry, offsetof(index_entry_t, id) +
+                                              CGIT_HASH_RAW_LEN) == 0;
+
+  pthread_mutex_lock(&index->lock);
+  if (index->fresh_count == index->fresh_capacity) {
+    size_t new_cap = index->fresh_capacity ? index->fresh_capacity * 2 : 64;
+    index_entry_t *tmp = realloc(index->fresh, new_cap * sizeof(*tmp));
+    if (!tmp) {
+      free(entry.path);
+      result = CGIT_ERROR_MEMORY;
+      goto cleanup;
+    }
+    index->fresh = tmp;
+    index->fresh_capacity = new_cap;
+  }
+  index->fresh[index->fresh_count++] = entry;
+  if (!same) index->changed = 1;
+
+cleanup:
+  pthread_mutex_unlock(&index->lock);
+  return result;
+}
+
+static const cache_tree_t *find_tree(const index_state_t *index,
+                                     const char *path) {
+  cache_tree_t key = {.path = (char *)path};
+  if (!index->tree_count) return NULL;
+  return bsearch(&key, index->trees, index->tree_count, sizeof(*index->trees),
+                 cmp_cache_tree);
+}
+
+/*
+ * Returns 1 and fills hash_out when the cache-tree has a valid record for
+ * the directory with the same file and subtree counts. The caller must
+ * already know that nothing below the directory changed.
+ */
+int index_cached_tree(const index_state_t *index, const char *walk_path,
+                      size_t files, size_t subtrees, char *hash_out) {
+  const cache_tree_t *tree = find_tree(index, index_path(walk_path));
+
+  if (!tree || tree->files < 0 || (size_t)tree->files != files ||
+      tree->subtrees != subtrees)
+    return 0;
+
+  bytes_to_hex_hash(tree->id, hash_out);
+  return 1;
+}
+
+/* Record a directory's tree. Safe to call from worker threads. */
+cgit_error_t index_record_tree(index_state_t *index, const char *walk_path,
+                               size_t files, size_t subtrees,
+                               const char *hash) {
+  cgit_error_t result = CGIT_OK;
+  const char *path = index_path(walk_path);
+  cache_tree_t tree = {.files = (long)files, .subtrees = subtrees};
+
+  hex_to_bytes_hash((const unsigned char *)hash, (char *)tree.id);
+  tree.path = strdup(path);
+  if (!tree.path) return CGIT_ERROR_MEMORY;
+
+  const cache_tree_t *old = find_tree(index, path);
+  int same = old && old->files == tree.files &&
+             old->subtrees == tree.subtrees &&
+             memcmp(old->id, tree.id, CGIT_HASH_RAW_LEN) == 0;
+
+  pthread_mutex_lock(&index->lock);
+  result = append_tree(&index->fresh_trees, &index->fresh_tree_count,
+                       &index->fresh_tree_capacity, tree);
+  if (result != CGIT_OK) free(tree.path);
+  if (!same) index->changed = 1;
+  pthread_mutex_unlock(&index->lock);
+  return result;
+}
+
+static cgit_error_t serialize_index(const index_entry_t *entries, size_t count,
+                                    buffer_t *out) {
+  unsigned char head[CGIT_INDEX_HEADER_SIZE];
+  unsigned char fixed[CGIT_INDEX_ENTRY_FIXED_SIZE];
+  static const unsigned char padding[8] = {0};
+  cgit_error_t result;
+
+  memcpy(head, CGIT_INDEX_SIGNATURE, 4);
+  put_be32(head + 4, CGIT_INDEX_VERSION);
+  put_be32(head + 8, (uint32_t)count);
+  result = buffer_append(out, head, sizeof(head));
+  if (result != CGIT_OK) return result;
+
+  for (size_t i = 0; i < count; i++) {
+    const index_entry_t *entry = &entries[i];
+    size_t name_len = strlen(entry->path);
+
+    put_be32(fixed, entry->ctime_sec);
+    put_be32(fixed + 4, entry->ctime_nsec);
+    put_be32(fixed + 8, entry->mtime_sec);
+    put_be32(fixed + 12, entry->mtime_nsec);
+    put_be32(fixed + 16, entry->dev);
+    put_be32(fixed + 20, entry->ino);
+    put_be32(fixed + 24, entry->mode);
+    put_be32(fixed + 28, entry->uid);
+    put_be32(fixed + 32, entry->gid);
+    put_be32(fixed + 36, entry->size);
+    memcpy(fixed + 40, entry->id, CGIT_HASH_RAW_LEN);
+
+    /* Names of 0xfff bytes or more store 0xfff and rely on the NUL */
+    unsigned int flags = name_len < 0xfff ? (unsigned int)name_len : 0xfff;
+    fixed[60] = (unsigned char)(flags >> 8);
+    fixed[61] = (unsigned char)flags;
+
+    size_t entry_len =
+        (CGIT_INDEX_ENTRY_FIXED_SIZE + name_len + 8) & ~(size_t)7;
+    size_t pad = entry_len - CGIT_INDEX_ENTRY_FIXED_SIZE - name_len;
+
+    if ((result = buffer_append(out, fixed, sizeof(fixed))) != CGIT_OK ||
+        (result = buffer_append(out, entry->path, name_len)) != CGIT_OK ||
+        (result = buffer_append(out, padding, pad)) != CGIT_OK)
+      return result;
+  }
+
+  return CGIT_OK;
+}
+
+static cgit_error_t serialize_cache_tree(cache_tree_t *trees, size_t count,
+                                         buffer_t *out) {
+  buffer_t body = {0};
+  unsigned char head[8];
+  cgit_error_t result = CGIT_OK;
+
+  qsort(trees, count, sizeof(*trees), cmp_tree_preorder);
+
+  for (size_t i = 0; i < count; i++) {
+    const char *slash = strrchr(trees[i].path, '/');
+    const char *name = slash ? slash + 1 : trees[i].path;
+    char counts[48];
+    int len = snprintf(counts, sizeof(counts), "%ld %zu\n", trees[i].files,
+                       trees[i].subtrees);
+
+    if ((result = buffer_append(&body, name, strlen(name) + 1)) != CGIT_OK ||
+        (result = buffer_append(&body, counts, (size_t)len)) != CGIT_OK ||
+        (result = buffer_append(&body, trees[i].id, CGIT_HASH_RAW_LEN)) !=
+            CGIT_OK)
+      goto cleanup;
+  }
+
+  memcpy(head, CGIT_INDEX_EXT_TREE, 4);
+  put_be32(head + 4, (uint32_t)body.size);
+  if ((result = buffer_append(out, head, sizeof(head))) != CGIT_OK) goto cleanup;
+  result = buffer_append(out, body.data, body.size);
+
+cleanup:
+  buffer_free(&body);
+  return result;
+}
+
+/*
+ * Replace the index with the entries and trees recorded since index_load.
+ * Does nothing when the walk found exactly what the index already had.
+ */
+cgit_error_t index_commit(index_state_t *index) {
+  cgit_error_t result = CGIT_OK;
+  buffer_t out = {0};
+  unsigned char sum[CGIT_HASH_RAW_LEN];
+  char path[PATH_MAX];
+  char lock_path[PATH_MAX];
+  int locked = 0;
+  int fd = -1;
+
+  if (!index->changed && index->fresh_count == index->count &&
+      index->fresh_tree_count == index->tree_count)
+    return CGIT_OK;
+
+  qsort(index->fresh, index->fresh_count, sizeof(*index->fresh),
+        cmp_index_entry);
+
+  result = serialize_index(index->fresh, index->fresh_count, &out);
+  if (result != CGIT_OK) goto cleanup;
+
+  if (index->fresh_tree_count) {
+    result = serialize_cache_tree(index->fresh_trees, index->fresh_tree_count,
+                                  &out);
+    if (result != CGIT_OK) goto cleanup;
+  }
+
+  result = sha1_raw(out.data, out.size, sum);
+  if (result != CGIT_OK) goto cleanup;
+  result = buffer_append(&out, sum, sizeof(sum));
+  if (result != CGIT_OK) goto cleanup;
+
+  result = repo_path(path, sizeof(path), CGIT_INDEX_FILE);
+  if (result != CGIT_OK) goto cleanup;
+  result = repo_path(lock_path, sizeof(lock_path), CGIT_INDEX_LOCK_FILE);
+  if (result != CGIT_OK) goto cleanup;
+
+  /* The lock file doubles as the temp file, so only one writer wins */
+  fd = open(lock_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (fd < 0) {
+    cgit_report("error: unable to create '%s': %s\n",
+                lock_path, strerror(errno));
+    result = CGIT_ERROR_IO;
+    goto cleanup;
+  }
+  locked = 1;
+
+  size_t done = 0;
+  while (done < out.size) {
+    ssize_t n = write(fd, out.data + done, out.size - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      cgit_report("error: write failed on '%s': %s\n",
+                  lock_path, strerror(errno));
+      result = CGIT_ERROR_IO;
+      goto cleanup;
+    }
+    done += (size_t)n;
+  }
+
+  int close_err = close(fd);
+  fd = -1;
+  if (close_err != 0) {
+    cgit_report("error: cannot close '%s': %s\n", lock_path,
+                strerror(errno));
+    result = CGIT_ERROR_IO;
+    goto cleanup;
+  }
+
+  if (rename(lock_path, path) != 0) {
+    cgit_report("error: cannot rename '%s': %s\n", lock_path,
+                strerror(errno));
+    result = CGIT_ERROR_IO;
+    goto cleanup;
+  }
+
+cleanup:
+  if (fd >= 0) close(fd);
+  if (result != CGIT_OK && locked) unlink(lock_path);
+  buffer_free(&out);
+  return result;
+}
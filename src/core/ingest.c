@@ -0,0 +1,328 @@
+/*
+ * hash-object --stdin-paths: many objects from one process.
+ *
+ * The main thread reads paths into batches of CGIT_HASH_BATCH_SIZE and
+ * submits each batch to the thread pool. A worker reads, hashes, compresses
+ * and writes a whole batch through write_objects_from_files, so small files
+ * go through hash_batch together and the pipeline stages overlap across
+ * batches rather than across threads. At most CGIT_INGEST_DEPTH batches per
+ * worker are in flight, in a ring: the main thread stops reading while the
+ * ring is full, so memory stays bounded however long the input is.
+ *
+ * Results leave in input order: only the oldest batch is ever output, once
+ * its worker is done. Ids are held back until object_files_flush has run,
+ * so in core.fsyncMethod=batch mode nobody sees an id before its object is
+ * in place. Then they go to the caller's output function, one "<id>\n" per
+ * path. That happens whenever the output buffer fills, at the end, and
+ * whenever the input has nothing more ready. In the last case the partial
+ * batch is sent off too, so a caller that writes one path and waits for its
+ * id gets an answer.
+ *
+ * When a batch fails, the ids of every batch before it still go out, the
+ * way git prints ids up to the failing path; nothing after it does.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../include/common.h"
+#include "../include/core.h"
+
+typedef struct ingest ingest_t;
+
+typedef struct {
+  ingest_t *ingest;
+  char *paths[CGIT_HASH_BATCH_SIZE];
+  char hashes[CGIT_HASH_BATCH_SIZE][CGIT_HASH_HEX_LEN + 1];
+  size_t count;
+  cgit_error_t result;
+  int done; /* guarded by ingest->lock */
+} ingest_batch_t;
+
+struct ingest {
+  const char *type;
+  int persist;
+  object_sink_fn output;
+  void *output_data;
+  thread_pool_t *pool;
+  ingest_batch_t *ring;
+  size_t ring_size;
+  size_t head;      /* oldest batch in flight */
+  size_t in_flight; /* submitted and not yet printed */
+  buffer_t out;     /* ids waiting for object_files_flush */
+  int failed;       /* no more ids are queued or output */
+  pthread_mutex_t lock;
+  pthread_cond_t done_cond;
+};
+
+typedef struct {
+  int fd;
+  char *buf;
+  size_t start; /* first byte not yet returned */
+  size_t end;   /* end of the bytes read */
+  size_t capacity;
+  int eof;
+} line_reader_t;
+
+static void ingest_batch_task(void *arg) {
+  ingest_batch_t *batch = arg;
+  ingest_t *ingest = batch->ingest;
+  char *hashes[CGIT_HASH_BATCH_SIZE];
+
+  for (size_t i = 0; i < batch->count; i++) hashes[i] = batch->hashes[i];
+
+  /* On failure the core has already named the path */
+  cgit_error_t result = write_objects_from_files(
+      AT_FDCWD, (const char *const *)batch->paths, batch->count, ingest->type,
+      hashes, ingest->persist);
+
+  pthread_mutex_lock(&ingest->lock);
+  batch->result = result;
+  batch->done = 1;
+  pthread_cond_broadcast(&ingest->done_cond);
+  pthread_mutex_unlock(&ingest->lock);
+}
+
+static cgit_error_t append_id(buffer_t *out, const char *hash) {
+  if (out->size + CGIT_HASH_HEX_LEN + 1 > out->capacity) {
+    size_t new_cap = out->capacity ? out->capacity * 2 : CGIT_READ_BUFFER_SIZE;
+    unsigned char *tmp = realloc(out->data, new_cap);
+    if (!tmp) {
+      cgit_report("error: out of memory\n");
+      return CGIT_ERROR_MEMORY;
+    }
+    out->data = tmp;
+    out->capacity = new_cap;
+  }
+
+  memcpy(out->data + out->size, hash, CGIT_HASH_HEX_LEN);
+  out->data[out->size + CGIT_HASH_HEX_LEN] = '\n';
+  out->size += CGIT_HASH_HEX_LEN + 1;
+  return CGIT_OK;
+}
+
+/* Put every object behind the held-back ids in place, then hand them out */
+static cgit_error_t emit(ingest_t *ingest) {
+  cgit_error_t result = object_files_flush();
+  if (result == CGIT_OK && ingest->out.size)
+    result = ingest->output(ingest->out.data, ingest->out.size,
+                            ingest->output_data);
+  ingest->out.size = 0;
+  if (result != CGIT_OK) ingest->failed = 1;
+  return result;
+}
+
+/* Wait for the oldest batch in flight and queue its ids for output */
+static cgit_error_t retire_oldest(ingest_t *ingest) {
+  cgit_error_t result = CGIT_OK;
+  ingest_batch_t *batch = &ingest->ring[ingest->head];
+
+  pthread_mutex_lock(&ingest->lock);
+  while (!batch->done) pthread_cond_wait(&ingest->done_cond, &ingest->lock);
+  pthread_mutex_unlock(&ingest->lock);
+
+  result = batch->result;
+  if (result != CGIT_OK) ingest->failed = 1;
+  for (size_t i = 0; i < batch->count; i++) {
+    if (!ingest->failed) {
+      result = append_id(&ingest->out, batch->hashes[i]);
+      if (result != CGIT_OK) ingest->failed = 1;
+    }
+    free(batch->paths[i]);
+  }
+  *batch = (ingest_batch_t){0};
+
+  ingest->head = (ingest->head + 1) % ingest->ring_size;
+  ingest->in_flight--;
+
+  if (!ingest->failed && ingest->out.size >= CGIT_INGEST_OUTPUT_MAX)
+    result = emit(ingest);
+  return result;
+}
+
+/* A batch the pool refused is dropped here, so drain never waits on it */
+static cgit_error_t submit(ingest_t *ingest, ingest_batch_t *batch) {
+  batch->ingest = ingest;
+  cgit_error_t result =
+      thread_pool_submit(ingest->pool, ingest_batch_task, batch);
+  if (result != CGIT_OK) {
+    for (size_t i = 0; i < batch->count; i++) free(batch->paths[i]);
+    *batch = (ingest_batch_t){0};
+    return result;
+  }
+  ingest->in_flight++;
+  return CGIT_OK;
+}
+
+/*
+ * Finish everything in flight and output the ids queued so far, which after
+ * a failure are those of the batches before it. The first error wins.
+ */
+static cgit_error_t drain(ingest_t *ingest, cgit_error_t result) {
+  while (ingest->in_flight) {
+    cgit_error_t r = retire_oldest(ingest);
+    if (result == CGIT_OK) result = r;
+  }
+  cgit_error_t r = emit(ingest);
+  if (result == CGIT_OK) result = r;
+  return result;
+}
+
+/* Whether a complete line (or a last one without newline) is buffered */
+static int line_ready(const line_reader_t *reader) {
+  if (reader->start == reader->end) return 0;
+  return reader->eof || memchr(reader->buf + reader->start, '\n',
+                               reader->end - reader->start) != NULL;
+}
+
+static int input_pending(int fd) {
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+  return poll(&pfd, 1, 0) > 0;
+}
+
+/* Read more input, blocking; keeps a spare byte for a final NUL */
+static cgit_error_t fill(line_reader_t *reader) {
+  if (reader->start > 0) {
+    memmove(reader->buf, reader->buf + reader->start,
+            reader->end - reader->start);
+    reader->end -= reader->start;
+    reader->start = 0;
+  }
+  if (reader->end + 1 >= reader->capacity) {
+    size_t new_cap =
+        reader->capacity ? reader->capacity * 2 : CGIT_READ_BUFFER_SIZE;
+    char *tmp = realloc(reader->buf, new_cap);
+    if (!tmp) {
+      cgit_report("error: out of memory\n");
+      return CGIT_ERROR_MEMORY;
+    }
+    reader->buf = tmp;
+    reader->capacity = new_cap;
+  }
+
+  for (;;) {
+    ssize_t n = read(reader->fd, reader->buf + reader->end,
+                     reader->capacity - reader->end - 1);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      cgit_report("error: cannot read paths: %s\n", strerror(errno));
+      return CGIT_ERROR_IO;
+    }
+    if (n == 0) reader->eof = 1;
+    reader->end += (size_t)n;
+    return CGIT_OK;
+  }
+}
+
+/* The next buffered line, without its "\n" or "\r\n" */
+static char *next_line(line_reader_t *reader) {
+  char *line = reader->buf + reader->start;
+  char *nl = memchr(line, '\n', reader->end - reader->start);
+  char *line_end = nl ? nl : reader->buf + reader->end;
+
+  reader->start = (size_t)(line_end - reader->buf) + (nl ? 1 : 0);
+  if (line_end > line && line_end[-1] == '\r') line_end--;
+  *line_end = '\0';
+  return line;
+}
+
+/*
+ * Hash (and with persist, write) the file named on each line of in_fd.
+ * The ids go to output, one per line and in input order, in chunks that
+ * each end with a newline.
+ */
+cgit_error_t ingest_paths(int in_fd, const char *type, int persist,
+                          size_t num_threads, object_sink_fn output,
+                          void *output_data) {
+  cgit_error_t result = CGIT_OK;
+  line_reader_t reader = {.fd = in_fd};
+  ingest_batch_t *batch = NULL; /* the batch being filled */
+  ingest_t ingest = {.type = type,
+                     .persist = persist,
+                     .output = output,
+                     .output_data = output_data};
+
+  pthread_mutex_init(&ingest.lock, NULL);
+  pthread_cond_init(&ingest.done_cond, NULL);
+
+  ingest.ring_size = num_threads * CGIT_INGEST_DEPTH;
+  ingest.ring = calloc(ingest.ring_size, sizeof(*ingest.ring));
+  if (!ingest.ring) {
+    cgit_report("error: out of memory\n");
+    result = CGIT_ERROR_MEMORY;
+    goto cleanup;
+  }
+
+  result = thread_pool_create(num_threads, &ingest.pool);
+  if (result != CGIT_OK) goto cleanup;
+
+  for (;;) {
+    if (!line_ready(&reader)) {
+      if (reader.eof) break;
+
+      /* About to block: answer everything read so far first */
+      if (!input_pending(in_fd) && (batch || ingest.in_flight)) {
+        if (batch) {
+          result = submit(&ingest, batch);
+          batch = NULL;
+          if (result != CGIT_OK) break;
+        }
+        result = drain(&ingest, CGIT_OK);
+        if (result != CGIT_OK) break;
+      }
+
+      result = fill(&reader);
+      if (result != CGIT_OK) break;
+      continue;
+    }
+
+    char *path = strdup(next_line(&reader));
+    if (!path) {
+      cgit_report("error: out of memory\n");
+      result = CGIT_ERROR_MEMORY;
+      break;
+    }
+
+    if (!batch) {
+      if (ingest.in_flight == ingest.ring_size) {
+        result = retire_oldest(&ingest);
+        if (result != CGIT_OK) {
+          free(path);
+          break;
+        }
+      }
+      batch = &ingest.ring[(ingest.head + ingest.in_flight) %
+                           ingest.ring_size];
+    }
+
+    batch->paths[batch->count++] = path;
+    if (batch->count == CGIT_HASH_BATCH_SIZE) {
+      result = submit(&ingest, batch);
+      batch = NULL;
+      if (result != CGIT_OK) break;
+    }
+  }
+
+  if (batch && result == CGIT_OK) {
+    result = submit(&ingest, batch);
+    batch = NULL;
+  }
+  result = drain(&ingest, result);
+
+cleanup:
+  /* A batch that never reached the pool still owns its paths */
+  if (batch)
+    for (size_t i = 0; i < batch->count; i++) free(batch->paths[i]);
+  thread_pool_destroy(ingest.pool);
+  free(ingest.ring);
+  buffer_free(&ingest.out);
+  free(reader.buf);
+  pthread_cond_destroy(&ingest.done_cond);
+  pthread_mutex_destroy(&ingest.lock);
+  return result;
+}
@@ -0,0 +1,214 @@
+/*
+ * libcgit entry points; see include/cgit.h.
+ *
+ * Each call makes its handle the thread's current repository and runs the
+ * same core code as the command-line tool, so the two cannot drift apart.
+ * Writes are flushed before a call returns: an id handed back always names
+ * an object in place, whatever core.fsyncMethod says.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "../include/cgit.h"
+#include "../include/common.h"
+#include "../include/core.h"
+
+/* path is the directory holding .cgit, as for the command-line tool */
+cgit_error_t cgit_repo_open(const char *path, cgit_repo_t **repo_out) {
+  cgit_error_t result = CGIT_OK;
+  char root[PATH_MAX];
+  char objects[CGIT_MAX_PATH_LENGTH];
+  struct stat st;
+
+  cgit_repo_t *repo = malloc(sizeof(*repo));
+  if (!repo) return CGIT_ERROR_MEMORY;
+  *repo = (cgit_repo_t)CGIT_REPO_INIT;
+  repo->keep_errors = 1;
+
+  cgit_repo_t *previous = repo_enter(repo);
+
+  if (!realpath(path, root)) {
+    cgit_report("error: cannot open repository '%s': %s\n", path,
+                strerror(errno));
+    result = CGIT_ERROR_FILE_NOT_FOUND;
+    goto cleanup;
+  }
+  if (strlen(root) >= CGIT_REPO_ROOT_MAX) {
+    cgit_report("error: repository path too long: '%s'\n", root);
+    result = CGIT_ERROR_INVALID_ARGS;
+    goto cleanup;
+  }
+
+  repo->root = strdup(root);
+  if (!repo->root) {
+    result = CGIT_ERROR_MEMORY;
+    goto cleanup;
+  }
+
+  result = repo_path(objects, sizeof(objects), CGIT_OBJECTS_DIR);
+  if (result != CGIT_OK) goto cleanup;
+  if (stat(objects, &st) != 0 || !S_ISDIR(st.st_mode)) {
+    cgit_report("error: not a cgit repository: '%s'\n", root);
+    result = CGIT_ERROR_FILE_NOT_FOUND;
+    goto cleanup;
+  }
+
+  *repo_out = repo;
+
+cleanup:
+  repo_leave(previous);
+  if (result != CGIT_OK) {
+    free(repo->root);
+    free(repo);
+  }
+  return result;
+}
+
+void cgit_repo_close(cgit_repo_t *repo) {
+  if (!repo) return;
+
+  config_release(repo);
+  packs_release(repo);
+  oid_set_free(&repo->known_objects);
+  free(repo->pending);
+  pthread_mutex_destroy(&repo->packs_lock);
+  pthread_mutex_destroy(&repo->map_lock);
+  pthread_mutex_destroy(&repo->known_lock);
+  pthread_mutex_destroy(&repo->pending_lock);
+  free(repo->root);
+  free(repo);
+}
+
+/* CGIT_OK when the object is stored, loose or packed */
+cgit_error_t cgit_object_exists(cgit_repo_t *repo, const char *hash) {
+  cgit_repo_t *previous = repo_enter(repo);
+  cgit_error_t result = object_exists(hash);
+  repo_leave(previous);
+  return result;
+}
+
+/* On success the caller frees obj with cgit_object_free */
+cgit_error_t cgit_read_object(cgit_repo_t *repo, const char *hash,
+                              git_object_t *obj) {
+  cgit_repo_t *previous = repo_enter(repo);
+  *obj = (git_object_t){0};
+  cgit_error_t result = read_object(hash, obj);
+  if (result != CGIT_OK) free_object(obj);
+  repo_leave(previous);
+  return result;
+}
+
+void cgit_object_free(git_object_t *obj) { free_object(obj); }
+
+/* Store data as an object of type; hash_out gets its hex id */
+cgit_error_t cgit_write_object(cgit_repo_t *repo, const void *data,
+                               size_t len, const char *type, char *hash_out) {
+  cgit_repo_t *previous = repo_enter(repo);
+  cgit_error_t result = write_object(data, len, type, hash_out, 1);
+  if (result == CGIT_OK) result = object_files_flush();
+  repo_leave(previous);
+  return result;
+}
+
+/* On success the caller frees tree with cgit_tree_free */
+cgit_error_t cgit_read_tree(cgit_repo_t *repo, const char *hash,
+                            cgit_tree_t *tree) {
+  cgit_error_t result = CGIT_OK;
+  git_object_t obj = {0};
+  cgit_repo_t *previous = repo_enter(repo);
+
+  *tree = (cgit_tree_t){0};
+  arena_t *arena = calloc(1, sizeof(*arena));
+  if (!arena) {
+    result = CGIT_ERROR_MEMORY;
+    goto cleanup;
+  }
+  tree->storage = arena;
+
+  result = read_object(hash, &obj);
+  if (result != CGIT_OK) goto cleanup;
+  if (strcmp(obj.type, "tree") != 0) {
+    cgit_report("error: %s is a %s, not a tree\n", hash, obj.type);
+    result = CGIT_ERROR_INVALID_OBJECT;
+    goto cleanup;
+  }
+
+  result = parse_tree(arena, obj.data, obj.size, &tree->entries, &tree->count);
+
+cleanup:
+  free_object(&obj);
+  if (result != CGIT_OK) cgit_tree_free(tree);
+  repo_leave(previous);
+  return result;
+}
+
+void cgit_tree_free(cgit_tree_t *tree) {
+  if (tree->storage) arena_release(tree->storage);
+  free(tree->storage);
+  *tree = (cgit_tree_t){0};
+}
+
+/* The modes cgit_read_tree can give back */
+static int valid_tree_mode(unsigned int mode) {
+  switch (mode) {
+    case 0100644:
+    case 0100755:
+    case 0120000:
+    case 040000:
+    case 0160000:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+/* Write a tree of entries (sorted in place by name); hash_out gets its id */
+cgit_error_t cgit_write_tree(cgit_repo_t *repo, tree_entry_t *entries,
+                             size_t count, char *hash_out) {
+  cgit_error_t result = CGIT_OK;
+  buffer_t buf = {0};
+  cgit_repo_t *previous = repo_enter(repo);
+
+  for (size_t i = 0; i < count; i++) {
+    if (!valid_tree_mode(entries[i].mode)) {
+      cgit_report("error: bad mode %o for tree entry '%s'\n", entries[i].mode,
+                  entries[i].name);
+      result = CGIT_ERROR_INVALID_OBJECT;
+      goto cleanup;
+    }
+  }
+
+  result = serialize_tree(entries, count, &buf);
+  if (result == CGIT_OK)
+    result = write_object(buf.data, buf.size, "tree", hash_out, 1);
+  if (result == CGIT_OK) result = object_files_flush();
+
+cleanup:
+  buffer_free(&buf);
+  repo_leave(previous);
+  return result;
+}
+
+/* Neither needs a repository; a blank one keeps their messages */
+cgit_error_t cgit_trace_start(const char *label) {
+  cgit_repo_t none = CGIT_REPO_INIT;
+  none.keep_errors = 1;
+  cgit_repo_t *previous = repo_enter(&none);
+  cgit_error_t result = trace_init(label);
+  repo_leave(previous);
+  return result;
+}
+
+cgit_error_t cgit_trace_report(FILE *out) {
+  cgit_repo_t none = CGIT_REPO_INIT;
+  none.keep_errors = 1;
+  cgit_repo_t *previous = repo_enter(&none);
+  cgit_error_t result = trace_report(out);
+  repo_leave(previous);
+  return result;
+}
@@ -1,5 +1,7 @@
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -8,6 +10,7 @@
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #include "../include/common.h"
 #include "../include/core.h"
@@ -18,8 +21,8 @@ static cgit_error_t buffer_append_fmt(buffer_t *buf, const char *fmt, ...) {
   if (!buf->data) {
     buf->data = malloc(CGIT_READ_BUFFER_SIZE);
     if (!buf->data) {
-      fprintf(stderr,
-              "error: buffer_append_fmt: failed to allocate output buffer\n");
+      cgit_report(
+          "error: buffer_append_fmt: failed to allocate output buffer\n");
       return CGIT_ERROR_MEMORY;
     }
     buf->capacity = CGIT_READ_BUFFER_SIZE;
@@ -36,7 +39,7 @@ static cgit_error_t buffer_append_fmt(buffer_t *buf, const char *fmt, ...) {
 
     while (len_line > new_cap - buf->size) {
       if (new_cap > SIZE_MAX / 2) {
-        fprintf(stderr, "out of memory");
+        cgit_report("out of memory");
         result = CGIT_ERROR_MEMORY;
         goto cleanup;
       }
@@ -45,10 +48,9 @@ static cgit_error_t buffer_append_fmt(buffer_t *buf, const char *fmt, ...) {
 
     unsigned char *tmp_buf = realloc(buf->data, new_cap);
     if (!tmp_buf) {
-      fprintf(stderr,
-              "error: serialize_tree: realloc failed growing buffer to %zu "
-              "bytes\n",
-              new_cap);
+      cgit_report("error: serialize_tree: realloc failed growing buffer to %zu "
+                  "bytes\n",
+                  new_cap);
       result = CGIT_ERROR_MEMORY;
       goto cleanup;
     }
@@ -66,17 +68,28 @@ cleanup:
   return result;
 }
 
+/* The current time in the local timezone, as commit-tree records it */
 cgit_error_t build_commit_content(const char *tree_hash,
                                   const char *parent_hash, const char *author,
                                   const char *email, const char *message,
                                   buffer_t *output) {
-  cgit_error_t result = CGIT_OK;
   time_t timestamp;
   time(&timestamp);
   struct tm lt;
   localtime_r(&timestamp, &lt);
 
-  int offset_seconds = lt.tm_gmtoff;
+  return build_commit_content_at(tree_hash, parent_hash, author, email,
+                                 message, timestamp, (int)lt.tm_gmtoff,
+                                 output);
+}
+
+/* A fixed date, so the same inputs always give the same commit id */
+cgit_error_t build_commit_content_at(const char *tree_hash,
+                                     const char *parent_hash,
+                                     const char *author, const char *email,
+                                     const char *message, time_t timestamp,
+                                     int offset_seconds, buffer_t *output) {
+  cgit_error_t result = CGIT_OK;
   char sign = offset_seconds >= 0 ? '+' : '-';
   int abs_offset = abs(offset_seconds);
   int hours = abs_offset / 3600;
@@ -116,12 +129,13 @@ static int cmp_entry(const void *a, const void *b) {
 cgit_error_t serialize_tree(tree_entry_t *entries, size_t count,
                             buffer_t *out) {
   cgit_error_t result = CGIT_OK;
-  qsort(entries, count, sizeof(tree_entry_t), cmp_entry);
+  uint64_t start = trace_begin();
+  /* An empty directory, or one whose entries are all ignored, has none */
+  if (count) qsort(entries, count, sizeof(tree_entry_t), cmp_entry);
 
   out->data = malloc(CGIT_READ_BUFFER_SIZE);
   if (!out->data) {
-    fprintf(stderr,
-            "error: serialize_tree: failed to allocate output buffer\n");
+    cgit_report("error: serialize_tree: failed to allocate output buffer\n");
     result = CGIT_ERROR_MEMORY;
     goto cleanup;
   }
@@ -137,15 +151,15 @@ cgit_error_t serialize_tree(tree_entry_t *entries, size_t count,
     if (result != CGIT_OK) goto cleanup;
 
     size_t len =
-        snprintf(tmp, sizeof(tmp), "%u %s", entries[i].mode, entries[i].name);
+        snprintf(tmp, sizeof(tmp), "%o %s", entries[i].mode, entries[i].name);
 
     memcpy(tmp + len + 1, entry_byte_hash, CGIT_HASH_RAW_LEN);
 
     size_t total_len = len + 1 + CGIT_HASH_RAW_LEN;
 
     if (out->size > SIZE_MAX - total_len) {
-      fprintf(stderr, "error: serialize_tree: size overflow on entry '%s'\n",
-              entries[i].name);
+      cgit_report("error: serialize_tree: size overflow on entry '%s'\n",
+                  entries[i].name);
       result = CGIT_ERROR_MEMORY;
       goto cleanup;
     }
@@ -155,10 +169,10 @@ cgit_error_t serialize_tree(tree_entry_t *entries, size_t count,
 
       while (total_len > new_cap - out->size) {
         if (new_cap > SIZE_MAX / 2) {
-          fprintf(stderr,
-                  "error: serialize_tree: buffer too large to grow for entry "
-                  "'%s'\n",
-                  entries[i].name);
+          cgit_report(
+              "error: serialize_tree: buffer too large to grow for entry "
+              "'%s'\n",
+              entries[i].name);
           result = CGIT_ERROR_MEMORY;
           goto cleanup;
         }
@@ -167,10 +181,10 @@ cgit_error_t serialize_tree(tree_entry_t *entries, size_t count,
 
       unsigned char *tmp_buf = realloc(out->data, new_cap);
       if (!tmp_buf) {
-        fprintf(stderr,
-                "error: serialize_tree: realloc failed growing buffer to %zu "
-                "bytes\n",
-                new_cap);
+        cgit_report(
+            "error: serialize_tree: realloc failed growing buffer to %zu "
+            "bytes\n",
+            new_cap);
         result = CGIT_ERROR_MEMORY;
         goto cleanup;
       }
@@ -183,6 +197,7 @@ cgit_error_t serialize_tree(tree_entry_t *entries, size_t count,
     out->size += total_len;
   }
 
+  trace_end(TRACE_TREE_SERIALIZE, start, out->size);
   return result;
 
 cleanup:
@@ -190,256 +205,467 @@ cleanup:
   return result;
 }
 
-cgit_error_t write_tree_recursive(const char *path, tree_entry_t **entries_out,
-                                  size_t *count_out) {
+/* Tree entry mode and object type for a directory entry */
+cgit_error_t tree_entry_mode(const struct stat *st, unsigned int *mode_out,
+                             const char **type_out) {
+  switch (st->st_mode & S_IFMT) {
+    case S_IFDIR:
+      *mode_out = 040000;
+      *type_out = "tree";
+      return CGIT_OK;
+    case S_IFREG:
+      *mode_out = (st->st_mode & S_IXUSR) ? 0100755 : 0100644;
+      *type_out = "blob";
+      return CGIT_OK;
+    case S_IFLNK:
+      *mode_out = 0120000;
+      *type_out = "blob";
+      return CGIT_OK;
+    default:
+      cgit_report("invalid mode\n");
+      return CGIT_ERROR_INVALID_OBJECT;
+  }
+}
+
+/*
+ * Serialize and write one directory's tree, unless the index's cache-tree
+ * already has it: that takes every file and subtree below having matched
+ * the index (stats->unchanged) and the same file and subtree counts as
+ * before. Either way the hash is recorded for the next run. *reused_out,
+ * when given, says whether the cached hash was used.
+ */
+cgit_error_t write_tree_object(const char *path, index_state_t *index,
+                               tree_entry_t *entries, size_t count,
+                               const tree_stats_t *stats, char *hash_out,
+                               int *reused_out) {
   cgit_error_t result = CGIT_OK;
-  tree_entry_t *entries = NULL;
-  size_t count = 0;
-  int persist = 1;
   buffer_t buf = {0};
-  tree_entry_t *sub_entries = NULL;
-  size_t sub_count = 0;
 
-  DIR *dir = opendir(path);
-  if (!dir) {
-    fprintf(stderr, "failed to open directory\n");
-    result = CGIT_ERROR_FILE_NOT_FOUND;
-    goto cleanup;
+  int reused = index && stats->unchanged &&
+               index_cached_tree(index, path, stats->files, stats->subtrees,
+                                 hash_out);
+
+  if (reused) trace_count(TRACE_CACHE_TREE_HITS, 1);
+
+  if (!reused) {
+    result = serialize_tree(entries, count, &buf);
+    if (result != CGIT_OK) goto cleanup;
+
+    result = write_object(buf.data, buf.size, "tree", hash_out, 1);
+    if (result != CGIT_OK) goto cleanup;
   }
 
-  struct dirent *dir_entry;
-  while ((dir_entry = readdir(dir)) != NULL) {
-    if (strcmp(dir_entry->d_name, ".cgit") == 0 ||
-        strcmp(dir_entry->d_name, ".") == 0 ||
-        strcmp(dir_entry->d_name, "..") == 0)
-      continue;
+  if (index) {
+    result = index_record_tree(index, path, stats->files, stats->subtrees,
+                               hash_out);
+    if (result != CGIT_OK) goto cleanup;
+  }
 
-    char sub_path[CGIT_MAX_PATH_LENGTH];
-    snprintf(sub_path, sizeof(sub_path), "%s/%s", path, dir_entry->d_name);
+  if (reused_out) *reused_out = reused;
 
-    struct stat st;
-    if (stat(sub_path, &st)) goto cleanup;
-    unsigned int mode;
-    char *type;
-
-    switch (st.st_mode & S_IFMT) {
-      case S_IFDIR:
-        mode = 40000;
-        type = "tree";
-        break;
-      case S_IFREG:
-        mode = (st.st_mode & S_IXUSR) ? 100755 : 100644;
-        type = "blob";
-        break;
-      case S_IFLNK:
-        type = "blob";
-        mode = 120000;
-        break;
-      default:
-        fprintf(stderr, "invalid mode\n");
-        result = CGIT_ERROR_INVALID_OBJECT;
-        goto cleanup;
-    }
+cleanup:
+  buffer_free(&buf);
+  return result;
+}
 
-    tree_entry_t *tmp = realloc(entries, (count + 1) * sizeof(tree_entry_t));
-    if (!tmp) {
-      result = CGIT_ERROR_MEMORY;
-      goto cleanup;
-    }
-    entries = tmp;
-    tree_entry_t *entry = &entries[count];
+/* Double the entry array in the arena once it is full */
+static cgit_error_t reserve_entry(arena_t *arena, tree_entry_t **entries,
+                                  size_t count, size_t *capacity) {
+  if (count < *capacity) return CGIT_OK;
 
-    entry->type = strdup(type);
-    if (!entry->type) {
-      result = CGIT_ERROR_MEMORY;
-      goto cleanup;
-    }
-    entry->mode = mode;
-    entry->name = malloc(strlen(dir_entry->d_name) + 1);
+  size_t new_cap = *capacity ? *capacity * 2 : 16;
+  tree_entry_t *tmp = arena_grow(arena, *entries, *capacity * sizeof(*tmp),
+                                 new_cap * sizeof(*tmp));
+  if (!tmp) return CGIT_ERROR_MEMORY;
 
-    if (!entry->name) {
-      free(entry->type);
-      result = CGIT_ERROR_MEMORY;
-      goto cleanup;
-    }
+  *entries = tmp;
+  *capacity = new_cap;
+  return CGIT_OK;
+}
 
-    memcpy(entry->name, dir_entry->d_name, strlen(dir_entry->d_name));
-    entry->name[strlen(dir_entry->d_name)] = '\0';
+/* Small files queued for one write_objects_from_files call */
+typedef struct {
+  size_t entry[CGIT_HASH_BATCH_SIZE];
+  struct stat st[CGIT_HASH_BATCH_SIZE];
+  size_t count;
+} blob_batch_t;
+
+/* The walk path of the directory being written, grown as the walk descends */
+typedef struct {
+  char *data;
+  size_t len;
+  size_t capacity;
+} walk_path_t;
+
+/* Append "/name"; path_pop with the returned length takes it off again */
+static cgit_error_t path_push(walk_path_t *path, const char *name,
+                              size_t *len_out) {
+  size_t name_len = strlen(name);
+  size_t needed = path->len + 1 + name_len + 1;
+
+  if (needed > path->capacity) {
+    size_t new_cap = path->capacity;
+    while (new_cap < needed) new_cap *= 2;
+    char *tmp = realloc(path->data, new_cap);
+    if (!tmp) return CGIT_ERROR_MEMORY;
+    path->data = tmp;
+    path->capacity = new_cap;
+  }
 
-    if (strcmp(entry->type, "blob") == 0) {
-      result = read_file(sub_path, &buf);
-      if (result != CGIT_OK) {
-        fprintf(stderr, "Failed to read file '%s'\n", sub_path);
-        goto cleanup;
-      }
+  *len_out = path->len;
+  path->data[path->len] = '/';
+  memcpy(path->data + path->len + 1, name, name_len + 1);
+  path->len += 1 + name_len;
+  return CGIT_OK;
+}
 
-      result = write_object(buf.data, buf.size, type, entry->hash, persist);
-      if (result != CGIT_OK) {
-        fprintf(stderr, "Failed to create the object\n");
-        goto cleanup;
-      }
-    } else if (strcmp(entry->type, "tree") == 0) {
-      result = write_tree_recursive(sub_path, &sub_entries, &sub_count);
-      if (result != CGIT_OK) goto cleanup;
+static void path_pop(walk_path_t *path, size_t len) {
+  path->len = len;
+  path->data[len] = '\0';
+}
 
-      result = serialize_tree(sub_entries, sub_count, &buf);
-      if (result != CGIT_OK) goto cleanup;
+/* index_record for entry name of the directory at path */
+static cgit_error_t record_entry(index_state_t *index, walk_path_t *path,
+                                 const tree_entry_t *entry,
+                                 const struct stat *st) {
+  size_t dir_len;
+  cgit_error_t result = path_push(path, entry->name, &dir_len);
+  if (result != CGIT_OK) return result;
 
-      result = write_object(buf.data, buf.size, "tree", entry->hash, persist);
-      if (result != CGIT_OK) goto cleanup;
+  result = index_record(index, path->data, st, entry->mode, entry->hash);
+  path_pop(path, dir_len);
+  return result;
+}
 
-      free_tree_entries(sub_entries, sub_count);
-      sub_entries = NULL;
-      sub_count = 0;
-    }
+static cgit_error_t flush_blob_batch(int dir_fd, walk_path_t *path,
+                                     tree_entry_t *entries,
+                                     blob_batch_t *batch,
+                                     index_state_t *index) {
+  cgit_error_t result = CGIT_OK;
+  const char *names[CGIT_HASH_BATCH_SIZE];
+  char *hashes[CGIT_HASH_BATCH_SIZE];
 
-    buffer_free(&buf);
-    count++;
+  for (size_t i = 0; i < batch->count; i++) {
+    tree_entry_t *entry = &entries[batch->entry[i]];
+    names[i] = entry->name;
+    hashes[i] = entry->hash;
   }
 
-  *entries_out = entries;
-  *count_out = count;
+  result = write_objects_from_files(dir_fd, names, batch->count, "blob",
+                                    hashes, 1);
+  if (result != CGIT_OK) {
+    cgit_report("Failed to create the objects for '%s'\n", path->data);
+    goto cleanup;
+  }
 
-  closedir(dir);
-  return result;
+  for (size_t i = 0; index && i < batch->count; i++) {
+    result = record_entry(index, path, &entries[batch->entry[i]],
+                          &batch->st[i]);
+    if (result != CGIT_OK) goto cleanup;
+  }
 
 cleanup:
-  buffer_free(&buf);
-  free_tree_entries(sub_entries, sub_count);
-  free_tree_entries(entries, count);
-  if (dir) closedir(dir);
+  batch->count = 0;
   return result;
 }
 
-static const char *type_from_mode(unsigned int mode) {
-  switch (mode) {
-    case 0100644:
-    case 0100755:
-    case 0120000:
-      return "blob";
-    case 040000:
-      return "tree";
-    default:
-      return NULL;
-  }
+static cgit_error_t stat_entry(int dir_fd, const walk_path_t *path,
+                               const char *name, struct stat *st) {
+  uint64_t start = trace_begin();
+  int ret = fstatat(dir_fd, name, st, AT_SYMLINK_NOFOLLOW);
+  trace_end(TRACE_WALK, start, 0);
+  trace_count(TRACE_SYSCALLS, 1);
+  if (ret == 0) return CGIT_OK;
+
+  cgit_report("stat: %s/%s: %s\n", path->data, name, strerror(errno));
+  return CGIT_ERROR_IO;
 }
 
-cgit_error_t parse_tree(const unsigned char *data, size_t len,
-                        tree_entry_t **entries_out, size_t *count_out) {
+/*
+ * write_tree_recursive for the open directory dir_fd, whose walk path is
+ * path. Entries are read with dir_iter and stat'ed with fstatat relative
+ * to dir_fd, so no syscall resolves more than one name. A d_type of DT_DIR
+ * is trusted as is; every other entry needs its lstat data for the index
+ * and the executable bit anyway. Symlinks are never followed: their blob
+ * is the link text.
+ *
+ * ignore holds the .cgitignore files of the directories above, and this
+ * directory's own is pushed on top. An ignored entry is dropped before it
+ * is stat'ed whenever d_type allows it, and an ignored directory is never
+ * opened.
+ */
+static cgit_error_t write_tree_at(arena_t *arena, int dir_fd,
+                                  walk_path_t *path, index_state_t *index,
+                                  const ignore_stack_t *ignore,
+                                  tree_entry_t **entries_out,
+                                  size_t *count_out, tree_stats_t *stats_out) {
   cgit_error_t result = CGIT_OK;
   tree_entry_t *entries = NULL;
   size_t count = 0;
-  size_t i = 0;
+  size_t capacity = 0;
+  int persist = 1;
+  tree_stats_t stats = {.unchanged = 1};
+  blob_batch_t batch = {0};
+  ignore_list_t *ignore_list = NULL;
+  ignore_stack_t ignore_frame;
+  dir_iter_t *it = NULL;
 
-  while (i < len) {
-    /* Parse mode: read until space */
-    size_t mode_start = i;
-    while (i < len && data[i] != ' ') i++;
+  result = ignore_load_at(dir_fd, path->data, &ignore_list);
+  if (result != CGIT_OK) return result;
+  if (ignore_list) {
+    ignore_frame = (ignore_stack_t){ignore_list, path->len, ignore};
+    ignore = &ignore_frame;
+  }
 
-    if (i >= len) {
-      fprintf(stderr, "error: invalid tree content\n");
-      result = CGIT_ERROR_INVALID_OBJECT;
-      goto cleanup;
+  /* Off the stack: the iterator's buffer is not needed while recursing */
+  it = malloc(sizeof(*it));
+  if (!it) {
+    result = CGIT_ERROR_MEMORY;
+    goto cleanup;
+  }
+  result = dir_iter_init(it, dir_fd, path->data);
+  if (result != CGIT_OK) {
+    free(it);
+    it = NULL;
+    goto cleanup;
+  }
+
+  dir_iter_entry_t dir_entry;
+  while (dir_iter_next(it, &dir_entry)) {
+    if (strcmp(dir_entry.name, CGIT_DIR) == 0) continue;
+
+    struct stat st = {.st_mode = S_IFDIR};
+    int need_stat = dir_entry.type != DT_DIR;
+    if (dir_entry.type == DT_UNKNOWN) {
+      result = stat_entry(dir_fd, path, dir_entry.name, &st);
+      if (result != CGIT_OK) goto cleanup;
+      need_stat = 0;
     }
 
-    char mode_str[CGIT_MAX_MODE_LEN];
-    size_t mode_len = i - mode_start;
-    if (mode_len >= sizeof(mode_str)) {
-      fprintf(stderr, "error: invalid tree content\n");
-      result = CGIT_ERROR_INVALID_OBJECT;
-      goto cleanup;
+    if (ignore) {
+      size_t dir_len;
+      result = path_push(path, dir_entry.name, &dir_len);
+      if (result != CGIT_OK) goto cleanup;
+      int ignored = ignore_match(ignore, path->data, dir_len + 1,
+                                 !need_stat && S_ISDIR(st.st_mode));
+      path_pop(path, dir_len);
+      if (ignored) continue;
     }
-    memcpy(mode_str, data + mode_start, mode_len);
-    mode_str[mode_len] = '\0';
 
-    char *endptr;
-    unsigned int mode = (unsigned int)strtol(mode_str, &endptr, 8);
-    if (*endptr != '\0') {
-      fprintf(stderr, "error: invalid mode in tree entry\n");
-      result = CGIT_ERROR_INVALID_OBJECT;
-      goto cleanup;
+    if (need_stat) {
+      result = stat_entry(dir_fd, path, dir_entry.name, &st);
+      if (result != CGIT_OK) goto cleanup;
     }
 
-    const char *type = type_from_mode(mode);
-    if (!type) {
-      fprintf(stderr, "fatal: invalid mode %o\n", mode);
-      result = CGIT_ERROR_INVALID_OBJECT;
+    unsigned int mode;
+    const char *type;
+    result = tree_entry_mode(&st, &mode, &type);
+    if (result != CGIT_OK) goto cleanup;
+
+    result = reserve_entry(arena, &entries, count, &capacity);
+    if (result != CGIT_OK) goto cleanup;
+
+    tree_entry_t *entry = &entries[count];
+    entry->mode = mode;
+    entry->type = type;
+    entry->name =
+        arena_strndup(arena, dir_entry.name, strlen(dir_entry.name));
+    if (!entry->name) {
+      result = CGIT_ERROR_MEMORY;
       goto cleanup;
     }
+    count++;
 
-    i++; /* skip space */
+    if (strcmp(type, "blob") != 0) continue;
 
-    /* Parse name: read until null terminator */
-    size_t name_start = i;
-    while (i < len && data[i] != '\0') i++;
+    stats.files++;
 
-    if (i >= len) {
-      fprintf(stderr, "error: invalid tree content\n");
-      result = CGIT_ERROR_INVALID_OBJECT;
-      goto cleanup;
+    if (index) {
+      size_t dir_len;
+      result = path_push(path, entry->name, &dir_len);
+      if (result != CGIT_OK) goto cleanup;
+      int hit = index_lookup(index, path->data, &st, mode, entry->hash);
+      if (hit) {
+        trace_count(TRACE_STAT_CACHE_HITS, 1);
+        result = index_record(index, path->data, &st, mode, entry->hash);
+      }
+      path_pop(path, dir_len);
+      if (result != CGIT_OK) goto cleanup;
+      if (hit) continue;
     }
 
-    size_t name_len = i - name_start;
-    i++; /* skip null terminator */
+    stats.unchanged = 0;
+    if (S_ISREG(st.st_mode) && (size_t)st.st_size <= CGIT_HASH_BATCH_MAX_BLOB) {
+      batch.entry[batch.count] = count - 1;
+      batch.st[batch.count++] = st;
+      if (batch.count == CGIT_HASH_BATCH_SIZE) {
+        result = flush_blob_batch(dir_fd, path, entries, &batch, index);
+        if (result != CGIT_OK) goto cleanup;
+      }
+      continue;
+    }
 
-    /* Parse raw SHA1 hash */
-    if (i + CGIT_HASH_RAW_LEN > len) {
-      fprintf(stderr, "error: invalid tree content\n");
-      result = CGIT_ERROR_INVALID_OBJECT;
+    result = S_ISLNK(st.st_mode)
+                 ? write_object_from_link(dir_fd, entry->name,
+                                          (size_t)st.st_size, entry->hash,
+                                          persist)
+                 : write_object_from_file_at(dir_fd, entry->name, type,
+                                             entry->hash, persist);
+    if (result != CGIT_OK) {
+      cgit_report("Failed to create the object for '%s/%s'\n", path->data,
+                  entry->name);
       goto cleanup;
     }
 
-    /* Grow entries array */
-    tree_entry_t *tmp = realloc(entries, (count + 1) * sizeof(tree_entry_t));
-    if (!tmp) {
-      result = CGIT_ERROR_MEMORY;
-      goto cleanup;
+    if (index) {
+      result = record_entry(index, path, entry, &st);
+      if (result != CGIT_OK) goto cleanup;
     }
-    entries = tmp;
+  }
 
-    /* Populate entry */
-    tree_entry_t *entry = &entries[count];
-    entry->mode = mode;
+  result = it->error;
+  dir_iter_release(it);
+  free(it);
+  it = NULL;
+  if (result != CGIT_OK) goto cleanup;
 
-    entry->type = strdup(type);
-    if (!entry->type) {
-      result = CGIT_ERROR_MEMORY;
-      goto cleanup;
-    }
+  if (batch.count) {
+    result = flush_blob_batch(dir_fd, path, entries, &batch, index);
+    if (result != CGIT_OK) goto cleanup;
+  }
 
-    entry->name = malloc(name_len + 1);
-    if (!entry->name) {
-      free(entry->type);
-      result = CGIT_ERROR_MEMORY;
+  for (size_t i = 0; i < count; i++) {
+    tree_entry_t *entry = &entries[i];
+    if (strcmp(entry->type, "tree") != 0) continue;
+
+    tree_entry_t *sub_entries = NULL;
+    size_t sub_count = 0;
+    tree_stats_t sub_stats;
+    int reused;
+    size_t dir_len;
+    arena_mark_t mark = arena_mark(arena);
+
+    int sub_fd = dir_open_at(dir_fd, entry->name);
+    if (sub_fd < 0) {
+      cgit_report("error: cannot open directory '%s/%s': %s\n", path->data,
+                  entry->name, strerror(errno));
+      result = CGIT_ERROR_FILE_NOT_FOUND;
       goto cleanup;
     }
-    memcpy(entry->name, data + name_start, name_len);
-    entry->name[name_len] = '\0';
 
-    for (size_t j = 0; j < CGIT_HASH_RAW_LEN; j++) {
-      sprintf(entry->hash + 2 * j, "%02x", data[i + j]);
+    result = path_push(path, entry->name, &dir_len);
+    if (result == CGIT_OK) {
+      result = write_tree_at(arena, sub_fd, path, index, ignore, &sub_entries,
+                             &sub_count, &sub_stats);
+      if (result == CGIT_OK)
+        result = write_tree_object(path->data, index, sub_entries, sub_count,
+                                   &sub_stats, entry->hash, &reused);
+      path_pop(path, dir_len);
     }
-    entry->hash[CGIT_HASH_HEX_LEN] = '\0';
+    close(sub_fd);
+    arena_rewind(arena, mark);
+    if (result != CGIT_OK) goto cleanup;
 
-    i += CGIT_HASH_RAW_LEN;
-    count++;
+    stats.files += sub_stats.files;
+    stats.subtrees++;
+    if (!reused) stats.unchanged = 0;
   }
 
   *entries_out = entries;
   *count_out = count;
-  return CGIT_OK;
+  *stats_out = stats;
 
 cleanup:
-  free_tree_entries(entries, count);
+  if (it) {
+    dir_iter_release(it);
+    free(it);
+  }
+  ignore_free(ignore_list);
   return result;
 }
 
-void free_tree_entries(tree_entry_t *entries, size_t count) {
-  for (size_t i = 0; i < count; i++) {
-    free(entries[i].type);
-    free(entries[i].name);
+/*
+ * index may be NULL. When given, files whose stat data match their index
+ * entry reuse its hash, unchanged subtrees reuse their cached tree, and
+ * everything seen is recorded for index_commit. stats_out describes the
+ * directory for write_tree_object.
+ *
+ * The entries and their names are allocated from arena. Subdirectories are
+ * walked only after this directory's entries are complete, so everything
+ * a subtree allocates can be rewound as soon as its tree is written.
+ *
+ * Small files that need hashing are queued and written in batches, so
+ * hash_batch can work on several of them at once.
+ *
+ * The walk holds one directory fd per level and builds walk paths only for
+ * the index, .cgitignore and messages, so there is no limit on depth or
+ * path length. Entries that a .cgitignore matches are left out.
+ */
+cgit_error_t write_tree_recursive(arena_t *arena, const char *path,
+                                  index_state_t *index,
+                                  tree_entry_t **entries_out,
+                                  size_t *count_out, tree_stats_t *stats_out) {
+  walk_path_t walk = {.len = strlen(path)};
+  walk.capacity = walk.len + CGIT_MAX_PATH_LENGTH;
+  walk.data = malloc(walk.capacity);
+  if (!walk.data) return CGIT_ERROR_MEMORY;
+  memcpy(walk.data, path, walk.len + 1);
+
+  int fd = dir_open_at(AT_FDCWD, path);
+  if (fd < 0) {
+    cgit_report("error: cannot open directory '%s': %s\n", path,
+                strerror(errno));
+    free(walk.data);
+    return CGIT_ERROR_FILE_NOT_FOUND;
   }
-  free(entries);
+
+  cgit_error_t result = write_tree_at(arena, fd, &walk, index, NULL,
+                                      entries_out, count_out, stats_out);
+  close(fd);
+  free(walk.data);
+  return result;
+}
+
+/*
+ * Owned, hex-encoded entries from tree_iter_next. The entries and their
+ * names are allocated from arena.
+ */
+cgit_error_t parse_tree(arena_t *arena, const unsigned char *data, size_t len,
+                        tree_entry_t **entries_out, size_t *count_out) {
+  cgit_error_t result = CGIT_OK;
+  tree_entry_t *entries = NULL;
+  size_t count = 0;
+  size_t capacity = 0;
+  tree_iter_t it;
+  tree_iter_entry_t view;
+  uint64_t start = trace_begin();
+
+  tree_iter_init(&it, data, len);
+  while (tree_iter_next(&it, &view)) {
+    result = reserve_entry(arena, &entries, count, &capacity);
+    if (result != CGIT_OK) goto cleanup;
+
+    tree_entry_t *entry = &entries[count];
+    entry->mode = view.mode;
+    entry->type = object_type_name(view.type);
+    entry->name = arena_strndup(arena, view.name, view.name_len);
+    if (!entry->name) {
+      result = CGIT_ERROR_MEMORY;
+      goto cleanup;
+    }
+    bytes_to_hex_hash(view.id, entry->hash);
+    count++;
+  }
+
+  result = it.error;
+  if (result != CGIT_OK) goto cleanup;
+
+  *entries_out = entries;
+  *count_out = count;
+
+cleanup:
+  trace_end(TRACE_TREE_PARSE, start, len);
+  return result;
 }
 
 cgit_error_t object_exists(const char *hash) {
@@ -449,14 +675,99 @@ cgit_error_t object_exists(const char *hash) {
   result = is_valid_hash(hash);
   if (result != CGIT_OK) return result;
 
+  /* The pack index answers from memory; only a miss costs a syscall */
+  if (packed_object_exists(hash) == CGIT_OK) return CGIT_OK;
+
   result = build_object_path(hash, path, CGIT_MAX_PATH_LENGTH);
   if (result != CGIT_OK) return result;
 
-  if (access(path, F_OK) != 0) return CGIT_ERROR_FILE_NOT_FOUND;
+  /* Missing from both: a repack may have moved it into a new pack */
+  if (access(path, F_OK) != 0)
+    return packs_reprepare() ? object_exists(hash) : CGIT_ERROR_FILE_NOT_FOUND;
 
   return CGIT_OK;
 }
 
+/*
+ * Type and size of an object without inflating its payload. Loose objects
+ * are inflated only until the NUL that ends "<type> <size>"; packed ones
+ * answer from their entry header (or a delta's size prefix). A missing
+ * object is returned as CGIT_ERROR_FILE_NOT_FOUND without a message.
+ */
+cgit_error_t read_object_header(const char *hash, char *type, size_t type_len,
+                                size_t *size_out) {
+  char path[CGIT_MAX_PATH_LENGTH];
+  unsigned char in[CGIT_HEADER_READ_SIZE];
+  unsigned char hdr[CGIT_MAX_HEADER_LEN];
+  cgit_error_t result = CGIT_OK;
+  int strm_initialized = 0;
+  int fd = -1;
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+
+  result = is_valid_hash(hash);
+  if (result != CGIT_OK) return result;
+
+  object_type_t packed_type;
+  result = read_packed_object_header(hash, &packed_type, size_out);
+  if (result == CGIT_OK) {
+    const char *name = object_type_name(packed_type);
+    if (!name || strlen(name) + 1 > type_len) return CGIT_ERROR_INVALID_OBJECT;
+    memcpy(type, name, strlen(name) + 1);
+    return CGIT_OK;
+  }
+  if (result != CGIT_ERROR_FILE_NOT_FOUND) return result;
+
+  result = build_object_path(hash, path, CGIT_MAX_PATH_LENGTH);
+  if (result != CGIT_OK) return result;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    if (errno != ENOENT) {
+      cgit_report("error: cannot open '%s': %s\n", path, strerror(errno));
+      return CGIT_ERROR_IO;
+    }
+    if (packs_reprepare())
+      return read_object_header(hash, type, type_len, size_out);
+    return CGIT_ERROR_FILE_NOT_FOUND;
+  }
+
+  if (inflateInit(&strm) != Z_OK) {
+    cgit_report("error: inflateInit failed\n");
+    result = CGIT_ERROR_COMPRESSION;
+    goto cleanup;
+  }
+  strm_initialized = 1;
+  strm.next_out = hdr;
+  strm.avail_out = sizeof(hdr);
+
+  for (;;) {
+    if (strm.avail_in == 0) {
+      ssize_t n = read_some(fd, in, sizeof(in));
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) break;
+      strm.next_in = in;
+      strm.avail_in = (uInt)n;
+    }
+
+    uint64_t start = trace_begin();
+    int zret = inflate(&strm, Z_NO_FLUSH);
+    trace_end(TRACE_INFLATE, start, (size_t)(strm.next_out - hdr));
+    if (memchr(hdr, '\0', (size_t)(strm.next_out - hdr))) break;
+    if (zret != Z_OK || strm.avail_out == 0) break;
+  }
+
+  /* parse_object_header reports a header that never reached its NUL */
+  size_t payload_offset;
+  result = parse_object_header(hdr, (size_t)(strm.next_out - hdr), type,
+                               type_len, size_out, &payload_offset);
+
+cleanup:
+  if (strm_initialized) inflateEnd(&strm);
+  close(fd);
+  return result;
+}
+
 cgit_error_t read_object(const char *hash, git_object_t *obj) {
   char path[CGIT_MAX_PATH_LENGTH];
   cgit_error_t result = CGIT_OK;
@@ -468,11 +779,21 @@ cgit_error_t read_object(const char *hash, git_object_t *obj) {
     goto cleanup;
   }
 
+  /* Packs first: an index lookup is cheaper than a failed open() */
+  result = read_packed_object(hash, obj);
+  if (result != CGIT_ERROR_FILE_NOT_FOUND) goto cleanup;
+
   result = build_object_path(hash, path, CGIT_MAX_PATH_LENGTH);
   if (result != CGIT_OK) {
     goto cleanup;
   }
 
+  /* Missing from both: a repack may have moved it into a new pack */
+  if (access(path, F_OK) != 0 && errno == ENOENT && packs_reprepare()) {
+    result = read_object(hash, obj);
+    goto cleanup;
+  }
+
   result = read_file(path, &buf);
   if (result != CGIT_OK) {
     goto cleanup;
@@ -498,7 +819,7 @@ cgit_error_t read_object(const char *hash, git_object_t *obj) {
   /* Validate payload size matches header */
   size_t payload_len = out_buf.size - payload_offset;
   if (payload_len != content_size) {
-    fprintf(stderr, "error: invalid object (size mismatch)\n");
+    cgit_report("error: invalid object (size mismatch)\n");
     result = CGIT_ERROR_INVALID_OBJECT;
     goto cleanup;
   }
@@ -521,18 +842,117 @@ cgit_error_t read_object(const char *hash, git_object_t *obj) {
   obj->data[payload_len] = '\0';
 
 cleanup:
+  if (result == CGIT_OK) trace_count(TRACE_OBJECTS_READ, 1);
   buffer_free(&buf);
   buffer_free(&out_buf);
   return result;
 }
 
+/* write() until all of data is out, retrying on EINTR */
+static cgit_error_t write_all(int fd, const unsigned char *data, size_t len) {
+  while (len > 0) {
+    uint64_t start = trace_begin();
+    ssize_t n = write(fd, data, len);
+    trace_end(TRACE_WRITE, start, n > 0 ? (size_t)n : 0);
+    trace_count(TRACE_SYSCALLS, 1);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      cgit_report("error: write failed: %s\n", strerror(errno));
+      return CGIT_ERROR_IO;
+    }
+    data += n;
+    len -= (size_t)n;
+  }
+  return CGIT_OK;
+}
+
+/*
+ * repo->known_objects holds ids known to be in the object store: written
+ * or found by this process, or vouched for by the index. A hit skips both
+ * the existence check and the compression. Shared by write-tree's worker
+ * threads.
+ */
+void object_mark_known(const unsigned char *id) {
+  cgit_repo_t *repo = repo_current();
+
+  pthread_mutex_lock(&repo->known_lock);
+  /* Only a cache: a failed insert costs a later stat, nothing more */
+  oid_set_insert(&repo->known_objects, id);
+  pthread_mutex_unlock(&repo->known_lock);
+}
+
+/*
+ * Whether hash is already stored, cheapest answer first: the known set,
+ * then the pack indexes in memory, then one stat for a loose object.
+ */
+static int object_present(const char *hash) {
+  cgit_repo_t *repo = repo_current();
+  unsigned char id[CGIT_HASH_RAW_LEN];
+  char path[CGIT_MAX_PATH_LENGTH];
+  struct stat st;
+
+  if (hex_to_bytes_hash((const unsigned char *)hash, (char *)id) != CGIT_OK)
+    return 0;
+
+  pthread_mutex_lock(&repo->known_lock);
+  int known = oid_set_contains(&repo->known_objects, id);
+  pthread_mutex_unlock(&repo->known_lock);
+  if (known) {
+    trace_count(TRACE_KNOWN_OBJECT_HITS, 1);
+    return 1;
+  }
+
+  if (packed_object_exists(hash) != CGIT_OK &&
+      (build_object_path(hash, path, sizeof(path)) != CGIT_OK ||
+       stat(path, &st) != 0))
+    return 0;
+
+  object_mark_known(id);
+  return 1;
+}
+
+/* Deflate and store a serialized object (header and payload) as hash */
+static cgit_error_t store_object(const unsigned char *data, size_t len,
+                                 const char *hash) {
+  cgit_error_t result = CGIT_OK;
+  buffer_t output_buf = {0};
+  char tmp_path[CGIT_MAX_PATH_LENGTH];
+  unsigned char id[CGIT_HASH_RAW_LEN];
+  int fd = -1;
+
+  /* Before compressing: rewriting stored content costs only its hash */
+  if (object_present(hash)) return CGIT_OK;
+
+  result = compress_data(data, len, &output_buf);
+  if (result != CGIT_OK) goto cleanup;
+
+  /* Never write the final path directly: a crash would leave it torn */
+  result = object_file_create(hash, tmp_path, sizeof(tmp_path), &fd);
+  if (result != CGIT_OK) goto cleanup;
+
+  result = write_all(fd, output_buf.data, output_buf.size);
+  if (result != CGIT_OK) {
+    close(fd);
+    unlink(tmp_path);
+    goto cleanup;
+  }
+
+  result = object_file_commit(fd, tmp_path, hash);
+  if (result != CGIT_OK) goto cleanup;
+
+  hex_to_bytes_hash((const unsigned char *)hash, (char *)id);
+  object_mark_known(id);
+  trace_count(TRACE_OBJECTS_WRITTEN, 1);
+
+cleanup:
+  buffer_free(&output_buf);
+  return result;
+}
+
 cgit_error_t write_object(const unsigned char *data, size_t len,
                           const char *type, char *hash_out, int persist) {
   cgit_error_t result = CGIT_OK;
   buffer_t header = {0};
-  buffer_t output_buf = {0};
-  char path[CGIT_MAX_PATH_LENGTH];
-  FILE *file = NULL;
 
   result = build_object_header(data, len, type, &header);
   if (result != CGIT_OK) goto cleanup;
@@ -541,47 +961,594 @@ cgit_error_t write_object(const unsigned char *data, size_t len,
   if (result != CGIT_OK) goto cleanup;
   if (!persist) goto cleanup;
 
-  /* if persistance, compression, path, writing */
-  result = compress_data(header.data, header.size, &output_buf);
-  if (result != CGIT_OK) goto cleanup;
+  result = store_object(header.data, header.size, hash_out);
 
-  result = build_object_path(hash_out, path, sizeof(path));
+cleanup:
+  buffer_free(&header);
+  return result;
+}
+
+cgit_error_t sink_to_file(const unsigned char *data, size_t len, void *file) {
+  if (fwrite(data, 1, len, file) != len) {
+    cgit_report("error: write failed: %s\n", strerror(errno));
+    return CGIT_ERROR_IO;
+  }
+  return CGIT_OK;
+}
+
+cgit_error_t sink_to_fd(const unsigned char *data, size_t len, void *fd) {
+  return write_all(*(int *)fd, data, len);
+}
+
+cgit_error_t sink_to_buffer(const unsigned char *data, size_t len,
+                            void *buf) {
+  buffer_t *out = buf;
+
+  if (out->size + len + 1 > out->capacity) {
+    size_t new_cap = out->capacity ? out->capacity : CGIT_READ_BUFFER_SIZE;
+    while (new_cap < out->size + len + 1) new_cap *= 2;
+
+    unsigned char *tmp = realloc(out->data, new_cap);
+    if (!tmp) {
+      cgit_report("error: out of memory\n");
+      return CGIT_ERROR_MEMORY;
+    }
+    out->data = tmp;
+    out->capacity = new_cap;
+  }
+
+  memcpy(out->data + out->size, data, len);
+  out->size += len;
+  out->data[out->size] = '\0';
+  return CGIT_OK;
+}
+
+/*
+ * Inflates a loose object CGIT_COMPRESSION_BUFFER_SIZE bytes at a time and
+ * hands the payload to sink as it goes, so memory use does not depend on
+ * the object size. The header is validated as soon as its NUL shows up;
+ * the size only at the end, after the sink has already seen the bytes.
+ * Packed objects go through stream_packed_object.
+ */
+cgit_error_t read_object_stream(const char *hash, char *type, size_t type_len,
+                                size_t *size_out, object_sink_fn sink,
+                                void *sink_data) {
+  char path[CGIT_MAX_PATH_LENGTH];
+  unsigned char in[CGIT_COMPRESSION_BUFFER_SIZE];
+  unsigned char out[CGIT_COMPRESSION_BUFFER_SIZE];
+  cgit_error_t result = CGIT_OK;
+  int strm_initialized = 0;
+  int fd = -1;
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+
+  result = is_valid_hash(hash);
+  if (result != CGIT_OK) return result;
+
+  object_type_t packed_type;
+  result = stream_packed_object(hash, &packed_type, size_out, sink, sink_data);
+  if (result == CGIT_OK) {
+    const char *name = object_type_name(packed_type);
+    if (!name || strlen(name) + 1 > type_len) return CGIT_ERROR_INVALID_OBJECT;
+    memcpy(type, name, strlen(name) + 1);
+    trace_count(TRACE_OBJECTS_READ, 1);
+    return CGIT_OK;
+  }
+  if (result != CGIT_ERROR_FILE_NOT_FOUND) return result;
+
+  result = build_object_path(hash, path, CGIT_MAX_PATH_LENGTH);
+  if (result != CGIT_OK) return result;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0 && errno == ENOENT && packs_reprepare())
+    return read_object_stream(hash, type, type_len, size_out, sink, sink_data);
+  if (fd < 0) {
+    cgit_report("error: cannot open '%s': %s\n", path, strerror(errno));
+    return errno == ENOENT ? CGIT_ERROR_FILE_NOT_FOUND : CGIT_ERROR_IO;
+  }
+
+  if (inflateInit(&strm) != Z_OK) {
+    cgit_report("error: inflateInit failed\n");
+    result = CGIT_ERROR_COMPRESSION;
+    goto cleanup;
+  }
+  strm_initialized = 1;
+
+  int header_done = 0;
+  int zret = Z_OK;
+  size_t content_size = 0;
+  size_t seen = 0;
+  strm.next_out = out;
+  strm.avail_out = sizeof(out);
+
+  while (zret != Z_STREAM_END) {
+    if (strm.avail_in == 0) {
+      ssize_t n = read_some(fd, in, sizeof(in));
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) {
+        cgit_report("error: read failed on '%s': %s\n", path, strerror(errno));
+        result = CGIT_ERROR_IO;
+        goto cleanup;
+      }
+      if (n == 0) break;
+      strm.next_in = in;
+      strm.avail_in = (uInt)n;
+    }
+
+    uint64_t started = trace_begin();
+    zret = inflate(&strm, Z_NO_FLUSH);
+    trace_end(TRACE_INFLATE, started, (size_t)(strm.next_out - out));
+    if (zret != Z_OK && zret != Z_STREAM_END) break;
+
+    size_t produced = (size_t)(strm.next_out - out);
+    size_t start = 0;
+
+    if (!header_done) {
+      /* Keep accumulating until the header's NUL has been inflated */
+      if (!memchr(out, '\0', produced) && produced < CGIT_MAX_HEADER_LEN &&
+          zret != Z_STREAM_END)
+        continue;
+
+      result = parse_object_header(out, produced, type, type_len,
+                                   &content_size, &start);
+      if (result != CGIT_OK) goto cleanup;
+      header_done = 1;
+    }
+
+    if (produced > start) {
+      seen += produced - start;
+      if (seen > content_size) break;
+
+      result = sink(out + start, produced - start, sink_data);
+      if (result != CGIT_OK) goto cleanup;
+    }
+
+    strm.next_out = out;
+    strm.avail_out = sizeof(out);
+  }
+
+  if (zret != Z_STREAM_END || !header_done || seen != content_size) {
+    cgit_report("error: invalid object %s (corrupt or size mismatch)\n", hash);
+    result = CGIT_ERROR_INVALID_OBJECT;
+    goto cleanup;
+  }
+
+  *size_out = content_size;
+  trace_count(TRACE_OBJECTS_READ, 1);
+
+cleanup:
+  if (strm_initialized) inflateEnd(&strm);
+  close(fd);
+  return result;
+}
+
+/* Deflate one input chunk (at most CGIT_COMPRESSION_BUFFER_SIZE) into fd */
+static cgit_error_t deflate_to_fd(z_stream *strm, const unsigned char *in,
+                                  size_t len, int flush, int fd) {
+  unsigned char out[CGIT_COMPRESSION_BUFFER_SIZE];
+  strm->next_in = (Bytef *)in;
+  strm->avail_in = (uInt)len;
+
+  do {
+    strm->next_out = out;
+    strm->avail_out = sizeof(out);
+
+    uint64_t start = trace_begin();
+    size_t avail = strm->avail_in;
+    int ret = deflate(strm, flush);
+    trace_end(TRACE_DEFLATE, start, avail - strm->avail_in);
+    if (ret == Z_STREAM_ERROR) {
+      cgit_report("compression error\n");
+      return CGIT_ERROR_COMPRESSION;
+    }
+
+    cgit_error_t result =
+        write_all(fd, out, sizeof(out) - (size_t)strm->avail_out);
+    if (result != CGIT_OK) return result;
+  } while (strm->avail_out == 0);
+
+  return CGIT_OK;
+}
+
+/*
+ * Start the deflate stream of a streamed object with its header. The level
+ * is chosen from the first chunk of contents, so the stream only starts
+ * once that chunk has been read.
+ */
+static cgit_error_t begin_deflate(z_stream *strm, int *initialized,
+                                  const unsigned char *head, size_t head_len,
+                                  const char *header, size_t header_len,
+                                  int fd) {
+  memset(strm, 0, sizeof(*strm));
+  if (deflateInit(strm, compression_level_for(head, head_len)) != Z_OK) {
+    cgit_report("compression error\n");
+    return CGIT_ERROR_COMPRESSION;
+  }
+  *initialized = 1;
+
+  return deflate_to_fd(strm, (const unsigned char *)header, header_len,
+                       Z_NO_FLUSH, fd);
+}
+
+/*
+ * Hash (and with persist, deflate) size bytes read from fd without holding
+ * more than one chunk of them. The id is only known once the last byte is
+ * in, so the compressed stream goes to a temporary file in the objects
+ * directory that is renamed into place at the end, or dropped when the
+ * object turns out to be stored already.
+ */
+static cgit_error_t stream_object(int fd, size_t size, const char *type,
+                                  char *hash_out, int persist) {
+  cgit_error_t result = CGIT_OK;
+  hash_ctx_t ctx = {0};
+  z_stream strm;
+  int strm_initialized = 0;
+  int tmp_fd = -1;
+  char tmp_path[CGIT_MAX_PATH_LENGTH];
+  unsigned char chunk[CGIT_COMPRESSION_BUFFER_SIZE];
+
+  char header[CGIT_MAX_TYPE_LEN + 32];
+  size_t header_len =
+      (size_t)snprintf(header, sizeof(header), "%s %zu", type, size) + 1;
+
+  result = hash_init(&ctx);
+  if (result != CGIT_OK) goto cleanup;
+  result = hash_update(&ctx, header, header_len);
   if (result != CGIT_OK) goto cleanup;
 
-  /* Skip if object already exists */
-  struct stat st;
-  if (stat(path, &st) == 0) goto cleanup;
+  if (persist) {
+    result = object_file_create(NULL, tmp_path, sizeof(tmp_path), &tmp_fd);
+    if (result != CGIT_OK) goto cleanup;
+  }
 
-  /* Create the object subdirectory (e.g. .cgit/objects/ab) */
-  char dir[sizeof(CGIT_OBJECTS_DIR) + 1 + CGIT_DIR_BUF_SIZE];
-  snprintf(dir, sizeof(dir), CGIT_OBJECTS_DIR "/%.2s", hash_out);
+  size_t total = 0;
+  for (;;) {
+    ssize_t n = read_some(fd, chunk, sizeof(chunk));
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      cgit_report("error: read failed: %s\n", strerror(errno));
+      result = CGIT_ERROR_IO;
+      goto cleanup;
+    }
+    if (n == 0) break;
+
+    total += (size_t)n;
+    if (total > size) break;
+
+    result = hash_update(&ctx, chunk, (size_t)n);
+    if (result != CGIT_OK) goto cleanup;
+
+    if (persist) {
+      if (!strm_initialized) {
+        result = begin_deflate(&strm, &strm_initialized, chunk, (size_t)n,
+                               header, header_len, tmp_fd);
+        if (result != CGIT_OK) goto cleanup;
+      }
+      result = deflate_to_fd(&strm, chunk, (size_t)n, Z_NO_FLUSH, tmp_fd);
+      if (result != CGIT_OK) goto cleanup;
+    }
+  }
 
-  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
-    fprintf(stderr, "error: cannot create directory '%s': %s\n", dir,
-            strerror(errno));
+  /* The header already promised size bytes */
+  if (total != size) {
+    cgit_report("error: file changed size while being hashed\n");
     result = CGIT_ERROR_IO;
     goto cleanup;
   }
 
-  /* Write compressed object to disk */
-  file = fopen(path, "wb");
-  if (!file) {
-    fprintf(stderr, "error: cannot open '%s': %s\n", path, strerror(errno));
+  unsigned char raw[CGIT_HASH_RAW_LEN];
+  result = hash_final(&ctx, raw);
+  if (result != CGIT_OK) goto cleanup;
+  bytes_to_hex_hash(raw, hash_out);
+
+  if (!persist) goto cleanup;
+  /* Already stored: cleanup drops the temporary copy */
+  if (object_present(hash_out)) goto cleanup;
+
+  if (!strm_initialized) {
+    result = begin_deflate(&strm, &strm_initialized, NULL, 0, header,
+                           header_len, tmp_fd);
+    if (result != CGIT_OK) goto cleanup;
+  }
+  result = deflate_to_fd(&strm, NULL, 0, Z_FINISH, tmp_fd);
+  if (result != CGIT_OK) goto cleanup;
+
+  /* Closes tmp_fd and cleans up after itself either way */
+  result = object_file_commit(tmp_fd, tmp_path, hash_out);
+  tmp_fd = -1;
+  if (result == CGIT_OK) trace_count(TRACE_OBJECTS_WRITTEN, 1);
+
+cleanup:
+  if (strm_initialized) deflateEnd(&strm);
+  if (tmp_fd >= 0) {
+    close(tmp_fd);
+    unlink(tmp_path);
+  }
+  hash_ctx_free(&ctx);
+  return result;
+}
+
+/* Pipes and other unsized inputs: read until EOF into a growing buffer */
+cgit_error_t read_fd_fully(int fd, buffer_t *output) {
+  output->capacity = CGIT_READ_BUFFER_SIZE;
+  output->size = 0;
+  output->data = malloc(output->capacity);
+  if (!output->data) {
+    cgit_report("error: out of memory\n");
+    return CGIT_ERROR_MEMORY;
+  }
+
+  for (;;) {
+    if (output->size == output->capacity) {
+      unsigned char *tmp = realloc(output->data, output->capacity * 2);
+      if (!tmp) {
+        cgit_report("error: out of memory\n");
+        buffer_free(output);
+        return CGIT_ERROR_MEMORY;
+      }
+      output->data = tmp;
+      output->capacity *= 2;
+    }
+
+    ssize_t n = read_some(fd, output->data + output->size,
+                          output->capacity - output->size);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      cgit_report("error: read failed: %s\n", strerror(errno));
+      buffer_free(output);
+      return CGIT_ERROR_IO;
+    }
+    if (n == 0) break;
+    output->size += (size_t)n;
+  }
+
+  return CGIT_OK;
+}
+
+/*
+ * Regular files above CGIT_STREAM_THRESHOLD are streamed, so memory use
+ * does not grow with the file; smaller ones take the in-memory path,
+ * which avoids a temporary file and a rename per object. Anything else,
+ * such as a pipe, is read whole. fd is left open; path names it in
+ * messages.
+ */
+cgit_error_t write_object_from_fd(int fd, const char *path, const char *type,
+                                  char *hash_out, int persist) {
+  cgit_error_t result = CGIT_OK;
+  buffer_t buf = {0};
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    cgit_report("stat: %s: %s\n", path, strerror(errno));
     result = CGIT_ERROR_IO;
     goto cleanup;
   }
 
-  size_t written = fwrite(output_buf.data, 1, output_buf.size, file);
-  if (written != output_buf.size) {
-    fprintf(stderr, "error: short write on '%s'\n", path);
+  /* A regular file handed over as stdin may already be partly read */
+  off_t start = S_ISREG(st.st_mode) ? lseek(fd, 0, SEEK_CUR) : -1;
+  size_t size = start >= 0 && st.st_size > start ? (size_t)(st.st_size - start)
+                                                 : 0;
+
+  if (start >= 0 && size > CGIT_STREAM_THRESHOLD) {
+    /*
+     * The id is only known at the end of the stream, so hash a first pass
+     * alone: hashing runs far faster than deflate, and content already
+     * stored then never gets compressed at all. Above
+     * CGIT_STREAM_PREHASH_MAX the file is unlikely to still be in the page
+     * cache for a second pass, so it is hashed and deflated in one.
+     */
+    if (persist && size <= CGIT_STREAM_PREHASH_MAX) {
+      result = stream_object(fd, size, type, hash_out, 0);
+      if (result != CGIT_OK || object_present(hash_out)) goto cleanup;
+      if (lseek(fd, start, SEEK_SET) != start) {
+        cgit_report("error: cannot rewind '%s': %s\n", path, strerror(errno));
+        result = CGIT_ERROR_IO;
+        goto cleanup;
+      }
+    }
+
+    result = stream_object(fd, size, type, hash_out, persist);
+    if (result == CGIT_OK && persist) {
+      unsigned char id[CGIT_HASH_RAW_LEN];
+      hex_to_bytes_hash((const unsigned char *)hash_out, (char *)id);
+      object_mark_known(id);
+    }
+    goto cleanup;
+  }
+
+  result = read_fd_fully(fd, &buf);
+  if (result != CGIT_OK) goto cleanup;
+
+  result = write_object(buf.data, buf.size, type, hash_out, persist);
+
+cleanup:
+  buffer_free(&buf);
+  return result;
+}
+
+cgit_error_t write_object_from_file(const char *path, const char *type,
+                                    char *hash_out, int persist) {
+  return write_object_from_file_at(AT_FDCWD, path, type, hash_out, persist);
+}
+
+/* The same for path relative to the directory dir_fd */
+cgit_error_t write_object_from_file_at(int dir_fd, const char *path,
+                                       const char *type, char *hash_out,
+                                       int persist) {
+  int fd = openat(dir_fd, path, O_RDONLY);
+  if (fd < 0) {
+    cgit_report("error: cannot open '%s': %s\n", path, strerror(errno));
+    return CGIT_ERROR_FILE_NOT_FOUND;
+  }
+
+  cgit_error_t result = write_object_from_fd(fd, path, type, hash_out, persist);
+  close(fd);
+  return result;
+}
+
+/*
+ * Write the blob of the symlink path below dir_fd: its target, as git
+ * stores it, rather than whatever it points to. size is the link's lstat
+ * size, which some filesystems leave at 0.
+ */
+cgit_error_t write_object_from_link(int dir_fd, const char *path, size_t size,
+                                    char *hash_out, int persist) {
+  cgit_error_t result = CGIT_OK;
+  size_t capacity = size < CGIT_READ_BUFFER_SIZE ? CGIT_READ_BUFFER_SIZE
+                                                 : size + 1;
+  char *target = NULL;
+
+  for (;;) {
+    char *tmp = realloc(target, capacity);
+    if (!tmp) {
+      result = CGIT_ERROR_MEMORY;
+      goto cleanup;
+    }
+    target = tmp;
+
+    ssize_t n = readlinkat(dir_fd, path, target, capacity);
+    if (n < 0) {
+      cgit_report("error: cannot read link '%s': %s\n", path,
+                  strerror(errno));
+      result = CGIT_ERROR_IO;
+      goto cleanup;
+    }
+    /* A target that fills the buffer may have been cut short */
+    if ((size_t)n < capacity) {
+      result = write_object((const unsigned char *)target, (size_t)n, "blob",
+                            hash_out, persist);
+      goto cleanup;
+    }
+    capacity *= 2;
+  }
+
+cleanup:
+  free(target);
+  return result;
+}
+
+/*
+ * Read a small regular file as a serialized object. The contents go
+ * CGIT_MAX_HEADER_LEN bytes into buf, and the header is written right
+ * before them, so *object_out is header and payload with no extra copy.
+ * Sets *object_out to NULL when the file is not a small regular file.
+ */
+static cgit_error_t read_small_object(int dir_fd, const char *path,
+                                      const char *type, buffer_t *buf,
+                                      const unsigned char **object_out,
+                                      size_t *len_out) {
+  cgit_error_t result = CGIT_OK;
+  *object_out = NULL;
+
+  int fd = openat(dir_fd, path, O_RDONLY);
+  if (fd < 0) {
+    cgit_report("error: cannot open '%s': %s\n", path, strerror(errno));
+    return CGIT_ERROR_FILE_NOT_FOUND;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    cgit_report("stat: %s: %s\n", path, strerror(errno));
     result = CGIT_ERROR_IO;
     goto cleanup;
   }
+  if (!S_ISREG(st.st_mode) || (size_t)st.st_size > CGIT_HASH_BATCH_MAX_BLOB)
+    goto cleanup;
+
+  /* One spare byte, so a file that grew is noticed */
+  buf->capacity = CGIT_MAX_HEADER_LEN + (size_t)st.st_size + 1;
+  buf->data = malloc(buf->capacity);
+  if (!buf->data) {
+    result = CGIT_ERROR_MEMORY;
+    goto cleanup;
+  }
+
+  size_t size = 0;
+  size_t room = (size_t)st.st_size + 1;
+  for (;;) {
+    ssize_t n =
+        read_some(fd, buf->data + CGIT_MAX_HEADER_LEN + size, room - size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      cgit_report("error: read failed: %s\n", strerror(errno));
+      result = CGIT_ERROR_IO;
+      goto cleanup;
+    }
+    if (n == 0) break;
+    size += (size_t)n;
+    if (size == room) {
+      cgit_report("error: '%s' changed size while being hashed\n", path);
+      result = CGIT_ERROR_IO;
+      goto cleanup;
+    }
+  }
+
+  char header[CGIT_MAX_HEADER_LEN];
+  size_t header_len =
+      (size_t)snprintf(header, sizeof(header), "%s %zu", type, size) + 1;
+  unsigned char *object = buf->data + CGIT_MAX_HEADER_LEN - header_len;
+  memcpy(object, header, header_len);
+
+  *object_out = object;
+  *len_out = header_len + size;
 
 cleanup:
-  if (file) fclose(file);
-  buffer_free(&header);
-  buffer_free(&output_buf);
+  close(fd);
+  return result;
+}
+
+/*
+ * Like write_object_from_file for up to CGIT_HASH_BATCH_SIZE files, with
+ * all the small ones hashed together by one hash_batch call. Files that
+ * are larger than CGIT_HASH_BATCH_MAX_BLOB, or not regular, are written one
+ * at a time. hashes_out[i] receives the id of paths[i], which are relative
+ * to dir_fd (AT_FDCWD for the working directory).
+ */
+cgit_error_t write_objects_from_files(int dir_fd, const char *const *paths,
+                                      size_t count, const char *type,
+                                      char *const *hashes_out, int persist) {
+  cgit_error_t result = CGIT_OK;
+  buffer_t bufs[CGIT_HASH_BATCH_SIZE] = {0};
+  hash_job_t jobs[CGIT_HASH_BATCH_SIZE];
+  size_t job_path[CGIT_HASH_BATCH_SIZE];
+  size_t num_jobs = 0;
+
+  if (count > CGIT_HASH_BATCH_SIZE) return CGIT_ERROR_INVALID_ARGS;
+
+  for (size_t i = 0; i < count; i++) {
+    const unsigned char *object;
+    size_t len;
+
+    result = read_small_object(dir_fd, paths[i], type, &bufs[num_jobs],
+                               &object, &len);
+    if (result != CGIT_OK) goto cleanup;
+
+    if (!object) {
+      result = write_object_from_file_at(dir_fd, paths[i], type, hashes_out[i],
+                                         persist);
+      if (result != CGIT_OK) goto cleanup;
+      continue;
+    }
+
+    jobs[num_jobs] = (hash_job_t){.data = object, .len = len};
+    job_path[num_jobs++] = i;
+  }
+
+  result = hash_batch(jobs, num_jobs);
+  if (result != CGIT_OK) goto cleanup;
+
+  for (size_t j = 0; j < num_jobs; j++) {
+    char *hash = hashes_out[job_path[j]];
+    bytes_to_hex_hash(jobs[j].digest, hash);
+
+    if (persist) {
+      result = store_object(jobs[j].data, jobs[j].len, hash);
+      if (result != CGIT_OK) goto cleanup;
+    }
+  }
+
+cleanup:
+  for (size_t j = 0; j < CGIT_HASH_BATCH_SIZE; j++) buffer_free(&bufs[j]);
   return result;
 }
 
@@ -592,3 +1559,83 @@ void free_object(git_object_t *obj) {
   obj->data = NULL;
   obj->size = 0;
 }
+
+object_type_t object_type_from_name(const char *name) {
+  if (strcmp(name, "commit") == 0) return OBJ_COMMIT;
+  if (strcmp(name, "tree") == 0) return OBJ_TREE;
+  if (strcmp(name, "blob") == 0) return OBJ_BLOB;
+  if (strcmp(name, "tag") == 0) return OBJ_TAG;
+  return OBJ_NONE;
+}
+
+const char *object_type_name(object_type_t type) {
+  switch (type) {
+    case OBJ_COMMIT:
+      return "commit";
+    case OBJ_TREE:
+      return "tree";
+    case OBJ_BLOB:
+      return "blob";
+    case OBJ_TAG:
+      return "tag";
+    default:
+      return NULL;
+  }
+}
+
+static int is_hex_name(const char *name, size_t len) {
+  return strlen(name) == len && hex_is_valid(name, len);
+}
+
+cgit_error_t for_each_loose_object(loose_object_fn fn, void *data) {
+  cgit_error_t result = CGIT_OK;
+  DIR *objects = NULL;
+  DIR *fanout = NULL;
+  char objects_dir[CGIT_MAX_PATH_LENGTH];
+
+  result = repo_path(objects_dir, sizeof(objects_dir), CGIT_OBJECTS_DIR);
+  if (result != CGIT_OK) goto cleanup;
+
+  objects = opendir(objects_dir);
+  if (!objects) {
+    cgit_report("error: cannot open '%s': %s\n", objects_dir,
+                strerror(errno));
+    result = CGIT_ERROR_FILE_NOT_FOUND;
+    goto cleanup;
+  }
+
+  struct dirent *dir_entry;
+  while ((dir_entry = readdir(objects)) != NULL) {
+    /* Only the two-hex-digit fanout directories hold loose objects */
+    if (!is_hex_name(dir_entry->d_name, 2)) continue;
+
+    char dir[CGIT_MAX_PATH_LENGTH];
+    if (repo_path(dir, sizeof(dir), CGIT_OBJECTS_DIR "/%s",
+                  dir_entry->d_name) != CGIT_OK)
+      continue;
+
+    fanout = opendir(dir);
+    if (!fanout) continue;
+
+    struct dirent *obj_entry;
+    while ((obj_entry = readdir(fanout)) != NULL) {
+      if (!is_hex_name(obj_entry->d_name, CGIT_OBJ_NAME_BUF_SIZE - 1))
+        continue;
+
+      char hash[CGIT_HASH_HEX_LEN + 1];
+      memcpy(hash, dir_entry->d_name, 2);
+      memcpy(hash + 2, obj_entry->d_name, CGIT_OBJ_NAME_BUF_SIZE);
+
+      result = fn(hash, data);
+      if (result != CGIT_OK) goto cleanup;
+    }
+
+    closedir(fanout);
+    fanout = NULL;
+  }
+
+cleanup:
+  if (fanout) closedir(fanout);
+  if (objects) closedir(objects);
+  return result;
+}
@@ -0,0 +1,349 @@
+/*
+ * Landing loose object files on disk.
+ *
+ * An object is written to a temporary file next to its final path and
+ * renamed into place, so readers never see a partial object and two
+ * writers of the same object cannot interleave: the loser's rename just
+ * replaces identical bytes, or finds the object there and drops its copy.
+ *
+ * core.fsyncMethod decides what survives a crash:
+ *
+ *   (unset)        no syncing, as before; the rename is still atomic
+ *   fsync          fsync each object before its rename
+ *   writeout-only  start writeback of each object, but wait for nothing
+ *   batch          start writeback of each object, defer its rename, and
+ *                  make all of them durable with one barrier in
+ *                  object_files_flush, before any rename
+ *
+ * Deferring the renames in batch mode matters: an object renamed before
+ * its data reached the disk can come back empty after a crash, and every
+ * later write would skip it as already present. Until the flush, batched
+ * objects are invisible under their final names, so commands flush before
+ * anything else (the index, a printed id) can refer to them.
+ */
+
+#define _GNU_SOURCE /* syncfs, sync_file_range */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../include/common.h"
+#include "../include/core.h"
+
+typedef enum {
+  FSYNC_NONE,
+  FSYNC_EACH,
+  FSYNC_WRITEOUT_ONLY,
+  FSYNC_BATCH,
+} fsync_method_t;
+
+/*
+ * Batch mode: an object written but not yet renamed into place. The path
+ * is allocated to its length: a batch can hold 100k objects.
+ */
+typedef struct pending_file {
+  char *tmp_path;
+  char hash[CGIT_HASH_HEX_LEN + 1];
+} pending_file_t;
+
+static void load_fsync_method(void) {
+  cgit_repo_t *repo = repo_current();
+  const char *value = config_get("core.fsyncMethod");
+
+  repo->fsync_method = FSYNC_NONE;
+  if (!value) return;
+
+  if (strcmp(value, "fsync") == 0) {
+    repo->fsync_method = FSYNC_EACH;
+  } else if (strcmp(value, "writeout-only") == 0) {
+    repo->fsync_method = FSYNC_WRITEOUT_ONLY;
+  } else if (strcmp(value, "batch") == 0) {
+    repo->fsync_method = FSYNC_BATCH;
+  } else {
+    cgit_report("warning: unknown core.fsyncMethod '%s'\n", value);
+  }
+}
+
+/* Ask the kernel to start writing fd's data back, without waiting */
+static void start_writeback(int fd) {
+#ifdef __linux__
+  sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#else
+  (void)fd;
+#endif
+}
+
+/*
+ * Create a read-only temporary file for an object: in its fanout directory
+ * when the id is known, so the rename stays within one directory, else in
+ * the objects directory. tmp_path receives its name.
+ */
+cgit_error_t object_file_create(const char *hash, char *tmp_path,
+                                size_t tmp_size, int *fd_out) {
+  cgit_error_t result;
+  uint64_t start = trace_begin();
+
+  if (hash) {
+    char dir[CGIT_MAX_PATH_LENGTH];
+    result = build_object_dir(hash, dir, sizeof(dir));
+    if (result != CGIT_OK) return result;
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+      cgit_report("error: cannot create directory '%s': %s\n", dir,
+                  strerror(errno));
+      return CGIT_ERROR_IO;
+    }
+    result = repo_path(tmp_path, tmp_size,
+                       CGIT_OBJECTS_DIR "/%.2s/tmp_obj_XXXXXX", hash);
+  } else {
+    result = repo_path(tmp_path, tmp_size, CGIT_OBJECTS_DIR "/tmp_obj_XXXXXX");
+  }
+  if (result != CGIT_OK) return result;
+
+  int fd = mkstemp(tmp_path);
+  if (fd < 0) {
+    cgit_report("error: cannot create temporary object: %s\n", strerror(errno));
+    return CGIT_ERROR_IO;
+  }
+  fchmod(fd, 0444);
+  trace_end(TRACE_WRITE, start, 0);
+
+  *fd_out = fd;
+  return CGIT_OK;
+}
+
+/*
+ * Move a finished temporary object to its final path. Another writer may
+ * have stored the same object meanwhile; identical ids mean identical
+ * content, so the temporary copy is simply dropped.
+ */
+static cgit_error_t finalize(const char *tmp_path, const char *hash) {
+  char path[CGIT_MAX_PATH_LENGTH];
+  cgit_error_t result = build_object_path(hash, path, sizeof(path));
+  if (result != CGIT_OK) return result;
+
+  struct stat st;
+  if (stat(path, &st) == 0) {
+    unlink(tmp_path);
+    return CGIT_OK;
+  }
+
+  char dir[CGIT_MAX_PATH_LENGTH];
+  result = build_object_dir(hash, dir, sizeof(dir));
+  if (result != CGIT_OK) return result;
+
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    cgit_report("error: cannot create directory '%s': %s\n", dir,
+                strerror(errno));
+    return CGIT_ERROR_IO;
+  }
+
+  if (rename(tmp_path, path) != 0) {
+    cgit_report("error: cannot rename '%s' to '%s': %s\n", tmp_path,
+                path, strerror(errno));
+    return CGIT_ERROR_IO;
+  }
+
+  return CGIT_OK;
+}
+
+static cgit_error_t defer(const char *tmp_path, const char *hash) {
+  cgit_repo_t *repo = repo_current();
+  cgit_error_t result = CGIT_OK;
+
+  char *path = strdup(tmp_path);
+  if (!path) {
+    cgit_report("error: out of memory\n");
+    return CGIT_ERROR_MEMORY;
+  }
+
+  pthread_mutex_lock(&repo->pending_lock);
+  if (repo->pending_count == repo->pending_capacity) {
+    size_t new_cap = repo->pending_capacity ? repo->pending_capacity * 2 : 64;
+    pending_file_t *tmp = realloc(repo->pending, new_cap * sizeof(*tmp));
+    if (!tmp) {
+      cgit_report("error: out of memory\n");
+      free(path);
+      result = CGIT_ERROR_MEMORY;
+      goto cleanup;
+    }
+    repo->pending = tmp;
+    repo->pending_capacity = new_cap;
+  }
+
+  pending_file_t *file = &repo->pending[repo->pending_count++];
+  file->tmp_path = path;
+  memcpy(file->hash, hash, sizeof(file->hash));
+
+cleanup:
+  pthread_mutex_unlock(&repo->pending_lock);
+  return result;
+}
+
+/*
+ * Close a fully written temporary object and put it in place as hash,
+ * syncing it as core.fsyncMethod asks. fd is closed and, on failure,
+ * tmp_path removed, whatever happens.
+ */
+cgit_error_t object_file_commit(int fd, const char *tmp_path,
+                                const char *hash) {
+  cgit_repo_t *repo = repo_current();
+  cgit_error_t result = CGIT_OK;
+  uint64_t start = trace_begin();
+
+  pthread_once(&repo->fsync_once, load_fsync_method);
+  fsync_method_t fsync_method = repo->fsync_method;
+  if (fsync_method != FSYNC_NONE) trace_count(TRACE_SYSCALLS, 1);
+
+  if (fsync_method == FSYNC_EACH && fsync(fd) != 0) {
+    cgit_report("error: cannot sync '%s': %s\n", tmp_path, strerror(errno));
+    result = CGIT_ERROR_IO;
+  } else if (fsync_method == FSYNC_WRITEOUT_ONLY ||
+             fsync_method == FSYNC_BATCH) {
+    start_writeback(fd);
+  }
+
+  if (close(fd) != 0 && result == CGIT_OK) {
+    cgit_report("error: cannot write '%s': %s\n", tmp_path, strerror(errno));
+    result = CGIT_ERROR_IO;
+  }
+  if (result != CGIT_OK) goto cleanup;
+
+  result = fsync_method == FSYNC_BATCH ? defer(tmp_path, hash)
+                                       : finalize(tmp_path, hash);
+
+cleanup:
+  if (result != CGIT_OK) unlink(tmp_path);
+  trace_end(TRACE_WRITE, start, 0);
+  return result;
+}
+
+/*
+ * Make a finished pack or index durable before its rename, as
+ * core.fsyncMethod asks. A pack is a few large files, so batch mode syncs
+ * it directly, like fsync. durable syncs whatever the method: the caller
+ * is about to delete the only other copy of the objects.
+ */
+cgit_error_t object_file_sync(int fd, const char *path, int durable) {
+  cgit_repo_t *repo = repo_current();
+
+  pthread_once(&repo->fsync_once, load_fsync_method);
+  fsync_method_t fsync_method = repo->fsync_method;
+  if (fsync_method == FSYNC_NONE && !durable) return CGIT_OK;
+  trace_count(TRACE_SYSCALLS, 1);
+
+  if (fsync_method == FSYNC_WRITEOUT_ONLY && !durable) {
+    start_writeback(fd);
+    return CGIT_OK;
+  }
+  if (fsync(fd) != 0) {
+    cgit_report("error: cannot sync '%s': %s\n", path, strerror(errno));
+    return CGIT_ERROR_IO;
+  }
+  return CGIT_OK;
+}
+
+/* Make the renames into a directory durable */
+cgit_error_t object_dir_sync(const char *dir) {
+  int fd = open(dir, O_RDONLY | O_DIRECTORY);
+  trace_count(TRACE_SYSCALLS, 1);
+  if (fd < 0 || fsync(fd) != 0) {
+    cgit_report("error: cannot sync '%s': %s\n", dir, strerror(errno));
+    if (fd >= 0) close(fd);
+    return CGIT_ERROR_IO;
+  }
+  close(fd);
+  return CGIT_OK;
+}
+
+/* Make every pending object durable with one barrier */
+static cgit_error_t barrier(cgit_repo_t *repo) {
+#ifdef __linux__
+  (void)repo;
+  char objects_dir[CGIT_MAX_PATH_LENGTH];
+  cgit_error_t result =
+      repo_path(objects_dir, sizeof(objects_dir), CGIT_OBJECTS_DIR);
+  if (result != CGIT_OK) return result;
+
+  int fd = open(objects_dir, O_RDONLY | O_DIRECTORY);
+  if (fd < 0 || syncfs(fd) != 0) {
+    cgit_report("error: cannot sync '%s': %s\n", objects_dir,
+                strerror(errno));
+    if (fd >= 0) close(fd);
+    return CGIT_ERROR_IO;
+  }
+  close(fd);
+#else
+  /* No filesystem-wide sync that waits: sync the files themselves */
+  for (size_t i = 0; i < repo->pending_count; i++) {
+    const char *tmp_path = repo->pending[i].tmp_path;
+    int fd = open(tmp_path, O_RDONLY);
+    if (fd < 0 || fsync(fd) != 0) {
+      cgit_report("error: cannot sync '%s': %s\n", tmp_path,
+                  strerror(errno));
+      if (fd >= 0) close(fd);
+      return CGIT_ERROR_IO;
+    }
+    close(fd);
+  }
+#endif
+  return CGIT_OK;
+}
+
+/*
+ * Batch mode: sync everything written since the last flush, then rename
+ * it into place. Called by commands once their objects are written and
+ * before anything refers to them; a no-op in the other modes.
+ */
+cgit_error_t object_files_flush(void) {
+  cgit_repo_t *repo = repo_current();
+  cgit_error_t result = CGIT_OK;
+
+  pthread_mutex_lock(&repo->pending_lock);
+  if (!repo->pending_count) goto cleanup;
+
+  uint64_t start = trace_begin();
+  result = barrier(repo);
+  trace_end(TRACE_WRITE, start, 0);
+  trace_count(TRACE_SYSCALLS, 1);
+
+  /* A barrier cannot be made to fail on demand; tests ask for it instead */
+  if (result == CGIT_OK && getenv("CGIT_TEST_FAIL_FLUSH")) {
+    cgit_report("error: CGIT_TEST_FAIL_FLUSH is set\n");
+    result = CGIT_ERROR_IO;
+  }
+
+  /* Nothing unsynced may get a final name; drop it all on failure */
+  for (size_t i = 0; i < repo->pending_count; i++) {
+    pending_file_t *file = &repo->pending[i];
+    if (result == CGIT_OK) result = finalize(file->tmp_path, file->hash);
+    if (result != CGIT_OK) unlink(file->tmp_path);
+    free(file->tmp_path);
+  }
+
+  free(repo->pending);
+  repo->pending = NULL;
+  repo->pending_count = 0;
+  repo->pending_capacity = 0;
+
+  /*
+   * Writers marked the dropped objects known when they queued them. Which
+   * ids those were is not tracked, so forget every one: the known set is
+   * only a cache, and the next lookup of each id asks the store again.
+   */
+  if (result != CGIT_OK) {
+    pthread_mutex_lock(&repo->known_lock);
+    oid_set_free(&repo->known_objects);
+    pthread_mutex_unlock(&repo->known_lock);
+  }
+
+cleanup:
+  pthread_mutex_unlock(&repo->pending_lock);
+  return result;
+}
@@ -0,0 +1,206 @@
+/*
+ * Reusable object reader for long-running callers (cat-file --batch).
+ *
+ * read_object allocates a fresh input buffer, a fresh inflate stream, a
+ * fresh output buffer and a payload copy for every object. The reader keeps
+ * all of them alive instead: buffers only ever grow, the z_stream is reset
+ * rather than torn down, and the payload is handed out as a view into the
+ * reader's own buffer, valid until the next read.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "../include/common.h"
+#include "../include/core.h"
+
+cgit_error_t object_reader_init(object_reader_t *reader) {
+  memset(reader, 0, sizeof(*reader));
+
+  z_stream *strm = calloc(1, sizeof(*strm));
+  if (!strm) return CGIT_ERROR_MEMORY;
+
+  if (inflateInit(strm) != Z_OK) {
+    free(strm);
+    cgit_report("error: inflateInit failed\n");
+    return CGIT_ERROR_COMPRESSION;
+  }
+
+  reader->zstream = strm;
+  return CGIT_OK;
+}
+
+void object_reader_release(object_reader_t *reader) {
+  if (reader->zstream) {
+    inflateEnd(reader->zstream);
+    free(reader->zstream);
+  }
+  buffer_free(&reader->raw);
+  buffer_free(&reader->inflated);
+  free_object(&reader->packed);
+  memset(reader, 0, sizeof(*reader));
+}
+
+/* Read a whole loose object file into reader->raw, reusing its capacity */
+static cgit_error_t read_loose_file(object_reader_t *reader, const char *path) {
+  cgit_error_t result = CGIT_OK;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    if (errno == ENOENT) return CGIT_ERROR_FILE_NOT_FOUND;
+    cgit_report("error: cannot open '%s': %s\n", path, strerror(errno));
+    return CGIT_ERROR_IO;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    cgit_report("stat: %s: %s\n", path, strerror(errno));
+    result = CGIT_ERROR_IO;
+    goto cleanup;
+  }
+
+  size_t size = (size_t)st.st_size;
+  result = buffer_reserve(&reader->raw, size);
+  if (result != CGIT_OK) goto cleanup;
+
+  reader->raw.size = 0;
+  while (reader->raw.size < size) {
+    ssize_t n = read_some(fd, reader->raw.data + reader->raw.size,
+                          size - reader->raw.size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      cgit_report("error: short read on '%s'\n", path);
+      result = CGIT_ERROR_IO;
+      goto cleanup;
+    }
+    reader->raw.size += (size_t)n;
+  }
+
+cleanup:
+  close(fd);
+  return result;
+}
+
+/* Inflate reader->raw into reader->inflated with the long-lived stream */
+static cgit_error_t inflate_loose(object_reader_t *reader) {
+  z_stream *strm = reader->zstream;
+
+  if (inflateReset(strm) != Z_OK) {
+    cgit_report("error: inflateReset failed\n");
+    return CGIT_ERROR_COMPRESSION;
+  }
+
+  const unsigned char *in_end = reader->raw.data + reader->raw.size;
+  strm->next_in = reader->raw.data;
+  strm->avail_in = 0;
+  reader->inflated.size = 0;
+
+  int zret;
+  uint64_t start = trace_begin();
+  do {
+    if (strm->avail_in == 0) {
+      size_t left = (size_t)(in_end - strm->next_in);
+      strm->avail_in = left > UINT_MAX ? UINT_MAX : (uInt)left;
+    }
+
+    /* Keep at least one spare byte for the NUL after the payload */
+    cgit_error_t result = buffer_reserve(
+        &reader->inflated, reader->inflated.size + CGIT_READ_BUFFER_SIZE + 1);
+    if (result != CGIT_OK) return result;
+
+    size_t room = reader->inflated.capacity - reader->inflated.size - 1;
+    strm->next_out = reader->inflated.data + reader->inflated.size;
+    strm->avail_out = room > UINT_MAX ? UINT_MAX : (uInt)room;
+
+    zret = inflate(strm, Z_NO_FLUSH);
+    reader->inflated.size =
+        (size_t)(strm->next_out - reader->inflated.data);
+  } while (zret == Z_OK);
+  trace_end(TRACE_INFLATE, start, reader->inflated.size);
+
+  if (zret != Z_STREAM_END) {
+    cgit_report("error: inflate failed (corrupt object?)\n");
+    return CGIT_ERROR_COMPRESSION;
+  }
+
+  reader->inflated.data[reader->inflated.size] = '\0';
+  return CGIT_OK;
+}
+
+static int looks_like_hash(const char *hash) {
+  return strlen(hash) == CGIT_HASH_HEX_LEN &&
+         hex_is_valid(hash, CGIT_HASH_HEX_LEN);
+}
+
+/*
+ * A missing object (or a string that cannot be an id) is reported as
+ * CGIT_ERROR_FILE_NOT_FOUND without printing, so batch callers can answer
+ * "missing" and move on.
+ */
+cgit_error_t object_reader_read(object_reader_t *reader, const char *hash,
+                                object_view_t *view) {
+  cgit_error_t result = CGIT_OK;
+  char path[CGIT_MAX_PATH_LENGTH];
+
+  if (!looks_like_hash(hash)) return CGIT_ERROR_FILE_NOT_FOUND;
+
+  free_object(&reader->packed);
+
+  result = read_packed_object(hash, &reader->packed);
+  if (result == CGIT_OK) {
+    snprintf(view->type, sizeof(view->type), "%s", reader->packed.type);
+    view->size = reader->packed.size;
+    view->data = reader->packed.data;
+    trace_count(TRACE_OBJECTS_READ, 1);
+    return CGIT_OK;
+  }
+  if (result != CGIT_ERROR_FILE_NOT_FOUND) return result;
+
+  result = build_object_path(hash, path, sizeof(path));
+  if (result != CGIT_OK) return result;
+
+  result = read_loose_file(reader, path);
+  if (result == CGIT_ERROR_FILE_NOT_FOUND && packs_reprepare())
+    return object_reader_read(reader, hash, view);
+  if (result != CGIT_OK) return result;
+
+  result = inflate_loose(reader);
+  if (result != CGIT_OK) return result;
+
+  size_t content_size = 0;
+  size_t payload_offset = 0;
+  result = parse_object_header(reader->inflated.data, reader->inflated.size,
+                               view->type, sizeof(view->type), &content_size,
+                               &payload_offset);
+  if (result != CGIT_OK) return result;
+
+  if (reader->inflated.size - payload_offset != content_size) {
+    cgit_report("error: invalid object (size mismatch)\n");
+    return CGIT_ERROR_INVALID_OBJECT;
+  }
+
+  view->size = content_size;
+  view->data = reader->inflated.data + payload_offset;
+  trace_count(TRACE_OBJECTS_READ, 1);
+  return CGIT_OK;
+}
+
+/* Like object_reader_read, but only type and size; view->data is NULL */
+cgit_error_t object_reader_read_header(object_reader_t *reader,
+                                       const char *hash, object_view_t *view) {
+  (void)reader;
+
+  if (!looks_like_hash(hash)) return CGIT_ERROR_FILE_NOT_FOUND;
+
+  view->data = NULL;
+  return read_object_header(hash, view->type, sizeof(view->type),
+                            &view->size);
+}
@@ -0,0 +1,282 @@
+/*
+ * Object id hex conversion.
+ *
+ * Every id crosses between its raw 20 bytes and its 40 hex digits at least
+ * once: hashing, tree parsing and serializing, the index, packs. The
+ * routines here replace the per-byte sprintf("%02x") / sscanf("%02x") /
+ * isxdigit loops with a table-driven scalar version and SSE2 and AVX2
+ * versions, picked once at runtime from what the CPU supports.
+ *
+ * All versions produce lowercase digits, accept either case, and reject
+ * anything that is not a hex digit. Building with -DCGIT_NO_SIMD keeps only
+ * the scalar version, which is also what non-x86 targets get; setting
+ * CGIT_NO_SIMD=1 in the environment picks it at runtime, so tests can run
+ * both on one build.
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/common.h"
+#include "../include/core.h"
+
+#if !defined(CGIT_NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__GNUC__) || defined(__clang__))
+#define OID_X86 1
+#include <immintrin.h>
+#endif
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/* Digit value plus one, so that 0 marks a non-hex character */
+static const unsigned char hex_value[256] = {
+    ['0'] = 1,   ['1'] = 2,   ['2'] = 3,   ['3'] = 4,   ['4'] = 5,
+    ['5'] = 6,   ['6'] = 7,   ['7'] = 8,   ['8'] = 9,   ['9'] = 10,
+    ['a'] = 11,  ['b'] = 12,  ['c'] = 13,  ['d'] = 14,  ['e'] = 15,
+    ['f'] = 16,  ['A'] = 11,  ['B'] = 12,  ['C'] = 13,  ['D'] = 14,
+    ['E'] = 15,  ['F'] = 16,
+};
+
+typedef struct {
+  void (*encode)(const unsigned char *raw, char *hex);
+  int (*decode)(const char *hex, unsigned char *raw);
+  int (*valid)(const char *hex, size_t len);
+} oid_impl_t;
+
+static void encode_scalar(const unsigned char *raw, char *hex) {
+  for (size_t i = 0; i < CGIT_HASH_RAW_LEN; i++) {
+    hex[2 * i] = hex_digits[raw[i] >> 4];
+    hex[2 * i + 1] = hex_digits[raw[i] & 0xf];
+  }
+}
+
+static int decode_scalar(const char *hex, unsigned char *raw) {
+  for (size_t i = 0; i < CGIT_HASH_RAW_LEN; i++) {
+    unsigned int hi = hex_value[(unsigned char)hex[2 * i]];
+    unsigned int lo = hex_value[(unsigned char)hex[2 * i + 1]];
+    if (!hi || !lo) return 0;
+    raw[i] = (unsigned char)(((hi - 1) << 4) | (lo - 1));
+  }
+  return 1;
+}
+
+static int valid_scalar(const char *hex, size_t len) {
+  for (size_t i = 0; i < len; i++)
+    if (!hex_value[(unsigned char)hex[i]]) return 0;
+  return 1;
+}
+
+#ifdef OID_X86
+
+/* Nibbles (0..15 per byte) to ASCII hex digits */
+__attribute__((target("sse2"))) static __m128i nibbles_to_hex_sse2(
+    __m128i n) {
+  __m128i alpha = _mm_cmpgt_epi8(n, _mm_set1_epi8(9));
+  __m128i ascii = _mm_add_epi8(n, _mm_set1_epi8('0'));
+  return _mm_add_epi8(ascii, _mm_and_si128(alpha, _mm_set1_epi8('a' - '0' - 10)));
+}
+
+/* 16 raw bytes to 32 hex digits */
+__attribute__((target("sse2"))) static void encode16_sse2(
+    const unsigned char *raw, char *hex) {
+  __m128i x = _mm_loadu_si128((const __m128i *)raw);
+  __m128i mask = _mm_set1_epi8(0x0f);
+  __m128i hi = nibbles_to_hex_sse2(_mm_and_si128(_mm_srli_epi16(x, 4), mask));
+  __m128i lo = nibbles_to_hex_sse2(_mm_and_si128(x, mask));
+
+  _mm_storeu_si128((__m128i *)hex, _mm_unpacklo_epi8(hi, lo));
+  _mm_storeu_si128((__m128i *)(hex + 16), _mm_unpackhi_epi8(hi, lo));
+}
+
+/* Bytes 0..15 and, overlapping, 4..19 cover all 20 */
+__attribute__((target("sse2"))) static void encode_sse2(
+    const unsigned char *raw, char *hex) {
+  encode16_sse2(raw + 4, hex + 8);
+  encode16_sse2(raw, hex);
+}
+
+/*
+ * Per byte: the digit's value, and 0xff in *ok where the byte was a hex
+ * digit. Signed compares are fine since every digit is ASCII.
+ */
+__attribute__((target("sse2"))) static __m128i hex_to_nibbles_sse2(
+    __m128i c, __m128i *ok) {
+  __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+  __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+                                _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+  __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+  __m128i dval = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+  __m128i aval = _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10));
+
+  *ok = _mm_or_si128(digit, alpha);
+  return _mm_or_si128(_mm_and_si128(digit, dval), _mm_and_si128(alpha, aval));
+}
+
+/* 16 hex digits to 8 bytes, in the low half of each 16-bit lane */
+__attribute__((target("sse2"))) static __m128i pair_nibbles_sse2(__m128i v) {
+  __m128i hi = _mm_and_si128(v, _mm_set1_epi16(0x00ff));
+  __m128i lo = _mm_srli_epi16(v, 8);
+  return _mm_or_si128(_mm_slli_epi16(hi, 4), lo);
+}
+
+/* Digits 0..15, 16..31 and, overlapping, 24..39 */
+__attribute__((target("sse2"))) static int decode_sse2(const char *hex,
+                                                       unsigned char *raw) {
+  __m128i ok0, ok1, ok2;
+  __m128i v0 = hex_to_nibbles_sse2(_mm_loadu_si128((const __m128i *)hex), &ok0);
+  __m128i v1 =
+      hex_to_nibbles_sse2(_mm_loadu_si128((const __m128i *)(hex + 16)), &ok1);
+  __m128i v2 =
+      hex_to_nibbles_sse2(_mm_loadu_si128((const __m128i *)(hex + 24)), &ok2);
+
+  __m128i ok = _mm_and_si128(_mm_and_si128(ok0, ok1), ok2);
+  if (_mm_movemask_epi8(ok) != 0xffff) return 0;
+
+  __m128i b01 = _mm_packus_epi16(pair_nibbles_sse2(v0), pair_nibbles_sse2(v1));
+  __m128i b2 = _mm_packus_epi16(pair_nibbles_sse2(v2), pair_nibbles_sse2(v2));
+  _mm_storeu_si128((__m128i *)raw, b01);
+  _mm_storel_epi64((__m128i *)(raw + 12), b2);
+  return 1;
+}
+
+__attribute__((target("sse2"))) static int valid_sse2(const char *hex,
+                                                      size_t len) {
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i ok;
+    hex_to_nibbles_sse2(_mm_loadu_si128((const __m128i *)(hex + i)), &ok);
+    if (_mm_movemask_epi8(ok) != 0xffff) return 0;
+  }
+  return valid_scalar(hex + i, len - i);
+}
+
+__attribute__((target("avx2"))) static __m256i nibbles_to_hex_avx2(
+    __m256i n) {
+  __m256i alpha = _mm256_cmpgt_epi8(n, _mm256_set1_epi8(9));
+  __m256i ascii = _mm256_add_epi8(n, _mm256_set1_epi8('0'));
+  return _mm256_add_epi8(
+      ascii, _mm256_and_si256(alpha, _mm256_set1_epi8('a' - '0' - 10)));
+}
+
+/*
+ * Both 16-byte windows (bytes 0..15 and 4..19) in one register. unpack
+ * works per 128-bit lane, so the low lane yields digits 0..31 and the high
+ * lane's upper half yields digits 24..39.
+ */
+__attribute__((target("avx2"))) static void encode_avx2(
+    const unsigned char *raw, char *hex) {
+  __m256i x = _mm256_inserti128_si256(
+      _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)raw)),
+      _mm_loadu_si128((const __m128i *)(raw + 4)), 1);
+  __m256i mask = _mm256_set1_epi8(0x0f);
+  __m256i hi =
+      nibbles_to_hex_avx2(_mm256_and_si256(_mm256_srli_epi16(x, 4), mask));
+  __m256i lo = nibbles_to_hex_avx2(_mm256_and_si256(x, mask));
+  __m256i first = _mm256_unpacklo_epi8(hi, lo);
+  __m256i second = _mm256_unpackhi_epi8(hi, lo);
+
+  _mm_storeu_si128((__m128i *)hex, _mm256_castsi256_si128(first));
+  _mm_storeu_si128((__m128i *)(hex + 16), _mm256_castsi256_si128(second));
+  _mm_storeu_si128((__m128i *)(hex + 24), _mm256_extracti128_si256(second, 1));
+}
+
+__attribute__((target("avx2"))) static __m256i hex_to_nibbles_avx2(
+    __m256i c, __m256i *ok) {
+  __m256i lower = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+  __m256i digit =
+      _mm256_andnot_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8('0'), c),
+                          _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+  __m256i alpha =
+      _mm256_andnot_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8('a'), lower),
+                          _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), lower));
+  __m256i dval = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+  __m256i aval = _mm256_sub_epi8(lower, _mm256_set1_epi8('a' - 10));
+
+  *ok = _mm256_or_si256(digit, alpha);
+  return _mm256_or_si256(_mm256_and_si256(digit, dval),
+                         _mm256_and_si256(alpha, aval));
+}
+
+/* Digits 0..31 in one register, 24..39 through the SSE2 path */
+__attribute__((target("avx2"))) static int decode_avx2(const char *hex,
+                                                       unsigned char *raw) {
+  __m256i ok;
+  __m128i ok_tail;
+  __m256i v = hex_to_nibbles_avx2(_mm256_loadu_si256((const __m256i *)hex), &ok);
+  __m128i tail =
+      hex_to_nibbles_sse2(_mm_loadu_si128((const __m128i *)(hex + 24)), &ok_tail);
+
+  if ((unsigned int)_mm256_movemask_epi8(ok) != 0xffffffffu ||
+      _mm_movemask_epi8(ok_tail) != 0xffff)
+    return 0;
+
+  __m256i hi = _mm256_and_si256(v, _mm256_set1_epi16(0x00ff));
+  __m256i pairs =
+      _mm256_or_si256(_mm256_slli_epi16(hi, 4), _mm256_srli_epi16(v, 8));
+  /* packus is per lane: bytes 0..7 sit in qword 0, bytes 8..15 in qword 2 */
+  __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(pairs, pairs),
+                                            0x08);
+  __m128i b2 = _mm_packus_epi16(pair_nibbles_sse2(tail), pair_nibbles_sse2(tail));
+
+  _mm_storeu_si128((__m128i *)raw, _mm256_castsi256_si128(packed));
+  _mm_storel_epi64((__m128i *)(raw + 12), b2);
+  return 1;
+}
+
+__attribute__((target("avx2"))) static int valid_avx2(const char *hex,
+                                                      size_t len) {
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i ok;
+    hex_to_nibbles_avx2(_mm256_loadu_si256((const __m256i *)(hex + i)), &ok);
+    if ((unsigned int)_mm256_movemask_epi8(ok) != 0xffffffffu) return 0;
+  }
+  return valid_sse2(hex + i, len - i);
+}
+
+#endif /* OID_X86 */
+
+static oid_impl_t oid_impl = {encode_scalar, decode_scalar, valid_scalar};
+static pthread_once_t oid_once = PTHREAD_ONCE_INIT;
+
+static void pick_impl(void) {
+#ifdef OID_X86
+  const char *no_simd = getenv("CGIT_NO_SIMD");
+  if (no_simd && *no_simd && strcmp(no_simd, "0") != 0) return;
+
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    oid_impl = (oid_impl_t){encode_avx2, decode_avx2, valid_avx2};
+  else if (__builtin_cpu_supports("sse2"))
+    oid_impl = (oid_impl_t){encode_sse2, decode_sse2, valid_sse2};
+#endif
+}
+
+static const oid_impl_t *impl(void) {
+  pthread_once(&oid_once, pick_impl);
+  return &oid_impl;
+}
+
+/* hex_out needs CGIT_HASH_HEX_LEN + 1 bytes; it is NUL-terminated */
+void bytes_to_hex_hash(const unsigned char *hash, char *hex_out) {
+  impl()->encode(hash, hex_out);
+  hex_out[CGIT_HASH_HEX_LEN] = '\0';
+}
+
+/*
+ * Reads exactly CGIT_HASH_HEX_LEN characters. Returns
+ * CGIT_ERROR_INVALID_ARGS, without printing, if any is not a hex digit.
+ */
+cgit_error_t hex_to_bytes_hash(const unsigned char *hex_hash, char *hash_out) {
+  if (!impl()->decode((const char *)hex_hash, (unsigned char *)hash_out))
+    return CGIT_ERROR_INVALID_ARGS;
+  return CGIT_OK;
+}
+
+/* 1 when all len characters of hex are hex digits */
+int hex_is_valid(const char *hex, size_t len) {
+  return impl()->valid(hex, len);
+}
@@ -0,0 +1,81 @@
+/*
+ * A set of raw object ids: open addressing with linear probing.
+ *
+ * Ids are SHA-1 output, so their first bytes are already uniformly
+ * distributed and serve as the hash directly. An all-zero slot is empty;
+ * the null id never names a real object. The table doubles at half full,
+ * which keeps probe runs short. Not thread-safe: callers that share a set
+ * lock around it.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/common.h"
+#include "../include/core.h"
+
+static const unsigned char null_id[CGIT_HASH_RAW_LEN];
+
+static size_t slot_of(const unsigned char *id, size_t capacity) {
+  uint64_t h;
+  memcpy(&h, id, sizeof(h));
+  return (size_t)h & (capacity - 1);
+}
+
+/* The slot holding id, or the empty slot where it would go */
+static unsigned char *probe(unsigned char (*ids)[CGIT_HASH_RAW_LEN],
+                            size_t capacity, const unsigned char *id) {
+  size_t i = slot_of(id, capacity);
+  while (memcmp(ids[i], null_id, CGIT_HASH_RAW_LEN) != 0 &&
+         memcmp(ids[i], id, CGIT_HASH_RAW_LEN) != 0)
+    i = (i + 1) & (capacity - 1);
+  return ids[i];
+}
+
+static cgit_error_t grow(oid_set_t *set) {
+  size_t new_cap = set->capacity ? set->capacity * 2 : CGIT_OID_SET_MIN;
+  unsigned char (*ids)[CGIT_HASH_RAW_LEN] = calloc(new_cap, sizeof(*ids));
+  if (!ids) {
+    cgit_report("error: out of memory\n");
+    return CGIT_ERROR_MEMORY;
+  }
+
+  for (size_t i = 0; i < set->capacity; i++)
+    if (memcmp(set->ids[i], null_id, CGIT_HASH_RAW_LEN) != 0)
+      memcpy(probe(ids, new_cap, set->ids[i]), set->ids[i],
+             CGIT_HASH_RAW_LEN);
+
+  free(set->ids);
+  set->ids = ids;
+  set->capacity = new_cap;
+  return CGIT_OK;
+}
+
+int oid_set_contains(const oid_set_t *set, const unsigned char *id) {
+  if (!set->count) return 0;
+  return memcmp(probe(set->ids, set->capacity, id), id, CGIT_HASH_RAW_LEN) ==
+         0;
+}
+
+cgit_error_t oid_set_insert(oid_set_t *set, const unsigned char *id) {
+  if (memcmp(id, null_id, CGIT_HASH_RAW_LEN) == 0) return CGIT_OK;
+
+  if (2 * (set->count + 1) > set->capacity) {
+    cgit_error_t result = grow(set);
+    if (result != CGIT_OK) return result;
+  }
+
+  unsigned char *slot = probe(set->ids, set->capacity, id);
+  if (memcmp(slot, null_id, CGIT_HASH_RAW_LEN) == 0) {
+    memcpy(slot, id, CGIT_HASH_RAW_LEN);
+    set->count++;
+  }
+  return CGIT_OK;
+}
+
+void oid_set_free(oid_set_t *set) {
+  free(set->ids);
+  *set = (oid_set_t){0};
+}
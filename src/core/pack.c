@@ -0,0 +1,850 @@
+/*
+ * Packfile reader.
+ *
+ * A pack is "PACK" + version + object count, followed by one entry per
+ * object (a variable-length type/size header and a zlib stream) and a
+ * trailing SHA-1 over everything before it.
+ *
+ * Lookups go through the pack's .idx (version 2): a 256-entry fanout table
+ * narrows the search to the ids sharing the first byte, and a binary search
+ * over the sorted raw ids finds the entry offset. The .idx is mmap'd when
+ * packs are first prepared; the .pack itself is only mapped the first time
+ * an entry is actually read, so existence checks never touch it.
+ *
+ * Deltified entries name their base either by distance back into the same
+ * pack (OFS_DELTA) or by object id (REF_DELTA). Reading one resolves the
+ * base first, recursively, and then applies the delta on top of it.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "../include/common.h"
+#include "../include/core.h"
+
+/*
+ * Each repository keeps its own list in repo->packs. Packs are only ever
+ * prepended, so readers walk it without a lock.
+ */
+typedef struct packed_git {
+  char path[CGIT_MAX_PATH_LENGTH]; /* the .pack; the .idx sits next to it */
+  unsigned char *idx_map;
+  size_t idx_len;
+  uint32_t num_objects;
+  const unsigned char *fanout;
+  const unsigned char *ids;
+  const unsigned char *offsets32;
+  const unsigned char *offsets64;
+  size_t num_offsets64;
+  unsigned char *map; /* NULL until the first entry is read */
+  size_t map_len;
+  struct packed_git *next;
+} packed_git_t;
+
+static uint32_t get_be32(const unsigned char *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint64_t get_be64(const unsigned char *p) {
+  return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+/*
+ * Entry header: the first byte holds a continuation bit, the 3-bit type and
+ * the low 4 bits of the inflated size; each following byte adds 7 more size
+ * bits for as long as the continuation bit is set.
+ */
+static cgit_error_t parse_entry_header(const packed_git_t *p, size_t offset,
+                                       object_type_t *type, size_t *size,
+                                       size_t *header_len) {
+  size_t end = p->map_len - CGIT_HASH_RAW_LEN;
+  size_t i = offset;
+
+  if (i >= end) goto corrupt;
+
+  unsigned char c = p->map[i++];
+  *type = (object_type_t)((c >> 4) & 7);
+  size_t val = c & 15;
+  unsigned int shift = 4;
+
+  while (c & 0x80) {
+    if (i >= end || shift > sizeof(size_t) * 8 - 7) goto corrupt;
+    c = p->map[i++];
+    val |= (size_t)(c & 0x7f) << shift;
+    shift += 7;
+  }
+
+  *size = val;
+  *header_len = i - offset;
+  return CGIT_OK;
+
+corrupt:
+  cgit_report("error: %s: corrupt entry header at offset %zu\n", p->path,
+              offset);
+  return CGIT_ERROR_INVALID_OBJECT;
+}
+
+/*
+ * Inflate one entry whose inflated size is known from its header. The
+ * output is NUL-terminated like read_object's payload; *consumed reports
+ * how many compressed bytes the stream used, which is where the next entry
+ * starts.
+ */
+static cgit_error_t inflate_entry(const unsigned char *in, size_t avail,
+                                  size_t size, buffer_t *out,
+                                  size_t *consumed) {
+  cgit_error_t result = CGIT_OK;
+  int strm_initialized = 0;
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+
+  if (size == SIZE_MAX) {
+    result = CGIT_ERROR_MEMORY;
+    goto cleanup;
+  }
+
+  out->data = malloc(size + 1);
+  if (!out->data) {
+    cgit_report("out of memory\n");
+    result = CGIT_ERROR_MEMORY;
+    goto cleanup;
+  }
+  out->capacity = size + 1;
+  out->size = 0;
+
+  if (inflateInit(&strm) != Z_OK) {
+    cgit_report("error: inflateInit failed\n");
+    result = CGIT_ERROR_COMPRESSION;
+    goto cleanup;
+  }
+  strm_initialized = 1;
+
+  /* One spare output byte lets zlib report a stream longer than its header */
+  const unsigned char *in_end = in + avail;
+  unsigned char *out_end = out->data + size + 1;
+  int zret;
+  strm.next_in = (Bytef *)in;
+  strm.next_out = out->data;
+
+  /* avail_in/avail_out are uInt, so refill them at most UINT_MAX at a time */
+  uint64_t start = trace_begin();
+  do {
+    if (strm.avail_in == 0) {
+      size_t left = (size_t)(in_end - strm.next_in);
+      strm.avail_in = left > UINT_MAX ? UINT_MAX : (uInt)left;
+    }
+    if (strm.avail_out == 0) {
+      size_t left = (size_t)(out_end - strm.next_out);
+      strm.avail_out = left > UINT_MAX ? UINT_MAX : (uInt)left;
+    }
+
+    zret = inflate(&strm, Z_NO_FLUSH);
+  } while (zret == Z_OK);
+
+  out->size = (size_t)(strm.next_out - out->data);
+  trace_end(TRACE_INFLATE, start, out->size);
+  if (zret != Z_STREAM_END || out->size != size) {
+    cgit_report("error: inflate failed (corrupt pack entry?)\n");
+    result = CGIT_ERROR_COMPRESSION;
+    goto cleanup;
+  }
+
+  out->data[size] = '\0';
+  *consumed = (size_t)(strm.next_in - in);
+
+cleanup:
+  if (strm_initialized) inflateEnd(&strm);
+  if (result != CGIT_OK) buffer_free(out);
+  return result;
+}
+
+static void free_pack(packed_git_t *p) {
+  if (!p) return;
+  if (p->idx_map) munmap(p->idx_map, p->idx_len);
+  if (p->map) munmap(p->map, p->map_len);
+  free(p);
+}
+
+static cgit_error_t map_file(const char *path, unsigned char **map_out,
+                             size_t *len_out) {
+  cgit_error_t result = CGIT_OK;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    cgit_report("error: cannot open '%s': %s\n", path, strerror(errno));
+    return CGIT_ERROR_FILE_NOT_FOUND;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    cgit_report("stat: %s: %s\n", path, strerror(errno));
+    result = CGIT_ERROR_IO;
+    goto cleanup;
+  }
+
+  if (st.st_size == 0) {
+    cgit_report("error: '%s' is empty\n", path);
+    result = CGIT_ERROR_INVALID_OBJECT;
+    goto cleanup;
+  }
+
+  void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    cgit_report("error: cannot mmap '%s': %s\n", path, strerror(errno));
+    result = CGIT_ERROR_IO;
+    goto cleanup;
+  }
+
+  *map_out = map;
+  *len_out = (size_t)st.st_size;
+
+cleanup:
+  close(fd);
+  return result;
+}
+
+/*
+ * .idx v2 layout: "\377tOc", version, fanout[256], ids[N], crc32[N],
+ * offset32[N], offset64[M], pack checksum, idx checksum. An offset32 entry
+ * with the top bit set is an index into offset64 instead of an offset.
+ */
+static cgit_error_t open_pack_index(const char *idx_path,
+                                    const char *pack_path,
+                                    packed_git_t **pack_out) {
+  cgit_error_t result = CGIT_OK;
+  packed_git_t *p = NULL;
+
+  p = calloc(1, sizeof(*p));
+  if (!p) {
+    result = CGIT_ERROR_MEMORY;
+    goto cleanup;
+  }
+  snprintf(p->path, sizeof(p->path), "%s", pack_path);
+
+  result = map_file(idx_path, &p->idx_map, &p->idx_len);
+  if (result != CGIT_OK) goto cleanup;
+
+  size_t min_len = CGIT_PACK_IDX_HEADER_SIZE + 2 * CGIT_HASH_RAW_LEN;
+  if (p->idx_len < min_len ||
+      memcmp(p->idx_map, CGIT_PACK_IDX_SIGNATURE, 4) != 0 ||
+      get_be32(p->idx_map + 4) != CGIT_PACK_IDX_VERSION) {
+    cgit_report("error: %s is not a version %d pack index\n", idx_path,
+                CGIT_PACK_IDX_VERSION);
+    result = CGIT_ERROR_INVALID_OBJECT;
+    goto cleanup;
+  }
+
+  p->fanout = p->idx_map + 8;
+  uint32_t prev = 0;
+  for (int i = 0; i < 256; i++) {
+    uint32_t n = get_be32(p->fanout + 4 * i);
+    if (n < prev) {
+      cgit_report("error: %s: non-monotonic fanout table\n", idx_path);
+      result = CGIT_ERROR_INVALID_OBJECT;
+      goto cleanup;
+    }
+    prev = n;
+  }
+  p->num_objects = prev;
+
+  size_t n = p->num_objects;
+  size_t tables_len = n * (CGIT_HASH_RAW_LEN + 4 + 4);
+  if (p->idx_len - min_len < tables_len ||
+      (p->idx_len - min_len - tables_len) % 8 != 0) {
+    cgit_report("error: %s: truncated pack index\n", idx_path);
+    result = CGIT_ERROR_INVALID_OBJECT;
+    goto cleanup;
+  }
+
+  p->ids = p->idx_map + CGIT_PACK_IDX_HEADER_SIZE;
+  p->offsets32 = p->ids + n * (CGIT_HASH_RAW_LEN + 4);
+  p->offsets64 = p->offsets32 + n * 4;
+  p->num_offsets64 = (p->idx_len - min_len - tables_len) / 8;
+
+  *pack_out = p;
+  p = NULL;
+
+cleanup:
+  free_pack(p);
+  return result;
+}
+
+/* Map the .pack on first use and make sure it is the one the .idx describes */
+static cgit_error_t map_pack(packed_git_t *p) {
+  unsigned char *map = NULL;
+  size_t map_len = 0;
+  cgit_error_t result = map_file(p->path, &map, &map_len);
+  if (result != CGIT_OK) return result;
+
+  const unsigned char *idx_pack_sum =
+      p->idx_map + p->idx_len - 2 * CGIT_HASH_RAW_LEN;
+
+  if (map_len < CGIT_PACK_HEADER_SIZE + CGIT_HASH_RAW_LEN ||
+      memcmp(map, CGIT_PACK_SIGNATURE, 4) != 0 ||
+      get_be32(map + 4) != CGIT_PACK_VERSION ||
+      get_be32(map + 8) != p->num_objects ||
+      memcmp(map + map_len - CGIT_HASH_RAW_LEN, idx_pack_sum,
+             CGIT_HASH_RAW_LEN) != 0) {
+    cgit_report("error: %s does not match its index\n", p->path);
+    munmap(map, map_len);
+    return CGIT_ERROR_INVALID_OBJECT;
+  }
+
+  p->map = map;
+  p->map_len = map_len;
+  return CGIT_OK;
+}
+
+static cgit_error_t use_pack(packed_git_t *p) {
+  cgit_repo_t *repo = repo_current();
+  cgit_error_t result = CGIT_OK;
+
+  pthread_mutex_lock(&repo->map_lock);
+  if (!p->map) result = map_pack(p);
+  pthread_mutex_unlock(&repo->map_lock);
+  return result;
+}
+
+static int pack_known(const packed_git_t *head, const char *pack_path) {
+  for (const packed_git_t *p = head; p; p = p->next)
+    if (strcmp(p->path, pack_path) == 0) return 1;
+  return 0;
+}
+
+/* Adds the packs not in the list yet; called with packs_lock held */
+static int scan_packs(void) {
+  cgit_repo_t *repo = repo_current();
+  char pack_dir[CGIT_MAX_PATH_LENGTH];
+  int added = 0;
+
+  if (repo_path(pack_dir, sizeof(pack_dir), CGIT_PACK_DIR) != CGIT_OK)
+    return 0;
+  DIR *dir = opendir(pack_dir);
+  if (!dir) return 0;
+
+  /* As in git, a pack is only visible once its .idx exists */
+  struct dirent *dir_entry;
+  while ((dir_entry = readdir(dir)) != NULL) {
+    size_t len = strlen(dir_entry->d_name);
+    if (len < 4 || strcmp(dir_entry->d_name + len - 4, ".idx") != 0)
+      continue;
+
+    char idx_path[CGIT_MAX_PATH_LENGTH];
+    char pack_path[CGIT_MAX_PATH_LENGTH];
+    int written = snprintf(idx_path, sizeof(idx_path), "%s/%s", pack_dir,
+                           dir_entry->d_name);
+    if (written < 0 || (size_t)written >= sizeof(idx_path)) continue;
+    written = snprintf(pack_path, sizeof(pack_path), "%s/%.*s.pack", pack_dir,
+                       (int)(len - 4), dir_entry->d_name);
+    if (written < 0 || (size_t)written >= sizeof(pack_path)) continue;
+
+    packed_git_t *head = atomic_load(&repo->packs);
+    if (pack_known(head, pack_path)) continue;
+
+    /* A broken index is reported and skipped; the others stay usable */
+    packed_git_t *p = NULL;
+    if (open_pack_index(idx_path, pack_path, &p) != CGIT_OK) continue;
+
+    p->next = head;
+    atomic_store(&repo->packs, p);
+    added++;
+  }
+
+  closedir(dir);
+  return added;
+}
+
+/* Worker threads may look objects up, so the first scan is serialized */
+static packed_git_t *prepare_packs(void) {
+  cgit_repo_t *repo = repo_current();
+
+  if (!atomic_load(&repo->packs_scanned)) {
+    pthread_mutex_lock(&repo->packs_lock);
+    if (!atomic_load(&repo->packs_scanned)) {
+      scan_packs();
+      atomic_store(&repo->packs_scanned, 1);
+    }
+    pthread_mutex_unlock(&repo->packs_lock);
+  }
+  return atomic_load(&repo->packs);
+}
+
+/*
+ * Rescan the pack directory for packs written since the last scan, as
+ * git's reprepare_packed_git does. Readers call this after an object was
+ * in neither the known packs nor loose, since a repack with --prune may
+ * have moved it. Returns the number of packs added.
+ */
+int packs_reprepare(void) {
+  cgit_repo_t *repo = repo_current();
+
+  pthread_mutex_lock(&repo->packs_lock);
+  int added = scan_packs();
+  atomic_store(&repo->packs_scanned, 1);
+  pthread_mutex_unlock(&repo->packs_lock);
+  return added;
+}
+
+void packs_release(cgit_repo_t *repo) {
+  packed_git_t *p = atomic_load(&repo->packs);
+  while (p) {
+    packed_git_t *next = p->next;
+    free_pack(p);
+    p = next;
+  }
+  atomic_store(&repo->packs, NULL);
+}
+
+static int idx_lookup(const packed_git_t *p, const unsigned char *id,
+                      size_t *offset_out) {
+  uint32_t lo = id[0] ? get_be32(p->fanout + 4 * (id[0] - 1)) : 0;
+  uint32_t hi = get_be32(p->fanout + 4 * id[0]);
+
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    int cmp =
+        memcmp(p->ids + (size_t)mid * CGIT_HASH_RAW_LEN, id, CGIT_HASH_RAW_LEN);
+
+    if (cmp == 0) {
+      uint32_t off = get_be32(p->offsets32 + 4 * (size_t)mid);
+      if (off & 0x80000000u) {
+        size_t large = off & 0x7fffffffu;
+        if (large >= p->num_offsets64) return 0;
+        *offset_out = (size_t)get_be64(p->offsets64 + 8 * large);
+      } else {
+        *offset_out = off;
+      }
+      return 1;
+    }
+
+    if (cmp < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return 0;
+}
+
+static int find_pack_entry(const char *hash, packed_git_t **pack_out,
+                           size_t *offset_out) {
+  char raw[CGIT_HASH_RAW_LEN];
+  hex_to_bytes_hash((const unsigned char *)hash, raw);
+
+  for (packed_git_t *p = prepare_packs(); p; p = p->next) {
+    if (idx_lookup(p, (const unsigned char *)raw, offset_out)) {
+      *pack_out = p;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+cgit_error_t packed_object_exists(const char *hash) {
+  packed_git_t *p;
+  size_t offset;
+
+  if (!find_pack_entry(hash, &p, &offset)) return CGIT_ERROR_FILE_NOT_FOUND;
+  return CGIT_OK;
+}
+
+/* OFS_DELTA distance, see encode_ofs_delta in pack_write.c */
+static cgit_error_t parse_ofs_delta(const packed_git_t *p, size_t *pos,
+                                    size_t offset, size_t *base_out) {
+  size_t end = p->map_len - CGIT_HASH_RAW_LEN;
+  size_t i = *pos;
+
+  if (i >= end) goto corrupt;
+  unsigned char c = p->map[i++];
+  size_t ofs = c & 0x7f;
+
+  while (c & 0x80) {
+    if (i >= end || ofs > (SIZE_MAX >> 7) - 1) goto corrupt;
+    c = p->map[i++];
+    ofs = ((ofs + 1) << 7) | (c & 0x7f);
+  }
+
+  if (ofs == 0 || ofs > offset - CGIT_PACK_HEADER_SIZE) goto corrupt;
+
+  *base_out = offset - ofs;
+  *pos = i;
+  return CGIT_OK;
+
+corrupt:
+  cgit_report("error: %s: bad delta base offset at %zu\n", p->path, offset);
+  return CGIT_ERROR_INVALID_OBJECT;
+}
+
+static cgit_error_t unpack_entry(packed_git_t *p, size_t offset, int depth,
+                                 object_type_t *type_out, buffer_t *out);
+
+/* REF_DELTA bases may live in any pack, or loose */
+static cgit_error_t unpack_ref_base(const unsigned char *id, int depth,
+                                    object_type_t *type_out, buffer_t *out) {
+  size_t base_offset;
+
+  for (packed_git_t *bp = prepare_packs(); bp; bp = bp->next) {
+    if (idx_lookup(bp, id, &base_offset))
+      return unpack_entry(bp, base_offset, depth, type_out, out);
+  }
+
+  char hex[CGIT_HASH_HEX_LEN + 1];
+  git_object_t base = {0};
+  bytes_to_hex_hash(id, hex);
+
+  cgit_error_t result = read_object(hex, &base);
+  if (result != CGIT_OK) return result;
+
+  *type_out = object_type_from_name(base.type);
+  out->data = base.data;
+  out->size = base.size;
+  out->capacity = base.size + 1;
+  base.data = NULL;
+  free_object(&base);
+  return CGIT_OK;
+}
+
+/*
+ * Inflate the entry at offset into out, resolving delta chains. *type_out
+ * is the type of the object at the end of the chain, never a delta type.
+ */
+static cgit_error_t unpack_entry(packed_git_t *p, size_t offset, int depth,
+                                 object_type_t *type_out, buffer_t *out) {
+  cgit_error_t result = CGIT_OK;
+  buffer_t base = {0};
+  buffer_t delta = {0};
+
+  if (depth > CGIT_PACK_MAX_DELTA_CHAIN) {
+    cgit_report("error: %s: delta chain too deep\n", p->path);
+    return CGIT_ERROR_INVALID_OBJECT;
+  }
+
+  result = use_pack(p);
+  if (result != CGIT_OK) return result;
+
+  object_type_t type;
+  size_t size, header_len, consumed;
+  result = parse_entry_header(p, offset, &type, &size, &header_len);
+  if (result != CGIT_OK) return result;
+
+  size_t data_start = offset + header_len;
+
+  switch (type) {
+    case OBJ_COMMIT:
+    case OBJ_TREE:
+    case OBJ_BLOB:
+    case OBJ_TAG:
+      *type_out = type;
+      return inflate_entry(p->map + data_start,
+                           p->map_len - CGIT_HASH_RAW_LEN - data_start, size,
+                           out, &consumed);
+
+    case OBJ_OFS_DELTA: {
+      size_t base_offset;
+      result = parse_ofs_delta(p, &data_start, offset, &base_offset);
+      if (result != CGIT_OK) goto cleanup;
+
+      result = unpack_entry(p, base_offset, depth + 1, type_out, &base);
+      if (result != CGIT_OK) goto cleanup;
+      break;
+    }
+
+    case OBJ_REF_DELTA: {
+      if (data_start + CGIT_HASH_RAW_LEN > p->map_len - CGIT_HASH_RAW_LEN) {
+        cgit_report("error: %s: truncated delta at %zu\n", p->path, offset);
+        result = CGIT_ERROR_INVALID_OBJECT;
+        goto cleanup;
+      }
+
+      result = unpack_ref_base(p->map + data_start, depth + 1, type_out,
+                               &base);
+      if (result != CGIT_OK) goto cleanup;
+      data_start += CGIT_HASH_RAW_LEN;
+      break;
+    }
+
+    default:
+      cgit_report("error: %s: unsupported entry type %d\n", p->path, (int)type);
+      return CGIT_ERROR_INVALID_OBJECT;
+  }
+
+  result = inflate_entry(p->map + data_start,
+                         p->map_len - CGIT_HASH_RAW_LEN - data_start, size,
+                         &delta, &consumed);
+  if (result != CGIT_OK) goto cleanup;
+
+  result = apply_delta(base.data, base.size, delta.data, delta.size, out);
+
+cleanup:
+  buffer_free(&base);
+  buffer_free(&delta);
+  return result;
+}
+
+/*
+ * Inflates only the start of a delta: the result size is the second of the
+ * two varints that open every delta, so a few bytes of output are enough.
+ */
+static cgit_error_t peek_delta_size(const packed_git_t *p, size_t data_start,
+                                    size_t *size_out) {
+  unsigned char head[CGIT_DELTA_HEADER_MAX];
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+
+  if (inflateInit(&strm) != Z_OK) {
+    cgit_report("error: inflateInit failed\n");
+    return CGIT_ERROR_COMPRESSION;
+  }
+
+  size_t avail = p->map_len - CGIT_HASH_RAW_LEN - data_start;
+  strm.next_in = (Bytef *)(p->map + data_start);
+  strm.avail_in = avail > UINT_MAX ? UINT_MAX : (uInt)avail;
+  strm.next_out = head;
+  strm.avail_out = sizeof(head);
+
+  int zret = inflate(&strm, Z_NO_FLUSH);
+  size_t len = (size_t)(strm.next_out - head);
+  inflateEnd(&strm);
+
+  if (zret != Z_OK && zret != Z_STREAM_END && zret != Z_BUF_ERROR) {
+    cgit_report("error: %s: corrupt delta at %zu\n", p->path, data_start);
+    return CGIT_ERROR_COMPRESSION;
+  }
+
+  return delta_result_size(head, len, size_out);
+}
+
+static cgit_error_t unpack_entry_header(packed_git_t *p, size_t offset,
+                                        int depth, object_type_t *type_out,
+                                        size_t *size_out);
+
+/* Only the type of a REF_DELTA base is needed, wherever it lives */
+static cgit_error_t ref_base_type(const unsigned char *id, int depth,
+                                  object_type_t *type_out) {
+  size_t base_offset;
+
+  for (packed_git_t *bp = prepare_packs(); bp; bp = bp->next) {
+    if (idx_lookup(bp, id, &base_offset))
+      return unpack_entry_header(bp, base_offset, depth, type_out, NULL);
+  }
+
+  char hex[CGIT_HASH_HEX_LEN + 1];
+  char type[CGIT_MAX_TYPE_LEN];
+  size_t size;
+  bytes_to_hex_hash(id, hex);
+
+  cgit_error_t result = read_object_header(hex, type, sizeof(type), &size);
+  if (result != CGIT_OK) return result;
+
+  *type_out = object_type_from_name(type);
+  return CGIT_OK;
+}
+
+/*
+ * Type and size of an entry without inflating it. A delta's size comes from
+ * its own prefix; its type is that of the chain's base, found by following
+ * entry headers only. size_out may be NULL when only the type is wanted.
+ */
+static cgit_error_t unpack_entry_header(packed_git_t *p, size_t offset,
+                                        int depth, object_type_t *type_out,
+                                        size_t *size_out) {
+  if (depth > CGIT_PACK_MAX_DELTA_CHAIN) {
+    cgit_report("error: %s: delta chain too deep\n", p->path);
+    return CGIT_ERROR_INVALID_OBJECT;
+  }
+
+  cgit_error_t result = use_pack(p);
+  if (result != CGIT_OK) return result;
+
+  object_type_t type;
+  size_t size, header_len;
+  result = parse_entry_header(p, offset, &type, &size, &header_len);
+  if (result != CGIT_OK) return result;
+
+  size_t data_start = offset + header_len;
+
+  switch (type) {
+    case OBJ_COMMIT:
+    case OBJ_TREE:
+    case OBJ_BLOB:
+    case OBJ_TAG:
+      *type_out = type;
+      if (size_out) *size_out = size;
+      return CGIT_OK;
+
+    case OBJ_OFS_DELTA: {
+      size_t base_offset;
+      result = parse_ofs_delta(p, &data_start, offset, &base_offset);
+      if (result != CGIT_OK) return result;
+
+      if (size_out) {
+        result = peek_delta_size(p, data_start, size_out);
+        if (result != CGIT_OK) return result;
+      }
+      return unpack_entry_header(p, base_offset, depth + 1, type_out, NULL);
+    }
+
+    case OBJ_REF_DELTA:
+      if (data_start + CGIT_HASH_RAW_LEN > p->map_len - CGIT_HASH_RAW_LEN) {
+        cgit_report("error: %s: truncated delta at %zu\n", p->path, offset);
+        return CGIT_ERROR_INVALID_OBJECT;
+      }
+
+      if (size_out) {
+        result = peek_delta_size(p, data_start + CGIT_HASH_RAW_LEN, size_out);
+        if (result != CGIT_OK) return result;
+      }
+      return ref_base_type(p->map + data_start, depth + 1, type_out);
+
+    default:
+      cgit_report("error: %s: unsupported entry type %d\n", p->path, (int)type);
+      return CGIT_ERROR_INVALID_OBJECT;
+  }
+}
+
+cgit_error_t read_packed_object_header(const char *hash,
+                                       object_type_t *type_out,
+                                       size_t *size_out) {
+  packed_git_t *p;
+  size_t offset;
+
+  if (!find_pack_entry(hash, &p, &offset)) return CGIT_ERROR_FILE_NOT_FOUND;
+  return unpack_entry_header(p, offset, 0, type_out, size_out);
+}
+
+/* A miss is reported as CGIT_ERROR_FILE_NOT_FOUND without printing */
+cgit_error_t read_packed_object(const char *hash, git_object_t *obj) {
+  cgit_error_t result = CGIT_OK;
+  buffer_t entry = {0};
+  packed_git_t *p;
+  size_t offset;
+
+  if (!find_pack_entry(hash, &p, &offset)) return CGIT_ERROR_FILE_NOT_FOUND;
+
+  object_type_t type;
+  result = unpack_entry(p, offset, 0, &type, &entry);
+  if (result != CGIT_OK) goto cleanup;
+
+  const char *type_name = object_type_name(type);
+  if (!type_name) {
+    result = CGIT_ERROR_INVALID_OBJECT;
+    goto cleanup;
+  }
+
+  obj->type = strdup(type_name);
+  if (!obj->type) {
+    result = CGIT_ERROR_MEMORY;
+    goto cleanup;
+  }
+
+  /* Hand the inflated buffer over; it is already NUL-terminated */
+  obj->size = entry.size;
+  obj->data = entry.data;
+  entry.data = NULL;
+
+cleanup:
+  buffer_free(&entry);
+  return result;
+}
+
+/*
+ * Whole (non-delta) entries are inflated straight from the mapped pack into
+ * sink, one CGIT_COMPRESSION_BUFFER_SIZE chunk at a time. A delta needs its
+ * base in memory anyway, so deltified entries are materialized with
+ * unpack_entry and handed to sink in one piece.
+ */
+cgit_error_t stream_packed_object(const char *hash, object_type_t *type_out,
+                                  size_t *size_out, object_sink_fn sink,
+                                  void *sink_data) {
+  cgit_error_t result = CGIT_OK;
+  unsigned char out[CGIT_COMPRESSION_BUFFER_SIZE];
+  buffer_t entry = {0};
+  packed_git_t *p;
+  size_t offset;
+
+  if (!find_pack_entry(hash, &p, &offset)) return CGIT_ERROR_FILE_NOT_FOUND;
+
+  result = use_pack(p);
+  if (result != CGIT_OK) return result;
+
+  object_type_t type;
+  size_t size, header_len;
+  result = parse_entry_header(p, offset, &type, &size, &header_len);
+  if (result != CGIT_OK) return result;
+
+  if (type == OBJ_OFS_DELTA || type == OBJ_REF_DELTA) {
+    result = unpack_entry(p, offset, 0, type_out, &entry);
+    if (result != CGIT_OK) return result;
+
+    *size_out = entry.size;
+    result = sink(entry.data, entry.size, sink_data);
+    buffer_free(&entry);
+    return result;
+  }
+
+  if (!object_type_name(type)) {
+    cgit_report("error: %s: unsupported entry type %d\n", p->path, (int)type);
+    return CGIT_ERROR_INVALID_OBJECT;
+  }
+
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  if (inflateInit(&strm) != Z_OK) {
+    cgit_report("error: inflateInit failed\n");
+    return CGIT_ERROR_COMPRESSION;
+  }
+
+  size_t data_start = offset + header_len;
+  const unsigned char *in_end = p->map + p->map_len - CGIT_HASH_RAW_LEN;
+  size_t seen = 0;
+  int zret;
+  strm.next_in = (Bytef *)(p->map + data_start);
+
+  do {
+    if (strm.avail_in == 0) {
+      size_t left = (size_t)(in_end - strm.next_in);
+      strm.avail_in = left > UINT_MAX ? UINT_MAX : (uInt)left;
+    }
+    strm.next_out = out;
+    strm.avail_out = sizeof(out);
+
+    uint64_t start = trace_begin();
+    zret = inflate(&strm, Z_NO_FLUSH);
+    trace_end(TRACE_INFLATE, start, sizeof(out) - strm.avail_out);
+    if (zret != Z_OK && zret != Z_STREAM_END) break;
+
+    size_t produced = sizeof(out) - strm.avail_out;
+    seen += produced;
+    if (seen > size) break;
+
+    result = sink(out, produced, sink_data);
+    if (result != CGIT_OK) goto cleanup;
+  } while (zret != Z_STREAM_END);
+
+  if (zret != Z_STREAM_END || seen != size) {
+    cgit_report("error: inflate failed (corrupt pack entry?)\n");
+    result = CGIT_ERROR_COMPRESSION;
+    goto cleanup;
+  }
+
+  *type_out = type;
+  *size_out = size;
+
+cleanup:
+  inflateEnd(&strm);
+  return result;
+}
@@ -0,0 +1,531 @@
+/*
+ * Packfile writer.
+ *
+ * Each entry is an entry header carrying the type and inflated size, then
+ * the zlib-compressed payload without the "<type> <size>\0" prefix loose
+ * objects have. Objects are written sorted by type and decreasing size, and
+ * each one is tried as a delta against the last `window` objects of the
+ * same type (git's sliding window); when a delta wins it is stored as an
+ * OFS_DELTA entry pointing back at its base. The pack is written to a
+ * temporary file next to its final location while a running SHA-1 is kept
+ * over every byte; that checksum becomes both the trailer and the pack name.
+ *
+ * The matching .idx (version 2) is built from the id, offset and CRC32 of
+ * every entry once the pack is complete, and renamed into place last: a
+ * pack only becomes visible to readers when its index exists.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "../include/common.h"
+#include "../include/core.h"
+
+typedef struct {
+  unsigned char id[CGIT_HASH_RAW_LEN];
+  uint64_t offset;
+  uint32_t crc;
+} pack_idx_entry_t;
+
+typedef struct {
+  const char *hash;
+  object_type_t type;
+  size_t size;
+} pack_object_t;
+
+/* A recently written object kept around as a delta base candidate */
+typedef struct {
+  git_object_t obj;
+  delta_index_t *index;
+  object_type_t type;
+  int depth;
+  uint64_t offset;
+} window_slot_t;
+
+static size_t encode_entry_header(object_type_t type, size_t size,
+                                  unsigned char *out) {
+  size_t n = 0;
+  unsigned char c = (unsigned char)((type << 4) | (size & 15));
+  size >>= 4;
+
+  while (size) {
+    out[n++] = c | 0x80;
+    c = size & 0x7f;
+    size >>= 7;
+  }
+  out[n++] = c;
+
+  return n;
+}
+
+static void put_be32(unsigned char *p, uint32_t v) {
+  p[0] = (unsigned char)(v >> 24);
+  p[1] = (unsigned char)(v >> 16);
+  p[2] = (unsigned char)(v >> 8);
+  p[3] = (unsigned char)v;
+}
+
+/* Write and checksum in one step so the trailer always covers the bytes */
+static cgit_error_t pack_write_bytes(FILE *file, hash_ctx_t *ctx,
+                                     const void *data, size_t len) {
+  if (fwrite(data, 1, len, file) != len) {
+    cgit_report("error: short write on pack\n");
+    return CGIT_ERROR_IO;
+  }
+  return hash_update(ctx, data, len);
+}
+
+/*
+ * Write one entry: header, the OFS_DELTA base distance when there is one,
+ * then the compressed data (the object payload or the delta). *written is
+ * the number of bytes the entry occupies in the pack.
+ */
+static cgit_error_t write_pack_entry(FILE *file, hash_ctx_t *ctx,
+                                     compress_ctx_t *zctx, object_type_t type,
+                                     const unsigned char *ofs, size_t ofs_len,
+                                     const unsigned char *data, size_t len,
+                                     pack_idx_entry_t *idx_entry,
+                                     size_t *written) {
+  cgit_error_t result = CGIT_OK;
+  buffer_t compressed = {0};
+
+  unsigned char header[CGIT_PACK_ENTRY_HEADER_MAX];
+  size_t header_len = encode_entry_header(type, len, header);
+
+  result = compress_ctx_deflate(zctx, data, len, &compressed);
+  if (result != CGIT_OK) goto cleanup;
+
+  result = pack_write_bytes(file, ctx, header, header_len);
+  if (result != CGIT_OK) goto cleanup;
+
+  if (ofs_len) {
+    result = pack_write_bytes(file, ctx, ofs, ofs_len);
+    if (result != CGIT_OK) goto cleanup;
+  }
+
+  result = pack_write_bytes(file, ctx, compressed.data, compressed.size);
+  if (result != CGIT_OK) goto cleanup;
+
+  /* The index CRC covers the raw entry bytes, header included */
+  uLong crc = crc32(0L, Z_NULL, 0);
+  crc = crc32_z(crc, header, header_len);
+  if (ofs_len) crc = crc32_z(crc, ofs, ofs_len); /* NULL would reset it */
+  crc = crc32_z(crc, compressed.data, compressed.size);
+
+  idx_entry->crc = (uint32_t)crc;
+  *written = header_len + ofs_len + compressed.size;
+
+cleanup:
+  buffer_free(&compressed);
+  return result;
+}
+
+/*
+ * OFS_DELTA distance: big-endian base-128 where every continuation step
+ * also adds one, so no two encodings describe the same distance.
+ */
+static size_t encode_ofs_delta(uint64_t ofs, unsigned char *out) {
+  unsigned char buf[CGIT_PACK_ENTRY_HEADER_MAX];
+  size_t pos = sizeof(buf) - 1;
+
+  buf[pos] = ofs & 0x7f;
+  while (ofs >>= 7) buf[--pos] = 0x80 | (--ofs & 0x7f);
+
+  memcpy(out, buf + pos, sizeof(buf) - pos);
+  return sizeof(buf) - pos;
+}
+
+static void free_window_slot(window_slot_t *slot) {
+  free_object(&slot->obj);
+  free_delta_index(slot->index);
+  memset(slot, 0, sizeof(*slot));
+}
+
+/*
+ * Look for the smallest delta of obj against the window. A delta is only
+ * worth storing when it is well under half the object; each better
+ * candidate tightens the limit for the next, so the search gets cheaper as
+ * it goes.
+ */
+static cgit_error_t find_delta(const window_slot_t *slots, int window,
+                               int max_depth, object_type_t type,
+                               const git_object_t *obj, buffer_t *best,
+                               int *best_slot) {
+  *best_slot = -1;
+  if (obj->size < CGIT_PACK_MIN_DELTA_SIZE) return CGIT_OK;
+
+  size_t limit = obj->size / 2 - CGIT_HASH_RAW_LEN;
+
+  for (int s = 0; s < window; s++) {
+    const window_slot_t *slot = &slots[s];
+    buffer_t delta = {0};
+
+    if (!slot->index || slot->type != type || slot->depth >= max_depth)
+      continue;
+    /* Bases far smaller than the target cannot supply most of it */
+    if (slot->obj.size < obj->size / 32) continue;
+
+    cgit_error_t result =
+        create_delta(slot->index, obj->data, obj->size, limit, &delta);
+    if (result != CGIT_OK) return result;
+    if (!delta.data) continue;
+
+    buffer_free(best);
+    *best = delta;
+    *best_slot = s;
+    if (delta.size <= 1) break;
+    limit = delta.size - 1;
+  }
+
+  return CGIT_OK;
+}
+
+/* Same type first, then largest first: bases precede their deltas */
+static int cmp_pack_object(const void *a, const void *b) {
+  const pack_object_t *x = a;
+  const pack_object_t *y = b;
+
+  if (x->type != y->type) return x->type < y->type ? -1 : 1;
+  if (x->size != y->size) return x->size > y->size ? -1 : 1;
+  return memcmp(x->hash, y->hash, CGIT_HASH_HEX_LEN);
+}
+
+static int cmp_idx_entry(const void *a, const void *b) {
+  return memcmp(((const pack_idx_entry_t *)a)->id,
+                ((const pack_idx_entry_t *)b)->id, CGIT_HASH_RAW_LEN);
+}
+
+static cgit_error_t write_pack_index(pack_idx_entry_t *entries, size_t count,
+                                     const unsigned char *pack_sum,
+                                     const char *idx_path, int durable) {
+  cgit_error_t result = CGIT_OK;
+  hash_ctx_t ctx = {0};
+  FILE *file = NULL;
+  char tmp_path[CGIT_MAX_PATH_LENGTH];
+  int tmp_created = 0;
+  unsigned char word[8];
+
+  qsort(entries, count, sizeof(*entries), cmp_idx_entry);
+
+  result = repo_path(tmp_path, sizeof(tmp_path),
+                     CGIT_PACK_DIR "/tmp_idx_XXXXXX");
+  if (result != CGIT_OK) return result;
+
+  int fd = mkstemp(tmp_path);
+  if (fd < 0) {
+    cgit_report("error: cannot create temporary index: %s\n", strerror(errno));
+    return CGIT_ERROR_IO;
+  }
+  tmp_created = 1;
+
+  /* Packs and indexes are immutable once written, as in git */
+  fchmod(fd, 0444);
+
+  file = fdopen(fd, "wb");
+  if (!file) {
+    close(fd);
+    cgit_report("error: cannot open '%s': %s\n", tmp_path, strerror(errno));
+    result = CGIT_ERROR_IO;
+    goto cleanup;
+  }
+
+  result = hash_init(&ctx);
+  if (result != CGIT_OK) goto cleanup;
+
+  memcpy(word, CGIT_PACK_IDX_SIGNATURE, 4);
+  put_be32(word + 4, CGIT_PACK_IDX_VERSION);
+  result = pack_write_bytes(file, &ctx, word, 8);
+  if (result != CGIT_OK) goto cleanup;
+
+  /* fanout[b] = number of ids whose first byte is <= b */
+  size_t pos = 0;
+  for (int b = 0; b < 256; b++) {
+    while (pos < count && entries[pos].id[0] == b) pos++;
+    put_be32(word, (uint32_t)pos);
+    result = pack_write_bytes(file, &ctx, word, 4);
+    if (result != CGIT_OK) goto cleanup;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    result = pack_write_bytes(file, &ctx, entries[i].id, CGIT_HASH_RAW_LEN);
+    if (result != CGIT_OK) goto cleanup;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    put_be32(word, entries[i].crc);
+    result = pack_write_bytes(file, &ctx, word, 4);
+    if (result != CGIT_OK) goto cleanup;
+  }
+
+  /* Offsets that do not fit in 31 bits go to the trailing 64-bit table */
+  uint32_t num_large = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (entries[i].offset < 0x80000000u)
+      put_be32(word, (uint32_t)entries[i].offset);
+    else
+      put_be32(word, 0x80000000u | num_large++);
+    result = pack_write_bytes(file, &ctx, word, 4);
+    if (result != CGIT_OK) goto cleanup;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    if (entries[i].offset < 0x80000000u) continue;
+    put_be32(word, (uint32_t)(entries[i].offset >> 32));
+    put_be32(word + 4, (uint32_t)entries[i].offset);
+    result = pack_write_bytes(file, &ctx, word, 8);
+    if (result != CGIT_OK) goto cleanup;
+  }
+
+  result = pack_write_bytes(file, &ctx, pack_sum, CGIT_HASH_RAW_LEN);
+  if (result != CGIT_OK) goto cleanup;
+
+  unsigned char idx_sum[CGIT_HASH_RAW_LEN];
+  result = hash_final(&ctx, idx_sum);
+  if (result != CGIT_OK) goto cleanup;
+
+  if (fwrite(idx_sum, 1, sizeof(idx_sum), file) != sizeof(idx_sum) ||
+      fflush(file) != 0) {
+    cgit_report("error: short write on '%s'\n", tmp_path);
+    result = CGIT_ERROR_IO;
+    goto cleanup;
+  }
+  result = object_file_sync(fileno(file), tmp_path, durable);
+  if (result != CGIT_OK) goto cleanup;
+
+  int close_failed = fclose(file);
+  file = NULL;
+  if (close_failed) {
+    cgit_report("error: cannot write '%s': %s\n", tmp_path, strerror(errno));
+    result = CGIT_ERROR_IO;
+    goto cleanup;
+  }
+
+  if (rename(tmp_path, idx_path) != 0) {
+    cgit_report("error: cannot rename '%s' to '%s': %s\n", tmp_path,
+                idx_path, strerror(errno));
+    result = CGIT_ERROR_IO;
+    goto cleanup;
+  }
+  tmp_created = 0;
+
+cleanup:
+  if (file) fclose(file);
+  if (tmp_created) unlink(tmp_path);
+  hash_ctx_free(&ctx);
+  return result;
+}
+
+cgit_error_t write_pack(const char (*hashes)[CGIT_HASH_HEX_LEN + 1],
+                        size_t count, const pack_options_t *opts,
+                        char *pack_hash_out) {
+  cgit_error_t result = CGIT_OK;
+  hash_ctx_t ctx = {0};
+  compress_ctx_t *zctx = NULL;
+  FILE *file = NULL;
+  char pack_dir[CGIT_MAX_PATH_LENGTH];
+  char tmp_path[CGIT_MAX_PATH_LENGTH];
+  int tmp_created = 0;
+  pack_idx_entry_t *idx_entries = NULL;
+  pack_object_t *objects = NULL;
+  window_slot_t *slots = NULL;
+  git_object_t obj = {0};
+  buffer_t delta = {0};
+  int window = opts->window > 0 ? opts->window : 0;
+
+  if (count > UINT32_MAX) {
+    cgit_report("error: too many objects for one pack\n");
+    return CGIT_ERROR_INVALID_ARGS;
+  }
+
+  if (repo_path(pack_dir, sizeof(pack_dir), CGIT_PACK_DIR) != CGIT_OK ||
+      repo_path(tmp_path, sizeof(tmp_path),
+                CGIT_PACK_DIR "/tmp_pack_XXXXXX") != CGIT_OK)
+    return CGIT_ERROR_IO;
+
+  if (mkdir(pack_dir, 0755) != 0 && errno != EEXIST) {
+    cgit_report("error: cannot create directory '%s': %s\n", pack_dir,
+                strerror(errno));
+    return CGIT_ERROR_IO;
+  }
+
+  idx_entries = malloc(count * sizeof(*idx_entries) + 1);
+  objects = malloc(count * sizeof(*objects) + 1);
+  slots = calloc((size_t)window + 1, sizeof(*slots));
+  if (!idx_entries || !objects || !slots) {
+    cgit_report("error: out of memory\n");
+    result = CGIT_ERROR_MEMORY;
+    goto cleanup;
+  }
+
+  /* First pass: type and size of every object, to order the window */
+  for (size_t i = 0; i < count; i++) {
+    char type[CGIT_MAX_TYPE_LEN];
+
+    result = read_object_header(hashes[i], type, sizeof(type),
+                                &objects[i].size);
+    if (result != CGIT_OK) {
+      cgit_report("error: cannot read object %s\n", hashes[i]);
+      goto cleanup;
+    }
+
+    objects[i].hash = hashes[i];
+    objects[i].type = object_type_from_name(type);
+    if (objects[i].type == OBJ_NONE) {
+      cgit_report("error: object %s has unknown type '%s'\n", hashes[i], type);
+      result = CGIT_ERROR_INVALID_OBJECT;
+      goto cleanup;
+    }
+  }
+  qsort(objects, count, sizeof(*objects), cmp_pack_object);
+
+  int fd = mkstemp(tmp_path);
+  if (fd < 0) {
+    cgit_report("error: cannot create temporary pack: %s\n", strerror(errno));
+    result = CGIT_ERROR_IO;
+    goto cleanup;
+  }
+  tmp_created = 1;
+
+  /* Packs and indexes are immutable once written, as in git */
+  fchmod(fd, 0444);
+
+  file = fdopen(fd, "wb");
+  if (!file) {
+    close(fd);
+    cgit_report("error: cannot open '%s': %s\n", tmp_path, strerror(errno));
+    result = CGIT_ERROR_IO;
+    goto cleanup;
+  }
+
+  result = hash_init(&ctx);
+  if (result != CGIT_OK) goto cleanup;
+
+  /* One deflate stream, reset per entry, serves the whole pack */
+  result = compress_ctx_create(compression_level(CGIT_COMPRESS_PACK), &zctx);
+  if (result != CGIT_OK) goto cleanup;
+
+  unsigned char header[CGIT_PACK_HEADER_SIZE];
+  memcpy(header, CGIT_PACK_SIGNATURE, 4);
+  put_be32(header + 4, CGIT_PACK_VERSION);
+  put_be32(header + 8, (uint32_t)count);
+
+  result = pack_write_bytes(file, &ctx, header, sizeof(header));
+  if (result != CGIT_OK) goto cleanup;
+
+  uint64_t offset = CGIT_PACK_HEADER_SIZE;
+  for (size_t i = 0; i < count; i++) {
+    const pack_object_t *po = &objects[i];
+    size_t written;
+    int base = -1;
+
+    result = read_object(po->hash, &obj);
+    if (result != CGIT_OK) goto cleanup;
+
+    if (window) {
+      result =
+          find_delta(slots, window, opts->depth, po->type, &obj, &delta, &base);
+      if (result != CGIT_OK) goto cleanup;
+    }
+
+    hex_to_bytes_hash((const unsigned char *)po->hash,
+                      (char *)idx_entries[i].id);
+    idx_entries[i].offset = offset;
+
+    if (base >= 0) {
+      unsigned char ofs[CGIT_PACK_ENTRY_HEADER_MAX];
+      size_t ofs_len = encode_ofs_delta(offset - slots[base].offset, ofs);
+      result = write_pack_entry(file, &ctx, zctx, OBJ_OFS_DELTA, ofs,
+                                ofs_len, delta.data, delta.size,
+                                &idx_entries[i], &written);
+    } else {
+      result = write_pack_entry(file, &ctx, zctx, po->type, NULL, 0,
+                                obj.data, obj.size, &idx_entries[i], &written);
+    }
+    if (result != CGIT_OK) goto cleanup;
+
+    /* The object just written replaces the oldest window slot */
+    if (window) {
+      int depth = base >= 0 ? slots[base].depth + 1 : 0;
+      window_slot_t *slot = &slots[i % (size_t)window];
+      free_window_slot(slot);
+
+      result = create_delta_index(obj.data, obj.size, &slot->index);
+      if (result != CGIT_OK) goto cleanup;
+      slot->obj = obj;
+      slot->type = po->type;
+      slot->depth = depth;
+      slot->offset = offset;
+      memset(&obj, 0, sizeof(obj));
+    }
+    free_object(&obj);
+    buffer_free(&delta);
+
+    offset += written;
+  }
+
+  unsigned char trailer[CGIT_HASH_RAW_LEN];
+  result = hash_final(&ctx, trailer);
+  if (result != CGIT_OK) goto cleanup;
+
+  if (fwrite(trailer, 1, sizeof(trailer), file) != sizeof(trailer) ||
+      fflush(file) != 0) {
+    cgit_report("error: short write on '%s'\n", tmp_path);
+    result = CGIT_ERROR_IO;
+    goto cleanup;
+  }
+  result = object_file_sync(fileno(file), tmp_path, opts->durable);
+  if (result != CGIT_OK) goto cleanup;
+
+  int close_failed = fclose(file);
+  file = NULL;
+  if (close_failed) {
+    cgit_report("error: cannot write '%s': %s\n", tmp_path, strerror(errno));
+    result = CGIT_ERROR_IO;
+    goto cleanup;
+  }
+
+  bytes_to_hex_hash(trailer, pack_hash_out);
+
+  char pack_path[CGIT_MAX_PATH_LENGTH];
+  result = repo_path(pack_path, sizeof(pack_path),
+                     CGIT_PACK_DIR "/pack-%s.pack", pack_hash_out);
+  if (result != CGIT_OK) goto cleanup;
+
+  if (rename(tmp_path, pack_path) != 0) {
+    cgit_report("error: cannot rename '%s' to '%s': %s\n", tmp_path,
+                pack_path, strerror(errno));
+    result = CGIT_ERROR_IO;
+    goto cleanup;
+  }
+  tmp_created = 0;
+
+  char idx_path[CGIT_MAX_PATH_LENGTH];
+  result = repo_path(idx_path, sizeof(idx_path), CGIT_PACK_DIR "/pack-%s.idx",
+                     pack_hash_out);
+  if (result != CGIT_OK) goto cleanup;
+
+  result = write_pack_index(idx_entries, count, trailer, idx_path,
+                            opts->durable);
+
+  /* Both renames must survive a crash before anything relies on them */
+  if (result == CGIT_OK && opts->durable) result = object_dir_sync(pack_dir);
+
+cleanup:
+  if (file) fclose(file);
+  if (tmp_created) unlink(tmp_path);
+  hash_ctx_free(&ctx);
+  compress_ctx_free(zctx);
+  buffer_free(&delta);
+  free_object(&obj);
+  for (int i = 0; slots && i < window; i++) free_window_slot(&slots[i]);
+  free(slots);
+  free(objects);
+  free(idx_entries);
+  return result;
+}
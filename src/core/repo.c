@@ -0,0 +1,77 @@
+/*
+ * Repositories: which one a thread is working on, paths inside it, and
+ * where messages go.
+ *
+ * Core functions take no repository argument. Each thread has a current
+ * repository instead, which libcgit entry points set with repo_enter for
+ * the length of a call, and which pool workers inherit from the thread
+ * that created the pool. A thread that never entered one, such as the
+ * command-line tool's main thread, works on the repository in the
+ * working directory, with paths relative to it as before.
+ *
+ * cgit_report is how core code speaks: to stderr normally, and into the
+ * calling thread's cgit_last_error buffer inside a libcgit call.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/common.h"
+#include "../include/core.h"
+
+static cgit_repo_t working_repo = CGIT_REPO_INIT;
+static _Thread_local cgit_repo_t *current_repo = NULL;
+static _Thread_local char last_error[CGIT_ERROR_MESSAGE_MAX];
+
+cgit_repo_t *repo_current(void) {
+  return current_repo ? current_repo : &working_repo;
+}
+
+/* Make repo this thread's repository; returns the one to restore */
+cgit_repo_t *repo_enter(cgit_repo_t *repo) {
+  cgit_repo_t *previous = current_repo;
+  current_repo = repo;
+  return previous;
+}
+
+void repo_leave(cgit_repo_t *previous) { current_repo = previous; }
+
+/* Format a path inside the current repository, e.g. ".cgit/objects/ab" */
+cgit_error_t repo_path(char *path_out, size_t path_size, const char *fmt,
+                       ...) {
+  const char *root = repo_current()->root;
+  int prefix = root ? snprintf(path_out, path_size, "%s/", root) : 0;
+  if (prefix < 0 || (size_t)prefix >= path_size) goto truncated;
+
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(path_out + prefix, path_size - (size_t)prefix, fmt, args);
+  va_end(args);
+  if (n < 0 || (size_t)n >= path_size - (size_t)prefix) goto truncated;
+  return CGIT_OK;
+
+truncated:
+  cgit_report("error: path too long in '%s'\n", root ? root : ".");
+  return CGIT_ERROR_IO;
+}
+
+void cgit_report(const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+
+  if (!repo_current()->keep_errors) {
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    return;
+  }
+
+  /* One line per message, without its newline */
+  vsnprintf(last_error, sizeof(last_error), fmt, args);
+  va_end(args);
+  last_error[strcspn(last_error, "\n")] = '\0';
+}
+
+/* The last message reported on this thread, or "" */
+const char *cgit_last_error(void) { return last_error; }
@@ -0,0 +1,194 @@
+/*
+ * Multi-buffer SHA-1 (AVX2).
+ *
+ * SHA-1 is a serial chain within one message, so a single small object
+ * cannot use wide registers. Eight independent messages can: each 32-bit
+ * lane of a 256-bit register carries one message's state, and all eight
+ * advance through the 80 rounds together. A lane whose message ends is
+ * refilled with the next job right away, so messages of different lengths
+ * do not hold each other up.
+ *
+ * Only hash_batch uses this; single streams stay with OpenSSL.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../include/common.h"
+#include "../include/core.h"
+
+#if !defined(CGIT_NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__GNUC__) || defined(__clang__))
+#define SHA1_MB_X86 1
+#include <immintrin.h>
+#endif
+
+#define MB_LANES 8
+#define SHA1_BLOCK 64
+
+#ifdef SHA1_MB_X86
+
+static const uint32_t sha1_iv[5] = {0x67452301, 0xefcdab89, 0x98badcfe,
+                                    0x10325476, 0xc3d2e1f0};
+
+typedef struct {
+  hash_job_t *job; /* NULL when the lane is idle */
+  size_t block;    /* next block to process */
+  size_t blocks;   /* blocks in the padded message */
+} lane_t;
+
+static size_t padded_blocks(size_t len) {
+  return (len + 8) / SHA1_BLOCK + 1;
+}
+
+/*
+ * The lane's current block of its padded message. Blocks wholly inside the
+ * data are read in place; the last one or two are assembled in scratch.
+ */
+static const unsigned char *message_block(const lane_t *lane,
+                                          unsigned char *scratch) {
+  const hash_job_t *job = lane->job;
+  size_t offset = lane->block * SHA1_BLOCK;
+
+  if (offset + SHA1_BLOCK <= job->len) return job->data + offset;
+
+  memset(scratch, 0, SHA1_BLOCK);
+  if (offset <= job->len) {
+    memcpy(scratch, job->data + offset, job->len - offset);
+    scratch[job->len - offset] = 0x80;
+  }
+  if (lane->block == lane->blocks - 1) {
+    uint64_t bits = (uint64_t)job->len * 8;
+    for (int i = 0; i < 8; i++)
+      scratch[SHA1_BLOCK - 1 - i] = (unsigned char)(bits >> (8 * i));
+  }
+  return scratch;
+}
+
+static uint32_t load_be32(const unsigned char *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         (uint32_t)p[3];
+}
+
+#define ROTL(x, n)                           \
+  _mm256_or_si256(_mm256_slli_epi32((x), (n)), \
+                  _mm256_srli_epi32((x), 32 - (n)))
+
+/* One 64-byte block for every lane; state is [word][lane] */
+__attribute__((target("avx2"))) static void compress_blocks(
+    uint32_t state[5][MB_LANES], const unsigned char *blocks[MB_LANES]) {
+  __m256i w[16];
+  __m256i a = _mm256_loadu_si256((const __m256i *)state[0]);
+  __m256i b = _mm256_loadu_si256((const __m256i *)state[1]);
+  __m256i c = _mm256_loadu_si256((const __m256i *)state[2]);
+  __m256i d = _mm256_loadu_si256((const __m256i *)state[3]);
+  __m256i e = _mm256_loadu_si256((const __m256i *)state[4]);
+  __m256i a0 = a, b0 = b, c0 = c, d0 = d, e0 = e;
+
+  for (int t = 0; t < 16; t++)
+    w[t] = _mm256_setr_epi32(
+        (int)load_be32(blocks[0] + 4 * t), (int)load_be32(blocks[1] + 4 * t),
+        (int)load_be32(blocks[2] + 4 * t), (int)load_be32(blocks[3] + 4 * t),
+        (int)load_be32(blocks[4] + 4 * t), (int)load_be32(blocks[5] + 4 * t),
+        (int)load_be32(blocks[6] + 4 * t), (int)load_be32(blocks[7] + 4 * t));
+
+  for (int t = 0; t < 80; t++) {
+    __m256i wt;
+    if (t < 16) {
+      wt = w[t];
+    } else {
+      __m256i x = _mm256_xor_si256(
+          _mm256_xor_si256(w[(t - 3) & 15], w[(t - 8) & 15]),
+          _mm256_xor_si256(w[(t - 14) & 15], w[t & 15]));
+      wt = w[t & 15] = ROTL(x, 1);
+    }
+
+    __m256i f, k;
+    if (t < 20) {
+      f = _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d)));
+      k = _mm256_set1_epi32(0x5a827999);
+    } else if (t < 40) {
+      f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+      k = _mm256_set1_epi32(0x6ed9eba1);
+    } else if (t < 60) {
+      f = _mm256_or_si256(_mm256_and_si256(b, c),
+                          _mm256_and_si256(d, _mm256_or_si256(b, c)));
+      k = _mm256_set1_epi32((int)0x8f1bbcdc);
+    } else {
+      f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+      k = _mm256_set1_epi32((int)0xca62c1d6);
+    }
+
+    __m256i tmp = _mm256_add_epi32(
+        _mm256_add_epi32(ROTL(a, 5), f),
+        _mm256_add_epi32(_mm256_add_epi32(e, k), wt));
+    e = d;
+    d = c;
+    c = ROTL(b, 30);
+    b = a;
+    a = tmp;
+  }
+
+  _mm256_storeu_si256((__m256i *)state[0], _mm256_add_epi32(a, a0));
+  _mm256_storeu_si256((__m256i *)state[1], _mm256_add_epi32(b, b0));
+  _mm256_storeu_si256((__m256i *)state[2], _mm256_add_epi32(c, c0));
+  _mm256_storeu_si256((__m256i *)state[3], _mm256_add_epi32(d, d0));
+  _mm256_storeu_si256((__m256i *)state[4], _mm256_add_epi32(e, e0));
+}
+
+int sha1_mb_available(void) {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+
+void sha1_mb_batch(hash_job_t *jobs, size_t count) {
+  static const unsigned char idle_block[SHA1_BLOCK];
+  unsigned char scratch[MB_LANES][SHA1_BLOCK];
+  uint32_t state[5][MB_LANES];
+  lane_t lanes[MB_LANES] = {0};
+  size_t next = 0;
+
+  for (;;) {
+    const unsigned char *blocks[MB_LANES];
+    int active = 0;
+
+    for (int i = 0; i < MB_LANES; i++) {
+      if (!lanes[i].job && next < count) {
+        lanes[i] = (lane_t){&jobs[next], 0, padded_blocks(jobs[next].len)};
+        next++;
+        for (int j = 0; j < 5; j++) state[j][i] = sha1_iv[j];
+      }
+      blocks[i] = lanes[i].job ? message_block(&lanes[i], scratch[i])
+                               : idle_block;
+      active |= lanes[i].job != NULL;
+    }
+    if (!active) break;
+
+    compress_blocks(state, blocks);
+
+    for (int i = 0; i < MB_LANES; i++) {
+      if (!lanes[i].job || ++lanes[i].block < lanes[i].blocks) continue;
+
+      for (int j = 0; j < 5; j++) {
+        unsigned char *out = lanes[i].job->digest + 4 * j;
+        out[0] = (unsigned char)(state[j][i] >> 24);
+        out[1] = (unsigned char)(state[j][i] >> 16);
+        out[2] = (unsigned char)(state[j][i] >> 8);
+        out[3] = (unsigned char)state[j][i];
+      }
+      lanes[i].job = NULL;
+    }
+  }
+}
+
+#else
+
+int sha1_mb_available(void) { return 0; }
+
+void sha1_mb_batch(hash_job_t *jobs, size_t count) {
+  (void)jobs;
+  (void)count;
+}
+
+#endif /* SHA1_MB_X86 */
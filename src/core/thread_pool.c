@@ -0,0 +1,264 @@
+/*
+ * Work-stealing thread pool.
+ *
+ * Every worker owns a deque of tasks. Tasks spawned by a worker go on the
+ * bottom of its own deque, and the worker also pops from the bottom, so it
+ * works depth-first on data that is still warm in its cache. A worker with
+ * an empty deque steals from the top of another worker's deque instead,
+ * taking the oldest task there, which is usually the largest piece of work
+ * left. Tasks submitted from outside the pool are dealt out round-robin.
+ *
+ * Each deque has its own mutex. The pool lock is only taken to sleep when
+ * no deque has anything to run, and to wake sleepers up again.
+ *
+ * Workers run in the repository of the thread that created the pool.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/common.h"
+#include "../include/core.h"
+
+typedef struct {
+  thread_task_fn fn;
+  void *arg;
+} task_t;
+
+typedef struct {
+  pthread_mutex_t lock;
+  task_t *tasks; /* ring buffer; the top (oldest task) is at head */
+  size_t head;
+  size_t count;
+  size_t capacity;
+} task_deque_t;
+
+typedef struct {
+  thread_pool_t *pool;
+  size_t id;
+  pthread_t thread;
+  task_deque_t deque;
+} worker_t;
+
+struct thread_pool {
+  cgit_repo_t *repo;
+  worker_t *workers;
+  size_t num_workers;
+  size_t num_started;
+  atomic_size_t queued;  /* tasks sitting in a deque */
+  atomic_size_t pending; /* tasks submitted and not yet finished */
+  atomic_size_t idle;    /* workers asleep, or about to be */
+  atomic_size_t next;    /* round-robin target for outside submissions */
+  pthread_mutex_t lock;
+  pthread_cond_t work_cond;
+  pthread_cond_t done_cond;
+  int stop;
+};
+
+static _Thread_local worker_t *current_worker = NULL;
+
+static cgit_error_t deque_push(task_deque_t *dq, task_t task) {
+  cgit_error_t result = CGIT_OK;
+
+  pthread_mutex_lock(&dq->lock);
+  if (dq->count == dq->capacity) {
+    size_t new_cap = dq->capacity ? dq->capacity * 2 : 64;
+    task_t *tmp = malloc(new_cap * sizeof(*tmp));
+    if (!tmp) {
+      result = CGIT_ERROR_MEMORY;
+      goto cleanup;
+    }
+
+    /* Unroll the ring so the top ends up at index 0 */
+    for (size_t i = 0; i < dq->count; i++)
+      tmp[i] = dq->tasks[(dq->head + i) % dq->capacity];
+    free(dq->tasks);
+    dq->tasks = tmp;
+    dq->head = 0;
+    dq->capacity = new_cap;
+  }
+
+  dq->tasks[(dq->head + dq->count) % dq->capacity] = task;
+  dq->count++;
+
+cleanup:
+  pthread_mutex_unlock(&dq->lock);
+  return result;
+}
+
+/* The owner takes the newest task */
+static int deque_pop(task_deque_t *dq, task_t *task_out) {
+  int found = 0;
+
+  pthread_mutex_lock(&dq->lock);
+  if (dq->count) {
+    dq->count--;
+    *task_out = dq->tasks[(dq->head + dq->count) % dq->capacity];
+    found = 1;
+  }
+  pthread_mutex_unlock(&dq->lock);
+  return found;
+}
+
+/* A thief takes the oldest task */
+static int deque_steal(task_deque_t *dq, task_t *task_out) {
+  int found = 0;
+
+  pthread_mutex_lock(&dq->lock);
+  if (dq->count) {
+    *task_out = dq->tasks[dq->head];
+    dq->head = (dq->head + 1) % dq->capacity;
+    dq->count--;
+    found = 1;
+  }
+  pthread_mutex_unlock(&dq->lock);
+  return found;
+}
+
+static int find_task(worker_t *self, task_t *task_out) {
+  thread_pool_t *pool = self->pool;
+
+  if (deque_pop(&self->deque, task_out)) return 1;
+
+  for (size_t i = 1; i < pool->num_workers; i++) {
+    worker_t *victim = &pool->workers[(self->id + i) % pool->num_workers];
+    if (deque_steal(&victim->deque, task_out)) return 1;
+  }
+  return 0;
+}
+
+static void *worker_main(void *arg) {
+  worker_t *self = arg;
+  thread_pool_t *pool = self->pool;
+  current_worker = self;
+  repo_enter(pool->repo);
+
+  for (;;) {
+    task_t task;
+
+    if (find_task(self, &task)) {
+      atomic_fetch_sub(&pool->queued, 1);
+      task.fn(task.arg);
+
+      if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->done_cond);
+        pthread_mutex_unlock(&pool->lock);
+      }
+      continue;
+    }
+
+    /*
+     * idle is raised before queued is checked, and submitters raise queued
+     * before checking idle, so a task pushed now either is seen here or
+     * gets a wakeup, which cannot be delivered until we are waiting.
+     */
+    pthread_mutex_lock(&pool->lock);
+    atomic_fetch_add(&pool->idle, 1);
+    while (atomic_load(&pool->queued) == 0 && !pool->stop)
+      pthread_cond_wait(&pool->work_cond, &pool->lock);
+    atomic_fetch_sub(&pool->idle, 1);
+    int stop = pool->stop && atomic_load(&pool->queued) == 0;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (stop) break;
+  }
+
+  return NULL;
+}
+
+cgit_error_t thread_pool_create(size_t num_threads, thread_pool_t **pool_out) {
+  if (num_threads == 0) return CGIT_ERROR_INVALID_ARGS;
+
+  thread_pool_t *pool = calloc(1, sizeof(*pool));
+  if (!pool) return CGIT_ERROR_MEMORY;
+
+  pool->workers = calloc(num_threads, sizeof(*pool->workers));
+  if (!pool->workers) {
+    free(pool);
+    return CGIT_ERROR_MEMORY;
+  }
+
+  pool->num_workers = num_threads;
+  pool->repo = repo_current();
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work_cond, NULL);
+  pthread_cond_init(&pool->done_cond, NULL);
+
+  for (size_t i = 0; i < num_threads; i++) {
+    pool->workers[i].pool = pool;
+    pool->workers[i].id = i;
+    pthread_mutex_init(&pool->workers[i].deque.lock, NULL);
+  }
+
+  for (size_t i = 0; i < num_threads; i++) {
+    int err = pthread_create(&pool->workers[i].thread, NULL, worker_main,
+                             &pool->workers[i]);
+    if (err != 0) {
+      cgit_report("error: cannot start worker thread: %s\n", strerror(err));
+      thread_pool_destroy(pool);
+      return CGIT_ERROR_MEMORY;
+    }
+    pool->num_started++;
+  }
+
+  *pool_out = pool;
+  return CGIT_OK;
+}
+
+cgit_error_t thread_pool_submit(thread_pool_t *pool, thread_task_fn fn,
+                                void *arg) {
+  worker_t *target = current_worker;
+  if (!target || target->pool != pool)
+    target = &pool->workers[atomic_fetch_add(&pool->next, 1) %
+                            pool->num_workers];
+
+  atomic_fetch_add(&pool->pending, 1);
+  if (deque_push(&target->deque, (task_t){fn, arg}) != CGIT_OK) {
+    atomic_fetch_sub(&pool->pending, 1);
+    cgit_report("error: out of memory\n");
+    return CGIT_ERROR_MEMORY;
+  }
+  atomic_fetch_add(&pool->queued, 1);
+
+  if (atomic_load(&pool->idle) > 0) {
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+  }
+  return CGIT_OK;
+}
+
+/* Blocks until every submitted task, including ones spawned by tasks, ran */
+void thread_pool_wait(thread_pool_t *pool) {
+  pthread_mutex_lock(&pool->lock);
+  while (atomic_load(&pool->pending) != 0)
+    pthread_cond_wait(&pool->done_cond, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_destroy(thread_pool_t *pool) {
+  if (!pool) return;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->work_cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (size_t i = 0; i < pool->num_started; i++)
+    pthread_join(pool->workers[i].thread, NULL);
+
+  for (size_t i = 0; i < pool->num_workers; i++) {
+    pthread_mutex_destroy(&pool->workers[i].deque.lock);
+    free(pool->workers[i].deque.tasks);
+  }
+
+  pthread_cond_destroy(&pool->done_cond);
+  pthread_cond_destroy(&pool->work_cond);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->workers);
+  free(pool);
+}
@@ -0,0 +1,261 @@
+/*
+ * Per-phase performance tracing, switched on by CGIT_TRACE_PERF.
+ *
+ * Core code brackets the work of each phase with trace_begin and
+ * trace_end, and bumps counters with trace_count. Both cost one relaxed
+ * load when tracing is off. When it is on, each phase keeps its calls,
+ * time and bytes in atomics, so pool workers need no lock. When a trace
+ * file was asked for, every bracket is also kept as an event.
+ *
+ *   CGIT_TRACE_PERF=1          a summary table on stderr at exit
+ *   CGIT_TRACE_PERF=/tmp/t.json  Chrome trace-event JSON written there,
+ *                              for chrome://tracing or ui.perfetto.dev
+ *
+ * Phases are leaves: none is timed inside another, so their times add up.
+ * The core only collects: the tool (or an embedder, through libcgit)
+ * decides when tracing starts and when the report is written.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/common.h"
+#include "../include/core.h"
+
+typedef enum {
+  TRACE_OFF,
+  TRACE_SUMMARY,
+  TRACE_JSON,
+} trace_mode_t;
+
+typedef struct {
+  uint64_t start; /* ns since trace_init */
+  uint64_t duration;
+  uint64_t bytes;
+  uint32_t tid;
+  uint32_t phase;
+} trace_event_t;
+
+static const char *const phase_names[TRACE_PHASE_COUNT] = {
+    [TRACE_READ] = "read",
+    [TRACE_SHA1] = "sha1",
+    [TRACE_DEFLATE] = "deflate",
+    [TRACE_INFLATE] = "inflate",
+    [TRACE_WRITE] = "write",
+    [TRACE_WALK] = "walk",
+    [TRACE_TREE_PARSE] = "tree-parse",
+    [TRACE_TREE_SERIALIZE] = "tree-serialize",
+};
+
+static const char *const counter_names[TRACE_COUNTER_COUNT] = {
+    [TRACE_OBJECTS_READ] = "objects read",
+    [TRACE_OBJECTS_WRITTEN] = "objects written",
+    [TRACE_SYSCALLS] = "syscalls",
+    [TRACE_STAT_CACHE_HITS] = "stat cache hits",
+    [TRACE_CACHE_TREE_HITS] = "cache-tree hits",
+    [TRACE_KNOWN_OBJECT_HITS] = "known object hits",
+};
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int trace_mode = TRACE_OFF;
+static int trace_initialized;
+static char trace_label[64];
+static char *trace_path;
+static uint64_t trace_epoch;
+
+static _Atomic uint64_t phase_calls[TRACE_PHASE_COUNT];
+static _Atomic uint64_t phase_ns[TRACE_PHASE_COUNT];
+static _Atomic uint64_t phase_bytes[TRACE_PHASE_COUNT];
+static _Atomic uint64_t counters[TRACE_COUNTER_COUNT];
+
+static trace_event_t *events;
+static atomic_size_t event_count;
+
+static atomic_uint next_tid = 1;
+static _Thread_local uint32_t thread_tid;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t current_tid(void) {
+  if (!thread_tid)
+    thread_tid = atomic_fetch_add_explicit(&next_tid, 1, memory_order_relaxed);
+  return thread_tid;
+}
+
+static void write_summary(FILE *out, uint64_t wall) {
+  fprintf(out, "cgit trace: %s, %.3f ms\n", trace_label, wall / 1e6);
+  fprintf(out, "  %-18s %10s %12s %14s\n", "phase", "calls", "ms", "bytes");
+  for (int i = 0; i < TRACE_PHASE_COUNT; i++) {
+    uint64_t calls = atomic_load(&phase_calls[i]);
+    if (!calls) continue;
+    fprintf(out, "  %-18s %10llu %12.3f %14llu\n", phase_names[i],
+            (unsigned long long)calls, atomic_load(&phase_ns[i]) / 1e6,
+            (unsigned long long)atomic_load(&phase_bytes[i]));
+  }
+  for (int i = 0; i < TRACE_COUNTER_COUNT; i++) {
+    uint64_t n = atomic_load(&counters[i]);
+    if (n)
+      fprintf(out, "  %-18s %10llu\n", counter_names[i], (unsigned long long)n);
+  }
+}
+
+/* Chrome's trace-event format: complete ("X") events, times in µs */
+static int write_json(FILE *out, uint64_t wall) {
+  size_t count = atomic_load(&event_count);
+  size_t dropped = 0;
+  if (count > CGIT_TRACE_MAX_EVENTS) {
+    dropped = count - CGIT_TRACE_MAX_EVENTS;
+    count = CGIT_TRACE_MAX_EVENTS;
+  }
+  long pid = (long)getpid();
+
+  fprintf(out, "{\"traceEvents\":[\n");
+  fprintf(out,
+          "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%ld,\"tid\":0,"
+          "\"args\":{\"name\":\"cgit %s\"}}",
+          pid, trace_label);
+  for (size_t i = 0; i < count; i++) {
+    const trace_event_t *e = &events[i];
+    fprintf(out,
+            ",\n{\"name\":\"%s\",\"cat\":\"cgit\",\"ph\":\"X\","
+            "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%ld,\"tid\":%u,"
+            "\"args\":{\"bytes\":%llu}}",
+            phase_names[e->phase], e->start / 1e3, e->duration / 1e3, pid,
+            e->tid, (unsigned long long)e->bytes);
+  }
+
+  fprintf(out, ",\n{\"name\":\"counters\",\"ph\":\"C\",\"ts\":%.3f,"
+               "\"pid\":%ld,\"tid\":0,\"args\":{",
+          wall / 1e3, pid);
+  for (int i = 0; i < TRACE_COUNTER_COUNT; i++)
+    fprintf(out, "%s\"%s\":%llu", i ? "," : "", counter_names[i],
+            (unsigned long long)atomic_load(&counters[i]));
+  fprintf(out, "}}\n],\"displayTimeUnit\":\"ms\",");
+  fprintf(out, "\"otherData\":{\"command\":\"%s\",\"dropped_events\":%zu}}\n",
+          trace_label, dropped);
+  return ferror(out) ? -1 : 0;
+}
+
+/*
+ * Stop tracing and write what was collected: the summary to out, or the
+ * trace file CGIT_TRACE_PERF named. Call it once the traced work has
+ * joined its threads; later calls find tracing off and do nothing.
+ */
+cgit_error_t trace_report(FILE *out) {
+  cgit_error_t result = CGIT_OK;
+  int mode = atomic_exchange(&trace_mode, TRACE_OFF);
+  uint64_t wall = now_ns() - trace_epoch;
+
+  if (mode == TRACE_SUMMARY) {
+    write_summary(out, wall);
+  } else if (mode == TRACE_JSON) {
+    FILE *json = fopen(trace_path, "w");
+    if (!json || write_json(json, wall) != 0) {
+      cgit_report("warning: cannot write trace to '%s'\n", trace_path);
+      result = CGIT_ERROR_IO;
+    }
+    if (json) fclose(json);
+  }
+
+  free(events);
+  free(trace_path);
+  events = NULL;
+  trace_path = NULL;
+  return result;
+}
+
+/*
+ * Read CGIT_TRACE_PERF once per process and start tracing when it asks
+ * for it; label names the run in the report. A value that is neither 1
+ * nor a path is reported and traced as 1.
+ */
+cgit_error_t trace_init(const char *label) {
+  cgit_error_t result = CGIT_OK;
+
+  pthread_mutex_lock(&trace_lock);
+  if (trace_initialized) goto cleanup;
+  trace_initialized = 1;
+
+  const char *value = getenv(CGIT_TRACE_ENV);
+  if (!value || !*value || strcmp(value, "0") == 0 ||
+      strcmp(value, "false") == 0)
+    goto cleanup;
+
+  snprintf(trace_label, sizeof(trace_label), "%s", label);
+  trace_epoch = now_ns();
+
+  int mode = TRACE_SUMMARY;
+  if (value[0] == '/') {
+    trace_path = strdup(value);
+    events = calloc(CGIT_TRACE_MAX_EVENTS, sizeof(*events));
+    if (trace_path && events) {
+      mode = TRACE_JSON;
+    } else {
+      free(trace_path);
+      free(events);
+      trace_path = NULL;
+      events = NULL;
+    }
+  } else if (strcmp(value, "1") != 0 && strcmp(value, "true") != 0 &&
+             strcmp(value, "summary") != 0) {
+    cgit_report("warning: %s='%s' is neither 1 nor an absolute path, "
+                "printing a summary\n",
+                CGIT_TRACE_ENV, value);
+    result = CGIT_ERROR_INVALID_ARGS;
+  }
+
+  atomic_store(&trace_mode, mode);
+
+cleanup:
+  pthread_mutex_unlock(&trace_lock);
+  return result;
+}
+
+/* A start time for trace_end, or 0 when tracing is off */
+uint64_t trace_begin(void) {
+  if (atomic_load_explicit(&trace_mode, memory_order_relaxed) == TRACE_OFF)
+    return 0;
+  return now_ns();
+}
+
+/* Charge the time since start, and bytes, to phase */
+void trace_end(trace_phase_t phase, uint64_t start, size_t bytes) {
+  if (!start) return;
+  int mode = atomic_load_explicit(&trace_mode, memory_order_relaxed);
+  if (mode == TRACE_OFF) return;
+
+  uint64_t end = now_ns();
+  atomic_fetch_add_explicit(&phase_calls[phase], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&phase_ns[phase], end - start,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&phase_bytes[phase], bytes, memory_order_relaxed);
+  if (mode != TRACE_JSON) return;
+
+  /* Past the cap, events are only counted, as dropped */
+  size_t slot = atomic_fetch_add_explicit(&event_count, 1,
+                                          memory_order_relaxed);
+  if (slot >= CGIT_TRACE_MAX_EVENTS) return;
+  events[slot] = (trace_event_t){
+      .start = start - trace_epoch,
+      .duration = end - start,
+      .bytes = bytes,
+      .tid = current_tid(),
+      .phase = (uint32_t)phase,
+  };
+}
+
+void trace_count(trace_counter_t counter, uint64_t n) {
+  if (atomic_load_explicit(&trace_mode, memory_order_relaxed) == TRACE_OFF)
+    return;
+  atomic_fetch_add_explicit(&counters[counter], n, memory_order_relaxed);
+}
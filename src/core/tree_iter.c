@@ -0,0 +1,87 @@
+/*
+ * Zero-copy tree iterator.
+ *
+ * A tree object is a run of "<octal mode> <name>\0<20-byte id>" records.
+ * The iterator walks them in place: each entry it yields points into the
+ * tree's own bytes, so nothing is allocated, copied or hex-encoded.
+ * Callers that want owned, hex-encoded entries use parse_tree, which is
+ * built on top of this.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../include/common.h"
+#include "../include/core.h"
+
+static object_type_t type_from_mode(unsigned int mode) {
+  switch (mode) {
+    case 0100644:
+    case 0100755:
+    case 0120000:
+      return OBJ_BLOB;
+    case 040000:
+      return OBJ_TREE;
+    case 0160000:
+      return OBJ_COMMIT;
+    default:
+      return OBJ_NONE;
+  }
+}
+
+void tree_iter_init(tree_iter_t *it, const unsigned char *data, size_t len) {
+  it->pos = data;
+  it->end = data + len;
+  it->error = CGIT_OK;
+}
+
+static int corrupt(tree_iter_t *it, const char *what) {
+  cgit_report("error: invalid tree content (%s)\n", what);
+  it->error = CGIT_ERROR_INVALID_OBJECT;
+  it->pos = it->end;
+  return 0;
+}
+
+/*
+ * Returns 1 and fills entry with the next entry, or 0 at the end of the
+ * tree. A malformed entry also ends the walk, with it->error set to
+ * CGIT_ERROR_INVALID_OBJECT. The entry stays valid as long as the tree's
+ * bytes do.
+ */
+int tree_iter_next(tree_iter_t *it, tree_iter_entry_t *entry) {
+  const unsigned char *p = it->pos;
+  const unsigned char *end = it->end;
+  unsigned int mode = 0;
+  size_t digits = 0;
+
+  if (p >= end) return 0;
+
+  while (p < end && *p != ' ') {
+    if (*p < '0' || *p > '7' || ++digits >= CGIT_MAX_MODE_LEN)
+      return corrupt(it, "bad mode");
+    mode = (mode << 3) | (unsigned int)(*p++ - '0');
+  }
+  if (p >= end || digits == 0) return corrupt(it, "bad mode");
+  p++; /* skip space */
+
+  const unsigned char *nul = memchr(p, '\0', (size_t)(end - p));
+  if (!nul || nul == p) return corrupt(it, "bad name");
+  if ((size_t)(end - nul - 1) < CGIT_HASH_RAW_LEN)
+    return corrupt(it, "truncated id");
+
+  entry->type = type_from_mode(mode);
+  if (entry->type == OBJ_NONE) {
+    cgit_report("fatal: invalid mode %o\n", mode);
+    it->error = CGIT_ERROR_INVALID_OBJECT;
+    it->pos = end;
+    return 0;
+  }
+
+  entry->mode = mode;
+  entry->name = (const char *)p;
+  entry->name_len = (size_t)(nul - p);
+  entry->id = nul + 1;
+
+  it->pos = nul + 1 + CGIT_HASH_RAW_LEN;
+  return 1;
+}
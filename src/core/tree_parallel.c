@@ -0,0 +1,516 @@
+/*
+ * Parallel write-tree.
+ *
+ * Produces the same trees as write_tree_recursive, spread over a
+ * thread_pool. Scanning a directory is one task. It records the entries,
+ * then submits one scan task per subdirectory and one task per large blob.
+ * Small blobs go CGIT_HASH_BATCH_SIZE to a task, so they can share one
+ * hash_batch call.
+ *
+ * Nothing ever waits for a child. Each directory counts its unfinished
+ * children, plus one for its own scan. Whichever task brings that count to
+ * zero writes the directory's tree (write_tree_object, which may reuse the
+ * index's cached hash), stores the hash in the parent's entry, and then
+ * finishes one child of the parent in turn. So
+ * trees are written bottom-up as soon as their last blob is done, and no
+ * worker sits blocked on a subtree.
+ *
+ * Each directory allocates its entries, slots and names from its own arena,
+ * released in one go once its tree is written. The root uses the caller's
+ * arena instead, since its entries are handed back.
+ *
+ * The hashes match the serial path because every entry is built the same
+ * way (same fstatat, same tree_entry_mode) and serialize_tree sorts the
+ * entries, so the order in which children finish does not matter.
+ *
+ * Each directory is opened once, when its scan starts: the root by path,
+ * every other one by name relative to its parent's fd, so no path is ever
+ * resolved twice. Its tasks then work on names relative to that fd (see
+ * core/dir_iter.c): the scan reads and stats its entries, a batch opens its
+ * files. The fd is closed with the node, so open fds are bounded by the
+ * directories that are scanned but not yet written, not by all of them.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../include/common.h"
+#include "../include/core.h"
+
+typedef struct dir_node dir_node_t;
+
+typedef struct {
+  thread_pool_t *pool;
+  index_state_t *index; /* may be NULL */
+  atomic_int error;     /* first failure; CGIT_OK while all is well */
+} tree_job_t;
+
+/* What a blob task needs: its directory, which entry, and its stat data */
+typedef struct {
+  dir_node_t *node;
+  size_t index;
+  struct stat st;
+} entry_slot_t;
+
+/* Small blobs of one directory, written by one task */
+typedef struct {
+  dir_node_t *node;
+  entry_slot_t *slots[CGIT_HASH_BATCH_SIZE];
+  size_t count;
+} blob_batch_t;
+
+struct dir_node {
+  tree_job_t *job;
+  dir_node_t *parent;
+  size_t parent_index;
+  char *path;
+  int fd; /* open from the start of its scan until the node is freed */
+  arena_t *arena; /* &own, or the caller's arena for the root */
+  arena_t own;
+  tree_entry_t *entries;
+  size_t count;
+  entry_slot_t *slots;
+  const ignore_stack_t *ignore; /* what the parent's scan left in force */
+  ignore_list_t *ignore_list;   /* this directory's .cgitignore, if any */
+  ignore_stack_t ignore_frame;
+  atomic_size_t pending; /* unfinished children, plus one while scanning */
+  atomic_size_t files;   /* blobs below, summed as children finish */
+  size_t subtrees;
+  atomic_int unchanged; /* cleared by any index miss below */
+};
+
+static void set_error(tree_job_t *job, cgit_error_t err) {
+  int expected = CGIT_OK;
+  atomic_compare_exchange_strong(&job->error, &expected, (int)err);
+}
+
+static char *join_path(const char *dir, const char *name) {
+  size_t dir_len = strlen(dir);
+  size_t name_len = strlen(name);
+  char *path = malloc(dir_len + 1 + name_len + 1);
+  if (!path) return NULL;
+
+  memcpy(path, dir, dir_len);
+  path[dir_len] = '/';
+  memcpy(path + dir_len + 1, name, name_len + 1);
+  return path;
+}
+
+static void free_dir_node(dir_node_t *node) {
+  if (node->fd >= 0) close(node->fd);
+  arena_release(&node->own);
+  ignore_free(node->ignore_list);
+  free(node->path);
+  free(node);
+}
+
+/*
+ * Called once per finished child and once at the end of the scan. The call
+ * that finishes the directory writes its tree and moves up to the parent.
+ */
+static void finish_child(dir_node_t *node) {
+  while (node && atomic_fetch_sub(&node->pending, 1) == 1) {
+    dir_node_t *parent = node->parent;
+
+    /* The root's entries are handed back to the caller instead */
+    if (!parent) return;
+
+    if (atomic_load(&node->job->error) == CGIT_OK) {
+      tree_stats_t stats = {.files = atomic_load(&node->files),
+                            .subtrees = node->subtrees,
+                            .unchanged = atomic_load(&node->unchanged)};
+      char *hash_out = parent->entries[node->parent_index].hash;
+      int reused = 0; /* set only when the write succeeds */
+
+      cgit_error_t result =
+          write_tree_object(node->path, node->job->index, node->entries,
+                            node->count, &stats, hash_out, &reused);
+      if (result != CGIT_OK) set_error(node->job, result);
+
+      /* Published before the parent's count drops below */
+      atomic_fetch_add(&parent->files, stats.files);
+      if (!reused) atomic_store(&parent->unchanged, 0);
+    }
+
+    free_dir_node(node);
+    node = parent;
+  }
+}
+
+/*
+ * Open node's directory for its scan and blob tasks. A child opens from its
+ * parent's fd, which stays open while any child is pending.
+ */
+static cgit_error_t open_node_dir(dir_node_t *node) {
+  dir_node_t *parent = node->parent;
+
+  node->fd = parent ? dir_open_at(parent->fd,
+                                  parent->entries[node->parent_index].name)
+                    : dir_open_path(node->path);
+  if (node->fd >= 0) return CGIT_OK;
+
+  cgit_report("error: cannot open directory '%s': %s\n", node->path,
+              strerror(errno));
+  return CGIT_ERROR_FILE_NOT_FOUND;
+}
+
+static void write_blob_task(void *arg) {
+  entry_slot_t *slot = arg;
+  dir_node_t *node = slot->node;
+  tree_entry_t *entry = &node->entries[slot->index];
+
+  if (atomic_load(&node->job->error) == CGIT_OK) {
+    char *path = join_path(node->path, entry->name);
+    cgit_error_t result = CGIT_ERROR_MEMORY;
+    if (path && S_ISLNK(slot->st.st_mode))
+      result = write_object_from_link(node->fd, entry->name,
+                                      (size_t)slot->st.st_size, entry->hash, 1);
+    else if (path)
+      result = write_object_from_file_at(node->fd, entry->name, entry->type,
+                                         entry->hash, 1);
+    atomic_store(&node->unchanged, 0);
+    if (result != CGIT_OK) {
+      cgit_report("Failed to create the object for '%s'\n",
+                  path ? path : entry->name);
+    } else if (node->job->index) {
+      result = index_record(node->job->index, path, &slot->st, entry->mode,
+                            entry->hash);
+    }
+    if (result != CGIT_OK) set_error(node->job, result);
+    free(path);
+  }
+
+  finish_child(node);
+}
+
+static void write_blob_batch_task(void *arg) {
+  blob_batch_t *batch = arg;
+  dir_node_t *node = batch->node;
+  const char *names[CGIT_HASH_BATCH_SIZE];
+  char *hashes[CGIT_HASH_BATCH_SIZE];
+  cgit_error_t result = CGIT_OK;
+
+  if (atomic_load(&node->job->error) != CGIT_OK) goto done;
+  atomic_store(&node->unchanged, 0);
+
+  for (size_t i = 0; i < batch->count; i++) {
+    tree_entry_t *entry = &node->entries[batch->slots[i]->index];
+    names[i] = entry->name;
+    hashes[i] = entry->hash;
+  }
+
+  /* The files are opened by name, relative to the directory's fd */
+  result = write_objects_from_files(node->fd, names, batch->count, "blob",
+                                    hashes, 1);
+  if (result != CGIT_OK) {
+    cgit_report("Failed to create the objects for '%s'\n", node->path);
+    goto done;
+  }
+
+  for (size_t i = 0; node->job->index && i < batch->count; i++) {
+    entry_slot_t *slot = batch->slots[i];
+    char *path = join_path(node->path, names[i]);
+    result = path ? index_record(node->job->index, path, &slot->st,
+                                 node->entries[slot->index].mode, hashes[i])
+                  : CGIT_ERROR_MEMORY;
+    free(path);
+    if (result != CGIT_OK) goto done;
+  }
+
+done:
+  if (result != CGIT_OK) set_error(node->job, result);
+
+  /* The batch lives in node's arena, so read the count first */
+  size_t count = batch->count;
+  for (size_t i = 0; i < count; i++) finish_child(node);
+}
+
+/* Hand a batch to the pool; its slots are finished here if that fails */
+static void submit_batch(dir_node_t *node, blob_batch_t *batch) {
+  if (thread_pool_submit(node->job->pool, write_blob_batch_task, batch) !=
+      CGIT_OK) {
+    set_error(node->job, CGIT_ERROR_MEMORY);
+    for (size_t i = 0; i < batch->count; i++) finish_child(node);
+  }
+}
+
+static cgit_error_t stat_entry(dir_node_t *node, int fd, const char *name,
+                               struct stat *st) {
+  uint64_t start = trace_begin();
+  int ret = fstatat(fd, name, st, AT_SYMLINK_NOFOLLOW);
+  trace_end(TRACE_WALK, start, 0);
+  trace_count(TRACE_SYSCALLS, 1);
+  if (ret == 0) return CGIT_OK;
+
+  cgit_report("stat: %s/%s: %s\n", node->path, name, strerror(errno));
+  return CGIT_ERROR_IO;
+}
+
+/* Whether the entry name of node, a directory if is_dir, is ignored */
+static cgit_error_t entry_ignored(dir_node_t *node, const char *name,
+                                  int is_dir, int *ignored_out) {
+  char *path = join_path(node->path, name);
+  if (!path) return CGIT_ERROR_MEMORY;
+
+  *ignored_out = ignore_match(node->ignore, path, strlen(node->path) + 1,
+                              is_dir);
+  free(path);
+  return CGIT_OK;
+}
+
+/*
+ * Entries that a .cgitignore in force matches are dropped here, before
+ * their stat when d_type allows it, so an ignored directory never gets a
+ * node at all. This directory's own .cgitignore joins node->ignore for
+ * its entries and everything below them.
+ */
+static cgit_error_t read_dir_entries(dir_node_t *node) {
+  cgit_error_t result = CGIT_OK;
+  size_t capacity = 0;
+  dir_iter_t it;
+
+  result = open_node_dir(node);
+  if (result != CGIT_OK) return result;
+  int fd = node->fd;
+
+  result = ignore_load_at(fd, node->path, &node->ignore_list);
+  if (result != CGIT_OK) return result;
+  if (node->ignore_list) {
+    node->ignore_frame = (ignore_stack_t){node->ignore_list,
+                                          strlen(node->path), node->ignore};
+    node->ignore = &node->ignore_frame;
+  }
+
+  result = dir_iter_init(&it, fd, node->path);
+  if (result != CGIT_OK) return result;
+
+  dir_iter_entry_t dir_entry;
+  while (dir_iter_next(&it, &dir_entry)) {
+    if (strcmp(dir_entry.name, CGIT_DIR) == 0) continue;
+
+    /* A directory is known from d_type; the rest need lstat data */
+    struct stat st = {.st_mode = S_IFDIR};
+    unsigned int mode;
+    const char *type;
+    int need_stat = dir_entry.type != DT_DIR;
+    if (dir_entry.type == DT_UNKNOWN) {
+      result = stat_entry(node, fd, dir_entry.name, &st);
+      if (result != CGIT_OK) goto cleanup;
+      need_stat = 0;
+    }
+
+    if (node->ignore) {
+      int ignored;
+      result = entry_ignored(node, dir_entry.name,
+                             !need_stat && S_ISDIR(st.st_mode), &ignored);
+      if (result != CGIT_OK) goto cleanup;
+      if (ignored) continue;
+    }
+
+    if (need_stat) {
+      result = stat_entry(node, fd, dir_entry.name, &st);
+      if (result != CGIT_OK) goto cleanup;
+    }
+
+    result = tree_entry_mode(&st, &mode, &type);
+    if (result != CGIT_OK) goto cleanup;
+
+    if (node->count == capacity) {
+      size_t new_cap = capacity ? capacity * 2 : 16;
+      tree_entry_t *tmp =
+          arena_grow(node->arena, node->entries, capacity * sizeof(*tmp),
+                     new_cap * sizeof(*tmp));
+      if (!tmp) {
+        result = CGIT_ERROR_MEMORY;
+        goto cleanup;
+      }
+      node->entries = tmp;
+
+      entry_slot_t *slots =
+          arena_grow(node->arena, node->slots, capacity * sizeof(*slots),
+                     new_cap * sizeof(*slots));
+      if (!slots) {
+        result = CGIT_ERROR_MEMORY;
+        goto cleanup;
+      }
+      node->slots = slots;
+      capacity = new_cap;
+    }
+
+    node->slots[node->count] = (entry_slot_t){node, node->count, st};
+    tree_entry_t *entry = &node->entries[node->count];
+    memset(entry, 0, sizeof(*entry));
+    entry->mode = mode;
+    entry->type = type;
+    entry->name = arena_strndup(node->arena, dir_entry.name,
+                                strlen(dir_entry.name));
+    if (!entry->name) {
+      result = CGIT_ERROR_MEMORY;
+      goto cleanup;
+    }
+    node->count++;
+  }
+  result = it.error;
+
+cleanup:
+  dir_iter_release(&it);
+  return result;
+}
+
+static void scan_dir_task(void *arg) {
+  dir_node_t *node = arg;
+  tree_job_t *job = node->job;
+  blob_batch_t *batch = NULL;
+
+  if (atomic_load(&job->error) != CGIT_OK) goto done;
+
+  cgit_error_t result = read_dir_entries(node);
+  if (result != CGIT_OK) {
+    set_error(job, result);
+    goto done;
+  }
+
+  /* Every child is counted before the first one can possibly finish */
+  atomic_fetch_add(&node->pending, node->count);
+
+  for (size_t i = 0; i < node->count; i++) {
+    tree_entry_t *entry = &node->entries[i];
+
+    if (strcmp(entry->type, "tree") != 0) {
+      entry_slot_t *slot = &node->slots[i];
+      atomic_fetch_add(&node->files, 1);
+
+      /* An unchanged file costs no task at all */
+      if (job->index) {
+        char *path = join_path(node->path, entry->name);
+        int hit = path && index_lookup(job->index, path, &slot->st,
+                                       entry->mode, entry->hash);
+        if (hit &&
+            index_record(job->index, path, &slot->st, entry->mode,
+                         entry->hash) != CGIT_OK)
+          set_error(job, CGIT_ERROR_MEMORY);
+        free(path);
+
+        if (hit) {
+          trace_count(TRACE_STAT_CACHE_HITS, 1);
+          finish_child(node);
+          continue;
+        }
+      }
+
+      if (S_ISREG(slot->st.st_mode) &&
+          (size_t)slot->st.st_size <= CGIT_HASH_BATCH_MAX_BLOB) {
+        if (!batch) {
+          /* Only this scan allocates from node's arena */
+          batch = arena_alloc(node->arena, sizeof(*batch));
+          if (!batch) {
+            set_error(job, CGIT_ERROR_MEMORY);
+            finish_child(node);
+            continue;
+          }
+          batch->node = node;
+          batch->count = 0;
+        }
+        batch->slots[batch->count++] = slot;
+        if (batch->count == CGIT_HASH_BATCH_SIZE) {
+          submit_batch(node, batch);
+          batch = NULL;
+        }
+        continue;
+      }
+
+      if (thread_pool_submit(job->pool, write_blob_task, slot) != CGIT_OK) {
+        set_error(job, CGIT_ERROR_MEMORY);
+        finish_child(node);
+      }
+      continue;
+    }
+
+    node->subtrees++;
+    dir_node_t *child = calloc(1, sizeof(*child));
+    char *child_path = join_path(node->path, entry->name);
+    if (!child || !child_path) {
+      free(child);
+      free(child_path);
+      set_error(job, CGIT_ERROR_MEMORY);
+      finish_child(node);
+      continue;
+    }
+
+    child->job = job;
+    child->parent = node;
+    child->parent_index = i;
+    child->path = child_path;
+    child->fd = -1;
+    child->arena = &child->own;
+    child->ignore = node->ignore;
+    atomic_init(&child->pending, 1);
+    atomic_init(&child->unchanged, 1);
+
+    if (thread_pool_submit(job->pool, scan_dir_task, child) != CGIT_OK) {
+      set_error(job, CGIT_ERROR_MEMORY);
+      finish_child(child);
+    }
+  }
+
+  if (batch) submit_batch(node, batch);
+
+done:
+  finish_child(node);
+}
+
+cgit_error_t write_tree_parallel(arena_t *arena, const char *path,
+                                 size_t num_threads, index_state_t *index,
+                                 tree_entry_t **entries_out,
+                                 size_t *count_out, tree_stats_t *stats_out) {
+  cgit_error_t result = CGIT_OK;
+  tree_job_t job = {0};
+  dir_node_t *root = NULL;
+
+  job.index = index;
+  atomic_init(&job.error, CGIT_OK);
+
+  root = calloc(1, sizeof(*root));
+  if (!root) return CGIT_ERROR_MEMORY;
+  root->job = &job;
+  root->path = strdup(path);
+  root->fd = -1;
+  root->arena = arena;
+  atomic_init(&root->pending, 1);
+  atomic_init(&root->unchanged, 1);
+  if (!root->path) {
+    result = CGIT_ERROR_MEMORY;
+    goto cleanup;
+  }
+
+  result = thread_pool_create(num_threads, &job.pool);
+  if (result != CGIT_OK) goto cleanup;
+
+  result = thread_pool_submit(job.pool, scan_dir_task, root);
+  if (result != CGIT_OK) goto cleanup;
+
+  thread_pool_wait(job.pool);
+
+  result = (cgit_error_t)atomic_load(&job.error);
+  if (result != CGIT_OK) goto cleanup;
+
+  *entries_out = root->entries;
+  *count_out = root->count;
+  stats_out->files = atomic_load(&root->files);
+  stats_out->subtrees = root->subtrees;
+  stats_out->unchanged = atomic_load(&root->unchanged);
+  root->entries = NULL;
+  root->count = 0;
+
+cleanup:
+  thread_pool_destroy(job.pool);
+  free_dir_node(root);
+  return result;
+}
@@ -1,12 +1,13 @@
-#include <ctype.h>
 #include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include "../include/common.h"
+#include "../include/core.h"
 
 cgit_error_t build_object_path(const char *hash, char *path_out,
                                size_t path_size) {
@@ -19,36 +20,50 @@ cgit_error_t build_object_path(const char *hash, char *path_out,
   dir[CGIT_DIR_BUF_SIZE - 1] = '\0';
   object[CGIT_OBJ_NAME_BUF_SIZE - 1] = '\0';
 
-  int written =
-      snprintf(path_out, path_size, CGIT_OBJECTS_DIR "/%s/%s", dir, object);
-
-  if (written < 0 || (size_t)written >= path_size) {
-    fprintf(stderr, "error: object path truncated\n");
-    return CGIT_ERROR_IO;
-  }
+  return repo_path(path_out, path_size, CGIT_OBJECTS_DIR "/%s/%s", dir, object);
+}
 
-  return CGIT_OK;
+/* The fanout directory holding hash's loose object, e.g. .cgit/objects/ab */
+cgit_error_t build_object_dir(const char *hash, char *path_out,
+                              size_t path_size) {
+  return repo_path(path_out, path_size, CGIT_OBJECTS_DIR "/%.2s", hash);
 }
 
 cgit_error_t is_valid_hash(const char *hash) {
   size_t objlen = strlen(hash);
 
   if (objlen != CGIT_HASH_HEX_LEN) {
-    fprintf(stderr,
-            "error: invalid hash name '%s': expected 40 hexadecimal "
-            "characters\n",
-            hash);
+    cgit_report("error: invalid hash name '%s': expected 40 hexadecimal "
+                "characters\n",
+                hash);
     return CGIT_ERROR_INVALID_ARGS;
   }
 
-  for (size_t i = 0; i < CGIT_HASH_HEX_LEN; i++) {
-    if (!isxdigit((unsigned char)hash[i])) {
-      fprintf(stderr,
-              "error: invalid hash name '%s': non-hexadecimal character\n",
-              hash);
-      return CGIT_ERROR_INVALID_ARGS;
-    }
+  if (!hex_is_valid(hash, CGIT_HASH_HEX_LEN)) {
+    cgit_report("error: invalid hash name '%s': non-hexadecimal character\n",
+                hash);
+    return CGIT_ERROR_INVALID_ARGS;
+  }
+  return CGIT_OK;
+}
+
+/* One thread per online CPU, capped at CGIT_MAX_THREADS */
+size_t default_jobs(void) {
+  long online = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t jobs = online > 0 ? (size_t)online : 1;
+  return jobs > CGIT_MAX_THREADS ? CGIT_MAX_THREADS : jobs;
+}
+
+/* A -j argument: a thread count from 1 to CGIT_MAX_THREADS */
+cgit_error_t parse_jobs(const char *arg, size_t *jobs_out) {
+  char *end;
+  long val = strtol(arg, &end, 10);
+
+  if (*arg == '\0' || *end != '\0' || val < 1 || val > CGIT_MAX_THREADS) {
+    cgit_report("error: invalid job count '%s'\n", arg);
+    return CGIT_ERROR_INVALID_ARGS;
   }
+  *jobs_out = (size_t)val;
   return CGIT_OK;
 }
 
@@ -60,19 +75,55 @@ void buffer_free(buffer_t *buf) {
   buf->capacity = 0;
 }
 
+/* Grow buf's capacity to at least needed bytes, doubling */
+cgit_error_t buffer_reserve(buffer_t *buf, size_t needed) {
+  if (needed <= buf->capacity) return CGIT_OK;
+
+  size_t new_cap = buf->capacity ? buf->capacity : CGIT_READ_BUFFER_SIZE;
+  while (new_cap < needed) {
+    if (new_cap > SIZE_MAX / 2) {
+      cgit_report("error: buffer too large\n");
+      return CGIT_ERROR_MEMORY;
+    }
+    new_cap *= 2;
+  }
+
+  unsigned char *tmp = realloc(buf->data, new_cap);
+  if (!tmp) {
+    cgit_report("error: out of memory\n");
+    return CGIT_ERROR_MEMORY;
+  }
+  buf->data = tmp;
+  buf->capacity = new_cap;
+  return CGIT_OK;
+}
+
+cgit_error_t buffer_append(buffer_t *buf, const void *data, size_t len) {
+  if (len > SIZE_MAX - buf->size) {
+    cgit_report("error: buffer too large\n");
+    return CGIT_ERROR_MEMORY;
+  }
+  cgit_error_t result = buffer_reserve(buf, buf->size + len);
+  if (result != CGIT_OK) return result;
+
+  memcpy(buf->data + buf->size, data, len);
+  buf->size += len;
+  return CGIT_OK;
+}
+
 cgit_error_t build_object_header(const unsigned char *data, size_t file_size,
                                  const char *type, buffer_t *output) {
   size_t header_len = snprintf(NULL, 0, "%s %zu", type, file_size);
 
   if (file_size > SIZE_MAX - header_len - 1) {
-    fprintf(stderr, "unable to represent total size\n");
+    cgit_report("unable to represent total size\n");
     return CGIT_ERROR_MEMORY;
   }
   size_t total_size = header_len + 1 + file_size;
 
   output->data = malloc(total_size);
   if (!output->data) {
-    fprintf(stderr, "error: %s\n", strerror(errno));
+    cgit_report("error: %s\n", strerror(errno));
     return CGIT_ERROR_MEMORY;
   }
 
@@ -91,12 +142,12 @@ cgit_error_t parse_object_header(const unsigned char *buf, size_t buf_len,
   size_t i = 0;
   while (i < buf_len && buf[i] != ' ') i++;
   if (i >= buf_len) {
-    fprintf(stderr, "error: invalid object header (no space after type)\n");
+    cgit_report("error: invalid object header (no space after type)\n");
     return CGIT_ERROR_INVALID_OBJECT;
   }
 
   if (i + 1 > type_len) {
-    fprintf(stderr, "error: object type too long\n");
+    cgit_report("error: object type too long\n");
     return CGIT_ERROR_INVALID_OBJECT;
   }
   memcpy(type, buf, i);
@@ -105,7 +156,7 @@ cgit_error_t parse_object_header(const unsigned char *buf, size_t buf_len,
   /* Parse decimal size until NUL */
   i++; /* Skip space */
   if (i >= buf_len) {
-    fprintf(stderr, "error: invalid object header (truncated after type)\n");
+    cgit_report("error: invalid object header (truncated after type)\n");
     return CGIT_ERROR_INVALID_OBJECT;
   }
 
@@ -116,13 +167,13 @@ cgit_error_t parse_object_header(const unsigned char *buf, size_t buf_len,
     unsigned char c = buf[i];
 
     if (c < '0' || c > '9') {
-      fprintf(stderr, "error: invalid object header (bad size)\n");
+      cgit_report("error: invalid object header (bad size)\n");
       return CGIT_ERROR_INVALID_OBJECT;
     }
     saw_digit = 1;
     size_t digit = (size_t)(c - '0');
     if (size_val > (SIZE_MAX - digit) / 10) {
-      fprintf(stderr, "error: object size too large to represent\n");
+      cgit_report("error: object size too large to represent\n");
       return CGIT_ERROR_INVALID_OBJECT;
     }
 
@@ -131,7 +182,7 @@ cgit_error_t parse_object_header(const unsigned char *buf, size_t buf_len,
   }
 
   if (!saw_digit || i == buf_len) {
-    fprintf(stderr, "error: invalid object header (no NUL)\n");
+    cgit_report("error: invalid object header (no NUL)\n");
     return CGIT_ERROR_INVALID_OBJECT;
   }
 
@@ -143,13 +194,22 @@ cgit_error_t parse_object_header(const unsigned char *buf, size_t buf_len,
   return CGIT_OK;
 }
 
+/* One read(2), charged to the read phase; callers handle EINTR */
+ssize_t read_some(int fd, void *buf, size_t len) {
+  uint64_t start = trace_begin();
+  ssize_t n = read(fd, buf, len);
+  trace_end(TRACE_READ, start, n > 0 ? (size_t)n : 0);
+  trace_count(TRACE_SYSCALLS, 1);
+  return n;
+}
+
 cgit_error_t read_file(const char *path, buffer_t *output) {
   FILE *file = NULL;
   cgit_error_t result = CGIT_OK;
 
   struct stat st;
   if (stat(path, &st) != 0) {
-    fprintf(stderr, "stat: %s: %s\n", path, strerror(errno));
+    cgit_report("stat: %s: %s\n", path, strerror(errno));
     result = CGIT_ERROR_FILE_NOT_FOUND;
     goto cleanup;
   }
@@ -157,21 +217,24 @@ cgit_error_t read_file(const char *path, buffer_t *output) {
 
   output->data = malloc(file_size);
   if (!output->data) {
-    fprintf(stderr, "error: out of memory\n");
+    cgit_report("error: out of memory\n");
     result = CGIT_ERROR_MEMORY;
     goto cleanup;
   }
 
   file = fopen(path, "rb");
   if (!file) {
-    fprintf(stderr, "error: cannot open '%s': %s\n", path, strerror(errno));
+    cgit_report("error: cannot open '%s': %s\n", path, strerror(errno));
     result = CGIT_ERROR_FILE_NOT_FOUND;
     goto cleanup;
   }
 
+  uint64_t start = trace_begin();
   size_t bytes_read = fread(output->data, 1, file_size, file);
+  trace_end(TRACE_READ, start, bytes_read);
+  trace_count(TRACE_SYSCALLS, 1);
   if (bytes_read != file_size) {
-    fprintf(stderr, "error: short read on '%s'\n", path);
+    cgit_report("error: short read on '%s'\n", path);
     result = CGIT_ERROR_IO;
     goto cleanup;
   }
@@ -0,0 +1,83 @@
+#ifndef CGIT_H
+#define CGIT_H
+
+/*
+ * libcgit: the object store as a library.
+ *
+ * A cgit_repo_t names one repository and owns everything cached about it:
+ * its configuration, pack indexes and the ids of objects known to exist.
+ * A handle may be shared by any number of threads, and a thread may use
+ * any number of handles. Functions report failure by returning a
+ * cgit_error_t; cgit_last_error() then describes it. Nothing is printed.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+
+typedef enum {
+  CGIT_OK = 0,
+  CGIT_ERROR_INVALID_ARGS,
+  CGIT_ERROR_FILE_NOT_FOUND,
+  CGIT_ERROR_MEMORY,
+  CGIT_ERROR_INVALID_OBJECT,
+  CGIT_ERROR_IO,
+  CGIT_ERROR_COMPRESSION,
+  CGIT_ERROR_HASH,
+} cgit_error_t;
+
+#define CGIT_HASH_RAW_LEN 20
+#define CGIT_HASH_HEX_LEN (CGIT_HASH_RAW_LEN * 2)
+
+typedef struct cgit_repo cgit_repo_t;
+
+typedef struct {
+  char *type;
+  size_t size;
+  unsigned char *data;
+} git_object_t;
+
+/* Names live in the arena the entries came from; type is a static string */
+typedef struct {
+  unsigned int mode; /* e.g. 0100644 */
+  const char *type;
+  char *name;
+  char hash[CGIT_HASH_HEX_LEN + 1];
+} tree_entry_t;
+
+/* A parsed tree; entries and their names belong to it */
+typedef struct {
+  tree_entry_t *entries;
+  size_t count;
+  void *storage;
+} cgit_tree_t;
+
+cgit_error_t cgit_repo_open(const char *path, cgit_repo_t **repo_out);
+void cgit_repo_close(cgit_repo_t *repo);
+const char *cgit_last_error(void);
+
+cgit_error_t cgit_object_exists(cgit_repo_t *repo, const char *hash);
+cgit_error_t cgit_read_object(cgit_repo_t *repo, const char *hash,
+                              git_object_t *obj);
+cgit_error_t cgit_write_object(cgit_repo_t *repo, const void *data,
+                               size_t len, const char *type, char *hash_out);
+void cgit_object_free(git_object_t *obj);
+
+cgit_error_t cgit_read_tree(cgit_repo_t *repo, const char *hash,
+                            cgit_tree_t *tree);
+/*
+ * Modes are real octal, as cgit_read_tree gives them; an unknown one is
+ * CGIT_ERROR_INVALID_OBJECT. entries is sorted by name in place.
+ */
+cgit_error_t cgit_write_tree(cgit_repo_t *repo, tree_entry_t *entries,
+                             size_t count, char *hash_out);
+void cgit_tree_free(cgit_tree_t *tree);
+
+/*
+ * Tracing (CGIT_TRACE_PERF) stays off unless the program starts it; the
+ * variable is read once per process. cgit_trace_report stops it and
+ * writes the summary to out, or the trace file the variable names.
+ */
+cgit_error_t cgit_trace_start(const char *label);
+cgit_error_t cgit_trace_report(FILE *out);
+
+#endif
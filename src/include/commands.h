@@ -7,5 +7,6 @@ int handle_hash_object(int argc, char *argv[]);
 int handle_ls_tree(int argc, char *argv[]);
 int handle_write_tree(int argc, char *argv[]);
 int handle_commit_tree(int argc, char *argv[]);
+int handle_pack_objects(int argc, char *argv[]);
 
 #endif
@@ -3,32 +3,66 @@
 
 #include <stddef.h>
 
-typedef enum {
-  CGIT_OK = 0,
-  CGIT_ERROR_INVALID_ARGS,
-  CGIT_ERROR_FILE_NOT_FOUND,
-  CGIT_ERROR_MEMORY,
-  CGIT_ERROR_INVALID_OBJECT,
-  CGIT_ERROR_IO,
-  CGIT_ERROR_COMPRESSION,
-  CGIT_ERROR_HASH,
-} cgit_error_t;
+/* cgit_error_t and the hash lengths are public, in cgit.h */
+#include "cgit.h"
 
 #define CGIT_DIR ".cgit"
 #define CGIT_OBJECTS_DIR CGIT_DIR "/objects"
+#define CGIT_PACK_DIR CGIT_OBJECTS_DIR "/pack"
 #define CGIT_REFS_DIR CGIT_DIR "/refs"
 #define CGIT_HEAD_FILE CGIT_DIR "/HEAD"
+#define CGIT_INDEX_FILE CGIT_DIR "/index"
+#define CGIT_INDEX_LOCK_FILE CGIT_INDEX_FILE ".lock"
+#define CGIT_CONFIG_FILE CGIT_DIR "/config"
+#define CGIT_CONFIG_LINE_MAX 1024
+#define CGIT_IGNORE_FILE ".cgitignore"
+#define CGIT_TRACE_ENV "CGIT_TRACE_PERF"
+#define CGIT_TRACE_MAX_EVENTS (1 << 20)
 
-#define CGIT_HASH_RAW_LEN 20
-#define CGIT_HASH_HEX_LEN (CGIT_HASH_RAW_LEN * 2)
 #define CGIT_COMPRESSION_BUFFER_SIZE 32768
 #define CGIT_READ_BUFFER_SIZE 8192
-#define CGIT_MAX_PATH_LENGTH 256
+#define CGIT_STREAM_THRESHOLD (1024 * 1024)
+#define CGIT_STREAM_PREHASH_MAX (64 * 1024 * 1024)
+#define CGIT_COMPRESS_SAMPLE_MIN (16 * 1024)
+#define CGIT_COMPRESS_SAMPLE_SIZE 4096
+#define CGIT_MAX_THREADS 256
+#define CGIT_HASH_BATCH_SIZE 16
+#define CGIT_HASH_BATCH_MAX_BLOB (64 * 1024)
+#define CGIT_INGEST_DEPTH 4
+#define CGIT_INGEST_OUTPUT_MAX (64 * 1024)
+#define CGIT_DIR_BUFFER_SIZE (32 * 1024)
+#define CGIT_ARENA_BLOCK_SIZE (16 * 1024)
+#define CGIT_ARENA_MAX_BLOCK (1024 * 1024)
+#define CGIT_OID_SET_MIN 64
+#define CGIT_MAX_PATH_LENGTH 1024
+#define CGIT_REPO_ROOT_MAX (CGIT_MAX_PATH_LENGTH / 2)
+#define CGIT_ERROR_MESSAGE_MAX 512
 #define CGIT_DIR_BUF_SIZE (2 + 1)
 #define CGIT_OBJ_NAME_BUF_SIZE (CGIT_HASH_HEX_LEN - 2 + 1)
 #define CGIT_DEFAULT_OBJ_TYPE "blob"
 #define CGIT_MAX_TYPE_LEN 16
 #define CGIT_MAX_MODE_LEN 8
+#define CGIT_MAX_HEADER_LEN 64
+#define CGIT_HEADER_READ_SIZE 512
+
+#define CGIT_PACK_SIGNATURE "PACK"
+#define CGIT_PACK_VERSION 2
+#define CGIT_PACK_HEADER_SIZE 12
+#define CGIT_PACK_ENTRY_HEADER_MAX 16
+#define CGIT_PACK_DEFAULT_WINDOW 10
+#define CGIT_PACK_DEFAULT_DEPTH 50
+#define CGIT_PACK_MAX_DELTA_CHAIN 10000
+#define CGIT_PACK_MIN_DELTA_SIZE 64
+#define CGIT_DELTA_HEADER_MAX 20
+#define CGIT_PACK_IDX_SIGNATURE "\377tOc"
+#define CGIT_PACK_IDX_VERSION 2
+#define CGIT_PACK_IDX_HEADER_SIZE (8 + 256 * 4)
+
+#define CGIT_INDEX_SIGNATURE "DIRC"
+#define CGIT_INDEX_VERSION 2
+#define CGIT_INDEX_HEADER_SIZE 12
+#define CGIT_INDEX_ENTRY_FIXED_SIZE 62
+#define CGIT_INDEX_EXT_TREE "TREE"
 
 #define CGIT_AUTHOR_NAME "Francesco Paparatto"
 #define CGIT_COMMITTER_NAME CGIT_AUTHOR_NAME
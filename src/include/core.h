@@ -1,34 +1,255 @@
 #ifndef CGIT_CORE_H
 #define CGIT_CORE_H
 
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "cgit.h"
 #include "common.h"
 
+struct stat;
+
+/* Numeric object types, as encoded in packfile entry headers */
+typedef enum {
+  OBJ_NONE = 0,
+  OBJ_COMMIT = 1,
+  OBJ_TREE = 2,
+  OBJ_BLOB = 3,
+  OBJ_TAG = 4,
+  OBJ_OFS_DELTA = 6,
+  OBJ_REF_DELTA = 7,
+} object_type_t;
+
+/* One tree entry, borrowed from the tree object's bytes */
+typedef struct {
+  unsigned int mode;       /* e.g. 0100644 */
+  object_type_t type;      /* OBJ_BLOB, OBJ_TREE or OBJ_COMMIT (gitlink) */
+  const char *name;        /* name_len bytes, not NUL-terminated */
+  size_t name_len;
+  const unsigned char *id; /* CGIT_HASH_RAW_LEN raw bytes */
+} tree_iter_entry_t;
+
+typedef struct {
+  const unsigned char *pos;
+  const unsigned char *end;
+  cgit_error_t error; /* set when a malformed entry ended the walk */
+} tree_iter_t;
+
+/* One directory entry from dir_iter_next */
+typedef struct {
+  const char *name;   /* valid until the next dir_iter_next */
+  unsigned char type; /* DT_REG, DT_DIR, DT_LNK, ... or DT_UNKNOWN */
+} dir_iter_entry_t;
+
+/* Entries of an open directory; see core/dir_iter.c */
+typedef struct {
+  int fd;             /* the caller's, not closed by the iterator */
+  const char *path;   /* for messages */
+  void *stream;       /* DIR *, where getdents64 is not used */
+  size_t pos;
+  size_t len;
+  cgit_error_t error; /* set when a failed read ended the walk */
+  _Alignas(8) unsigned char buf[CGIT_DIR_BUFFER_SIZE];
+} dir_iter_t;
+
+typedef struct arena_block arena_block_t;
+
+/* A zeroed arena_t is empty; see core/arena.c */
+typedef struct {
+  arena_block_t *head; /* newest block */
+  size_t next_size;    /* size of the next block to allocate */
+  void *last;          /* most recent allocation, which can grow in place */
+} arena_t;
+
 typedef struct {
-  unsigned int mode;
-  char *type;
-  char *name;
-  char hash[CGIT_HASH_HEX_LEN + 1];
-} tree_entry_t;
+  arena_block_t *block;
+  size_t used;
+} arena_mark_t;
 
+/* What write-tree learned about one directory while walking it */
 typedef struct {
-  char *type;
+  size_t files;    /* blobs in this directory and below */
+  size_t subtrees; /* immediate subdirectories */
+  int unchanged;   /* every file and subtree below matched the index */
+} tree_stats_t;
+
+/* Where time goes; see core/trace.c */
+typedef enum {
+  TRACE_READ,
+  TRACE_SHA1,
+  TRACE_DEFLATE,
+  TRACE_INFLATE,
+  TRACE_WRITE,
+  TRACE_WALK, /* getdents64 and fstatat */
+  TRACE_TREE_PARSE,
+  TRACE_TREE_SERIALIZE,
+  TRACE_PHASE_COUNT,
+} trace_phase_t;
+
+typedef enum {
+  TRACE_OBJECTS_READ,
+  TRACE_OBJECTS_WRITTEN,
+  TRACE_SYSCALLS,          /* read, write, getdents64, fstatat, fsync */
+  TRACE_STAT_CACHE_HITS,   /* files the index vouched for */
+  TRACE_CACHE_TREE_HITS,   /* directories whose cached tree was reused */
+  TRACE_KNOWN_OBJECT_HITS, /* writes skipped because the object exists */
+  TRACE_COUNTER_COUNT,
+} trace_counter_t;
+
+typedef struct {
+  void *md_ctx; /* EVP_MD_CTX, kept opaque so OpenSSL stays out of headers */
+} hash_ctx_t;
+
+/* One message for hash_batch */
+typedef struct {
+  const unsigned char *data;
+  size_t len;
+  unsigned char digest[CGIT_HASH_RAW_LEN];
+} hash_job_t;
+
+typedef struct {
+  int window; /* delta candidates tried per object, 0 disables deltas */
+  int depth;  /* longest delta chain allowed */
+  int durable; /* sync the pack whatever core.fsyncMethod says */
+} pack_options_t;
+
+/* Open-addressing set of raw ids; zero-initialize before use */
+typedef struct {
+  unsigned char (*ids)[CGIT_HASH_RAW_LEN];
+  size_t capacity; /* a power of two */
+  size_t count;
+} oid_set_t;
+
+typedef struct delta_index delta_index_t;
+typedef struct compress_ctx compress_ctx_t;
+
+typedef enum {
+  CGIT_COMPRESS_LOOSE,
+  CGIT_COMPRESS_PACK,
+} compression_target_t;
+
+/*
+ * What is known about one repository; see core/repo.c. Each module keeps
+ * its per-repository state here, under its own once-flag or lock.
+ */
+struct cgit_repo {
+  char *root;      /* directory holding .cgit; NULL for the working dir */
+  int keep_errors; /* messages go to cgit_last_error, not stderr */
+
+  /* config.c */
+  pthread_once_t config_once;
+  struct config_entry *config_entries;
+  size_t config_count;
+
+  /* compression.c */
+  pthread_once_t levels_once;
+  int levels[2];
+  int adaptive;
+
+  /* pack.c */
+  pthread_mutex_t packs_lock;
+  _Atomic int packs_scanned;
+  _Atomic(struct packed_git *) packs; /* only ever grows until close */
+  pthread_mutex_t map_lock;
+
+  /* object.c */
+  pthread_mutex_t known_lock;
+  oid_set_t known_objects;
+
+  /* object_file.c */
+  pthread_once_t fsync_once;
+  int fsync_method;
+  pthread_mutex_t pending_lock;
+  struct pending_file *pending;
+  size_t pending_count;
+  size_t pending_capacity;
+};
+
+#define CGIT_REPO_INIT                                                  \
+  {                                                                     \
+    .config_once = PTHREAD_ONCE_INIT, .levels_once = PTHREAD_ONCE_INIT, \
+    .fsync_once = PTHREAD_ONCE_INIT,                                    \
+    .packs_lock = PTHREAD_MUTEX_INITIALIZER,                            \
+    .map_lock = PTHREAD_MUTEX_INITIALIZER,                              \
+    .known_lock = PTHREAD_MUTEX_INITIALIZER,                            \
+    .pending_lock = PTHREAD_MUTEX_INITIALIZER,                          \
+  }
+
+typedef struct thread_pool thread_pool_t;
+typedef struct ignore_list ignore_list_t;
+
+/* The .cgitignore files in force for a directory, innermost first */
+typedef struct ignore_stack {
+  const ignore_list_t *list;
+  size_t base_len; /* length of the walk path of list's directory */
+  const struct ignore_stack *parent;
+} ignore_stack_t;
+typedef struct index_state index_state_t;
+typedef void (*thread_task_fn)(void *arg);
+
+/* An object borrowed from an object_reader_t, valid until its next read */
+typedef struct {
+  char type[CGIT_MAX_TYPE_LEN];
   size_t size;
-  unsigned char *data;
-} git_object_t;
+  const unsigned char *data;
+} object_view_t;
+
+typedef struct {
+  void *zstream;       /* z_stream reset between objects, not reallocated */
+  buffer_t raw;        /* compressed bytes of the current loose object */
+  buffer_t inflated;   /* header and payload of the current loose object */
+  git_object_t packed; /* current object when it came from a pack */
+} object_reader_t;
+
+typedef cgit_error_t (*loose_object_fn)(const char *hash, void *data);
+
+/* Receives an object's payload in order, one chunk per call */
+typedef cgit_error_t (*object_sink_fn)(const unsigned char *data, size_t len,
+                                       void *sink_data);
 
 cgit_error_t build_commit_content(const char *tree_hash,
                                   const char *parent_hash, const char *author,
                                   const char *email, const char *message,
                                   buffer_t *output);
+cgit_error_t build_commit_content_at(const char *tree_hash,
+                                     const char *parent_hash,
+                                     const char *author, const char *email,
+                                     const char *message, time_t timestamp,
+                                     int offset_seconds, buffer_t *output);
 
 cgit_error_t serialize_tree(tree_entry_t *entries, size_t count, buffer_t *out);
-cgit_error_t parse_tree(const unsigned char *data, size_t len,
+void tree_iter_init(tree_iter_t *it, const unsigned char *data, size_t len);
+int tree_iter_next(tree_iter_t *it, tree_iter_entry_t *entry);
+int dir_open_at(int dir_fd, const char *name);
+int dir_open_path(const char *path);
+cgit_error_t dir_iter_init(dir_iter_t *it, int dir_fd, const char *path);
+int dir_iter_next(dir_iter_t *it, dir_iter_entry_t *entry);
+void dir_iter_release(dir_iter_t *it);
+cgit_error_t ignore_load_at(int dir_fd, const char *path,
+                            ignore_list_t **list_out);
+void ignore_free(ignore_list_t *list);
+int ignore_match(const ignore_stack_t *stack, const char *entry_path,
+                 size_t name_offset, int is_dir);
+cgit_error_t parse_tree(arena_t *arena, const unsigned char *data, size_t len,
                         tree_entry_t **entries_out, size_t *count_out);
 
-cgit_error_t write_tree_recursive(const char *path, tree_entry_t **entries_out,
-                                  size_t *count_out);
+cgit_error_t write_tree_recursive(arena_t *arena, const char *path,
+                                  index_state_t *index,
+                                  tree_entry_t **entries_out,
+                                  size_t *count_out, tree_stats_t *stats_out);
+cgit_error_t write_tree_parallel(arena_t *arena, const char *path,
+                                 size_t num_threads, index_state_t *index,
+                                 tree_entry_t **entries_out, size_t *count_out,
+                                 tree_stats_t *stats_out);
+cgit_error_t write_tree_object(const char *path, index_state_t *index,
+                               tree_entry_t *entries, size_t count,
+                               const tree_stats_t *stats, char *hash_out,
+                               int *reused_out);
+cgit_error_t tree_entry_mode(const struct stat *st, unsigned int *mode_out,
+                             const char **type_out);
 
-void free_tree_entries(tree_entry_t *entries, size_t count);
 cgit_error_t hex_to_bytes_hash(const unsigned char *hex_hash, char *hash_out);
 
 cgit_error_t parse_object_header(const unsigned char *buf, size_t buf_len,
@@ -40,22 +261,169 @@ cgit_error_t build_object_header(const unsigned char *data, size_t file_size,
 
 cgit_error_t object_exists(const char *hash);
 cgit_error_t read_object(const char *hash, git_object_t *obj);
+cgit_error_t read_object_header(const char *hash, char *type, size_t type_len,
+                                size_t *size_out);
+cgit_error_t read_object_stream(const char *hash, char *type, size_t type_len,
+                                size_t *size_out, object_sink_fn sink,
+                                void *sink_data);
+cgit_error_t sink_to_file(const unsigned char *data, size_t len, void *file);
+cgit_error_t sink_to_fd(const unsigned char *data, size_t len, void *fd);
+cgit_error_t sink_to_buffer(const unsigned char *data, size_t len, void *buf);
 cgit_error_t write_object(const unsigned char *data, size_t len,
                           const char *type, char *hash_out, int persist);
+cgit_error_t write_object_from_fd(int fd, const char *path, const char *type,
+                                  char *hash_out, int persist);
+cgit_error_t write_object_from_file(const char *path, const char *type,
+                                    char *hash_out, int persist);
+cgit_error_t write_object_from_file_at(int dir_fd, const char *path,
+                                       const char *type, char *hash_out,
+                                       int persist);
+cgit_error_t write_object_from_link(int dir_fd, const char *path, size_t size,
+                                    char *hash_out, int persist);
+void object_mark_known(const unsigned char *id);
+cgit_error_t object_file_create(const char *hash, char *tmp_path,
+                                size_t tmp_size, int *fd_out);
+cgit_error_t object_file_commit(int fd, const char *tmp_path,
+                                const char *hash);
+cgit_error_t object_files_flush(void);
+cgit_error_t object_file_sync(int fd, const char *path, int durable);
+cgit_error_t object_dir_sync(const char *dir);
+cgit_error_t write_objects_from_files(int dir_fd, const char *const *paths,
+                                      size_t count, const char *type,
+                                      char *const *hashes_out, int persist);
+cgit_error_t ingest_paths(int in_fd, const char *type, int persist,
+                          size_t num_threads, object_sink_fn output,
+                          void *output_data);
 void free_object(git_object_t *obj);
+cgit_error_t for_each_loose_object(loose_object_fn fn, void *data);
+
+cgit_error_t object_reader_init(object_reader_t *reader);
+cgit_error_t object_reader_read(object_reader_t *reader, const char *hash,
+                                object_view_t *view);
+cgit_error_t object_reader_read_header(object_reader_t *reader,
+                                       const char *hash, object_view_t *view);
+void object_reader_release(object_reader_t *reader);
+
+object_type_t object_type_from_name(const char *name);
+const char *object_type_name(object_type_t type);
+
+int packs_reprepare(void);
+cgit_error_t packed_object_exists(const char *hash);
+cgit_error_t read_packed_object(const char *hash, git_object_t *obj);
+cgit_error_t read_packed_object_header(const char *hash,
+                                       object_type_t *type_out,
+                                       size_t *size_out);
+cgit_error_t stream_packed_object(const char *hash, object_type_t *type_out,
+                                  size_t *size_out, object_sink_fn sink,
+                                  void *sink_data);
+cgit_error_t write_pack(const char (*hashes)[CGIT_HASH_HEX_LEN + 1],
+                        size_t count, const pack_options_t *opts,
+                        char *pack_hash_out);
+
+cgit_error_t create_delta_index(const unsigned char *src, size_t src_len,
+                                delta_index_t **index_out);
+void free_delta_index(delta_index_t *index);
+cgit_error_t create_delta(const delta_index_t *index,
+                          const unsigned char *trg, size_t trg_len,
+                          size_t max_size, buffer_t *out);
+cgit_error_t delta_result_size(const unsigned char *delta, size_t delta_len,
+                               size_t *size_out);
+cgit_error_t apply_delta(const unsigned char *base, size_t base_len,
+                         const unsigned char *delta, size_t delta_len,
+                         buffer_t *out);
+
+cgit_error_t index_load(index_state_t **index_out);
+void index_free(index_state_t *index);
+int index_lookup(const index_state_t *index, const char *walk_path,
+                 const struct stat *st, unsigned int tree_mode,
+                 char *hash_out);
+cgit_error_t index_record(index_state_t *index, const char *walk_path,
+                          const struct stat *st, unsigned int tree_mode,
+                          const char *hash);
+int index_cached_tree(const index_state_t *index, const char *walk_path,
+                      size_t files, size_t subtrees, char *hash_out);
+cgit_error_t index_record_tree(index_state_t *index, const char *walk_path,
+                               size_t files, size_t subtrees,
+                               const char *hash);
+cgit_error_t index_commit(index_state_t *index);
+
+void *arena_alloc(arena_t *arena, size_t size);
+void *arena_grow(arena_t *arena, void *ptr, size_t old_size, size_t new_size);
+char *arena_strndup(arena_t *arena, const char *s, size_t len);
+arena_mark_t arena_mark(const arena_t *arena);
+void arena_rewind(arena_t *arena, arena_mark_t mark);
+void arena_release(arena_t *arena);
+
+int oid_set_contains(const oid_set_t *set, const unsigned char *id);
+cgit_error_t oid_set_insert(oid_set_t *set, const unsigned char *id);
+void oid_set_free(oid_set_t *set);
+
+cgit_error_t thread_pool_create(size_t num_threads, thread_pool_t **pool_out);
+cgit_error_t thread_pool_submit(thread_pool_t *pool, thread_task_fn fn,
+                                void *arg);
+void thread_pool_wait(thread_pool_t *pool);
+void thread_pool_destroy(thread_pool_t *pool);
 
 cgit_error_t compress_data(const unsigned char *input, size_t input_len,
                            buffer_t *output);
 cgit_error_t decompress_data(const unsigned char *input, size_t input_len,
                              buffer_t *output);
+int compression_level(compression_target_t target);
+int compression_level_for(const unsigned char *head, size_t len);
+cgit_error_t compress_ctx_create(int level, compress_ctx_t **ctx_out);
+cgit_error_t compress_ctx_deflate(compress_ctx_t *ctx,
+                                  const unsigned char *input,
+                                  size_t input_len, buffer_t *output);
+cgit_error_t compress_ctx_inflate(compress_ctx_t *ctx,
+                                  const unsigned char *input,
+                                  size_t input_len, buffer_t *output);
+void compress_ctx_free(compress_ctx_t *ctx);
+
+const char *config_get(const char *key);
+int config_get_int(const char *key, int *value_out);
+int config_get_bool(const char *key, int default_value);
 
 cgit_error_t compute_sha1(const unsigned char *header, size_t len,
                           char *hex_out);
+void bytes_to_hex_hash(const unsigned char *hash, char *hex_out);
+int hex_is_valid(const char *hex, size_t len);
+
+cgit_error_t hash_init(hash_ctx_t *ctx);
+cgit_error_t hash_update(hash_ctx_t *ctx, const void *data, size_t len);
+cgit_error_t hash_final(hash_ctx_t *ctx, unsigned char *raw_out);
+void hash_ctx_free(hash_ctx_t *ctx);
+cgit_error_t hash_batch(hash_job_t *jobs, size_t count);
+const char *hash_backend_name(void);
+int sha1_mb_available(void);
+void sha1_mb_batch(hash_job_t *jobs, size_t count);
+
+cgit_error_t trace_init(const char *label);
+cgit_error_t trace_report(FILE *out);
+uint64_t trace_begin(void);
+void trace_end(trace_phase_t phase, uint64_t start, size_t bytes);
+void trace_count(trace_counter_t counter, uint64_t n);
+
+cgit_repo_t *repo_current(void);
+cgit_repo_t *repo_enter(cgit_repo_t *repo);
+void repo_leave(cgit_repo_t *previous);
+cgit_error_t repo_path(char *path_out, size_t path_size, const char *fmt,
+                       ...) __attribute__((format(printf, 3, 4)));
+void cgit_report(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void config_release(cgit_repo_t *repo);
+void packs_release(cgit_repo_t *repo);
 
 cgit_error_t build_object_path(const char *hash, char *path_out,
                                size_t path_size);
+cgit_error_t build_object_dir(const char *hash, char *path_out,
+                              size_t path_size);
 cgit_error_t read_file(const char *path, buffer_t *output);
+cgit_error_t read_fd_fully(int fd, buffer_t *output);
+ssize_t read_some(int fd, void *buf, size_t len);
 cgit_error_t is_valid_hash(const char *hash);
+size_t default_jobs(void);
+cgit_error_t parse_jobs(const char *arg, size_t *jobs_out);
 void buffer_free(buffer_t *buf);
+cgit_error_t buffer_reserve(buffer_t *buf, size_t needed);
+cgit_error_t buffer_append(buffer_t *buf, const void *data, size_t len);
 
 #endif
@@ -1,7 +1,9 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "include/commands.h"
+#include "include/core.h"
 
 typedef struct {
   const char *name;
@@ -12,14 +14,22 @@ typedef struct {
 static const command_t commands[] = {
     {"init", handle_init, "cgit init"},
     {"cat-file", handle_cat_file,
-     "cgit cat-file <type | (-p | -t | -e | -s)> <object>"},
-    {"hash-object", handle_hash_object, "cgit hash-object [-w] <file>"},
+     "cgit cat-file <type | (-p | -t | -e | -s)> <object> | "
+     "(--batch | --batch-check)"},
+    {"hash-object", handle_hash_object,
+     "cgit hash-object [-w] (<file> | --stdin | --stdin-paths [-j <n>])"},
     {"ls-tree", handle_ls_tree, "cgit ls-tree [--name-only] <object>"},
-    {"write-tree", handle_write_tree, "cgit write-tree"},
+    {"write-tree", handle_write_tree, "cgit write-tree [-j <n>]"},
     {"commit-tree", handle_commit_tree,
      "cgit commit-tree <tree-hash> [-p <parent-hash>] -m <commit-message>"},
+    {"pack-objects", handle_pack_objects,
+     "cgit pack-objects [--all] [--prune] [--window=<n>] [--depth=<n>] "
+     "< <object-list>"},
     {NULL, NULL, NULL}};
 
+/* Every command has joined its workers by the time it returns */
+static void report_trace(void) { trace_report(stderr); }
+
 int main(int argc, char *argv[]) {
   if (argc < 2) {
     fprintf(stderr, "Usage: cgit <command>\n");
@@ -29,8 +39,11 @@ int main(int argc, char *argv[]) {
   /* Handler receives also the command name in order to use it for better error
    * messages */
   for (int i = 0; commands[i].name; i++) {
-    if (strcmp(argv[1], commands[i].name) == 0)
+    if (strcmp(argv[1], commands[i].name) == 0) {
+      trace_init(commands[i].name);
+      atexit(report_trace);
       return commands[i].handler(argc - 1, argv + 1);
+    }
   }
 
   fprintf(stderr, "Unknown command: %s\n", argv[1]);
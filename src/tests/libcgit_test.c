@@ -0,0 +1,265 @@
+/*
+ * libcgit-test: the public API, as an embedder sees it.
+ *
+ * Only cgit.h is included. tests.sh runs this against a repository made by
+ * cgit init, passed by absolute path, from another working directory. Each
+ * check prints "ok <name>" or "not ok <name>"; the exit status is 1 when
+ * any failed. The library itself must print nothing.
+ *
+ * Given the cgit executable as well, it also repacks the repository under
+ * an open handle, as another process would. Tracing is only reported where
+ * the program asks for it, even with CGIT_TRACE_PERF set.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../include/cgit.h"
+
+#define THREAD_BLOBS 64
+
+/* git hash-object of "hello\n" */
+#define HELLO_ID "ce013625030ba8dba906f756967f9e9ca394464a"
+#define MISSING_ID "0123456789abcdef0123456789abcdef01234567"
+#define REPACK_DATA "packed behind the handle's back\n"
+#define FLUSH_DATA "lost to a failed flush\n"
+
+static int failures;
+
+static void check(int passed, const char *name) {
+  printf("%s %s\n", passed ? "ok" : "not ok", name);
+  if (!passed) failures++;
+}
+
+static void check_blob(cgit_repo_t *repo) {
+  char id[CGIT_HASH_HEX_LEN + 1];
+  git_object_t obj;
+
+  check(cgit_write_object(repo, "hello\n", 6, "blob", id) == CGIT_OK &&
+            strcmp(id, HELLO_ID) == 0,
+        "write a blob");
+  check(cgit_object_exists(repo, HELLO_ID) == CGIT_OK, "the blob exists");
+
+  cgit_error_t err = cgit_read_object(repo, HELLO_ID, &obj);
+  check(err == CGIT_OK && strcmp(obj.type, "blob") == 0 && obj.size == 6 &&
+            memcmp(obj.data, "hello\n", 6) == 0,
+        "read the blob back");
+  if (err == CGIT_OK) cgit_object_free(&obj);
+}
+
+static void check_tree(cgit_repo_t *repo) {
+  char id[CGIT_HASH_HEX_LEN + 1];
+  char again[CGIT_HASH_HEX_LEN + 1];
+  cgit_tree_t tree;
+  tree_entry_t entries[] = {
+      {0100644, "blob", "b.txt", HELLO_ID},
+      {0100644, "blob", "a.txt", HELLO_ID},
+  };
+  tree_entry_t bad[] = {{100644, "blob", "a.txt", HELLO_ID}};
+
+  check(cgit_write_tree(repo, entries, 2, id) == CGIT_OK, "write a tree");
+
+  cgit_error_t err = cgit_read_tree(repo, id, &tree);
+  check(err == CGIT_OK && tree.count == 2 &&
+            strcmp(tree.entries[0].name, "a.txt") == 0 &&
+            strcmp(tree.entries[1].name, "b.txt") == 0 &&
+            tree.entries[0].mode == 0100644 &&
+            strcmp(tree.entries[0].hash, HELLO_ID) == 0,
+        "read the tree back, sorted");
+  if (err == CGIT_OK) {
+    check(cgit_write_tree(repo, tree.entries, tree.count, again) == CGIT_OK &&
+              strcmp(again, id) == 0,
+          "a tree read back writes the same id");
+    cgit_tree_free(&tree);
+  }
+
+  check(cgit_write_tree(repo, bad, 1, id) == CGIT_ERROR_INVALID_OBJECT,
+        "an unknown mode is rejected");
+  check(cgit_read_tree(repo, HELLO_ID, &tree) == CGIT_ERROR_INVALID_OBJECT,
+        "a blob is not a tree");
+}
+
+static void check_errors(cgit_repo_t *repo) {
+  git_object_t obj;
+  cgit_repo_t *none;
+
+  check(cgit_read_object(repo, MISSING_ID, &obj) != CGIT_OK &&
+            strlen(cgit_last_error()) > 0,
+        "a missing id is an error value with a message");
+  check(cgit_repo_open("/nonexistent/cgit-repo", &none) ==
+                CGIT_ERROR_FILE_NOT_FOUND &&
+            strstr(cgit_last_error(), "/nonexistent/cgit-repo") != NULL,
+        "a missing repository is an error value with a message");
+}
+
+typedef struct {
+  cgit_repo_t *repo;
+  int id;
+  int failed;
+} worker_t;
+
+/* Write distinct blobs through the shared handle and read each back */
+static void *worker(void *arg) {
+  worker_t *w = arg;
+  char data[64];
+  char id[CGIT_HASH_HEX_LEN + 1];
+  git_object_t obj;
+
+  for (int i = 0; i < THREAD_BLOBS && !w->failed; i++) {
+    int len = snprintf(data, sizeof(data), "thread %d blob %d\n", w->id, i);
+    if (cgit_write_object(w->repo, data, (size_t)len, "blob", id) !=
+            CGIT_OK ||
+        cgit_read_object(w->repo, id, &obj) != CGIT_OK) {
+      w->failed = 1;
+      break;
+    }
+    w->failed = obj.size != (size_t)len || memcmp(obj.data, data, obj.size);
+    cgit_object_free(&obj);
+  }
+  return NULL;
+}
+
+static void check_threads(cgit_repo_t *repo) {
+  worker_t workers[2] = {{repo, 0, 0}, {repo, 1, 0}};
+  pthread_t threads[2];
+  int started = 0;
+
+  for (; started < 2; started++)
+    if (pthread_create(&threads[started], NULL, worker,
+                       &workers[started]) != 0)
+      break;
+  for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+
+  check(started == 2 && !workers[0].failed && !workers[1].failed,
+        "one handle shared by two threads");
+}
+
+/* The summary goes where the program says, and only when it says so */
+static void check_trace(cgit_repo_t *repo) {
+  char line[256] = "";
+  git_object_t obj;
+  FILE *out = tmpfile();
+
+  setenv("CGIT_TRACE_PERF", "1", 1);
+  check(cgit_trace_start("libcgit-test") == CGIT_OK, "start tracing");
+  if (cgit_read_object(repo, HELLO_ID, &obj) == CGIT_OK)
+    cgit_object_free(&obj);
+
+  check(out && cgit_trace_report(out) == CGIT_OK &&
+            fseek(out, 0, SEEK_SET) == 0 && fgets(line, sizeof(line), out) &&
+            strstr(line, "libcgit-test") != NULL,
+        "the trace summary goes to the stream passed in");
+  if (out) fclose(out);
+  unsetenv("CGIT_TRACE_PERF"); /* not for the cgit this may run next */
+}
+
+/*
+ * In core.fsyncMethod=batch mode an object is only renamed into place by
+ * the flush. When that fails, the handle must not go on believing the
+ * object is stored: writing it again has to store it.
+ */
+static void check_failed_flush(const char *dir) {
+  char config[4096];
+  char id[CGIT_HASH_HEX_LEN + 1];
+  cgit_repo_t *repo;
+  size_t len = strlen(FLUSH_DATA);
+
+  snprintf(config, sizeof(config), "%s/.cgit/config", dir);
+  FILE *f = fopen(config, "w");
+  if (!f) {
+    check(0, "set core.fsyncMethod=batch");
+    return;
+  }
+  fputs("[core]\n\tfsyncMethod = batch\n", f);
+  fclose(f);
+
+  if (cgit_repo_open(dir, &repo) != CGIT_OK) {
+    check(0, "open a batch-mode handle");
+    unlink(config);
+    return;
+  }
+
+  setenv("CGIT_TEST_FAIL_FLUSH", "1", 1);
+  check(cgit_write_object(repo, FLUSH_DATA, len, "blob", id) != CGIT_OK,
+        "a failed batch flush fails the write");
+  unsetenv("CGIT_TEST_FAIL_FLUSH");
+  check(cgit_object_exists(repo, id) == CGIT_ERROR_FILE_NOT_FOUND,
+        "the object is missing after a failed flush");
+  check(cgit_write_object(repo, FLUSH_DATA, len, "blob", id) == CGIT_OK &&
+            cgit_object_exists(repo, id) == CGIT_OK,
+        "writing it again stores it");
+
+  cgit_repo_close(repo);
+  unlink(config);
+}
+
+/* cgit pack-objects --all --prune in dir, with stdout discarded */
+static int repack(const char *cgit, const char *dir) {
+  int status;
+  pid_t pid = fork();
+
+  if (pid < 0) return 0;
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    if (null < 0 || dup2(null, STDOUT_FILENO) < 0 || chdir(dir) != 0)
+      _exit(127);
+    execl(cgit, cgit, "pack-objects", "--all", "--prune", (char *)NULL);
+    _exit(127);
+  }
+  return waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+         WEXITSTATUS(status) == 0;
+}
+
+/* Objects a repack moves into a new pack stay readable through the handle */
+static void check_repack(cgit_repo_t *repo, const char *cgit,
+                         const char *dir) {
+  char id[CGIT_HASH_HEX_LEN + 1];
+  git_object_t obj;
+  size_t len = strlen(REPACK_DATA);
+
+  cgit_error_t err = cgit_write_object(repo, REPACK_DATA, len, "blob", id);
+  if (err == CGIT_OK) err = cgit_read_object(repo, id, &obj);
+  check(err == CGIT_OK, "read a loose object before a repack");
+  if (err == CGIT_OK) cgit_object_free(&obj);
+
+  check(repack(cgit, dir), "cgit pack-objects --all --prune");
+
+  err = cgit_read_object(repo, id, &obj);
+  check(err == CGIT_OK && obj.size == len &&
+            memcmp(obj.data, REPACK_DATA, len) == 0,
+        "read it again once a repack has pruned it");
+  if (err == CGIT_OK) cgit_object_free(&obj);
+  check(cgit_object_exists(repo, HELLO_ID) == CGIT_OK,
+        "older objects are found in the new pack");
+}
+
+int main(int argc, char *argv[]) {
+  cgit_repo_t *repo;
+
+  if (argc != 2 && argc != 3) {
+    fprintf(stderr, "usage: libcgit-test <repository> [<cgit>]\n");
+    return 2;
+  }
+  if (cgit_repo_open(argv[1], &repo) != CGIT_OK) {
+    check(0, "open the repository");
+    fprintf(stderr, "%s", cgit_last_error());
+    return 1;
+  }
+  check(1, "open the repository");
+
+  check_blob(repo);
+  check_tree(repo);
+  check_errors(repo);
+  check_threads(repo);
+  check_trace(repo);
+  check_failed_flush(argv[1]);
+  if (argc == 3) check_repack(repo, argv[2], argv[1]);
+
+  cgit_repo_close(repo);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,493 @@
+/*
+ * cgit-synth: deterministic synthetic repositories for scaling studies.
+ *
+ * The working tree is a complete directory tree: every directory has
+ * --fanout subdirectories down to --depth levels, and the --files files are
+ * spread evenly over all of them, root included. File i's size and bytes
+ * are a function of the seed, i and the commit that last wrote it, so the
+ * same options always give the same tree id, on any machine and whatever
+ * order the files are written in.
+ *
+ * With --commits, the tree is committed through the core, in process: the
+ * first commit holds every file and each later one rewrites a --churn
+ * fraction of them. Commit dates are fixed, so commit ids are reproducible
+ * too. Directories are walked one path at a time, so generating 10M files
+ * needs no more memory than generating 1k.
+ */
+
+#define _GNU_SOURCE /* M_PI */
+
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../bench/datagen.h"
+#include "../include/common.h"
+#include "../include/core.h"
+
+#define SYNTH_MAX_DEPTH 16
+#define SYNTH_MAX_FANOUT 4096
+#define SYNTH_MAX_SIZE (1024.0 * 1024 * 1024)
+#define SYNTH_BLOCK 256          /* compressibility is chosen per block */
+#define SYNTH_EPOCH 1577836800   /* 2020-01-01, the first commit's date */
+#define SYNTH_COMMIT_GAP 3600    /* seconds between commits */
+
+static const char usage[] =
+    "usage: cgit-synth [--files <n>] [--fanout <n>] [--depth <n>] "
+    "[--size <dist>]\n"
+    "                  [--max-size <bytes>] [--compress <0..1>] "
+    "[--seed <n>]\n"
+    "                  [--commits <n>] [--churn <0..1>] [-j <n>] <dir>\n"
+    "\n"
+    "  <dist> is fixed:<bytes>, uniform:<min>:<max> or "
+    "lognormal:<median>:<sigma>\n"
+    "  sizes take a k or m suffix; the default is lognormal:2k:1.5\n";
+
+typedef enum { SIZE_FIXED, SIZE_UNIFORM, SIZE_LOGNORMAL } size_kind_t;
+
+typedef struct {
+  size_kind_t kind;
+  double a, b; /* bytes, min and max, or median and sigma */
+} size_dist_t;
+
+typedef struct {
+  size_t files;
+  size_t fanout;
+  size_t depth;
+  size_dist_t size;
+  size_t max_size; /* caps lognormal sizes and sizes the write buffer */
+  double compress; /* fraction of blocks that are text rather than noise */
+  uint64_t seed;
+  size_t commits;
+  double churn; /* fraction of files each later commit rewrites */
+  size_t jobs;
+} synth_options_t;
+
+typedef struct {
+  const synth_options_t *opts;
+  size_t dirs;      /* directories in the layout, root included */
+  size_t next_dir;  /* walk position, in depth-first order */
+  size_t next_file;
+  size_t commit;    /* 0 creates the tree; later ones rewrite a subset */
+  unsigned char *buf;
+  char path[PATH_MAX];
+  size_t files_written;
+  uint64_t bytes_written;
+} synth_walk_t;
+
+/* splitmix64: spreads (seed, file, commit) into independent streams */
+static uint64_t mix(uint64_t x) {
+  x += 0x9E3779B97F4A7C15ull;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+  return x ^ (x >> 31);
+}
+
+/* Uniform in [0, 1) */
+static double next_unit(uint64_t *state) {
+  return (double)(datagen_random(state) >> 11) * 0x1p-53;
+}
+
+static size_t sample_size(const synth_options_t *opts, uint64_t *state) {
+  const size_dist_t *d = &opts->size;
+  double size;
+
+  switch (d->kind) {
+    case SIZE_FIXED:
+      return (size_t)d->a;
+    case SIZE_UNIFORM:
+      return (size_t)d->a + (size_t)(datagen_random(state) %
+                                     ((uint64_t)(d->b - d->a) + 1));
+    case SIZE_LOGNORMAL:
+    default: {
+      /* Box-Muller; 1 - u keeps the logarithm finite */
+      double u = 1.0 - next_unit(state), v = next_unit(state);
+      double normal = sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+      size = d->a * exp(d->b * normal);
+      break;
+    }
+  }
+  return size >= (double)opts->max_size ? opts->max_size : (size_t)size;
+}
+
+/* File file's contents as written by commit; returns the length */
+static size_t file_contents(const synth_options_t *opts, size_t file,
+                            size_t commit, unsigned char *buf) {
+  uint64_t state = mix(opts->seed ^ mix(file ^ mix(commit))) | 1;
+  size_t len = sample_size(opts, &state);
+
+  for (size_t pos = 0; pos < len; pos += SYNTH_BLOCK) {
+    size_t n = len - pos < SYNTH_BLOCK ? len - pos : SYNTH_BLOCK;
+    if (next_unit(&state) < opts->compress)
+      datagen_fill(buf + pos, n, &state, 1);
+    else
+      datagen_fill(buf + pos, n, &state, 0);
+  }
+  return len;
+}
+
+/* Whether commit rewrites file; the first commit writes every file */
+static int touched(const synth_options_t *opts, size_t file, size_t commit) {
+  if (commit == 0 || opts->churn >= 1.0) return 1;
+  uint64_t r = mix(opts->seed ^ mix(commit ^ mix(file ^ 0xc4u)));
+  return (double)(r >> 11) * 0x1p-53 < opts->churn;
+}
+
+static int write_file(const char *path, const unsigned char *data,
+                      size_t len) {
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    perror(path);
+    return 1;
+  }
+  int failed = fwrite(data, 1, len, f) != len;
+  failed |= fclose(f) != 0;
+  if (failed) perror(path);
+  return failed;
+}
+
+/*
+ * Generate the directory at w->path and everything below it. Directory k
+ * in depth-first order holds files/dirs files, plus one when k is below
+ * the remainder, numbered on from the directories before it.
+ */
+static int walk_dir(synth_walk_t *w, size_t level) {
+  const synth_options_t *opts = w->opts;
+  size_t k = w->next_dir++;
+  size_t files = opts->files / w->dirs + (k < opts->files % w->dirs);
+  size_t len = strlen(w->path);
+
+  for (size_t i = 0; i < files; i++) {
+    size_t file = w->next_file++;
+    if (!touched(opts, file, w->commit)) continue;
+
+    size_t size = file_contents(opts, file, w->commit, w->buf);
+    snprintf(w->path + len, sizeof(w->path) - len, "/f%07zu.c", file);
+    if (write_file(w->path, w->buf, size)) return 1;
+    w->files_written++;
+    w->bytes_written += size;
+  }
+
+  if (level < opts->depth) {
+    for (size_t i = 0; i < opts->fanout; i++) {
+      snprintf(w->path + len, sizeof(w->path) - len, "/d%03zu", i);
+      if (w->commit == 0 && mkdir(w->path, 0755) != 0) {
+        perror(w->path);
+        return 1;
+      }
+      if (walk_dir(w, level + 1)) return 1;
+    }
+  }
+  w->path[len] = '\0';
+  return 0;
+}
+
+static int ensure_dir(const char *path) {
+  if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+    perror(path);
+    return 1;
+  }
+  return 0;
+}
+
+/* The layout init creates, with HEAD on refs/heads/main */
+static int init_repo(void) {
+  if (ensure_dir(CGIT_DIR) || ensure_dir(CGIT_OBJECTS_DIR) ||
+      ensure_dir(CGIT_REFS_DIR) || ensure_dir(CGIT_REFS_DIR "/heads"))
+    return 1;
+
+  FILE *head = fopen(CGIT_HEAD_FILE, "w");
+  if (!head) {
+    perror(CGIT_HEAD_FILE);
+    return 1;
+  }
+  fprintf(head, "ref: refs/heads/main\n");
+  return fclose(head) != 0;
+}
+
+/* write-tree, then a commit of the result on top of parent */
+static int commit_tree(const synth_options_t *opts, size_t commit,
+                       const char *parent, char *commit_out,
+                       char *tree_out) {
+  int result = 1;
+  arena_t arena = {0};
+  tree_entry_t *entries = NULL;
+  size_t count = 0;
+  tree_stats_t stats;
+  index_state_t *index = NULL;
+  buffer_t content = {0};
+  char message[128];
+
+  if (index_load(&index) != CGIT_OK) goto cleanup;
+
+  cgit_error_t err =
+      opts->jobs > 1
+          ? write_tree_parallel(&arena, ".", opts->jobs, index, &entries,
+                                &count, &stats)
+          : write_tree_recursive(&arena, ".", index, &entries, &count,
+                                 &stats);
+  if (err == CGIT_OK)
+    err = write_tree_object(".", index, entries, count, &stats, tree_out,
+                            NULL);
+  if (err == CGIT_OK) err = object_files_flush();
+  if (err == CGIT_OK) err = index_commit(index);
+  if (err != CGIT_OK) goto cleanup;
+
+  snprintf(message, sizeof(message), "synthetic commit %zu of %zu",
+           commit + 1, opts->commits);
+  err = build_commit_content_at(
+      tree_out, parent, CGIT_AUTHOR_NAME, CGIT_AUTHOR_EMAIL, message,
+      (time_t)(SYNTH_EPOCH + commit * SYNTH_COMMIT_GAP), 0, &content);
+  if (err == CGIT_OK)
+    err = write_object(content.data, content.size, "commit", commit_out, 1);
+  if (err == CGIT_OK) err = object_files_flush();
+  if (err != CGIT_OK) goto cleanup;
+
+  result = 0;
+cleanup:
+  if (result) fprintf(stderr, "error: cannot write commit %zu\n", commit + 1);
+  object_files_flush(); /* after a failure, keep what was written */
+  buffer_free(&content);
+  arena_release(&arena);
+  index_free(index);
+  return result;
+}
+
+static int write_ref(const char *hash) {
+  FILE *ref = fopen(CGIT_REFS_DIR "/heads/main", "w");
+  if (!ref) {
+    perror(CGIT_REFS_DIR "/heads/main");
+    return 1;
+  }
+  fprintf(ref, "%s\n", hash);
+  return fclose(ref) != 0;
+}
+
+/* Directories in a complete fanout-ary tree of the given depth */
+static int count_dirs(size_t fanout, size_t depth, size_t *out) {
+  size_t total = 1, level = 1;
+  for (size_t i = 0; i < depth; i++) {
+    if (level > SIZE_MAX / fanout) return 1;
+    level *= fanout;
+    if (total > SIZE_MAX - level) return 1;
+    total += level;
+  }
+  *out = total;
+  return 0;
+}
+
+static int parse_count(const char *arg, unsigned long long max,
+                       unsigned long long *out) {
+  char *end;
+  errno = 0;
+  unsigned long long val = strtoull(arg, &end, 10);
+
+  if (*arg == '\0' || *arg == '-' || *end != '\0' || errno || val > max) {
+    fprintf(stderr, "error: invalid count '%s'\n", arg);
+    return 1;
+  }
+  *out = val;
+  return 0;
+}
+
+/* Bytes, with an optional k or m suffix; *end is left after it */
+static int parse_bytes(const char *arg, const char **end_out, double *out) {
+  char *end;
+  double val = strtod(arg, &end);
+
+  if (end == arg || !(val >= 0)) return 1;
+  if (*end == 'k' || *end == 'K') {
+    val *= 1024;
+    end++;
+  } else if (*end == 'm' || *end == 'M') {
+    val *= 1024 * 1024;
+    end++;
+  }
+  if (val > SYNTH_MAX_SIZE) return 1;
+  *out = val;
+  *end_out = end;
+  return 0;
+}
+
+static int parse_fraction(const char *arg, double *out) {
+  char *end;
+  double val = strtod(arg, &end);
+
+  if (end == arg || *end != '\0' || !(val >= 0 && val <= 1)) {
+    fprintf(stderr, "error: invalid fraction '%s'\n", arg);
+    return 1;
+  }
+  *out = val;
+  return 0;
+}
+
+static int parse_dist(const char *arg, size_dist_t *out) {
+  const char *p;
+  size_dist_t d;
+
+  if (strncmp(arg, "fixed:", 6) == 0) {
+    d.kind = SIZE_FIXED;
+    if (parse_bytes(arg + 6, &p, &d.a) || *p) goto invalid;
+    d.b = d.a;
+  } else if (strncmp(arg, "uniform:", 8) == 0) {
+    d.kind = SIZE_UNIFORM;
+    if (parse_bytes(arg + 8, &p, &d.a) || *p != ':' ||
+        parse_bytes(p + 1, &p, &d.b) || *p || d.b < d.a)
+      goto invalid;
+  } else if (strncmp(arg, "lognormal:", 10) == 0) {
+    char *end;
+    d.kind = SIZE_LOGNORMAL;
+    if (parse_bytes(arg + 10, &p, &d.a) || *p != ':') goto invalid;
+    d.b = strtod(p + 1, &end);
+    if (end == p + 1 || *end || !(d.b >= 0 && d.b <= 8)) goto invalid;
+  } else {
+    goto invalid;
+  }
+  d.a = floor(d.a);
+  d.b = d.kind == SIZE_LOGNORMAL ? d.b : floor(d.b);
+  *out = d;
+  return 0;
+
+invalid:
+  fprintf(stderr, "error: invalid size distribution '%s'\n", arg);
+  return 1;
+}
+
+static void report_trace(void) { trace_report(stderr); }
+
+int main(int argc, char *argv[]) {
+  int result = 1;
+  const char *dir = NULL;
+  synth_walk_t *w = NULL;
+  char parent[CGIT_HASH_HEX_LEN + 1] = "";
+  char commit_hash[CGIT_HASH_HEX_LEN + 1];
+  char tree_hash[CGIT_HASH_HEX_LEN + 1];
+  double max_size = 1024 * 1024;
+  synth_options_t opts = {
+      .files = 1000,
+      .fanout = 8,
+      .depth = 2,
+      .size = {SIZE_LOGNORMAL, 2048, 1.5},
+      .compress = 0.9,
+      .seed = 1,
+      .churn = 0.01,
+  };
+
+  opts.jobs = default_jobs();
+
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+    unsigned long long n;
+    const char *end;
+
+    if (arg[0] != '-' && !dir) {
+      dir = arg;
+      continue;
+    }
+    if (!value) goto bad_usage;
+    i++;
+
+    if (strcmp(arg, "--files") == 0) {
+      if (parse_count(value, 1000000000, &n)) goto cleanup;
+      opts.files = (size_t)n;
+    } else if (strcmp(arg, "--fanout") == 0) {
+      if (parse_count(value, SYNTH_MAX_FANOUT, &n) || n < 1) goto cleanup;
+      opts.fanout = (size_t)n;
+    } else if (strcmp(arg, "--depth") == 0) {
+      if (parse_count(value, SYNTH_MAX_DEPTH, &n)) goto cleanup;
+      opts.depth = (size_t)n;
+    } else if (strcmp(arg, "--size") == 0) {
+      if (parse_dist(value, &opts.size)) goto cleanup;
+    } else if (strcmp(arg, "--max-size") == 0) {
+      if (parse_bytes(value, &end, &max_size) || *end) {
+        fprintf(stderr, "error: invalid size '%s'\n", value);
+        goto cleanup;
+      }
+    } else if (strcmp(arg, "--compress") == 0) {
+      if (parse_fraction(value, &opts.compress)) goto cleanup;
+    } else if (strcmp(arg, "--seed") == 0) {
+      if (parse_count(value, UINT64_MAX, &n)) goto cleanup;
+      opts.seed = n;
+    } else if (strcmp(arg, "--commits") == 0) {
+      if (parse_count(value, 1000000, &n)) goto cleanup;
+      opts.commits = (size_t)n;
+    } else if (strcmp(arg, "--churn") == 0) {
+      if (parse_fraction(value, &opts.churn)) goto cleanup;
+    } else if (strcmp(arg, "-j") == 0) {
+      if (parse_jobs(value, &opts.jobs) != CGIT_OK) goto cleanup;
+    } else {
+      goto bad_usage;
+    }
+  }
+  if (!dir) goto bad_usage;
+
+  /* Only lognormal sizes are open-ended; the others fit their bounds */
+  opts.max_size = opts.size.kind == SIZE_LOGNORMAL ? (size_t)max_size
+                                                   : (size_t)opts.size.b;
+
+  w = calloc(1, sizeof(*w));
+  if (!w) goto cleanup;
+  w->opts = &opts;
+  w->buf = malloc(opts.max_size ? opts.max_size : 1);
+  if (!w->buf) {
+    fprintf(stderr, "error: out of memory\n");
+    goto cleanup;
+  }
+  if (count_dirs(opts.fanout, opts.depth, &w->dirs) ||
+      w->dirs > opts.files) {
+    fprintf(stderr,
+            "error: --fanout %zu --depth %zu makes more directories than "
+            "--files %zu\n",
+            opts.fanout, opts.depth, opts.files);
+    goto cleanup;
+  }
+
+  /* A fresh directory, so nothing but the options decides the tree */
+  if (mkdir(dir, 0755) != 0) {
+    perror(dir);
+    goto cleanup;
+  }
+  if (chdir(dir) != 0) {
+    perror(dir);
+    goto cleanup;
+  }
+  trace_init("cgit-synth");
+  atexit(report_trace);
+
+  for (size_t c = 0; c == 0 || c < opts.commits; c++) {
+    w->commit = c;
+    w->next_dir = w->next_file = 0;
+    w->files_written = 0;
+    w->bytes_written = 0;
+    strcpy(w->path, ".");
+    if (walk_dir(w, 0)) goto cleanup;
+    fprintf(stderr, "%s: %zu files, %llu bytes written\n",
+            c == 0 ? "tree" : "commit", w->files_written,
+            (unsigned long long)w->bytes_written);
+
+    if (opts.commits == 0) break;
+    if (c == 0 && init_repo()) goto cleanup;
+    if (commit_tree(&opts, c, c ? parent : NULL, commit_hash, tree_hash))
+      goto cleanup;
+    printf("%s %s\n", commit_hash, tree_hash);
+    memcpy(parent, commit_hash, sizeof(parent));
+  }
+
+  if (opts.commits && write_ref(parent)) goto cleanup;
+  fprintf(stderr, "%zu files in %zu directories\n", opts.files, w->dirs);
+  result = 0;
+  goto cleanup;
+
+bad_usage:
+  fputs(usage, stderr);
+cleanup:
+  if (w) free(w->buf);
+  free(w);
+  return result;
+}
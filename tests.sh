@@ -35,6 +35,24 @@ HASH=$("$CGIT" hash-object -w testfile.txt)
   ok "hash is 40 hex chars ($HASH)" ||
   fail "unexpected hash length: '$HASH'"
 
+# testing hash-object on a file large enough to be streamed
+echo "--- hash-object (streamed) ---"
+seq 1 400000 >bigfile.txt
+BIG_HASH=$("$CGIT" hash-object -w bigfile.txt)
+[ "$BIG_HASH" = "$(git hash-object bigfile.txt)" ] &&
+  ok "streamed hash matches git" ||
+  fail "streamed hash mismatch (cgit: '$BIG_HASH', git: '$(git hash-object bigfile.txt)')"
+
+"$CGIT" cat-file -p "$BIG_HASH" | cmp -s - bigfile.txt &&
+  ok "streamed object round-trips" ||
+  fail "streamed object content differs"
+
+STDIN_HASH=$(echo "from a pipe" | "$CGIT" hash-object /dev/stdin)
+[ "$STDIN_HASH" = "$(echo "from a pipe" | git hash-object --stdin)" ] &&
+  ok "hash-object reads unsized input (/dev/stdin)" ||
+  fail "hash-object on /dev/stdin gave '$STDIN_HASH'"
+rm -f bigfile.txt
+
 # testing cat-file -t
 echo "--- cat-file -t ---"
 TYPE=$("$CGIT" cat-file -t "$HASH")
@@ -56,6 +74,16 @@ CONTENT=$("$CGIT" cat-file -p "$HASH")
   ok "content matches" ||
   fail "expected 'hello world', got '$CONTENT'"
 
+CONTENT=$("$CGIT" cat-file blob "$HASH")
+[ "$CONTENT" = "hello world" ] &&
+  ok "cat-file <type> streams matching object" ||
+  fail "cat-file blob gave '$CONTENT'"
+
+OUT=$("$CGIT" cat-file tree "$HASH" 2>/dev/null) &&
+  fail "cat-file tree on a blob should fail" ||
+  { [ -z "$OUT" ] && ok "type mismatch rejected before any output" ||
+    fail "type mismatch still printed '$OUT'"; }
+
 # testing cat-file -e (existence check)
 echo "--- cat-file -e ---"
 "$CGIT" cat-file -e "$HASH" &&
@@ -98,6 +126,23 @@ ACTUAL=$("$CGIT" ls-tree --name-only "$TREE_HASH")
   ok "ls-tree --name-only output matches git" ||
   fail "ls-tree --name-only output differs (expected: '$EXPECTED', got: '$ACTUAL')"
 
+# a wide tree spans several arena blocks and entry-array regrowths
+echo "--- ls-tree (wide tree) ---"
+mkdir wide && (cd wide && seq -f "entry-%g" 1 3000 | xargs touch)
+git add wide && git commit -m "wide" --quiet
+cp -r .git/objects/* .cgit/objects/
+WIDE_HASH=$(git rev-parse HEAD:wide)
+[ "$(git ls-tree "$WIDE_HASH")" = "$("$CGIT" ls-tree "$WIDE_HASH")" ] &&
+  ok "ls-tree of a 3000-entry tree matches git" ||
+  fail "ls-tree of a wide tree differs from git"
+
+git update-index --add --cacheinfo 160000,"$(git rev-parse HEAD)",sub
+GITLINK_TREE=$(git write-tree)
+cp -r .git/objects/* .cgit/objects/
+[ "$(git ls-tree "$GITLINK_TREE")" = "$("$CGIT" ls-tree "$GITLINK_TREE")" ] &&
+  ok "ls-tree shows gitlink entries as commits" ||
+  fail "ls-tree of a tree with a gitlink differs from git"
+
 cd "$TMPDIR"
 
 # testing write-tree (flat directory)
@@ -177,6 +222,500 @@ ACTUAL=$("$CGIT" ls-tree "$SUB_HASH")
   ok "ls-tree on recursive write-tree output matches git" ||
   fail "ls-tree (recursive) mismatch (expected: '$EXPECTED', got: '$ACTUAL')"
 
+# testing write-tree -j (thread pool) against git and the serial walk
+echo "--- write-tree -j ---"
+WTPARDIR="$TMPDIR/write-tree-parallel"
+mkdir -p "$WTPARDIR" && cd "$WTPARDIR"
+for d in a b c d e f; do
+  mkdir -p "$d/x/y"
+  for f in 1 2 3 4 5 6 7 8; do
+    echo "$d $f" >"$d/f$f"
+    echo "$f" >"$d/x/y/g$f"
+  done
+done
+echo "top" >top.txt
+git init --quiet && git add . && GIT_PAR_HASH=$(git write-tree) && rm -rf .git
+"$CGIT" init >/dev/null
+
+PAR_HASH=$("$CGIT" write-tree -j 8)
+[ "$PAR_HASH" = "$GIT_PAR_HASH" ] &&
+  ok "write-tree -j 8 hash matches git" ||
+  fail "write-tree -j 8 hash mismatch (cgit: '$PAR_HASH', git: '$GIT_PAR_HASH')"
+
+[ "$("$CGIT" write-tree -j 1)" = "$PAR_HASH" ] &&
+  ok "write-tree -j 1 and -j 8 agree" ||
+  fail "serial and parallel write-tree disagree"
+
+"$CGIT" write-tree -j 0 >/dev/null 2>&1 &&
+  fail "write-tree -j 0 should be rejected" ||
+  ok "write-tree -j 0 rejected"
+
+# ids are checked by the scalar table or by SSE2/AVX2 code; CGIT_NO_SIMD=1
+# forces the scalar version, and both must reject the same malformed ids.
+# The bad character goes in each of the vector windows (0..15, 16..31,
+# 24..39), and covers the neighbours of the digit and letter ranges
+echo "--- malformed ids ---"
+HEXDIR="$TMPDIR/hex"
+mkdir -p "$HEXDIR" && cd "$HEXDIR" && "$CGIT" init >/dev/null
+echo hello >hello
+HEX_ID=$("$CGIT" hash-object -w hello)
+HEX_UPPER=$(printf '%s' "$HEX_ID" | tr a-f A-F)
+# fails, and reports a non-hex character, with CGIT_NO_SIMD=$1
+hex_rejected() {
+  ! CGIT_NO_SIMD=$1 "$CGIT" "${@:2}" >/dev/null 2>"$TMPDIR/hex.err" &&
+    grep -q "non-hexadecimal" "$TMPDIR/hex.err"
+}
+for simd in "" 1; do
+  HEX_LABEL=${simd:+scalar}
+  HEX_LABEL=${HEX_LABEL:-default}
+  HEX_ACCEPTED=""
+  for c in G : @ '`' / g $'\xe9'; do
+    for pos in 0 15 20 39; do
+      HEX_BAD="${HEX_ID:0:pos}$c${HEX_ID:pos+1}"
+      hex_rejected "$simd" cat-file -t "$HEX_BAD" &&
+        hex_rejected "$simd" cat-file -p "$HEX_BAD" &&
+        hex_rejected "$simd" ls-tree "$HEX_BAD" ||
+        HEX_ACCEPTED="$HEX_ACCEPTED '$HEX_BAD'"
+    done
+  done
+  [ -z "$HEX_ACCEPTED" ] &&
+    ok "$HEX_LABEL hex: malformed ids rejected by cat-file -t/-p and ls-tree" ||
+    fail "$HEX_LABEL hex: accepted$HEX_ACCEPTED"
+  [ "$(CGIT_NO_SIMD=$simd "$CGIT" cat-file -t "$HEX_ID")" = blob ] &&
+    [ "$(CGIT_NO_SIMD=$simd "$CGIT" hash-object hello)" = "$HEX_ID" ] &&
+    ok "$HEX_LABEL hex: a valid id reads back" ||
+    fail "$HEX_LABEL hex: cannot read $HEX_ID"
+  # either case is a hex digit; loose objects are only named in lowercase
+  CGIT_NO_SIMD=$simd "$CGIT" cat-file -t "$HEX_UPPER" >/dev/null \
+    2>"$TMPDIR/hex.err" || true
+  ! grep -q "non-hexadecimal" "$TMPDIR/hex.err" &&
+    ok "$HEX_LABEL hex: uppercase digits are not malformed" ||
+    fail "$HEX_LABEL hex: '$HEX_UPPER' rejected as malformed"
+done
+
+# small files are hashed in batches; every backend must agree with git
+echo "--- hash backends ---"
+HBDIR="$TMPDIR/hash-backends"
+mkdir -p "$HBDIR/many" && cd "$HBDIR"
+for f in $(seq 1 40); do head -c $((f * 37)) /dev/urandom >"many/f$f"; done
+head -c 65536 /dev/zero >exact-limit
+head -c 65537 /dev/zero >over-limit
+: >empty
+git init --quiet && git add . && GIT_HB_HASH=$(git write-tree) && rm -rf .git
+for backend in openssl multibuffer; do
+  for jobs in 1 4; do
+    rm -rf .cgit && "$CGIT" init >/dev/null
+    HB_HASH=$(CGIT_HASH_BACKEND=$backend "$CGIT" write-tree -j $jobs 2>/dev/null)
+    [ "$HB_HASH" = "$GIT_HB_HASH" ] &&
+      ok "$backend backend, -j $jobs: hash matches git" ||
+      fail "$backend backend, -j $jobs: got '$HB_HASH', git '$GIT_HB_HASH'"
+  done
+done
+
+# core.compression and friends set the zlib level; hashes never change
+echo "--- compression level ---"
+cd "$HBDIR"
+ZERO_BLOB=$(git hash-object exact-limit)
+ZERO_PATH=".cgit/objects/${ZERO_BLOB:0:2}/${ZERO_BLOB:2}"
+for level in 0 9; do
+  rm -rf .cgit && "$CGIT" init >/dev/null
+  printf '[core]\n\tcompression = %s\n' "$level" >.cgit/config
+  LVL_HASH=$("$CGIT" write-tree)
+  [ "$LVL_HASH" = "$GIT_HB_HASH" ] &&
+    GIT_DIR=.cgit git cat-file -p "$ZERO_BLOB" | cmp -s - exact-limit &&
+    ok "level $level: hash matches git and git reads the objects" ||
+    fail "level $level: got '$LVL_HASH', git '$GIT_HB_HASH'"
+  eval "SIZE_$level=\$(wc -c <\"\$ZERO_PATH\")"
+done
+[ "$SIZE_0" -gt 65536 ] && [ "$SIZE_9" -lt 1024 ] &&
+  ok "level 0 stores, level 9 compresses ($SIZE_0 vs $SIZE_9 bytes)" ||
+  fail "compression level ignored ($SIZE_0 vs $SIZE_9 bytes)"
+
+printf '[core]\n\tcompression = 9\n\tlooseCompression = 0\n' >.cgit/config
+rm -rf .cgit/objects .cgit/index && mkdir .cgit/objects
+"$CGIT" write-tree >/dev/null
+[ "$(wc -c <"$ZERO_PATH")" -gt 65536 ] &&
+  ok "core.looseCompression overrides core.compression" ||
+  fail "core.looseCompression ignored"
+
+printf '[core]\n\tcompression = 12\n' >.cgit/config
+rm -rf .cgit/objects .cgit/index && mkdir .cgit/objects
+BAD_LVL=$("$CGIT" write-tree 2>&1 >/dev/null)
+case "$BAD_LVL" in
+  *"bad zlib compression level 12"*) ok "out-of-range level warns" ;;
+  *) fail "out-of-range level: '$BAD_LVL'" ;;
+esac
+rm -f .cgit/config
+
+# incompressible blobs are stored, not deflated; the zlib header's level
+# bits tell which way an object went (78 01 fastest/stored, 78 9c default)
+echo "--- adaptive compression ---"
+ACDIR="$TMPDIR/adaptive"
+mkdir -p "$ACDIR" && cd "$ACDIR"
+head -c 100000 /dev/urandom >random.bin
+head -c 1500000 /dev/urandom >random-streamed.bin
+seq 1 30000 >text.txt
+zlib_level() {
+  local id
+  id=$(git hash-object "$1")
+  head -c 2 ".cgit/objects/${id:0:2}/${id:2}" | od -An -tx1 | tr -d ' '
+}
+rm -rf .cgit && "$CGIT" init >/dev/null && "$CGIT" write-tree >/dev/null
+[ "$(zlib_level random.bin)" = "7801" ] &&
+  [ "$(zlib_level random-streamed.bin)" = "7801" ] &&
+  ok "random data is stored, in memory and streamed" ||
+  fail "random data deflated: $(zlib_level random.bin) $(zlib_level random-streamed.bin)"
+[ "$(zlib_level text.txt)" = "789c" ] &&
+  ok "compressible data keeps the default level" ||
+  fail "text compressed with header $(zlib_level text.txt)"
+GIT_DIR=.cgit git cat-file -p "$(git hash-object random.bin)" |
+  cmp -s - random.bin &&
+  GIT_DIR=.cgit git cat-file -p "$(git hash-object random-streamed.bin)" |
+  cmp -s - random-streamed.bin &&
+  ok "git reads the stored objects" ||
+  fail "git cannot read the stored objects"
+
+rm -rf .cgit && "$CGIT" init >/dev/null
+printf '[core]\n\tadaptiveCompression = false\n' >.cgit/config
+"$CGIT" write-tree >/dev/null
+[ "$(zlib_level random.bin)" = "789c" ] &&
+  [ "$(zlib_level random-streamed.bin)" = "789c" ] &&
+  ok "core.adaptiveCompression = false deflates everything" ||
+  fail "adaptive compression not disabled"
+
+# objects land via temp file and rename; batch defers the renames to one
+# barrier per command, so nothing may be left behind under a temp name
+echo "--- fsync methods ---"
+cd "$HBDIR"
+for method in fsync writeout-only batch; do
+  rm -rf .cgit && "$CGIT" init >/dev/null
+  printf '[core]\n\tfsyncMethod = %s\n' "$method" >.cgit/config
+  FS_HASH=$("$CGIT" write-tree -j 4)
+  FS_BLOB=$("$CGIT" hash-object -w exact-limit)
+  FS_COMMIT=$("$CGIT" commit-tree "$FS_HASH" -m "$method")
+  LEFT=$(find .cgit/objects -name 'tmp_obj_*' | wc -l)
+  [ "$FS_HASH" = "$GIT_HB_HASH" ] && [ "$LEFT" -eq 0 ] &&
+    GIT_DIR=.cgit git cat-file -e "$FS_BLOB" &&
+    GIT_DIR=.cgit git cat-file -e "$FS_COMMIT" &&
+    GIT_DIR=.cgit git ls-tree -r "$FS_HASH" >/dev/null &&
+    ok "$method: objects in place and readable by git" ||
+    fail "$method: tree '$FS_HASH', $LEFT temporary files left"
+done
+
+printf '[core]\n\tfsyncMethod = sometimes\n' >.cgit/config
+echo "fsync probe" >"$TMPDIR/fsync-probe.txt"
+BAD_FS=$("$CGIT" hash-object -w "$TMPDIR/fsync-probe.txt" 2>&1 >/dev/null)
+case "$BAD_FS" in
+  *"unknown core.fsyncMethod 'sometimes'"*) ok "unknown fsync method warns" ;;
+  *) fail "unknown fsync method: '$BAD_FS'" ;;
+esac
+rm -f .cgit/config
+
+# content already stored is never compressed again; a bad level in the
+# config is the tripwire, since it is only read when something is deflated
+echo "--- existing objects ---"
+EXDIR="$TMPDIR/existing"
+mkdir -p "$EXDIR/sub" && cd "$EXDIR"
+for f in $(seq 1 20); do echo "file $f" >"sub/f$f"; done
+echo "file 1" >dup-of-f1
+seq 1 300000 >streamed.txt
+rm -rf .cgit && "$CGIT" init >/dev/null
+EX_HASH=$("$CGIT" write-tree)
+git init --quiet && git add -- . ':!.cgit' && GIT_EX_HASH=$(git write-tree) && rm -rf .git
+[ "$EX_HASH" = "$GIT_EX_HASH" ] &&
+  ok "duplicate content within one run stored once, hash matches git" ||
+  fail "write-tree with duplicates gave '$EX_HASH', git '$GIT_EX_HASH'"
+
+printf '[core]\n\tcompression = 12\n' >.cgit/config
+touch sub/* dup-of-f1 streamed.txt
+RESNAP=$("$CGIT" write-tree 2>&1)
+[ "$RESNAP" = "$EX_HASH" ] &&
+  ok "re-snapshot of touched files hashes but compresses nothing" ||
+  fail "re-snapshot compressed or failed: '$RESNAP'"
+
+rm -f .cgit/index
+RESNAP=$("$CGIT" write-tree -j 1 2>&1)
+BLOB=$("$CGIT" hash-object -w streamed.txt 2>&1)
+[ "$RESNAP" = "$EX_HASH" ] && [ "$BLOB" = "$(git hash-object streamed.txt)" ] &&
+  ok "without the index, existing objects still skip compression" ||
+  fail "existing objects recompressed: '$RESNAP' '$BLOB'"
+rm -f .cgit/config
+
+"$CGIT" pack-objects --all --prune >/dev/null
+rm -f .cgit/index
+"$CGIT" write-tree >/dev/null
+LOOSE=$(find .cgit/objects -path '*/pack' -prune -o -type f -print | wc -l)
+[ "$LOOSE" -eq 0 ] &&
+  ok "packed objects are not written again as loose ones" ||
+  fail "$LOOSE loose copies of packed objects written"
+
+echo "--- hash-object --stdin-paths ---"
+SPDIR="$TMPDIR/stdin-paths"
+mkdir -p "$SPDIR" && cd "$SPDIR"
+for f in $(seq 1 100); do echo "path $f" >"p$f"; done
+seq 1 300000 >streamed.txt
+rm -rf .cgit && "$CGIT" init >/dev/null
+(ls p*; echo streamed.txt; echo p1) >paths
+"$CGIT" hash-object -w --stdin-paths -j 3 <paths >ids
+git hash-object --stdin-paths <paths | cmp -s - ids &&
+  ok "ids come out in input order and match git" ||
+  fail "--stdin-paths output differs from git's"
+
+OBJ_OK=1
+while read -r id; do
+  GIT_DIR=.cgit git cat-file -e "$id" || OBJ_OK=0
+done <ids
+[ "$OBJ_OK" -eq 1 ] &&
+  ok "-w --stdin-paths writes every object" ||
+  fail "--stdin-paths left objects unwritten"
+
+# a caller that waits for each id before sending the next path
+coproc SP { "$CGIT" hash-object --stdin-paths; }
+SP_JOB=$SP_PID # bash unsets SP_PID once the coproc exits
+echo p7 >&"${SP[1]}"
+read -r -t 10 -u "${SP[0]}" SP_ONE
+echo p8 >&"${SP[1]}"
+read -r -t 10 -u "${SP[0]}" SP_TWO
+exec {SP[1]}>&-
+wait "$SP_JOB"
+[ "$SP_ONE" = "$(git hash-object p7)" ] && [ "$SP_TWO" = "$(git hash-object p8)" ] &&
+  ok "answers each path before the input ends" ||
+  fail "interactive --stdin-paths gave '$SP_ONE' '$SP_TWO'"
+
+printf 'p1\nmissing-file\n' | "$CGIT" hash-object --stdin-paths >/dev/null 2>&1 &&
+  fail "--stdin-paths accepted a missing file" ||
+  ok "--stdin-paths fails on a missing file"
+
+# ids before the failing batch still come out, as git prints them up to the
+# failing path; the batch holding it may leave up to 15 of them unprinted
+(for f in $(seq 1 20); do echo "p$f"; done; echo missing-file
+  for f in $(seq 21 40); do echo "p$f"; done) >bad-paths
+SP_STATUS=0
+cat bad-paths | "$CGIT" hash-object -w --stdin-paths -j 2 >bad-ids 2>/dev/null ||
+  SP_STATUS=$?
+SP_COUNT=$(wc -l <bad-ids)
+head -n 20 bad-paths | git hash-object --stdin-paths >good-ids
+head -n "$SP_COUNT" good-ids | cmp -s - bad-ids &&
+  [ "$SP_STATUS" -ne 0 ] && [ "$SP_COUNT" -ge 5 ] &&
+  ok "--stdin-paths prints the ids before a missing file" ||
+  fail "--stdin-paths printed $SP_COUNT ids before a missing file, status $SP_STATUS"
+
+STDIN_HASH=$("$CGIT" hash-object --stdin <streamed.txt)
+[ "$STDIN_HASH" = "$(git hash-object streamed.txt)" ] &&
+  ok "--stdin hashes standard input like git" ||
+  fail "--stdin gave '$STDIN_HASH'"
+
+echo "--- symlinks and deep paths ---"
+SLDIR="$TMPDIR/symlinks"
+mkdir -p "$SLDIR/sub" && cd "$SLDIR"
+echo "target" >file
+echo "inside" >sub/inner
+ln -s file to-file
+ln -s sub to-dir
+ln -s /nonexistent/target dangling
+rm -rf .cgit && "$CGIT" init >/dev/null
+git init --quiet && git add -- . ':!.cgit' && GIT_SL_HASH=$(git write-tree) && rm -rf .git
+
+SL_SERIAL=$("$CGIT" write-tree -j 1)
+[ "$SL_SERIAL" = "$GIT_SL_HASH" ] &&
+  ok "symlinks are stored as links, like git" ||
+  fail "write-tree -j 1 with symlinks gave '$SL_SERIAL', git '$GIT_SL_HASH'"
+
+rm -f .cgit/index
+SL_PARALLEL=$("$CGIT" write-tree -j 4)
+[ "$SL_PARALLEL" = "$GIT_SL_HASH" ] &&
+  ok "write-tree -j 4 stores symlinks like git" ||
+  fail "write-tree -j 4 with symlinks gave '$SL_PARALLEL', git '$GIT_SL_HASH'"
+
+# deeper than PATH_MAX: only ever reachable relative to a directory fd
+DEEP_NAME=$(printf 'd%.0s' $(seq 1 100))
+for i in $(seq 1 50); do mkdir "$DEEP_NAME" && cd "$DEEP_NAME"; done
+echo "deep" >leaf
+cd "$SLDIR"
+DEEP_SERIAL=$("$CGIT" write-tree -j 1)
+rm -f .cgit/index
+DEEP_PARALLEL=$("$CGIT" write-tree -j 4)
+[ ${#DEEP_SERIAL} -eq 40 ] && [ "$DEEP_SERIAL" = "$DEEP_PARALLEL" ] &&
+  ok "paths longer than PATH_MAX are walked" ||
+  fail "deep write-tree gave '$DEEP_SERIAL' and '$DEEP_PARALLEL'"
+
+[ "$("$CGIT" write-tree)" = "$DEEP_SERIAL" ] &&
+  ok "deep paths round-trip through the index" ||
+  fail "write-tree changed after indexing deep paths"
+
+# testing .cgitignore against git's handling of the same patterns
+echo "--- .cgitignore ---"
+IGDIR="$TMPDIR/cgitignore"
+mkdir -p "$IGDIR" && cd "$IGDIR"
+mkdir -p src/build node_modules/pkg lib/sub logs/deep docs/a/b
+for f in src/main.c src/main.o src/keep.o src/build/out.bin \
+  node_modules/pkg/index.js lib/lib.c lib/tmp-cache lib/sub/x.o lib/sub/y.c \
+  logs/a.log logs/deep/b.log logs/deep/keep.txt docs/a/b/n.tmp docs/a/x.md \
+  docs/c1.txt docs/cx.txt root.o build top.txt; do
+  echo "content of $f" >"$f"
+done
+printf '%s\n' '# build outputs' '*.o' '!keep.o' 'node_modules/' 'tmp*' \
+  '/build' 'docs/**/*.tmp' 'docs/c[0-9].txt' 'logs/deep/' >.cgitignore
+printf '%s\n' '!*.o' 'y.c' >lib/.cgitignore
+printf '%s\n' 'build/' >src/.cgitignore
+for f in $(find . -name .cgitignore); do cp "$f" "${f%.cgitignore}.gitignore"; done
+rm -rf .cgit && "$CGIT" init >/dev/null
+git init --quiet && git add -- . ':!.cgit' ':!*.gitignore' &&
+  GIT_IG_FILES=$(git ls-files) && rm -rf .git
+find . -name .gitignore -delete
+
+IG_SERIAL=$("$CGIT" write-tree -j 1)
+IG_FILES=$(GIT_DIR=.cgit git ls-tree -r --name-only "$IG_SERIAL")
+[ "$IG_FILES" = "$GIT_IG_FILES" ] &&
+  ok "write-tree -j 1 leaves out what git ignores" ||
+  fail "ignored files differ from git: $(diff <(echo "$IG_FILES") <(echo "$GIT_IG_FILES") | tr '\n' ' ')"
+
+rm -f .cgit/index
+IG_PARALLEL=$("$CGIT" write-tree -j 4)
+[ "$IG_PARALLEL" = "$IG_SERIAL" ] &&
+  ok "write-tree -j 4 ignores the same entries" ||
+  fail "write-tree -j 4 with .cgitignore gave '$IG_PARALLEL', -j 1 '$IG_SERIAL'"
+
+echo "*.txt" >>.cgitignore
+IG_MORE=$(GIT_DIR=.cgit git ls-tree -r --name-only "$("$CGIT" write-tree)")
+echo "$IG_MORE" | grep -q 'top.txt' &&
+  fail "an edited .cgitignore was not picked up" ||
+  ok "an edited .cgitignore applies to the next write-tree"
+
+# testing CGIT_TRACE_PERF
+echo "--- trace ---"
+TRDIR="$TMPDIR/trace"
+TR_OUT="$TMPDIR/trace.out" # outside the tree being written
+TR_JSON="$TMPDIR/trace.json"
+mkdir -p "$TRDIR/src/sub" && cd "$TRDIR"
+for i in 1 2 3 4 5; do echo "file $i" >"src/f$i.txt"; done
+echo "nested" >src/sub/n.txt
+"$CGIT" init >/dev/null
+
+TR_PLAIN=$("$CGIT" write-tree)
+rm -f .cgit/index
+TR_TRACED=$(CGIT_TRACE_PERF=1 "$CGIT" write-tree 2>"$TR_OUT")
+[ "$TR_TRACED" = "$TR_PLAIN" ] && grep -q '^cgit trace: write-tree' "$TR_OUT" &&
+  grep -q '^  sha1 ' "$TR_OUT" && grep -q '^  walk ' "$TR_OUT" &&
+  ok "CGIT_TRACE_PERF=1 prints a per-phase summary and changes nothing" ||
+  fail "traced write-tree gave '$TR_TRACED' (want '$TR_PLAIN'): $(tr '\n' ' ' <"$TR_OUT")"
+
+CGIT_TRACE_PERF=1 "$CGIT" write-tree 2>"$TR_OUT" >/dev/null
+grep -q 'stat cache hits' "$TR_OUT" && grep -q 'cache-tree hits' "$TR_OUT" &&
+  ok "the summary counts stat cache and cache-tree hits" ||
+  fail "no cache hits in the trace of a warm write-tree: $(tr '\n' ' ' <"$TR_OUT")"
+
+CGIT_TRACE_PERF="$TR_JSON" "$CGIT" cat-file -p "$TR_PLAIN" >/dev/null
+TR_JSON_OK=1
+if command -v python3 >/dev/null; then
+  python3 -m json.tool "$TR_JSON" >/dev/null 2>&1 || TR_JSON_OK=0
+fi
+[ "$TR_JSON_OK" = 1 ] && grep -q '"traceEvents"' "$TR_JSON" &&
+  grep -q '"name":"inflate","cat":"cgit","ph":"X"' "$TR_JSON" &&
+  grep -q '"objects read":1' "$TR_JSON" &&
+  ok "CGIT_TRACE_PERF=<path> writes Chrome trace-event JSON" ||
+  fail "bad trace file: $(head -c 300 "$TR_JSON" 2>/dev/null)"
+
+# libcgit-test is built next to cgit and uses only the public cgit.h; it
+# opens a repository by absolute path from another directory, and the
+# library must report errors as values without printing anything, traced
+# or not. It also runs cgit pack-objects --prune under the open handle
+echo "--- libcgit ---"
+LIBTEST="$(dirname "$CGIT")/libcgit-test"
+LIBDIR="$TMPDIR/libcgit"
+mkdir -p "$LIBDIR" && cd "$LIBDIR" && "$CGIT" init >/dev/null && cd "$TMPDIR"
+if [ -x "$LIBTEST" ]; then
+  LIB_STATUS=0
+  LIB_OUT=$(CGIT_TRACE_PERF=1 "$LIBTEST" "$LIBDIR" "$CGIT" \
+    2>"$TMPDIR/libcgit.err") || LIB_STATUS=$?
+  while read -r LIB_RESULT LIB_NAME; do
+    case "$LIB_RESULT" in
+      ok) ok "libcgit: $LIB_NAME" ;;
+      *) fail "libcgit: ${LIB_NAME#ok }" ;;
+    esac
+  done <<<"$LIB_OUT"
+  [ "$LIB_STATUS" = 0 ] && [ ! -s "$TMPDIR/libcgit.err" ] &&
+    ok "libcgit: exits 0 and prints nothing itself" ||
+    fail "libcgit-test exited $LIB_STATUS: $(head -c 300 "$TMPDIR/libcgit.err")"
+else
+  fail "libcgit-test not built next to $CGIT"
+fi
+
+# cgit-synth is built next to cgit; the same seed and options must give
+# the same commit and tree ids whatever -j is, and another seed others
+echo "--- cgit-synth ---"
+SYNTH="$(dirname "$CGIT")/cgit-synth"
+if [ -x "$SYNTH" ]; then
+  SY_ARGS=(--files 300 --fanout 4 --depth 2 --size uniform:0:2k --commits 2)
+  SY_J1=$("$SYNTH" "${SY_ARGS[@]}" --seed 42 -j 1 "$TMPDIR/synth-j1" 2>/dev/null)
+  SY_J4=$("$SYNTH" "${SY_ARGS[@]}" --seed 42 -j 4 "$TMPDIR/synth-j4" 2>/dev/null)
+  SY_OTHER=$("$SYNTH" "${SY_ARGS[@]}" --seed 43 -j 4 "$TMPDIR/synth-43" \
+    2>/dev/null)
+  [ "$(printf '%s\n' "$SY_J1" | wc -l)" -eq 2 ] &&
+    [ "$SY_J1" = "$SY_J4" ] &&
+    ok "the same seed gives the same commit and tree ids with -j 1 and -j 4" ||
+    fail "seed 42 gave '$SY_J1' with -j 1 and '$SY_J4' with -j 4"
+  [ -n "$SY_OTHER" ] && [ "$SY_OTHER" != "$SY_J1" ] &&
+    ok "another seed gives other ids" ||
+    fail "seeds 42 and 43 both gave '$SY_OTHER'"
+  SY_HEAD=$(cut -d' ' -f1 <<<"$SY_J1" | tail -n 1)
+  [ "$(cat "$TMPDIR/synth-j1/.cgit/refs/heads/main")" = "$SY_HEAD" ] &&
+    (cd "$TMPDIR/synth-j1" && "$CGIT" cat-file -p "$SY_HEAD") |
+    grep -q '^parent ' &&
+    ok "refs/heads/main names the last commit, on top of the first" ||
+    fail "bad history in $TMPDIR/synth-j1"
+else
+  fail "cgit-synth not built next to $CGIT"
+fi
+
+# testing the .cgit/index stat cache (git's DIRC v2 format)
+echo "--- index ---"
+cd "$WTPARDIR"
+git init --quiet && git add -- . ':!.cgit' && GIT_LS=$(git ls-files -s) && rm -rf .git
+CGIT_LS=$(GIT_DIR=.cgit GIT_INDEX_FILE=.cgit/index git ls-files -s)
+[ "$CGIT_LS" = "$GIT_LS" ] &&
+  ok "git ls-files -s reads .cgit/index like its own" ||
+  fail "index entries differ from git's"
+
+BEFORE=$(stat -c '%i %y' .cgit/index)
+"$CGIT" write-tree >/dev/null
+[ "$(stat -c '%i %y' .cgit/index)" = "$BEFORE" ] &&
+  ok "unchanged tree leaves the index untouched" ||
+  fail "index rewritten although nothing changed"
+
+echo "edited" >>a/f1
+rm b/f2
+IDX_HASH=$("$CGIT" write-tree)
+git init --quiet && git add -- . ':!.cgit' && GIT_IDX_HASH=$(git write-tree) && rm -rf .git
+[ "$IDX_HASH" = "$GIT_IDX_HASH" ] &&
+  ok "edited and deleted files are picked up" ||
+  fail "write-tree after edits gave '$IDX_HASH', git '$GIT_IDX_HASH'"
+
+ENTRY=$(GIT_DIR=.cgit GIT_INDEX_FILE=.cgit/index git ls-files -s a/f1 b/f2)
+[ "$ENTRY" = "100644 $(git hash-object a/f1) 0	a/f1" ] &&
+  ok "index entries follow the edit" ||
+  fail "index entries after edit: '$ENTRY'"
+
+echo "--- cache-tree ---"
+CT_HASH=$(GIT_DIR=.cgit GIT_INDEX_FILE=.cgit/index git write-tree)
+[ "$CT_HASH" = "$IDX_HASH" ] &&
+  ok "git write-tree agrees with the stored cache-tree" ||
+  fail "git write-tree from .cgit/index gave '$CT_HASH', cgit '$IDX_HASH'"
+
+mkdir -p deep/er/still && echo "deep" >deep/er/still/f
+"$CGIT" write-tree >/dev/null
+sleep 1
+echo "deeper" >deep/er/still/f
+DEEP_HASH=$("$CGIT" write-tree -j 4)
+git init --quiet && git add -- . ':!.cgit' && GIT_DEEP_HASH=$(git write-tree) && rm -rf .git
+[ "$DEEP_HASH" = "$GIT_DEEP_HASH" ] &&
+  ok "an edit deep in the tree invalidates its parents" ||
+  fail "write-tree after deep edit gave '$DEEP_HASH', git '$GIT_DEEP_HASH'"
+
+[ "$("$CGIT" write-tree)" = "$DEEP_HASH" ] &&
+  ok "cached trees give the same root hash" ||
+  fail "reusing cached trees changed the root hash"
+
 # testing write-tree outside a repo (no .cgit)
 echo "--- write-tree outside repo ---"
 NOREPODIR="$TMPDIR/no-repo"
@@ -255,6 +794,117 @@ echo "--- commit-tree (error cases) ---"
 
 cd "$TMPDIR"
 
+# testing pack-objects
+echo "--- pack-objects ---"
+PKDIR="$TMPDIR/pack-objects-test"
+mkdir -p "$PKDIR/subdir" && cd "$PKDIR"
+"$CGIT" init >/dev/null
+echo "packed top" >top.txt
+echo "packed nested" >subdir/nested.txt
+PK_TREE=$("$CGIT" write-tree)
+PK_BLOB=$("$CGIT" hash-object top.txt)
+
+PACK_H=$("$CGIT" pack-objects --all --prune)
+[ -f ".cgit/objects/pack/pack-$PACK_H.pack" ] &&
+  ok "pack-objects writes pack-<hash>.pack" ||
+  fail "pack file missing for '$PACK_H'"
+
+git index-pack -o "$TMPDIR/verify.idx" ".cgit/objects/pack/pack-$PACK_H.pack" >/dev/null 2>&1 &&
+  ok "git index-pack accepts the pack" ||
+  fail "git index-pack rejected the pack"
+
+cmp -s "$TMPDIR/verify.idx" ".cgit/objects/pack/pack-$PACK_H.idx" &&
+  ok "pack .idx is identical to git's" ||
+  fail "pack .idx differs from git index-pack output"
+
+[ -z "$(find .cgit/objects -path '*/pack' -prune -o -type f -print)" ] &&
+  ok "--prune removes loose copies" ||
+  fail "loose objects left behind after --prune"
+
+[ -z "$(find .cgit/objects -mindepth 1 -maxdepth 1 -name '??' -print)" ] &&
+  ok "--prune removes the emptied fanout directories" ||
+  fail "fanout directories left behind after --prune"
+
+CONTENT=$("$CGIT" cat-file -p "$PK_BLOB")
+[ "$CONTENT" = "packed top" ] &&
+  ok "cat-file reads packed blob" ||
+  fail "expected 'packed top' from pack, got '$CONTENT'"
+
+"$CGIT" cat-file -e "$PK_TREE" &&
+  ok "packed tree exists (cat-file -e)" ||
+  fail "packed tree not found via cat-file -e"
+
+ACTUAL=$("$CGIT" ls-tree --name-only "$PK_TREE" | tr '\n' ' ')
+[ "$ACTUAL" = "subdir top.txt " ] &&
+  ok "ls-tree reads packed tree" ||
+  fail "ls-tree on packed tree gave '$ACTUAL'"
+
+# testing pack-objects delta compression
+echo "--- pack-objects (deltas) ---"
+DLDIR="$TMPDIR/pack-delta-test"
+mkdir -p "$DLDIR" && cd "$DLDIR"
+"$CGIT" init >/dev/null
+for i in 1 2 3 4 5 6 7 8; do
+  seq 1 2000 >"v$i.txt"
+  echo "revision $i" >>"v$i.txt"
+done
+DL_BLOB=$("$CGIT" hash-object v5.txt)
+"$CGIT" write-tree >/dev/null
+
+FULL_H=$("$CGIT" pack-objects --all --window=0)
+FULL_SIZE=$(wc -c <".cgit/objects/pack/pack-$FULL_H.pack")
+DELTA_H=$("$CGIT" pack-objects --all --prune --window=10 --depth=50)
+DELTA_SIZE=$(wc -c <".cgit/objects/pack/pack-$DELTA_H.pack")
+rm -f ".cgit/objects/pack/pack-$FULL_H".*
+
+[ "$DELTA_SIZE" -lt $((FULL_SIZE / 2)) ] &&
+  ok "deltified pack is smaller ($DELTA_SIZE < $FULL_SIZE bytes)" ||
+  fail "deltified pack not smaller ($DELTA_SIZE vs $FULL_SIZE bytes)"
+
+git index-pack -o "$TMPDIR/delta.idx" ".cgit/objects/pack/pack-$DELTA_H.pack" >/dev/null 2>&1 &&
+  cmp -s "$TMPDIR/delta.idx" ".cgit/objects/pack/pack-$DELTA_H.idx" &&
+  ok "git resolves the deltas and builds the same .idx" ||
+  fail "git index-pack disagrees with the deltified pack"
+
+ACTUAL="$("$CGIT" cat-file -t "$DL_BLOB") $("$CGIT" cat-file -s "$DL_BLOB")"
+[ "$ACTUAL" = "blob $(seq 1 2000 | wc -c | awk '{print $1 + 11}')" ] &&
+  ok "cat-file -t/-s read a deltified entry's header" ||
+  fail "cat-file -t/-s on deltified blob gave '$ACTUAL'"
+
+CONTENT=$("$CGIT" cat-file -p "$DL_BLOB" | tail -1)
+[ "$CONTENT" = "revision 5" ] &&
+  ok "cat-file applies the delta chain" ||
+  fail "expected 'revision 5' from deltified blob, got '$CONTENT'"
+
+# testing cat-file --batch / --batch-check against packed and loose objects
+echo "--- cat-file --batch ---"
+printf '%s\n' "$DL_BLOB" "$HASH" 0000000000000000000000000000000000000000 >ids.txt
+EXPECTED="$DL_BLOB blob $(GIT_DIR=.cgit git cat-file -s "$DL_BLOB")
+$HASH missing
+0000000000000000000000000000000000000000 missing"
+ACTUAL=$("$CGIT" cat-file --batch-check <ids.txt)
+[ "$ACTUAL" = "$EXPECTED" ] &&
+  ok "--batch-check reports type, size and missing ids" ||
+  fail "--batch-check gave '$ACTUAL'"
+
+"$CGIT" cat-file --batch <ids.txt >cgit-batch.out
+GIT_DIR=.cgit git cat-file --batch <ids.txt >git-batch.out 2>/dev/null
+cmp -s cgit-batch.out git-batch.out &&
+  ok "--batch output identical to git's" ||
+  fail "--batch output differs from git's"
+
+cd "$TMPDIR"
+
+{ echo "$HASH"; echo "$BIG_HASH"; echo "$HASH"; } | "$CGIT" cat-file --batch >batch.out
+{
+  echo "$HASH blob 11"; printf 'hello world\n'
+  echo "$BIG_HASH blob $(seq 1 400000 | wc -c)"; seq 1 400000; echo
+  echo "$HASH blob 11"; printf 'hello world\n'
+} >batch.expected
+cmp -s batch.out batch.expected &&
+  ok "--batch streams repeated loose objects" ||
+  fail "--batch output for loose objects is wrong"
+
 echo "--- error handling ---"
 "$CGIT" nosuchcmd 2>/dev/null && fail "unknown command should exit non-zero" || ok "unknown command rejected"
 